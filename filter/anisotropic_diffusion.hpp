@@ -1,6 +1,11 @@
 #ifndef ANISOTROPIC_DIFFUSION
 #define ANISOTROPIC_DIFFUSION
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <type_traits>
 #include "tipl/utility/basic_image.hpp"
+#include "tipl/utility/multi_thread.hpp"
 #include "tipl/numerical/numerical.hpp"
 
 namespace tipl
@@ -10,113 +15,211 @@ namespace tipl
 namespace filter
 {
 
-/**
+namespace imp
+{
 
-    conductance_parameter
-    delta_t: the time step
-             stable time step for this image must be smaller than
-               minSpacing / 2.0^(ImageDimension+1);
+// Perona-Malik conductances as a function of r = |grad I|^2/K^2
+struct perona_malik_exp{
+    float operator()(float r) const{return std::exp(-r);}
+};
+struct perona_malik_inv{
+    float operator()(float r) const{return 1.0f/(1.0f+r);}
+};
+
+// flux from line "from" to line "to": g(d^2/K^2)*d/h^2 with d = to-from
+template<class fun_type>
+inline void diffusion_flux(const float* from,const float* to,float* flux,int n,
+                           float inv_K2,float inv_h2,fun_type g)
+{
+    for(int x = 0;x < n;++x)
+    {
+        float d = to[x]-from[x];
+        flux[x] = g(d*d*inv_K2)*d*inv_h2;
+    }
+}
 
-    iteration: diffusion iteration
+/*
+    explicit scheme I += dt*sum_d (flux_d(x)-flux_d(x-e_d)) in float.
+    The rows are split into tiles processed in parallel; within a tile the
+    fluxes of the previous row and plane are kept in line buffers, so each
+    flux is evaluated once. Boundaries have no flux.
+    K^2 along each dimension is K2_scale times the mean squared difference.
+    dt = 1/(2*sum_d 1/h_d^2) is the largest step that keeps the maximum
+    principle because g <= 1.
 */
-
-template<class image_type>
-void anisotropic_diffusion(image_type& src,float conductance_parameter = 1.0,int iteration = 5)
+template<class image_type,class spacing_type,class fun_type>
+void anisotropic_diffusion(image_type& src,const spacing_type& spacing,float K2_scale,int iteration,fun_type g)
 {
-
-    conductance_parameter *= conductance_parameter;
-    conductance_parameter *= 1.38629436; // 2.0*ln(2)   the ln(2) is used to change the base from ln to ln2
-    std::vector<int> gx(src.size()),gx2(src.size()),total_gx(src.size());
-    for (int iter = 0;iter != iteration;++iter)
+    const unsigned int dim = image_type::dimension;
+    typedef typename image_type::value_type value_type;
+    size_t size = src.size();
+    if(!size || iteration <= 0)
+        return;
+    int w = src.geometry()[0];
+    int h = dim > 1 ? src.geometry()[1] : 1;
+    size_t row_count = size/w;
+    size_t depth = row_count/h;
+    size_t plane_size = size_t(w)*h;
+    float inv_h2[3] = {0.0f,0.0f,0.0f};
+    float sum_inv_h2 = 0.0f;
+    for(unsigned int d = 0;d < dim && d < 3;++d)
+    {
+        inv_h2[d] = 1.0f/(float(spacing[d])*float(spacing[d]));
+        sum_inv_h2 += inv_h2[d];
+    }
+    float dt = 0.5f/sum_inv_h2;
+
+    std::vector<float> I(src.begin(),src.end()),J(size);
+    size_t thread_count = available_thread_count();
+    // whole planes per tile when there are enough of them
+    size_t tile_rows = (dim > 2 && depth >= thread_count) ?
+                size_t(h)*((depth+thread_count-1)/thread_count) : (row_count+thread_count-1)/thread_count;
+    size_t tile_count = (row_count+tile_rows-1)/tile_rows;
+    std::vector<double> tile_sum2(tile_count*3);
+    for(int iter = 0;iter < iteration;++iter)
     {
-        unsigned int shift = 1;
-        for (unsigned char index = 0;index < image_type::dimension;++index)
+        // conductance from the mean squared difference along each dimension
+        par_for(tile_count,[&](size_t t)
         {
-            // gx = gradien(I), the gradient at the current dimension
-            tipl::gradient(src.begin(),src.end(),gx.begin(),shift,shift);
-            gx2 = gx;
-
-            //   gx*gx
-            tipl::square(gx2.begin(),gx2.end());
-
-            float K = (float)std::accumulate(gx2.begin(),gx2.end(),(float)0);
-            K /= (float)src.size();
-            K *= conductance_parameter;
-
-            // gx2 <= gx*gx/K
-            tipl::divide_constant(gx2.begin(),gx2.end(),K);
-
-            // add scaling to avoid trancation error
-            // will be scaled back later
-            tipl::minus_constant(gx2.begin(),gx2.end(),8);
+            double sum2[3] = {0.0,0.0,0.0};
+            size_t r1 = std::min(row_count,(t+1)*tile_rows);
+            for(size_t r = t*tile_rows;r < r1;++r)
+            {
+                const float* c = &I[r*w];
+                for(int x = 0;x+1 < w;++x)
+                    sum2[0] += (c[x+1]-c[x])*(c[x+1]-c[x]);
+                if(dim > 1 && int(r % h)+1 < h)
+                    for(int x = 0;x < w;++x)
+                        sum2[1] += (c[x+w]-c[x])*(c[x+w]-c[x]);
+                if(dim > 2 && r/h+1 < depth)
+                    for(int x = 0;x < w;++x)
+                        sum2[2] += (c[x+plane_size]-c[x])*(c[x+plane_size]-c[x]);
+            }
+            std::copy(sum2,sum2+3,tile_sum2.begin()+t*3);
+        });
+        float inv_K2[3] = {0.0f,0.0f,0.0f};
+        double pair_count[3] = {double(w-1)*row_count,double(h-1)*w*depth,double(depth-1)*plane_size};
+        for(unsigned int d = 0;d < dim && d < 3;++d)
+        {
+            double sum2 = 0.0;
+            for(size_t t = 0;t < tile_count;++t)
+                sum2 += tile_sum2[t*3+d];
+            if(sum2 > 0.0)
+                inv_K2[d] = float(pair_count[d]/(sum2*K2_scale));
+        }
 
-            // px <- pow(2,-gx*gx/K)*gx
-            tipl::divide_pow(gx.begin(),gx.end(),gx2.begin());
+        par_for(tile_count,[&](size_t t)
+        {
+            std::vector<float> fx(w+1),fy(w),fz(w),y_flux(w),z_flux(dim > 2 ? plane_size : 0);
+            size_t r0 = t*tile_rows;
+            size_t r1 = std::min(row_count,r0+tile_rows);
+            for(size_t r = r0;r < r1;++r)
+            {
+                int y = int(r % h);
+                size_t z = r/h;
+                const float* c = &I[r*w];
+                float* out = &J[r*w];
+                // fx[x+1] is the flux from x to x+1
+                fx[0] = fx[w] = 0.0f;
+                diffusion_flux(c,c+1,&fx[1],w-1,inv_K2[0],inv_h2[0],g);
+                if(dim > 1)
+                {
+                    // y_flux holds the flux from row y-1 to y
+                    if(r == r0 || y == 0)
+                    {
+                        if(y)
+                            diffusion_flux(c-w,c,&y_flux[0],w,inv_K2[1],inv_h2[1],g);
+                        else
+                            std::fill(y_flux.begin(),y_flux.end(),0.0f);
+                    }
+                    if(y+1 < h)
+                        diffusion_flux(c,c+w,&fy[0],w,inv_K2[1],inv_h2[1],g);
+                    else
+                        std::fill(fy.begin(),fy.end(),0.0f);
+                }
+                float* zb = dim > 2 ? &z_flux[size_t(y)*w] : 0;
+                if(dim > 2)
+                {
+                    // zb holds the flux from plane z-1 to z
+                    if(r < r0+h)
+                    {
+                        if(z)
+                            diffusion_flux(c-plane_size,c,zb,w,inv_K2[2],inv_h2[2],g);
+                        else
+                            std::fill(zb,zb+w,0.0f);
+                    }
+                    if(z+1 < depth)
+                        diffusion_flux(c,c+plane_size,&fz[0],w,inv_K2[2],inv_h2[2],g);
+                    else
+                        std::fill(fz.begin(),fz.end(),0.0f);
+                }
+                if(dim == 1)
+                    for(int x = 0;x < w;++x)
+                        out[x] = c[x]+dt*(fx[x+1]-fx[x]);
+                if(dim == 2)
+                    for(int x = 0;x < w;++x)
+                        out[x] = c[x]+dt*((fx[x+1]-fx[x])+(fy[x]-y_flux[x]));
+                if(dim > 2)
+                    for(int x = 0;x < w;++x)
+                        out[x] = c[x]+dt*((fx[x+1]-fx[x])+(fy[x]-y_flux[x])+(fz[x]-zb[x]));
+                if(dim > 1)
+                    y_flux.swap(fy);
+                if(dim > 2)
+                    std::copy(fz.begin(),fz.end(),zb);
+            }
+        });
+        I.swap(J);
+    }
+    if(std::is_integral<value_type>::value)
+        for(size_t i = 0;i < size;++i)
+            src[i] = value_type(std::floor(I[i]+0.5f));
+    else
+        std::copy(I.begin(),I.end(),src.begin());
+}
 
-            // exp(gx1*gx1/K)*gx1-exp(gx2*gx2/K)*gx2
-            tipl::gradient(gx.begin(),gx.end(),gx2.begin(),shift,0);
+}
 
-            // accumulate the diffusion magnitude
-            // skip the boundary
-            tipl::add(total_gx.begin(),total_gx.end(),gx2.begin());
+/**
+    Perona-Malik diffusion with the conductance exp(-|grad I|^2/K^2),
+    K^2 = 2*conductance_parameter^2*mean(|grad I|^2) along each dimension.
+    spacing: voxel size, which also sets the stable time step
+    iteration: diffusion iteration
+*/
+template<class image_type,class spacing_type>
+void anisotropic_diffusion(image_type& src,const spacing_type& spacing,float conductance_parameter,int iteration)
+{
+    imp::anisotropic_diffusion(src,spacing,2.0f*conductance_parameter*conductance_parameter,
+                               iteration,imp::perona_malik_exp());
+}
 
-            // proceed to next dimensiom
-            shift *= src.geometry()[index];
-        }
-        // perform I <= I + total_gx * delta_t
-        // delta_t = 1.0/(1 << dimension);
-        // scale back the multiplication of 8
-        tipl::divide_pow_constant(total_gx.begin(),total_gx.end(),image_type::dimension+8);
-        tipl::add(src.begin(),src.end(),total_gx.begin());
-    }
+template<class image_type>
+void anisotropic_diffusion(image_type& src,float conductance_parameter = 1.0,int iteration = 5)
+{
+    float spacing[image_type::dimension];
+    std::fill(spacing,spacing+image_type::dimension,1.0f);
+    anisotropic_diffusion(src,spacing,conductance_parameter,iteration);
 }
 
+/**
+    Perona-Malik diffusion with the conductance 1/(1+|grad I|^2/K^2),
+    K^2 = conductance_parameter^2*mean(|grad I|^2), which favors wide
+    regions over high-contrast edges.
+*/
+template<class image_type,class spacing_type>
+void anisotropic_diffusion_inv(image_type& src,const spacing_type& spacing,float conductance_parameter,size_t iteration)
+{
+    imp::anisotropic_diffusion(src,spacing,conductance_parameter*conductance_parameter,
+                               int(iteration),imp::perona_malik_inv());
+}
 
-template<class pixel_type,size_t dimension>
+template<class pixel_type,unsigned int dimension>
 void anisotropic_diffusion_inv(tipl::image<pixel_type,dimension>& src,
                            float conductance_parameter = 1.0,
                            size_t iteration = 5)
 {
-    conductance_parameter *= conductance_parameter;
-    std::vector<int> gx(src.size()),gx2(src.size()),total_gx(src.size());
-    for (size_t iter = 0;iter != iteration;++iter)
-    {
-        size_t shift = 1;
-        for (size_t index = 0;index < dimension;++index)
-        {
-            // gx = gradien(I), the gradient at the current dimension
-            tipl::gradient(src.begin(),src.end(),gx.begin(),shift,shift);
-            gx2 = gx;
-
-            //   gx*gx
-            tipl::square(gx2.begin(),gx2.end());
-
-            float K = (float)std::accumulate(gx2.begin(),gx2.end(),(float)0);
-            K /= (float)src.size();
-            K *= conductance_parameter;
-
-            // gx2 <- K+(gx*gx);
-            tipl::add_constant(gx2.begin(),gx2.end(),K);
-
-            // gx <- gx*K/(K+(gx*gx))
-            tipl::multiply_constant(gx.begin(),gx.end(),K);
-            tipl::divide(gx.begin(),gx.end(),gx2.begin());
-
-            // gx2 <- gradient(gx);
-            tipl::gradient(gx.begin(),gx.end(),gx2.begin(),shift,0);
-
-            // accumulate the diffusion magnitude
-            tipl::add(total_gx.begin(),total_gx.end(),gx2.begin());
-
-            // proceed to next dimensiom
-            shift *= src.geometry()[index];
-        }
-        // perform I <= I + total_gx * delta_t
-        // delta_t = 1.0/(1 << dimension);
-        // scale back the multiplication of 8
-        tipl::divide_pow_constant(total_gx.begin(),total_gx.end(),dimension);
-        tipl::add(src.begin(),src.end(),total_gx.begin());
-    }
+    float spacing[dimension];
+    std::fill(spacing,spacing+dimension,1.0f);
+    anisotropic_diffusion_inv(src,spacing,conductance_parameter,iteration);
 }
 
 
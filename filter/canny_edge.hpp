@@ -1,8 +1,11 @@
 #ifndef CANNY_EDGE_HPP_INCLUDED
 #define CANNY_EDGE_HPP_INCLUDED
 
-
+#include <vector>
+#include <cmath>
+#include <algorithm>
 #include "filter_model.hpp"
+#include "tipl/utility/multi_thread.hpp"
 //---------------------------------------------------------------------------
 namespace tipl
 {
@@ -10,197 +13,346 @@ namespace tipl
 namespace filter
 {
 
-template<class value_type,size_t dimension>
-class canny_edge_filter_imp;
+namespace imp
+{
 
-template<class value_type>
-class canny_edge_filter_imp<value_type,2>
+/*
+    Sobel gradient and non-maximum suppression of a w x h slice, fused per
+    tile of rows. A tile computes its smoothed rows, gradients and
+    magnitudes with a halo of two rows in local buffers, so the
+    intermediates stay in cache and no full-size temporary is allocated.
+    Borders are replicated. out receives the magnitude of the local maxima
+    and 0 elsewhere.
+*/
+template<class pixel_type>
+void canny_nms_2d(const pixel_type* src,int w,int h,float* out,bool smooth,bool parallel)
 {
-    typedef typename pixel_manip<value_type>::type manip_type;
-public:
-    template<class image_type>
-    void operator()(image_type& src)
+    const int tile_rows = std::max<int>(8,(1 << 16)/w);
+    const int halo = 2;
+    int tile_count = (h+tile_rows-1)/tile_rows;
+    par_for(tile_count,[&](int t)
     {
-        std::vector<manip_type> gx(src.size());
-        int w = src.width();
-
-		add_weight<2>(gx,src,1);
-        add_weight<1>(gx,src,1-w);
-        add_weight<1>(gx,src,1+w);
-        minus_weight<2>(gx,src,-1);
-        minus_weight<1>(gx,src,-1-w);
-        minus_weight<1>(gx,src,-1+w);
-
-        std::vector<manip_type> gy(src.size());
-
-		add_weight<2>(gy,src,w);
-        add_weight<1>(gy,src,w-1);
-        add_weight<1>(gy,src,w+1);
-        minus_weight<2>(gy,src,-w);
-        minus_weight<1>(gy,src,-w-1);
-        minus_weight<1>(gy,src,-w+1);
-
-        for(size_t index = 0;index < src.size();++index)
+        int r0 = t*tile_rows;
+        int r1 = std::min(h,r0+tile_rows);
+        int s0 = std::max(0,r0-halo),s1 = std::min(h,r1+halo);
+        int rows = s1-s0;
+        std::vector<float> s(size_t(rows)*w),gx(s.size()),gy(s.size()),mag(s.size()),col(w),dif(w);
+        // smoothing with [1 2 1]/4 in each direction
+        for(int y = s0;y < s1;++y)
         {
-            float fx = gx[index];
-            float fy = gy[index];
-            src[index] = std::sqrt(fx*fx+fy*fy);
+            float* sy = &s[size_t(y-s0)*w];
+            const pixel_type* c = src+size_t(y)*w;
+            if(!smooth)
+            {
+                for(int x = 0;x < w;++x)
+                    sy[x] = float(c[x]);
+                continue;
+            }
+            const pixel_type* a = src+size_t(std::max(0,y-1))*w;
+            const pixel_type* b = src+size_t(std::min(h-1,y+1))*w;
+            for(int x = 0;x < w;++x)
+                col[x] = float(a[x])+2.0f*float(c[x])+float(b[x]);
+            sy[0] = (3.0f*col[0]+col[std::min(1,w-1)])*0.0625f;
+            for(int x = 1;x+1 < w;++x)
+                sy[x] = (col[x-1]+2.0f*col[x]+col[x+1])*0.0625f;
+            if(w > 1)
+                sy[w-1] = (col[w-2]+3.0f*col[w-1])*0.0625f;
         }
-
-        int i1,i2;
-        float abs_x,abs_y,fx,fy;
-        for(int index = 0;index < src.size();++index)
+        // Sobel gradient: column sums first, then the horizontal stencil
+        int g0 = std::max(0,r0-1),g1 = std::min(h,r1+1);
+        for(int y = g0;y < g1;++y)
         {
-            fx = gx[index];
-            fy = gy[index];
-            abs_x = (fx >= 0) ? fx : -fx;
-            abs_y = (fy >= 0) ? fy : -fy;
-
-            //edge at x direction
-            if(abs_x > abs_y * 2.41421356)
+            const float* a = &s[size_t(std::max(0,y-1)-s0)*w];
+            const float* c = &s[size_t(y-s0)*w];
+            const float* b = &s[size_t(std::min(h-1,y+1)-s0)*w];
+            float* px = &gx[size_t(y-s0)*w];
+            float* py = &gy[size_t(y-s0)*w];
+            float* pm = &mag[size_t(y-s0)*w];
+            for(int x = 0;x < w;++x)
             {
-                i1 = index - 1;
-                i2 = index + 1;
+                col[x] = a[x]+2.0f*c[x]+b[x];
+                dif[x] = b[x]-a[x];
             }
-            else
-            //edge at y direction
-            if(abs_y > abs_x * 2.41421356)
+            for(int x = 0;x < w;++x)
             {
-                i1 = index - w;
-                i2 = index + w;
+                int xl = std::max(0,x-1),xr = std::min(w-1,x+1);
+                px[x] = col[xr]-col[xl];
+                py[x] = dif[xl]+2.0f*dif[x]+dif[xr];
             }
-            else
-            if((fx > 0 && fy > 0) || (fx < 0 && fy < 0))
+            for(int x = 0;x < w;++x)
+                pm[x] = std::sqrt(px[x]*px[x]+py[x]*py[x]);
+        }
+        // non-maximum suppression along the quantized gradient direction
+        for(int y = r0;y < r1;++y)
+        {
+            size_t row = size_t(y-s0)*w;
+            const float* px = &gx[row];
+            const float* py = &gy[row];
+            const float* pm = &mag[row];
+            float* o = out+size_t(y)*w;
+            for(int x = 0;x < w;++x)
             {
-                i1 = index - 1 - w;
-                i2 = index + 1 + w;
+                float m = pm[x];
+                if(m == 0.0f)
+                {
+                    o[x] = 0.0f;
+                    continue;
+                }
+                float ax = std::fabs(px[x]),ay = std::fabs(py[x]);
+                int dx,dy;
+                if(ax > ay*2.41421356f)
+                    dx = 1,dy = 0;
+                else
+                if(ay > ax*2.41421356f)
+                    dx = 0,dy = 1;
+                else
+                    dx = (px[x] > 0.0f) == (py[x] > 0.0f) ? 1 : -1,dy = 1;
+                float m1 = 0.0f,m2 = 0.0f;
+                if(x-dx >= 0 && x-dx < w && y-dy >= 0)
+                    m1 = pm[x-dx-ptrdiff_t(dy*w)];
+                if(x+dx >= 0 && x+dx < w && y+dy < h)
+                    m2 = pm[x+dx+ptrdiff_t(dy*w)];
+                o[x] = (m < m1 || m < m2) ? 0.0f : m;
             }
-            else
+        }
+    },parallel ? available_thread_count() : 1);
+}
+
+inline unsigned int canny_find(const std::vector<unsigned int>& parent,unsigned int i)
+{
+    while(parent[i] != i)
+        i = parent[i];
+    return i;
+}
+
+// find with path halving
+inline unsigned int canny_find(std::vector<unsigned int>& parent,unsigned int i)
+{
+    while(parent[i] != i)
+        i = parent[i] = parent[parent[i]];
+    return i;
+}
+
+inline void canny_union(std::vector<unsigned int>& parent,unsigned int a,unsigned int b)
+{
+    a = canny_find(parent,a);
+    b = canny_find(parent,b);
+    if(a < b)
+        parent[b] = a;
+    else
+        if(b < a)
+            parent[a] = b;
+}
+
+/*
+    hysteresis by union-find: candidates (m > low) are joined with their
+    8-neighbors within each tile of rows in parallel, the tile seams are
+    joined afterward, and a component is an edge if any of its pixels is
+    above high.
+*/
+inline void canny_hysteresis(const float* m,int w,int h,float low,float high,
+                             unsigned char* edge,bool parallel)
+{
+    const int tile_rows = std::max<int>(8,(1 << 16)/w);
+    int tile_count = (h+tile_rows-1)/tile_rows;
+    int thread_count = parallel ? available_thread_count() : 1;
+    size_t size = size_t(w)*h;
+    std::vector<unsigned int> parent(size);
+    par_for(tile_count,[&](int t)
+    {
+        int r0 = t*tile_rows;
+        int r1 = std::min(h,r0+tile_rows);
+        for(int y = r0;y < r1;++y)
+            for(int x = 0;x < w;++x)
             {
-                i1 = index + 1 - w;
-                i2 = index - 1 + w;
+                unsigned int i = (unsigned int)(size_t(y)*w+x);
+                parent[i] = i;
+                if(m[i] <= low)
+                    continue;
+                if(x && m[i-1] > low)
+                    canny_union(parent,i,i-1);
+                if(y == r0)
+                    continue;
+                for(int dx = -1;dx <= 1;++dx)
+                    if(x+dx >= 0 && x+dx < w && m[i-w+dx] > low)
+                        canny_union(parent,i,i-w+dx);
             }
-
-            if(i1 < 0 || i2 >= src.size())
+    },thread_count);
+    for(int t = 1;t < tile_count;++t)
+    {
+        size_t y = size_t(t)*tile_rows;
+        for(int x = 0;x < w;++x)
+        {
+            unsigned int i = (unsigned int)(y*w+x);
+            if(m[i] <= low)
                 continue;
-            // perform non-maximum elimination
-            if(src[index] < src[i1] || src[index] < src[i2])
-                src[index] = 0;
-
+            for(int dx = -1;dx <= 1;++dx)
+                if(x+dx >= 0 && x+dx < w && m[i-w+dx] > low)
+                    canny_union(parent,i,i-w+dx);
         }
+    }
+    std::vector<unsigned int> root(size);
+    std::vector<unsigned char> strong(size);
+    const std::vector<unsigned int>& const_parent = parent;
+    par_for(tile_count,[&](int t)
+    {
+        size_t from = size_t(t)*tile_rows*w,to = std::min(size,from+size_t(tile_rows)*w);
+        for(size_t i = from;i < to;++i)
+            root[i] = canny_find(const_parent,(unsigned int)i);
+    },thread_count);
+    for(size_t i = 0;i < size;++i)
+        if(m[i] > high)
+            strong[root[i]] = 1;
+    par_for(tile_count,[&](int t)
+    {
+        size_t from = size_t(t)*tile_rows*w,to = std::min(size,from+size_t(tile_rows)*w);
+        for(size_t i = from;i < to;++i)
+            edge[i] = (m[i] > low && strong[root[i]]) ? 1 : 0;
+    },thread_count);
+}
+
+template<class pixel_type>
+void canny_edge_2d(const pixel_type* src,int w,int h,unsigned char* edge,
+                   float low_ratio,float high_ratio,bool parallel)
+{
+    std::vector<float> m(size_t(w)*h);
+    canny_nms_2d(src,w,h,&m[0],true,parallel);
+    float max_m = *std::max_element(m.begin(),m.end());
+    canny_hysteresis(&m[0],w,h,max_m*low_ratio,max_m*high_ratio,edge,parallel);
+}
+
+}
 
+template<class value_type,size_t dimension>
+class canny_edge_filter_imp;
+
+template<class value_type>
+class canny_edge_filter_imp<value_type,2>
+{
+public:
+    template<class image_type>
+    void operator()(image_type& src)
+    {
+        if(src.empty())
+            return;
+        std::vector<float> m(src.size());
+        imp::canny_nms_2d(&src[0],src.width(),src.height(),&m[0],false,true);
+        std::copy(m.begin(),m.end(),src.begin());
     }
 };
 
 template<class value_type>
 class canny_edge_filter_imp<value_type,3>
 {
-    typedef typename pixel_manip<value_type>::type manip_type;
 public:
     template<class image_type>
     void operator()(image_type& src)
     {
+        if(src.empty())
+            return;
         int w = src.width();
-        int wh = src.geometry().plane_size();
-
-		std::vector<manip_type> gx(src.size());
-
-		add_weight<2>(gx,src,1);
-        add_weight<1>(gx,src,1-w);
-        add_weight<1>(gx,src,1+w);
-        add_weight<1>(gx,src,1-wh);
-        add_weight<1>(gx,src,1+wh);
-        minus_weight<2>(gx,src,-1);
-        minus_weight<1>(gx,src,-1-w);
-        minus_weight<1>(gx,src,-1+w);
-		minus_weight<1>(gx,src,-1-wh);
-        minus_weight<1>(gx,src,-1+wh);
-
-        std::vector<manip_type> gy(src.size());
-
-		add_weight<2>(gy,src,w);
-        add_weight<1>(gy,src,w-1);
-        add_weight<1>(gy,src,w+1);
-        add_weight<1>(gy,src,w+wh);
-        add_weight<1>(gy,src,w-wh);
-        minus_weight<2>(gy,src,-w);
-        minus_weight<1>(gy,src,-w-1);
-        minus_weight<1>(gy,src,-w+1);
-		minus_weight<1>(gy,src,-w-wh);
-        minus_weight<1>(gy,src,-w+wh);
-
-        std::vector<manip_type> gz(src.size());
-
-		add_weight<2>(gy,src,wh);
-        add_weight<1>(gy,src,wh-1);
-        add_weight<1>(gy,src,wh+1);
-        add_weight<1>(gy,src,wh+w);
-        add_weight<1>(gy,src,wh-w);
-        minus_weight<2>(gy,src,-wh);
-        minus_weight<1>(gy,src,-wh-1);
-        minus_weight<1>(gy,src,-wh+1);
-		minus_weight<1>(gy,src,-wh-w);
-        minus_weight<1>(gy,src,-wh+w);
-
-        for(size_t index = 0;index < src.size();++index)
+        int h = src.height();
+        int d = src.depth();
+        std::vector<float> gx(src.size()),gy(src.size()),gz(src.size()),mag(src.size());
+        // gradients and magnitudes, one plane per task
+        par_for(d,[&](int z)
         {
-            float fx = gx[index];
-            float fy = gy[index];
-            float fz = gz[index];
-            src[index] = std::sqrt(fx*fx+fy*fy+fz*fz);
-        }
-
-        int shift,i1,i2;
-        float fx,fy,fz,max_value;
-        for(int index = 0;index < src.size();++index)
+            int zl = std::max(0,z-1),zr = std::min(d-1,z+1);
+            for(int y = 0;y < h;++y)
+            {
+                int yl = std::max(0,y-1),yr = std::min(h-1,y+1);
+                auto at = [&](int x,int yy,int zz){return float(src[(size_t(zz)*h+yy)*w+x]);};
+                size_t base = (size_t(z)*h+y)*w;
+                for(int x = 0;x < w;++x)
+                {
+                    int xl = std::max(0,x-1),xr = std::min(w-1,x+1);
+                    float fx = 2.0f*(at(xr,y,z)-at(xl,y,z))+
+                               (at(xr,yl,z)-at(xl,yl,z))+(at(xr,yr,z)-at(xl,yr,z))+
+                               (at(xr,y,zl)-at(xl,y,zl))+(at(xr,y,zr)-at(xl,y,zr));
+                    float fy = 2.0f*(at(x,yr,z)-at(x,yl,z))+
+                               (at(xl,yr,z)-at(xl,yl,z))+(at(xr,yr,z)-at(xr,yl,z))+
+                               (at(x,yr,zl)-at(x,yl,zl))+(at(x,yr,zr)-at(x,yl,zr));
+                    float fz = 2.0f*(at(x,y,zr)-at(x,y,zl))+
+                               (at(xl,y,zr)-at(xl,y,zl))+(at(xr,y,zr)-at(xr,y,zl))+
+                               (at(x,yl,zr)-at(x,yl,zl))+(at(x,yr,zr)-at(x,yr,zl));
+                    gx[base+x] = fx;
+                    gy[base+x] = fy;
+                    gz[base+x] = fz;
+                    mag[base+x] = std::sqrt(fx*fx+fy*fy+fz*fz);
+                }
+            }
+        });
+        // non-maximum suppression
+        par_for(d,[&](int z)
         {
-            if(src[index] == 0)
-                continue;
-            max_value = src[index];
-            fx = gx[index]/max_value;
-            fy = gy[index]/max_value;
-            fz = gz[index]/max_value;
-
-            shift = 0;
-            if(fx >= 0.577)
-                shift += 1;
-            else
-            if(fx < -0.577)
-                shift -= 1;
-
-            if(fy >= 0.577)
-                shift += w;
-            else
-            if(fy < -0.577)
-                shift -= w;
-
-            if(fz >= 0.577)
-                shift += wh;
-            else
-            if(fz < -0.577)
-                shift -= wh;
-
-            i1 = index - shift;
-            i2 = index + shift;
-
-            if(i1 < 0 || i2 >= src.size())
-                continue;
-            // perform non-maximum elimination
-            if(src[index] < src[i1] || src[index] < src[i2])
-                src[index] = 0;
-
-        }
-
+            for(int y = 0;y < h;++y)
+                for(int x = 0;x < w;++x)
+                {
+                    size_t index = (size_t(z)*h+y)*w+x;
+                    float max_value = mag[index];
+                    if(max_value == 0.0f)
+                    {
+                        src[index] = 0;
+                        continue;
+                    }
+                    int s[3] = {0,0,0};
+                    float f[3] = {gx[index]/max_value,gy[index]/max_value,gz[index]/max_value};
+                    for(int k = 0;k < 3;++k)
+                        s[k] = f[k] >= 0.577f ? 1 : (f[k] < -0.577f ? -1 : 0);
+                    float m1 = 0.0f,m2 = 0.0f;
+                    if(x-s[0] >= 0 && x-s[0] < w && y-s[1] >= 0 && y-s[1] < h && z-s[2] >= 0 && z-s[2] < d)
+                        m1 = mag[(size_t(z-s[2])*h+y-s[1])*w+x-s[0]];
+                    if(x+s[0] >= 0 && x+s[0] < w && y+s[1] >= 0 && y+s[1] < h && z+s[2] >= 0 && z+s[2] < d)
+                        m2 = mag[(size_t(z+s[2])*h+y+s[1])*w+x+s[0]];
+                    src[index] = (max_value < m1 || max_value < m2) ? 0 : max_value;
+                }
+        });
     }
 };
 
-template<typename pixel_type,size_t dimension>
+/**
+    Sobel gradient magnitude with non-maximum suppression, in place
+*/
+template<typename pixel_type,unsigned int dimension>
 void canny_edge(image<pixel_type,dimension>& src)
 {
     canny_edge_filter_imp<pixel_type,dimension>()(src);
 }
 
+/**
+    Canny edge detection: [1 2 1] smoothing, Sobel gradient, non-maximum
+    suppression and hysteresis. edge is 1 on edge pixels.
+    low_ratio, high_ratio: hysteresis thresholds relative to the largest
+    gradient magnitude
+    A 3D volume is processed slice by slice with the slices in parallel.
+*/
+template<typename pixel_type,typename edge_type>
+void canny_edge(const image<pixel_type,2>& src,image<edge_type,2>& edge,
+                float low_ratio = 0.1f,float high_ratio = 0.2f)
+{
+    edge.resize(src.geometry());
+    if(src.empty())
+        return;
+    std::vector<unsigned char> e(src.size());
+    imp::canny_edge_2d(&*src.begin(),src.width(),src.height(),&e[0],low_ratio,high_ratio,true);
+    std::copy(e.begin(),e.end(),edge.begin());
+}
 
+template<typename pixel_type,typename edge_type>
+void canny_edge(const image<pixel_type,3>& src,image<edge_type,3>& edge,
+                float low_ratio = 0.1f,float high_ratio = 0.2f)
+{
+    edge.resize(src.geometry());
+    if(src.empty())
+        return;
+    size_t wh = src.plane_size();
+    par_for(src.depth(),[&](int z)
+    {
+        std::vector<unsigned char> e(wh);
+        imp::canny_edge_2d(&*src.begin()+size_t(z)*wh,src.width(),src.height(),&e[0],low_ratio,high_ratio,false);
+        std::copy(e.begin(),e.end(),edge.begin()+size_t(z)*wh);
+    });
+}
 
 
 }
@@ -2,6 +2,7 @@
 #ifndef GAUSSIAN_HPP
 #define GAUSSIAN_HPP
 #include "filter_model.hpp"
+#include "tipl/utility/vector_image.hpp"
 //---------------------------------------------------------------------------
 namespace tipl
 {
@@ -189,6 +190,27 @@ void gaussian2(image_type& src)
     gaussian_filter_imp2<typename image_type::value_type,image_type::dimension>()(src);
 }
 
+// smooth each component plane of a structure-of-arrays vector field
+template<unsigned int dimension,class value_type>
+void gaussian(vector_image<dimension,value_type>& src)
+{
+    tipl::par_for(dimension,[&](unsigned int d)
+    {
+        typename vector_image<dimension,value_type>::plane_type plane = src.plane_image(d);
+        gaussian_filter_imp<value_type,dimension>()(plane);
+    });
+}
+
+template<unsigned int dimension,class value_type>
+void gaussian2(vector_image<dimension,value_type>& src)
+{
+    tipl::par_for(dimension,[&](unsigned int d)
+    {
+        typename vector_image<dimension,value_type>::plane_type plane = src.plane_image(d);
+        gaussian_filter_imp2<value_type,dimension>()(plane);
+    });
+}
+
 
 }
 
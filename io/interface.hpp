@@ -1,6 +1,18 @@
 #ifndef IMAGE_IO_INTERFACE_HPP
 #define IMAGE_IO_INTERFACE_HPP
 #include <fstream>
+#include <algorithm>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 namespace tipl
 {
@@ -70,6 +82,90 @@ public:
     operator bool() const	{return out.good();}
     bool operator!() const	{return !out.good();}
 };
+
+// read-only memory mapping of a whole file
+class memory_map{
+    const char* ptr = 0;
+    size_t size_ = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = 0;
+#endif
+    memory_map(const memory_map&);
+    memory_map& operator=(const memory_map&);
+public:
+    memory_map(void){}
+    ~memory_map(void){close();}
+    bool open(const char* file_name)
+    {
+        close();
+#ifdef _WIN32
+        file = CreateFileA(file_name,GENERIC_READ,FILE_SHARE_READ,0,OPEN_EXISTING,
+                           FILE_ATTRIBUTE_NORMAL|FILE_FLAG_SEQUENTIAL_SCAN,0);
+        if(file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER file_size;
+        if(!GetFileSizeEx(file,&file_size) || !file_size.QuadPart ||
+           !(mapping = CreateFileMappingA(file,0,PAGE_READONLY,0,0,0)) ||
+           !(ptr = (const char*)MapViewOfFile(mapping,FILE_MAP_READ,0,0,0)))
+        {
+            close();
+            return false;
+        }
+        size_ = size_t(file_size.QuadPart);
+#else
+        int fd = ::open(file_name,O_RDONLY);
+        if(fd < 0)
+            return false;
+        struct stat st;
+        if(fstat(fd,&st) || !st.st_size)
+        {
+            ::close(fd);
+            return false;
+        }
+        void* p = mmap(0,size_t(st.st_size),PROT_READ,MAP_SHARED,fd,0);
+        ::close(fd);
+        if(p == MAP_FAILED)
+            return false;
+        ptr = (const char*)p;
+        size_ = size_t(st.st_size);
+#endif
+        return true;
+    }
+    void close(void)
+    {
+#ifdef _WIN32
+        if(ptr)
+            UnmapViewOfFile(ptr);
+        if(mapping)
+            CloseHandle(mapping);
+        if(file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        mapping = 0;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if(ptr)
+            munmap((void*)ptr,size_);
+#endif
+        ptr = 0;
+        size_ = 0;
+    }
+    // hint that [from,from+length) will be read soon
+    void prefetch(size_t from,size_t length) const
+    {
+#ifndef _WIN32
+        const size_t page = 4096;
+        size_t to = std::min(size_,from+length);
+        from -= from % page;
+        if(from < to)
+            madvise((void*)(ptr+from),to-from,MADV_WILLNEED);
+#endif
+    }
+    const char* data(void) const{return ptr;}
+    size_t size(void) const{return size_;}
+    operator bool() const	{return ptr != 0;}
+    bool operator!() const	{return ptr == 0;}
+};
 }
 }
 
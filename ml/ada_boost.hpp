@@ -4,14 +4,20 @@
 #include <numeric>
 #include <cmath>
 #include <memory>
+#include <ostream>
+#include "tipl/utility/multi_thread.hpp"
+#include "tipl/ml/utility.hpp"
 
-namespace image{
+namespace tipl{
 
 namespace ml{
 
-template<typename attribute_type,typename classification_type>
+template<typename attribute_type_,typename classification_type_>
 class decision_stump
 {
+public:
+    typedef attribute_type_ attribute_type;
+    typedef classification_type_ classification_type;
 private:
     size_t which_attribute;
     attribute_type threshold;
@@ -24,46 +30,62 @@ public:
                sample_weighting_type Dt,
                classifications_iterator_type classifications_from)
     {
-        size_t sample_size = attributes_to-attributes_from;
+        binned_attributes<attribute_type> data(attributes_from,attributes_to,attribute_dimension);
+        learn(data,Dt,classifications_from);
+    }
+    // thresholds are searched on a histogram of signed weights over the attribute bins
+    template<typename sample_weighting_type,typename classifications_iterator_type>
+    void learn(const binned_attributes<attribute_type>& data,
+               sample_weighting_type Dt,
+               classifications_iterator_type classifications_from)
+    {
+        size_t sample_size = data.sample_size;
+        size_t attribute_dimension = data.attribute_dimension();
+        std::vector<double> best(attribute_dimension);
+        std::vector<size_t> best_bin(attribute_dimension);
+        std::vector<unsigned char> best_reverse(attribute_dimension);
+        par_for(attribute_dimension,[&](size_t index)
+        {
+            std::vector<double> hist(data.bin_count(index));
+            const unsigned char* bins = data.attribute_bins(index);
+            for (size_t i = 0;i < sample_size;++i)
+                hist[bins[i]] += (classifications_from[i] ? Dt[i] : -Dt[i]);
+            // X > edges[b-1] takes bins b and above, scanned from the highest bin down
+            double cur_classification_number = 0.0;
+            for (size_t b = hist.size()-1;b > 0;--b)
+            {
+                cur_classification_number -= hist[b];
+                if (std::abs(cur_classification_number) > best[index])
+                {
+                    best[index] = std::abs(cur_classification_number);
+                    best_bin[index] = b-1;
+                    best_reverse[index] = cur_classification_number > 0.0;
+                }
+            }
+        });
         which_attribute = 0;
         threshold = 0;
         reverse = false;
-
         double classification_number = 0.0;
-
         for (size_t index = 0;index < attribute_dimension;++index)
-        {
-            double cur_classification_number = 0.0;
-            std::map<attribute_type,double,std::greater<attribute_type> > sorted_attribute;
-            for (size_t i = 0;i < sample_size;++i)
-                sorted_attribute[attributes_from[i][index]] += (classifications_from[i] ? Dt[i] : -Dt[i]);
-
-            typename std::map<attribute_type,double,std::greater<attribute_type> >::const_iterator iter = sorted_attribute.begin();
-            typename std::map<attribute_type,double,std::greater<attribute_type> >::const_iterator end = sorted_attribute.end();
-
-            for (;iter != end;++iter)
+            if (best[index] > classification_number)
             {
-                cur_classification_number -= iter->second;
-                if (std::abs(cur_classification_number) > classification_number)
-                {
-                    classification_number = std::abs(cur_classification_number);
-                    which_attribute = index;
-                    threshold = iter->first;
-                    reverse = cur_classification_number > 0.0;
-                }
+                classification_number = best[index];
+                which_attribute = index;
+                threshold = data.edges[index][best_bin[index]];
+                reverse = best_reverse[index];
             }
-        }
     }
 
     template<typename attribute_iterator_type>
     classification_type predict(attribute_iterator_type attributes) const
     {
-        return ((attributes[which_attribute] >= threshold) ^ reverse) ? 1:0;
+        return ((attributes[which_attribute] > threshold) ^ reverse) ? 1:0;
     }
 
     friend std::ostream& operator<<(std::ostream& out,const decision_stump& rhs)
     {
-        out << "X(" << rhs.which_attribute << ") " << (rhs.reverse ? "< " : ">= ") << rhs.threshold;
+        out << "X(" << rhs.which_attribute << ") " << (rhs.reverse ? "<= " : "> ") << rhs.threshold;
         return out;
     }
 };
@@ -102,18 +124,23 @@ public:
     {
         clear();
         size_t sample_size = attributes_to-attributes_from;
+        // the attributes are binned once for all rounds
+        binned_attributes<typename method_type::attribute_type> data(attributes_from,attributes_to,attribute_dimension);
         std::vector<double> Dt(sample_size);
         std::fill(Dt.begin(),Dt.end(),1.0/((double)sample_size));
+        const size_t block_size = 4096;
         for (size_t t = 0;t < max_iteration;++t)
         {
-            std::auto_ptr<method_type> ht(new method_type);
-            ht->learn(attributes_from,attributes_to,attribute_dimension,Dt.begin(),classifications_from);
+            std::unique_ptr<method_type> ht(new method_type);
+            ht->learn(data,Dt.begin(),classifications_from);
             std::vector<unsigned char> correct_predict(sample_size);
             // get the classification result 1 for correc predict, 0 otherwise
+            par_for((sample_size+block_size-1)/block_size,[&](size_t b)
             {
-                for (size_t index = 0;index < sample_size;++index)
+                size_t to = std::min(sample_size,(b+1)*block_size);
+                for (size_t index = b*block_size;index < to;++index)
                     correct_predict[index] = (ht->predict(&(attributes_from[index][0])) == classifications_from[index]) ? 1:0;
-            }
+            });
             //calculate `t
             double et;
             {
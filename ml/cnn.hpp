@@ -18,6 +18,13 @@
 #include <thread>
 #include <vector>
 #include <random>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <mutex>
+#include <type_traits>
 
 #include "tipl/numerical/matrix.hpp"
 #include "tipl/numerical/numerical.hpp"
@@ -26,6 +33,8 @@
 #include "tipl/utility/geometry.hpp"
 #include "tipl/utility/basic_image.hpp"
 #include "tipl/utility/multi_thread.hpp"
+#include "tipl/utility/cu.hpp"
+#include "tipl/io/interface.hpp"
 
 
 namespace tipl
@@ -37,18 +46,179 @@ namespace ml
 enum activation_type { relu, identity};
 enum status_type { training,testing};
 
+// int8 inference: x ~ input_scale*qx, row o of w ~ weight_scale[o]*qw
+inline void quantize_int8(const float* x,signed char* q,size_t n,float inv_scale)
+{
+    for(size_t i = 0;i < n;++i)
+    {
+        float v = x[i]*inv_scale;
+        v = v > 127.0f ? 127.0f : (v < -127.0f ? -127.0f : v);
+        q[i] = (signed char)(int)std::lrint(v);
+    }
+}
+inline int dot_int8(const signed char* a,const signed char* b,int k)
+{
+    int sum = 0;
+    for(int i = 0;i < k;++i)
+        sum += int(a[i])*int(b[i]);
+    return sum;
+}
+/*
+    C[i*ldc+j] = dot(A row i,B row j), rows of k values, four rows of B at a
+    time so that each row of A is loaded once per four outputs.
+*/
+inline void gemm_int8(const signed char* A,const signed char* B,int* C,int m,int n,int k,size_t ldc,bool parallel)
+{
+    auto run = [&](int jb)
+    {
+        int j = jb*4;
+        if(j+4 > n)
+        {
+            for(;j < n;++j)
+                for(int i = 0;i < m;++i)
+                    C[i*ldc+j] = dot_int8(A+size_t(i)*k,B+size_t(j)*k,k);
+            return;
+        }
+        const signed char* b0 = B+size_t(j)*k;
+        const signed char* b1 = b0+k;
+        const signed char* b2 = b1+k;
+        const signed char* b3 = b2+k;
+        for(int i = 0;i < m;++i)
+        {
+            const signed char* a = A+size_t(i)*k;
+            int s0 = 0,s1 = 0,s2 = 0,s3 = 0;
+            for(int t = 0;t < k;++t)
+            {
+                int v = a[t];
+                s0 += v*b0[t];
+                s1 += v*b1[t];
+                s2 += v*b2[t];
+                s3 += v*b3[t];
+            }
+            int* c = C+i*ldc+j;
+            c[0] = s0;
+            c[1] = s1;
+            c[2] = s2;
+            c[3] = s3;
+        }
+    };
+    int block_count = (n+3)/4;
+    if(parallel)
+        par_for(block_count,run);
+    else
+        for(int jb = 0;jb < block_count;++jb)
+            run(jb);
+}
+enum optimizer_type {sgd,nesterov,rmsprop,adam,adamw};
+struct optimizer_param{
+    optimizer_type type = sgd;
+    float w_rate = 0.01f,b_rate = 0.01f;
+    float momentum = 0.9f;          // sgd and nesterov
+    float beta1 = 0.9f;             // adam and adamw
+    float beta2 = 0.999f;           // rmsprop, adam and adamw
+    float epsilon = 1e-8f;
+    float weight_decay = 0.0f;      // adamw, decoupled from the gradient
+    float correction1 = 1.0f;       // 1/(1-beta1^t)
+    float correction2 = 1.0f;       // 1/(1-beta2^t)
+    // buffers per parameter
+    size_t state_count(void) const{return type == sgd ? 0 : ((type == adam || type == adamw) ? 2 : 1);}
+};
+/*
+    One pass over n parameters: w is updated with the gradient g, the
+    state m and v are updated, and g is cleared for the next batch. SGD
+    keeps its velocity in g, which is scaled by the momentum.
+*/
+inline void optimizer_step(const optimizer_param& p,float rate,float decay,
+                           float* w,float* g,float* m,float* v,size_t n)
+{
+    switch(p.type)
+    {
+    case sgd:
+        for(size_t i = 0;i < n;++i)
+        {
+            w[i] -= rate*g[i];
+            g[i] *= p.momentum;
+        }
+        return;
+    case nesterov:
+        for(size_t i = 0;i < n;++i)
+        {
+            float vi = p.momentum*m[i]+g[i];
+            m[i] = vi;
+            w[i] -= rate*(g[i]+p.momentum*vi);
+            g[i] = 0.0f;
+        }
+        return;
+    case rmsprop:
+        for(size_t i = 0;i < n;++i)
+        {
+            float vi = p.beta2*m[i]+(1.0f-p.beta2)*g[i]*g[i];
+            m[i] = vi;
+            w[i] -= rate*g[i]/(std::sqrt(vi)+p.epsilon);
+            g[i] = 0.0f;
+        }
+        return;
+    case adam:
+    case adamw:
+        for(size_t i = 0;i < n;++i)
+        {
+            float mi = p.beta1*m[i]+(1.0f-p.beta1)*g[i];
+            float vi = p.beta2*v[i]+(1.0f-p.beta2)*g[i]*g[i];
+            m[i] = mi;
+            v[i] = vi;
+            w[i] -= rate*(mi*p.correction1/(std::sqrt(vi*p.correction2)+p.epsilon)+decay*w[i]);
+            g[i] = 0.0f;
+        }
+        return;
+    }
+}
+// symmetric int8 weights with one scale per output channel
+struct int8_weight{
+    std::vector<signed char> w;
+    std::vector<float> scale;   // weight scale times input_scale
+    float input_scale = 0.0f;
+    bool empty(void) const{return w.empty();}
+    void clear(void)
+    {
+        w.clear();
+        scale.clear();
+    }
+    // row o is weight[row_pos[o],row_pos[o+1])
+    void quantize(const std::vector<float>& weight,const std::vector<size_t>& row_pos,float input_scale_)
+    {
+        input_scale = input_scale_;
+        w.resize(weight.size());
+        scale.resize(row_pos.size()-1);
+        for(size_t o = 0;o+1 < row_pos.size();++o)
+        {
+            float max_w = 0.0f;
+            for(size_t i = row_pos[o];i < row_pos[o+1];++i)
+                max_w = std::max(max_w,std::fabs(weight[i]));
+            float ws = max_w > 0.0f ? max_w/127.0f : 1.0f;
+            quantize_int8(&weight[0]+row_pos[o],&w[0]+row_pos[o],row_pos[o+1]-row_pos[o],1.0f/ws);
+            scale[o] = ws*input_scale;
+        }
+    }
+    void quantize_input(const float* x,signed char* q,size_t n) const
+    {
+        quantize_int8(x,q,n,1.0f/input_scale);
+    }
+};
+
 class basic_layer
 {
 
 public:
     activation_type af;
     status_type status;
+    bool deterministic = false; // gradient reduction independent of the thread count
     int input_size;
     int output_size;
     float weight_base;
     float wlearning_base_rate = 1.0f;
     float blearning_base_rate = 1.0f;
     std::vector<float> weight,bias;
+    int8_weight qweight;    // used by the inference when not empty
 public:
 
     virtual ~basic_layer() {}
@@ -93,6 +263,78 @@ public:
                 if(x[i] <= 0)
                     dOut[i] = 0;
     }
+    /*
+        mini-batch versions: sample i reads x+i*x_stride and writes
+        y+i*y_stride, so that each sample keeps the in_out layout of the
+        single-sample functions. The defaults run the samples in parallel.
+    */
+    virtual void forward_propagation_batch(const float* x,size_t x_stride,float* y,size_t y_stride,int n)
+    {
+        par_for(n,[&](int i)
+        {
+            forward_propagation(x+i*x_stride,y+i*y_stride);
+        });
+    }
+    virtual void back_propagation_batch(float* dOut,float* dX,const float* x,size_t stride,int n)
+    {
+        par_for(n,[&](int i)
+        {
+            back_propagation(dOut+i*stride,dX+i*stride,x+i*stride);
+        });
+    }
+    virtual void calculate_dwdb_batch(const float* dOut,size_t dOut_stride,
+                                      const float* x,size_t x_stride,int n,
+                                      std::vector<float>& dweight,
+                                      std::vector<float>& dbias)
+    {
+        reduce_dwdb(n,dweight,dbias,[&](int from,int to,std::vector<float>& dw,std::vector<float>& db)
+        {
+            for(int i = from;i < to;++i)
+                calculate_dwdb(dOut+i*dOut_stride,x+i*x_stride,dw,db);
+        });
+    }
+protected:
+    /*
+        fun(from,to,dw,db) accumulates the samples [from,to). Each thread
+        takes one chunk of samples with its own buffers, and the chunks
+        are summed into dweight and dbias by a pairwise tree.
+    */
+    template<class fun_type>
+    void reduce_dwdb(int n,std::vector<float>& dweight,std::vector<float>& dbias,fun_type&& fun)
+    {
+        const int deterministic_chunk_count = 16;
+        int chunk_count = std::max<int>(1,std::min<int>(n,deterministic ?
+                            deterministic_chunk_count : available_thread_count()));
+        std::vector<std::vector<float> > dw(chunk_count),db(chunk_count);
+        dw[0].swap(dweight);
+        db[0].swap(dbias);
+        par_for(chunk_count,[&](int c)
+        {
+            if(c)
+            {
+                dw[c].resize(dw[0].size());
+                db[c].resize(db[0].size());
+            }
+            fun(c*n/chunk_count,(c+1)*n/chunk_count,dw[c],db[c]);
+        });
+        for(int step = 1;step < chunk_count;step <<= 1)
+            par_for((chunk_count+step+step-1)/(step+step),[&](int pair)
+            {
+                int c = pair*(step+step);
+                if(c+step >= chunk_count)
+                    return;
+                tipl::add(dw[c],dw[c+step]);
+                tipl::add(db[c],db[c+step]);
+            });
+        dw[0].swap(dweight);
+        db[0].swap(dbias);
+    }
+public:
+    // int8 weights for inputs within [-input_scale*127,input_scale*127]
+    virtual bool quantize(float)
+    {
+        return false;
+    }
     virtual unsigned int computation_cost(void) const
     {
         return (unsigned int)(weight.size());
@@ -100,9 +342,24 @@ public:
     virtual void update(float rw,const std::vector<float>& dw,
                         float rb,const std::vector<float>& db)
     {
+        qweight.clear();
         tipl::vec::axpy(&weight[0],&weight[0] + weight.size(),rw,&dw[0]);
         tipl::vec::axpy(&bias[0],&bias[0] + bias.size(),rb,&db[0]);
     }
+    // state: the optimizer buffers of the weights followed by the biases
+    virtual void update(const optimizer_param& p,std::vector<float>& dw,std::vector<float>& db,
+                        std::vector<float>& state)
+    {
+        qweight.clear();
+        size_t n = weight.size()+bias.size();
+        state.resize(n*p.state_count());
+        float* m = state.empty() ? 0 : &state[0];
+        float* v = p.state_count() > 1 ? m+n : 0;
+        size_t nw = weight.size();
+        optimizer_step(p,p.w_rate,p.type == adamw ? p.weight_decay : 0.0f,&weight[0],&dw[0],m,v,nw);
+        if(!bias.empty())
+            optimizer_step(p,p.b_rate,0.0f,&bias[0],&db[0],m ? m+nw : 0,v ? v+nw : 0,bias.size());
+    }
 };
 
 
@@ -127,8 +384,25 @@ public:
 
     void forward_propagation(const float* x,float* y) override
     {
-        for(int i = 0,i_pos = 0;i < output_size;++i,i_pos += input_size)
-            y[i] = bias[i] + tipl::vec::dot(&weight[i_pos],&weight[i_pos]+input_size,&x[0]);
+        if(!qweight.empty())
+        {
+            std::vector<signed char> qx(input_size);
+            qweight.quantize_input(x,&qx[0],input_size);
+            for(int o = 0;o < output_size;++o)
+                y[o] = bias[o]+qweight.scale[o]*float(dot_int8(&qweight.w[0]+size_t(o)*input_size,&qx[0],input_size));
+            return;
+        }
+        // samples are already spread over threads by the trainer
+        tipl::cu::y_Ax(y,&weight[0],x,output_size,input_size,1,1);
+        tipl::add(y,y+output_size,&bias[0]);
+    }
+    bool quantize(float input_scale) override
+    {
+        std::vector<size_t> row_pos(output_size+1);
+        for(int o = 0;o <= output_size;++o)
+            row_pos[o] = size_t(o)*input_size;
+        qweight.quantize(weight,row_pos,input_scale);
+        return true;
     }
     //dW += dOut * x
     //db += dOut
@@ -149,6 +423,81 @@ public:
     {
         tipl::mat::left_vector_product(&weight[0],dOut,dX,tipl::dyndim(output_size,input_size));
     }
+    // with the samples as rows: Y = X*W'+b, dX = dOut*W, dW += dOut'*X
+    void forward_propagation_batch(const float* x,size_t x_stride,float* y,size_t y_stride,int n) override
+    {
+        if(n < 4)
+        {
+            basic_layer::forward_propagation_batch(x,x_stride,y,y_stride,n);
+            return;
+        }
+        if(!qweight.empty())
+        {
+            std::vector<signed char> qx(size_t(n)*input_size);
+            std::vector<int> acc(size_t(n)*output_size);
+            par_for(n,[&](int i)
+            {
+                qweight.quantize_input(x+i*x_stride,&qx[0]+size_t(i)*input_size,input_size);
+            });
+            // acc[o*n+i]: the samples are spread over the threads
+            gemm_int8(&qweight.w[0],&qx[0],&acc[0],output_size,n,input_size,n,true);
+            for(int i = 0;i < n;++i)
+                for(int o = 0;o < output_size;++o)
+                    y[i*y_stride+o] = bias[o]+qweight.scale[o]*float(acc[size_t(o)*n+i]);
+            return;
+        }
+        std::vector<float> wt(weight.size());
+        tipl::mat::blocked::transpose(&weight[0],&wt[0],output_size,input_size);
+        for(int i = 0;i < n;++i)
+            std::copy(bias.begin(),bias.end(),y+i*y_stride);
+        tipl::mat::blocked::gemm(x,&wt[0],y,n,output_size,input_size,
+                                 (unsigned int)x_stride,output_size,(unsigned int)y_stride,true);
+    }
+    void back_propagation_batch(float* dOut,float* dX,const float* x,size_t stride,int n) override
+    {
+        if(n < 4)
+        {
+            basic_layer::back_propagation_batch(dOut,dX,x,stride,n);
+            return;
+        }
+        tipl::mat::blocked::gemm(dOut,&weight[0],dX,n,input_size,output_size,
+                                 (unsigned int)stride,input_size,(unsigned int)stride);
+    }
+    void calculate_dwdb_batch(const float* dOut,size_t dOut_stride,
+                              const float* x,size_t x_stride,int n,
+                              std::vector<float>& dweight,
+                              std::vector<float>& dbias) override
+    {
+        // samples with no error (common with the clamped targets) are skipped
+        std::vector<int> active;
+        for(int i = 0;i < n;++i)
+        {
+            const float* d = dOut+i*dOut_stride;
+            if(std::any_of(d,d+output_size,[](float v){return v != 0.0f;}))
+                active.push_back(i);
+        }
+        int m = int(active.size());
+        if(!m)
+            return;
+        std::vector<float> dOut_t(size_t(output_size)*m),xs;
+        for(int a = 0;a < m;++a)
+        {
+            const float* d = dOut+active[a]*dOut_stride;
+            tipl::add(&dbias[0],&dbias[0]+output_size,d);
+            for(int j = 0;j < output_size;++j)
+                dOut_t[size_t(j)*m+a] = d[j];
+        }
+        if(m < n)
+        {
+            xs.resize(size_t(m)*input_size);
+            for(int a = 0;a < m;++a)
+                std::copy(x+active[a]*x_stride,x+active[a]*x_stride+input_size,&xs[0]+size_t(a)*input_size);
+            x = &xs[0];
+            x_stride = input_size;
+        }
+        tipl::mat::blocked::gemm(&dOut_t[0],x,&dweight[0],output_size,input_size,m,
+                                 m,(unsigned int)x_stride,input_size,true);
+    }
 
 
 };
@@ -189,6 +538,12 @@ public:
         basic_layer::update(rw,dw,rb,db);
         orthogonize();
     }
+    virtual void update(const optimizer_param& p,std::vector<float>& dw,std::vector<float>& db,
+                        std::vector<float>& state)
+    {
+        basic_layer::update(p,dw,db,state);
+        orthogonize();
+    }
 };
 
 
@@ -212,8 +567,37 @@ public:
         weight.resize(w_sum);
         basic_layer::initialize_weight(gen);
     }
+    bool quantize(float input_scale) override
+    {
+        std::vector<size_t> row_pos(output_size+1);
+        for(int i = 0;i < output_size;++i)
+            row_pos[i+1] = row_pos[i]+(mapping[i].empty() ? input_size : mapping[i].size());
+        qweight.quantize(weight,row_pos,input_scale);
+        return true;
+    }
     void forward_propagation(const float* x,float* y) override
     {
+        if(!qweight.empty())
+        {
+            std::vector<signed char> qx(input_size);
+            qweight.quantize_input(x,&qx[0],input_size);
+            const signed char* w = &qweight.w[0];
+            for(int i = 0;i < output_size;++i)
+            {
+                const auto& cur_mapping = mapping[i];
+                int sum = 0;
+                if(!cur_mapping.empty())
+                    for(size_t j = 0;j < cur_mapping.size();++j)
+                        sum += int(*w++)*int(qx[cur_mapping[j]]);
+                else
+                {
+                    sum = dot_int8(w,&qx[0],input_size);
+                    w += input_size;
+                }
+                y[i] = bias[i]+qweight.scale[i]*float(sum);
+            }
+            return;
+        }
         for(int i = 0,i_pos = 0;i < output_size;++i)
             if(!mapping[i].empty())
             {
@@ -268,6 +652,22 @@ public:
         */
 
     }
+    // the mapped weights are not a dense matrix
+    void forward_propagation_batch(const float* x,size_t x_stride,float* y,size_t y_stride,int n) override
+    {
+        basic_layer::forward_propagation_batch(x,x_stride,y,y_stride,n);
+    }
+    void back_propagation_batch(float* dOut,float* dX,const float* x,size_t stride,int n) override
+    {
+        basic_layer::back_propagation_batch(dOut,dX,x,stride,n);
+    }
+    void calculate_dwdb_batch(const float* dOut,size_t dOut_stride,
+                              const float* x,size_t x_stride,int n,
+                              std::vector<float>& dweight,
+                              std::vector<float>& dbias) override
+    {
+        basic_layer::calculate_dwdb_batch(dOut,dOut_stride,x,x_stride,n,dweight,dbias);
+    }
     void back_propagation(float* ,// output_size
                           float* ,// input_size
                           const float*) override
@@ -405,6 +805,13 @@ public:
 
     void forward_propagation(const float* x,float* y) override
     {
+        if(!qweight.empty())
+        {
+            std::vector<signed char> buf;
+            std::vector<int> acc;
+            forward_int8(x,y,buf,acc);
+            return;
+        }
         for(int o = 0, o_index = 0,o_index2 = 0; o < out_dim.depth(); ++o, o_index += out_dim.plane_size())
         {
             std::fill(y+o_index,y+o_index+out_dim.plane_size(),bias[o]);
@@ -485,6 +892,134 @@ public:
             }
         }
     }
+private:
+    // col: one row of out_dim.plane_size() per weight (inc,wy,wx), holding the input under that weight
+    void im2col(const float* x,float* col) const
+    {
+        for(int inc = 0;inc < in_dim.depth();++inc)
+            for(int wy = 0;wy < kernel_size;++wy)
+                for(int wx = 0;wx < kernel_size;++wx)
+                {
+                    const float* p = x + (in_dim.height() * inc + wy) * in_dim.width() + wx;
+                    for(int y = 0;y < out_dim.height();++y,p += in_dim.width(),col += out_dim.width())
+                        std::copy(p,p+out_dim.width(),col);
+                }
+    }
+    // dX = sum of the rows of col moved back to their input positions
+    void col2im(const float* col,float* dX) const
+    {
+        std::fill(dX,dX+input_size,0.0f);
+        for(int inc = 0;inc < in_dim.depth();++inc)
+            for(int wy = 0;wy < kernel_size;++wy)
+                for(int wx = 0;wx < kernel_size;++wx)
+                {
+                    float* p = dX + (in_dim.height() * inc + wy) * in_dim.width() + wx;
+                    for(int y = 0;y < out_dim.height();++y,p += in_dim.width(),col += out_dim.width())
+                        tipl::add(p,p+out_dim.width(),col);
+                }
+    }
+    // row: the transpose of col, one row of weight_size/out_dim.depth() per output position
+    template<typename value_type>
+    void im2row(const value_type* x,value_type* row) const
+    {
+        int row_size = kernel_size2*in_dim.depth();
+        for(int y = 0;y < out_dim.height();++y)
+            for(int xx = 0;xx < out_dim.width();++xx,row += row_size)
+            {
+                value_type* r = row;
+                for(int inc = 0;inc < in_dim.depth();++inc)
+                    for(int wy = 0;wy < kernel_size;++wy,r += kernel_size)
+                    {
+                        const value_type* p = x + (in_dim.height() * inc + y + wy) * in_dim.width() + xx;
+                        std::copy(p,p+kernel_size,r);
+                    }
+            }
+    }
+    // Y = Wq*row' with the int8 input and weights
+    void forward_int8(const float* x,float* y,std::vector<signed char>& buf,std::vector<int>& acc) const
+    {
+        unsigned int k = kernel_size2*in_dim.depth(),p = out_dim.plane_size();
+        buf.resize(input_size+size_t(k)*p);
+        acc.resize(size_t(out_dim.depth())*p);
+        qweight.quantize_input(x,&buf[0],input_size);
+        im2row(&buf[0],&buf[0]+input_size);
+        gemm_int8(&qweight.w[0],&buf[0]+input_size,&acc[0],out_dim.depth(),p,k,p,false);
+        for(int o = 0;o < out_dim.depth();++o)
+        {
+            float s = qweight.scale[o],b = bias[o];
+            const int* a = &acc[0]+size_t(o)*p;
+            for(unsigned int j = 0;j < p;++j)
+                y[o*p+j] = b+s*float(a[j]);
+        }
+    }
+public:
+    bool quantize(float input_scale) override
+    {
+        std::vector<size_t> row_pos(out_dim.depth()+1);
+        for(int o = 0;o <= out_dim.depth();++o)
+            row_pos[o] = size_t(o)*kernel_size2*in_dim.depth();
+        qweight.quantize(weight,row_pos,input_scale);
+        return true;
+    }
+    // per sample: Y = W*col+b, dX = col2im(W'*dOut), dW += dOut*row
+    void forward_propagation_batch(const float* x,size_t x_stride,float* y,size_t y_stride,int n) override
+    {
+        unsigned int k = kernel_size2*in_dim.depth(),p = out_dim.plane_size();
+        unsigned int thread_count = available_thread_count();
+        if(!qweight.empty())
+        {
+            std::vector<std::vector<signed char> > buf(thread_count);
+            std::vector<std::vector<int> > acc(thread_count);
+            par_for2(n,[&](int i,int id)
+            {
+                forward_int8(x+i*x_stride,y+i*y_stride,buf[id],acc[id]);
+            },thread_count);
+            return;
+        }
+        std::vector<std::vector<float> > col(thread_count);
+        par_for2(n,[&](int i,int id)
+        {
+            col[id].resize(size_t(k)*p);
+            im2col(x+i*x_stride,&col[id][0]);
+            float* yi = y+i*y_stride;
+            for(int o = 0;o < out_dim.depth();++o)
+                std::fill(yi+o*p,yi+(o+1)*p,bias[o]);
+            tipl::mat::blocked::gemm_block(&weight[0],&col[id][0],yi,0,out_dim.depth(),0,p,k,k,p,p,1.0f);
+        },thread_count);
+    }
+    void back_propagation_batch(float* dOut,float* dX,const float*,size_t stride,int n) override
+    {
+        unsigned int k = kernel_size2*in_dim.depth(),p = out_dim.plane_size();
+        std::vector<float> wt(weight.size());
+        tipl::mat::blocked::transpose(&weight[0],&wt[0],out_dim.depth(),k);
+        int thread_count = available_thread_count();
+        std::vector<std::vector<float> > col(thread_count);
+        par_for2(n,[&](int i,int id)
+        {
+            col[id].assign(size_t(k)*p,0.0f);
+            tipl::mat::blocked::gemm_block(&wt[0],dOut+i*stride,&col[id][0],0,k,0,p,out_dim.depth(),out_dim.depth(),p,p,1.0f);
+            col2im(&col[id][0],dX+i*stride);
+        },thread_count);
+    }
+    void calculate_dwdb_batch(const float* dOut,size_t dOut_stride,
+                              const float* x,size_t x_stride,int n,
+                              std::vector<float>& dweight,
+                              std::vector<float>& dbias) override
+    {
+        unsigned int k = kernel_size2*in_dim.depth(),p = out_dim.plane_size();
+        reduce_dwdb(n,dweight,dbias,[&](int from,int to,std::vector<float>& dw,std::vector<float>& db)
+        {
+            std::vector<float> row(size_t(k)*p);
+            for(int i = from;i < to;++i)
+            {
+                const float* d = dOut+i*dOut_stride;
+                im2row(x+i*x_stride,&row[0]);
+                tipl::mat::blocked::gemm_block(d,&row[0],&dw[0],0,out_dim.depth(),0,k,p,p,k,k,1.0f);
+                for(int o = 0;o < out_dim.depth();++o)
+                    db[o] += std::accumulate(d+o*p,d+(o+1)*p,0.0f);
+            }
+        });
+    }
     virtual unsigned int computation_cost(void) const
     {
         return out_dim.size()*in_dim.depth()*kernel_size*kernel_size;
@@ -532,6 +1067,12 @@ public:
                 std::copy(dOut,dOut+dim.plane_size(),dX);
         }*/
     }
+    // the samples share one generator
+    void forward_propagation_batch(const float* x,size_t x_stride,float* y,size_t y_stride,int n) override
+    {
+        for(int i = 0;i < n;++i)
+            forward_propagation(x+i*x_stride,y+i*y_stride);
+    }
     void forward_propagation(const float* x,float* y) override
     {
         if(status == testing)
@@ -793,72 +1334,765 @@ void data_fold_for_cv(const network_data<label_type>& rhs,
                 training_data[j].pos.push_back(i);
     }
 }
+
+// IEEE half precision, rounded to nearest even
+inline unsigned short float_to_half(float value)
+{
+    unsigned int f;
+    std::memcpy(&f,&value,4);
+    unsigned int sign = (f >> 16) & 0x8000;
+    unsigned int mant = f & 0x7FFFFF;
+    int exp = int((f >> 23) & 0xFF)-127+15;
+    if(((f >> 23) & 0xFF) == 0xFF) // inf or nan
+        return (unsigned short)(sign | 0x7C00 | (mant ? 0x200 : 0));
+    if(exp >= 31)
+        return (unsigned short)(sign | 0x7C00);
+    if(exp <= 0)
+    {
+        if(exp < -10)
+            return (unsigned short)sign;
+        mant |= 0x800000;
+        unsigned int shift = (unsigned int)(14-exp);
+        unsigned int h = mant >> shift;
+        unsigned int rem = mant & ((1u << shift)-1),half = 1u << (shift-1);
+        if(rem > half || (rem == half && (h & 1)))
+            ++h;
+        return (unsigned short)(sign | h);
+    }
+    unsigned int h = sign | (unsigned int)(exp << 10) | (mant >> 13);
+    unsigned int rem = mant & 0x1FFF;
+    if(rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+        ++h;
+    return (unsigned short)h;
+}
+inline float half_to_float(unsigned short h)
+{
+    unsigned int sign = (unsigned int)(h & 0x8000) << 16;
+    unsigned int exp = (h >> 10) & 0x1F;
+    unsigned int mant = h & 0x3FF;
+    unsigned int f;
+    if(exp == 0)
+    {
+        if(!mant)
+            f = sign;
+        else
+        {
+            exp = 127-15+1;
+            while(!(mant & 0x400))
+            {
+                mant <<= 1;
+                --exp;
+            }
+            f = sign | (exp << 23) | ((mant & 0x3FF) << 13);
+        }
+    }
+    else
+        if(exp == 31)
+            f = sign | 0x7F800000 | (mant << 13);
+        else
+            f = sign | ((exp+112) << 23) | (mant << 13);
+    float value;
+    std::memcpy(&value,&f,4);
+    return value;
+}
+
+enum network_data_storage {float32_storage = 0,float16_storage = 1,uint8_storage = 2};
+
 /*
+    Sample file for out-of-core training:
+        header (64 bytes)
+        samples: sample_count x sample_dim values stored as float32,
+                 float16 or uint8 (value = offset + scale*q)
+        labels: sample_count label_type, at a 64-byte boundary
+*/
+struct network_data_file_header{
+    char magic[8];
+    int input[3];
+    int output[3];
+    unsigned int storage;
+    unsigned int sample_dim;
+    unsigned long long sample_count;
+    float scale;
+    float offset;
+    unsigned int label_size;
+    unsigned int reserved;
+    static const char* file_magic(void){return "TIPLNND1";}
+    size_t value_size(void) const{return storage == float32_storage ? 4 : (storage == float16_storage ? 2 : 1);}
+    size_t sample_bytes(void) const{return value_size()*sample_dim;}
+    size_t label_pos(void) const{return (sizeof(network_data_file_header)+sample_count*sample_bytes()+63)/64*64;}
+};
 
-    void rotate_permute(void)
-    {
-        tipl::uniform_dist<int> gen(2);
-        for(int j = 0;j < size();++j)
+template<typename label_type>
+class network_data_writer{
+    std::ofstream out;
+    network_data_file_header header;
+    std::vector<label_type> labels;
+    std::vector<char> buf;
+public:
+    ~network_data_writer(void){close();}
+    /*
+        min_value,max_value: the range quantized by uint8 storage
+    */
+    bool open(const char* file_name,const tipl::geometry<3>& input,const tipl::geometry<3>& output,
+              network_data_storage storage = float32_storage,float min_value = 0.0f,float max_value = 1.0f)
+    {
+        static_assert(std::is_trivially_copyable<label_type>::value,"labels are stored as raw bytes");
+        close();
+        std::memset(&header,0,sizeof(header));
+        std::memcpy(header.magic,network_data_file_header::file_magic(),8);
+        for(int d = 0;d < 3;++d)
         {
-            auto I = tipl::make_image(&data[j][0],input);
-            if(gen())
-                tipl::flip_x(I);
-            if(gen())
-                tipl::flip_y(I);
-            if(gen())
-                tipl::swap_xy(I);
+            header.input[d] = input[d];
+            header.output[d] = output[d];
         }
+        header.storage = storage;
+        header.sample_dim = (unsigned int)input.size();
+        header.offset = min_value;
+        header.scale = (max_value > min_value) ? (max_value-min_value)/255.0f : 1.0f;
+        header.label_size = sizeof(label_type);
+        labels.clear();
+        buf.resize(header.sample_bytes());
+        out.open(file_name,std::ios::binary);
+        out.write((const char*)&header,sizeof(header));
+        return out.good();
+    }
+    void add(const float* sample,const label_type& label)
+    {
+        size_t dim = header.sample_dim;
+        if(header.storage == float32_storage)
+            std::memcpy(&buf[0],sample,dim*4);
+        if(header.storage == float16_storage)
+            for(size_t i = 0;i < dim;++i)
+            {
+                unsigned short h = float_to_half(sample[i]);
+                std::memcpy(&buf[i*2],&h,2);
+            }
+        if(header.storage == uint8_storage)
+            for(size_t i = 0;i < dim;++i)
+                buf[i] = char((unsigned char)std::max<float>(0.0f,std::min<float>(255.0f,
+                                std::floor((sample[i]-header.offset)/header.scale+0.5f))));
+        out.write(&buf[0],std::streamsize(buf.size()));
+        labels.push_back(label);
     }
- */
-class network
+    // writes the labels and the final header
+    bool close(void)
+    {
+        if(!out.is_open())
+            return false;
+        header.sample_count = labels.size();
+        size_t pos = sizeof(header)+header.sample_count*header.sample_bytes();
+        std::vector<char> pad(header.label_pos()-pos);
+        if(!pad.empty())
+            out.write(&pad[0],std::streamsize(pad.size()));
+        if(!labels.empty())
+            out.write((const char*)&labels[0],std::streamsize(labels.size()*sizeof(label_type)));
+        out.seekp(0);
+        out.write((const char*)&header,sizeof(header));
+        bool result = out.good();
+        out.close();
+        return result;
+    }
+};
+
+template<typename label_type>
+bool save_to_mapped_file(const network_data<label_type>& data,const char* file_name,
+                         network_data_storage storage = float32_storage)
 {
+    float min_value = 0.0f,max_value = 1.0f;
+    if(storage == uint8_storage && !data.data.empty())
+    {
+        min_value = max_value = data.data[0][0];
+        for(const auto& sample : data.data)
+        {
+            min_value = std::min(min_value,*std::min_element(sample.begin(),sample.end()));
+            max_value = std::max(max_value,*std::max_element(sample.begin(),sample.end()));
+        }
+    }
+    network_data_writer<label_type> writer;
+    if(!writer.open(file_name,data.input,data.output,storage,min_value,max_value))
+        return false;
+    for(size_t i = 0;i < data.size();++i)
+        writer.add(&data.data[i][0],data.data_label[i]);
+    return writer.close();
+}
+
+// memory-mapped sample file
+template<typename label_type>
+class network_data_file{
+    tipl::io::memory_map map;
+    network_data_file_header header;
 public:
-    std::vector<std::shared_ptr<basic_layer> > layers;
-    std::vector<tipl::geometry<3> > geo;
-    unsigned int data_size = 0;
-    unsigned int output_size = 0;
-    bool initialized = false;
-    std::string error_msg;
+    tipl::geometry<3> input,output;
 public:
-    network(){}
-    void reset(void)
+    bool load_from_file(const char* file_name)
     {
-        layers.clear();
-        geo.clear();
-        data_size = 0;
-        initialized = false;
+        if(!map.open(file_name) || map.size() < sizeof(header))
+            return false;
+        std::memcpy(&header,map.data(),sizeof(header));
+        if(std::memcmp(header.magic,network_data_file_header::file_magic(),8) ||
+           header.label_size != sizeof(label_type) || header.storage > uint8_storage ||
+           map.size() < header.label_pos()+header.sample_count*sizeof(label_type))
+        {
+            map.close();
+            return false;
+        }
+        input = tipl::geometry<3>(header.input[0],header.input[1],header.input[2]);
+        output = tipl::geometry<3>(header.output[0],header.output[1],header.output[2]);
+        return true;
     }
-    const network& operator=(const network& rhs)
+    size_t size(void) const{return map ? size_t(header.sample_count) : 0;}
+    bool empty(void) const{return size() == 0;}
+    unsigned int sample_dim(void) const{return header.sample_dim;}
+    network_data_storage storage(void) const{return network_data_storage(header.storage);}
+    const label_type& get_label(size_t index) const
     {
-        reset();
-        add(rhs.get_layer_text());
-        for(int i = 0;i < rhs.layers.size();++i)
-            if(!layers[i]->weight.empty())
+        return ((const label_type*)(map.data()+header.label_pos()))[index];
+    }
+    // float32 samples can be read in place
+    const float* get_raw_data(size_t index) const
+    {
+        return header.storage == float32_storage ?
+                    (const float*)(map.data()+sizeof(header)+index*header.sample_bytes()) : 0;
+    }
+    void get_data(size_t index,float* out) const
+    {
+        size_t dim = header.sample_dim;
+        const char* p = map.data()+sizeof(header)+index*header.sample_bytes();
+        if(header.storage == float32_storage)
+            std::memcpy(out,p,dim*4);
+        if(header.storage == float16_storage)
+            for(size_t i = 0;i < dim;++i)
             {
-                layers[i]->weight = rhs.layers[i]->weight;
-                layers[i]->bias = rhs.layers[i]->bias;
+                unsigned short h;
+                std::memcpy(&h,p+i*2,2);
+                out[i] = half_to_float(h);
             }
-        data_size = rhs.data_size;
-        output_size = rhs.output_size;
-        initialized = rhs.initialized;
-        return *this;
+        if(header.storage == uint8_storage)
+            for(size_t i = 0;i < dim;++i)
+                out[i] = header.offset+header.scale*float((unsigned char)p[i]);
     }
-    const network& operator=(network&& rhs)
+    void prefetch(size_t from,size_t to) const
     {
-        layers.swap(rhs.layers);
-        geo.swap(rhs.geo);
-        data_size = rhs.data_size;
-        output_size = rhs.output_size;
-        initialized = rhs.initialized;
-        return *this;
+        map.prefetch(sizeof(header)+from*header.sample_bytes(),(to-from)*header.sample_bytes());
     }
-
-    void init_weights(unsigned int seed = 0)
+    bool load(network_data<label_type>& data) const
     {
-        tipl::uniform_dist<float> gen(-1.0,1.0,seed);
-        for(auto layer : layers)
+        data.input = input;
+        data.output = output;
+        data.data.resize(size());
+        data.data_label.resize(size());
+        for(size_t i = 0;i < size();++i)
         {
-            layer->initialize_weight(gen);
+            data.data[i].resize(header.sample_dim);
+            get_data(i,&data.data[i][0]);
+            data.data_label[i] = get_label(i);
+        }
+        return true;
+    }
+};
+
+/*
+    Feeds trainer::train from a network_data_file. shuffle permutes the
+    order of blocks of consecutive samples, so that the file is read
+    sequentially, and the samples within each block. The next block is
+    decoded by a background task while the current one is being trained,
+    in a ring of three buffers; block_size must not be smaller than the
+    trainer's batch_size, or the trainer throws.
+*/
+template<typename label_type>
+class network_data_loader{
+    struct block_type{
+        std::vector<float> data;
+        std::vector<label_type> label;
+    };
+    static const size_t npos = size_t(-1);
+    const network_data_file<label_type>* source = 0;
+    size_t block_size = 4096;
+    unsigned int seed = 0;
+    std::vector<size_t> block_order,block_start;
+    block_type ring[3];
+    std::atomic<size_t> ready[3];
+    std::future<void> pending[3];
+    size_t pending_block[3];
+    std::mutex lock;
+private:
+    void decode(size_t j)
+    {
+        block_type& b = ring[j % 3];
+        size_t from = block_order[j]*block_size;
+        size_t count = block_start[j+1]-block_start[j];
+        size_t dim = source->sample_dim();
+        if(j+1 < block_order.size())
+            source->prefetch(block_order[j+1]*block_size,block_order[j+1]*block_size+block_size);
+        std::vector<unsigned int> perm(count);
+        std::iota(perm.begin(),perm.end(),0);
+        std::mt19937 gen(seed+(unsigned int)j);
+        std::shuffle(perm.begin(),perm.end(),gen);
+        b.data.resize(count*dim);
+        b.label.resize(count);
+        for(size_t k = 0;k < count;++k)
+        {
+            source->get_data(from+k,&b.data[perm[k]*dim]);
+            b.label[perm[k]] = source->get_label(from+k);
+        }
+    }
+    void wait(int s)
+    {
+        if(pending[s].valid())
+            pending[s].wait();
+        pending[s] = std::future<void>();
+    }
+    // make block j ready and start decoding j+1
+    void fetch(size_t j)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        int s = int(j % 3);
+        if(ready[s] != j)
+        {
+            bool prefetched = pending[s].valid() && pending_block[s] == j;
+            wait(s);
+            if(!prefetched)
+                decode(j);
+            ready[s] = j;
+        }
+        size_t next = j+1;
+        int s2 = int(next % 3);
+        if(next < block_order.size() && ready[s2] != next && !(pending[s2].valid() && pending_block[s2] == next))
+        {
+            wait(s2);
+            ready[s2] = npos;
+            pending_block[s2] = next;
+            pending[s2] = std::async(std::launch::async,[this,next](){decode(next);});
+        }
+    }
+    size_t block_of(size_t index) const
+    {
+        return size_t(std::upper_bound(block_start.begin(),block_start.end(),index)-block_start.begin())-1;
+    }
+    void stop(void)
+    {
+        for(int s = 0;s < 3;++s)
+        {
+            wait(s);
+            ready[s] = npos;
+        }
+    }
+    void reset(void)
+    {
+        block_start.resize(block_order.size()+1);
+        block_start[0] = 0;
+        for(size_t j = 0;j < block_order.size();++j)
+            block_start[j+1] = block_start[j]+
+                    std::min(block_size,source->size()-block_order[j]*block_size);
+        if(!block_order.empty())
+            fetch(0);
+    }
+    network_data_loader(const network_data_loader&);
+    network_data_loader& operator=(const network_data_loader&);
+public:
+    network_data_loader(const network_data_file<label_type>& source_,size_t block_size_ = 4096):
+        source(&source_),block_size(std::max<size_t>(1,block_size_))
+    {
+        block_order.resize((source->size()+block_size-1)/block_size);
+        std::iota(block_order.begin(),block_order.end(),0);
+        stop();
+        reset();
+    }
+    ~network_data_loader(void){stop();}
+    size_t size(void) const{return source->size();}
+    size_t get_block_size(void) const{return block_size;}
+    bool empty(void) const{return source->empty();}
+    template <typename seed_type>
+    void shuffle(seed_type& gen)
+    {
+        stop();
+        std::shuffle(block_order.begin(),block_order.end(),gen);
+        seed = (unsigned int)gen();
+        reset();
+    }
+    // samples are visited in increasing order, as trainer::train_batch does
+    const float* get_data(size_t index)
+    {
+        size_t j = block_of(index);
+        if(ready[j % 3] != j)
+            fetch(j);
+        return &ring[j % 3].data[(index-block_start[j])*source->sample_dim()];
+    }
+    const label_type& get_label(size_t index)
+    {
+        size_t j = block_of(index);
+        if(ready[j % 3] != j)
+            fetch(j);
+        return ring[j % 3].label[index-block_start[j]];
+    }
+};
+template<typename label_type>
+const size_t network_data_loader<label_type>::npos;
+
+/*
+    On-the-fly augmentation in front of trainer::train. The transform of a
+    sample is drawn from a generator seeded with (seed,epoch,index), so
+    that it does not depend on the thread timing. Flips, intensity jitter
+    and small affine warps (tipl::resample of each channel plane) are
+    computed by background threads into a bounded queue of blocks ahead
+    of the samples requested by train_batch, which reads the samples in
+    increasing order. When only flips are used, get_data(index,out)
+    gathers the source sample straight into out through a precomputed
+    index table and no queue is used. The source must allow concurrent
+    get_data calls, as network_data_proxy does.
+*/
+template<typename label_type,typename data_type = network_data_proxy<label_type> >
+class network_data_augmentation{
+public:
+    struct param_type{
+        bool flip_x = false;
+        bool flip_y = false;
+        float intensity_scale = 0.0f;   // x*(1+u*intensity_scale), u in [-1,1]
+        float intensity_shift = 0.0f;   // + u*intensity_shift
+        float noise = 0.0f;             // standard deviation of the added noise
+        float rotation = 0.0f;          // maximum rotation in radians
+        float scaling = 0.0f;           // maximum relative scaling
+        float translation = 0.0f;       // maximum shift in pixels
+        bool affine(void) const{return rotation != 0.0f || scaling != 0.0f || translation != 0.0f;}
+        bool geometric_only(void) const{return !affine() && intensity_scale == 0.0f && intensity_shift == 0.0f && noise == 0.0f;}
+    };
+private:
+    static const size_t npos = size_t(-1);
+    data_type& source;
+    tipl::geometry<3> dim;
+    param_type param;
+    unsigned int seed;
+    unsigned int epoch = 0;
+    size_t block_size,queue_size;
+    std::vector<std::vector<float> > queue;
+    std::vector<size_t> slot_block;     // the block held by each slot
+    std::vector<std::vector<unsigned int> > flip_table;
+    size_t next_block = 0;              // the next block to produce
+    size_t requested = 0;               // one past the last block requested
+    size_t busy = 0;
+    bool running = false,quit = false;
+    std::mutex lock;
+    std::condition_variable produced,consumed;
+    std::vector<std::thread> workers;
+private:
+    size_t block_count(void) const{return (source.size()+block_size-1)/block_size;}
+    // a batch spans at most two blocks, so the slot of block j-queue_size
+    // is free once block j-queue_size+2 has been requested and that block
+    // is no longer being produced
+    bool can_produce(void) const
+    {
+        return running && next_block < block_count() && next_block+2 < requested+queue_size &&
+               (next_block < queue_size || slot_block[next_block % queue_size] == next_block-queue_size);
+    }
+    struct affine_transform{
+        double m[4],c[2],t[2];
+        template<typename index_type,typename pos_type>
+        void operator()(const index_type& index,pos_type& pos) const
+        {
+            double x = index[0]-c[0],y = index[1]-c[1];
+            pos[0] = m[0]*x+m[1]*y+c[0]+t[0];
+            pos[1] = m[2]*x+m[3]*y+c[1]+t[1];
+        }
+    };
+    void produce(size_t index,float* out)
+    {
+        std::seed_seq seq{seed,epoch,(unsigned int)index};
+        std::mt19937 gen(seq);
+        std::uniform_real_distribution<float> u(-1.0f,1.0f);
+        int flip = (param.flip_x && (gen() & 1) ? 1 : 0) | (param.flip_y && (gen() & 1) ? 2 : 0);
+        const float* x = source.get_data(index);
+        if(param.affine())
+        {
+            // the flips are folded into the matrix
+            float angle = u(gen)*param.rotation;
+            float scale = 1.0f+u(gen)*param.scaling;
+            affine_transform T;
+            T.m[0] = std::cos(angle)/scale;
+            T.m[1] = -std::sin(angle)/scale;
+            T.m[2] = -T.m[1];
+            T.m[3] = T.m[0];
+            if(flip & 1)
+            {
+                T.m[0] = -T.m[0];
+                T.m[2] = -T.m[2];
+            }
+            if(flip & 2)
+            {
+                T.m[1] = -T.m[1];
+                T.m[3] = -T.m[3];
+            }
+            T.c[0] = 0.5*(dim.width()-1);
+            T.c[1] = 0.5*(dim.height()-1);
+            T.t[0] = u(gen)*param.translation;
+            T.t[1] = u(gen)*param.translation;
+            tipl::geometry<2> geo2(dim.width(),dim.height());
+            std::fill(out,out+dim.size(),0.0f);
+            for(int c = 0;c < dim.depth();++c)
+            {
+                tipl::const_pointer_image<float,2> from(x+c*dim.plane_size(),geo2);
+                tipl::pointer_image<float,2> to(out+c*dim.plane_size(),geo2);
+                tipl::resample(from,to,T,tipl::linear);
+            }
+        }
+        else
+            copy_sample(x,flip,out);
+        if(param.intensity_scale != 0.0f || param.intensity_shift != 0.0f || param.noise != 0.0f)
+        {
+            float a = 1.0f+u(gen)*param.intensity_scale;
+            float b = u(gen)*param.intensity_shift;
+            std::normal_distribution<float> n(0.0f,param.noise);
+            for(size_t i = 0;i < dim.size();++i)
+                out[i] = out[i]*a+b+(param.noise != 0.0f ? n(gen) : 0.0f);
+        }
+    }
+    void copy_sample(const float* x,int flip,float* out) const
+    {
+        if(flip)
+        {
+            const unsigned int* table = &flip_table[flip][0];
+            for(size_t i = 0;i < dim.size();++i)
+                out[i] = x[table[i]];
+        }
+        else
+            std::copy(x,x+dim.size(),out);
+    }
+    void work(void)
+    {
+        std::unique_lock<std::mutex> lk(lock);
+        while(true)
+        {
+            consumed.wait(lk,[this](){return quit || can_produce();});
+            if(quit)
+                return;
+            size_t j = next_block++;
+            ++busy;
+            lk.unlock();
+            std::vector<float>& block = queue[j % queue_size];
+            size_t from = j*block_size,to = std::min(source.size(),from+block_size);
+            block.resize((to-from)*dim.size());
+            for(size_t i = from;i < to;++i)
+                produce(i,&block[(i-from)*dim.size()]);
+            lk.lock();
+            slot_block[j % queue_size] = j;
+            --busy;
+            produced.notify_all();
+        }
+    }
+    void stop(void)
+    {
+        std::unique_lock<std::mutex> lk(lock);
+        running = false;
+        produced.wait(lk,[this](){return busy == 0;});
+        next_block = 0;
+        requested = 0;
+        std::fill(slot_block.begin(),slot_block.end(),npos);
+    }
+    // with flips only, the queue starts at the first get_data(index)
+    void start(void)
+    {
+        std::lock_guard<std::mutex> lk(lock);
+        running = !param.geometric_only();
+        consumed.notify_all();
+    }
+    network_data_augmentation(const network_data_augmentation&);
+    network_data_augmentation& operator=(const network_data_augmentation&);
+public:
+    /*
+        dim: the sample geometry, width x height x channels
+        block_size must not be smaller than the trainer's batch_size, or the trainer throws
+    */
+    network_data_augmentation(data_type& source_,const tipl::geometry<3>& dim_,const param_type& param_,
+                              unsigned int seed_ = 0,size_t block_size_ = 256,size_t queue_size_ = 4,
+                              unsigned int thread_count = 2):
+        source(source_),dim(dim_),param(param_),seed(seed_),
+        block_size(std::max<size_t>(1,block_size_)),queue_size(std::max<size_t>(3,queue_size_)),
+        queue(queue_size),slot_block(queue_size,npos),flip_table(4)
+    {
+        for(int flip = 1;flip < 4;++flip)
+        {
+            flip_table[flip].resize(dim.size());
+            for(unsigned int i = 0;i < dim.size();++i)
+            {
+                unsigned int x = i % dim.width(),y = (i/dim.width()) % dim.height();
+                unsigned int c = i/dim.plane_size();
+                if(flip & 1)
+                    x = dim.width()-1-x;
+                if(flip & 2)
+                    y = dim.height()-1-y;
+                flip_table[flip][i] = (c*dim.height()+y)*dim.width()+x;
+            }
+        }
+        for(unsigned int i = 0;i < std::max<unsigned int>(1,thread_count);++i)
+            workers.push_back(std::thread([this](){work();}));
+        start();
+    }
+    ~network_data_augmentation(void)
+    {
+        {
+            std::lock_guard<std::mutex> lk(lock);
+            quit = true;
+            consumed.notify_all();
+        }
+        for(auto& t : workers)
+            t.join();
+    }
+    size_t size(void) const{return source.size();}
+    size_t get_block_size(void) const{return block_size;}
+    bool empty(void) const{return source.empty();}
+    template <typename seed_type>
+    void shuffle(seed_type& gen)
+    {
+        stop();
+        source.shuffle(gen);
+        ++epoch;
+        start();
+    }
+    const label_type& get_label(size_t index){return source.get_label(index);}
+    const float* get_data(size_t index)
+    {
+        size_t j = index/block_size;
+        std::unique_lock<std::mutex> lk(lock);
+        running = true;
+        if(j+1 > requested)
+        {
+            requested = j+1;
+            consumed.notify_all();
+        }
+        produced.wait(lk,[&](){return slot_block[j % queue_size] == j;});
+        return &queue[j % queue_size][(index-j*block_size)*dim.size()];
+    }
+    void get_data(size_t index,float* out)
+    {
+        if(!param.geometric_only())
+        {
+            const float* x = get_data(index);
+            std::copy(x,x+dim.size(),out);
+            return;
+        }
+        std::seed_seq seq{seed,epoch,(unsigned int)index};
+        std::mt19937 gen(seq);
+        int flip = (param.flip_x && (gen() & 1) ? 1 : 0) | (param.flip_y && (gen() & 1) ? 2 : 0);
+        copy_sample(source.get_data(index),flip,out);
+    }
+};
+template<typename label_type,typename data_type>
+const size_t network_data_augmentation<label_type,data_type>::npos;
+
+/*
+
+    void rotate_permute(void)
+    {
+        tipl::uniform_dist<int> gen(2);
+        for(int j = 0;j < size();++j)
+        {
+            auto I = tipl::make_image(&data[j][0],input);
+            if(gen())
+                tipl::flip_x(I);
+            if(gen())
+                tipl::flip_y(I);
+            if(gen())
+                tipl::swap_xy(I);
+        }
+    }
+ */
+/*
+    Model file, in native (little-endian) byte order:
+        header (64 bytes)
+        layer text: text_length bytes
+        sections: layer_count network_model_section, at a 64-byte boundary
+        weights and biases: float32, each at a 64-byte boundary so that
+                            a mapped file can be used in place
+*/
+struct network_model_file_header{
+    char magic[8];
+    unsigned int version;
+    unsigned int text_length;
+    unsigned int layer_count;
+    unsigned int reserved;
+    unsigned long long file_size;
+    char pad[32];
+    static const char* file_magic(void){return "TIPLNNM1";}
+    static unsigned int current_version(void){return 1;}
+    size_t section_pos(void) const{return (sizeof(network_model_file_header)+text_length+63)/64*64;}
+};
+// byte offsets and float counts of a layer's weight and bias
+struct network_model_section{
+    unsigned long long weight_pos,weight_count;
+    unsigned long long bias_pos,bias_count;
+};
+
+// int8 against float32 outputs of network::quantize
+struct quantization_report{
+    size_t sample_count = 0;
+    bool classification = false;
+    size_t float_correct = 0;
+    size_t int8_correct = 0;
+    size_t agreement = 0;       // samples with the same prediction
+    float max_error = 0.0f;     // largest absolute output difference
+    float mean_error = 0.0f;
+    std::string to_string(void) const
+    {
+        std::ostringstream out;
+        out << "samples:" << sample_count;
+        if(sample_count && classification)
+            out << " agreement:" << 100.0*double(agreement)/double(sample_count) << "%"
+                << " float accuracy:" << 100.0*double(float_correct)/double(sample_count) << "%"
+                << " int8 accuracy:" << 100.0*double(int8_correct)/double(sample_count) << "%";
+        out << " max error:" << max_error << " mean error:" << mean_error;
+        return out.str();
+    }
+};
+
+class network
+{
+public:
+    std::vector<std::shared_ptr<basic_layer> > layers;
+    std::vector<tipl::geometry<3> > geo;
+    unsigned int data_size = 0;
+    unsigned int output_size = 0;
+    bool initialized = false;
+    std::string error_msg;
+public:
+    network(){}
+    void reset(void)
+    {
+        layers.clear();
+        geo.clear();
+        data_size = 0;
+        initialized = false;
+    }
+    const network& operator=(const network& rhs)
+    {
+        reset();
+        add(rhs.get_layer_text());
+        for(int i = 0;i < rhs.layers.size();++i)
+            if(!layers[i]->weight.empty())
+            {
+                layers[i]->weight = rhs.layers[i]->weight;
+                layers[i]->bias = rhs.layers[i]->bias;
+            }
+        data_size = rhs.data_size;
+        output_size = rhs.output_size;
+        initialized = rhs.initialized;
+        return *this;
+    }
+    const network& operator=(network&& rhs)
+    {
+        layers.swap(rhs.layers);
+        geo.swap(rhs.geo);
+        data_size = rhs.data_size;
+        output_size = rhs.output_size;
+        initialized = rhs.initialized;
+        return *this;
+    }
+
+    void init_weights(unsigned int seed = 0)
+    {
+        tipl::uniform_dist<float> gen(-1.0,1.0,seed);
+        for(auto layer : layers)
+        {
+            layer->initialize_weight(gen);
+            layer->qweight.clear();
             layer->wlearning_base_rate = 1.0f;
             layer->blearning_base_rate = 1.0f;
         }
@@ -885,6 +2119,9 @@ public:
                     vector_length[i] = tipl::vec::norm2(w1.begin()+pos,w1.begin()+pos+n);
                 });
                 auto idx = tipl::arg_sort(vector_length,std::greater<float>());
+                // the int8 weights no longer match
+                l1->qweight.clear();
+                l2->qweight.clear();
                 std::vector<float> nw1(w1),nb1(b1),nw2(w2);
                 for(int i = 0,pos = 0;i < m;++i,pos += n)
                     if(idx[i] != i)
@@ -1126,6 +2363,101 @@ public:
         set_test_mode(true);
         return !!in;
     }
+    bool save_to_model_file(const char* file_name) const
+    {
+        network_model_file_header header;
+        std::memset(&header,0,sizeof(header));
+        std::memcpy(header.magic,network_model_file_header::file_magic(),8);
+        std::string nn_text = get_layer_text();
+        header.version = network_model_file_header::current_version();
+        header.text_length = (unsigned int)nn_text.length();
+        header.layer_count = (unsigned int)layers.size();
+        std::vector<network_model_section> sections(layers.size());
+        size_t pos = header.section_pos()+sections.size()*sizeof(network_model_section);
+        // empty sections are at 0
+        auto place = [&pos](size_t count)
+        {
+            if(!count)
+                return size_t(0);
+            size_t at = (pos+63)/64*64;
+            pos = at+count*4;
+            return at;
+        };
+        for(size_t k = 0;k < layers.size();++k)
+        {
+            sections[k].weight_count = layers[k]->weight.size();
+            sections[k].weight_pos = place(layers[k]->weight.size());
+            sections[k].bias_count = layers[k]->bias.size();
+            sections[k].bias_pos = place(layers[k]->bias.size());
+        }
+        header.file_size = pos;
+
+        std::ofstream out(file_name,std::ios::binary);
+        size_t out_pos = 0;
+        auto write_at = [&](size_t at,const void* buf,size_t length)
+        {
+            const char zero[64] = {0};
+            out.write(zero,std::streamsize(at-out_pos));
+            out.write((const char*)buf,std::streamsize(length));
+            out_pos = at+length;
+        };
+        write_at(0,&header,sizeof(header));
+        write_at(sizeof(header),nn_text.c_str(),nn_text.length());
+        if(!sections.empty())
+            write_at(header.section_pos(),&sections[0],sections.size()*sizeof(network_model_section));
+        for(size_t k = 0;k < layers.size();++k)
+        {
+            if(!layers[k]->weight.empty())
+                write_at(sections[k].weight_pos,&layers[k]->weight[0],layers[k]->weight.size()*4);
+            if(!layers[k]->bias.empty())
+                write_at(sections[k].bias_pos,&layers[k]->bias[0],layers[k]->bias.size()*4);
+        }
+        return out.good();
+    }
+    /*
+        Validates a mapped model file and builds the layers from its text,
+        leaving the weights unread. Returns the section table or 0.
+    */
+    const network_model_section* open_model_file(const tipl::io::memory_map& map)
+    {
+        network_model_file_header header;
+        if(map.size() < sizeof(header))
+            return 0;
+        std::memcpy(&header,map.data(),sizeof(header));
+        size_t table_end = header.section_pos()+size_t(header.layer_count)*sizeof(network_model_section);
+        if(std::memcmp(header.magic,network_model_file_header::file_magic(),8) ||
+           header.version != network_model_file_header::current_version() ||
+           header.file_size > map.size() || table_end > map.size())
+            return 0;
+        reset();
+        if(!add(std::string(map.data()+sizeof(header),header.text_length)) ||
+           layers.size() != header.layer_count)
+            return 0;
+        const network_model_section* sections = (const network_model_section*)(map.data()+header.section_pos());
+        for(size_t k = 0;k < layers.size();++k)
+            if(sections[k].weight_count != layers[k]->weight.size() ||
+               sections[k].bias_count != layers[k]->bias.size() ||
+               sections[k].weight_pos % 64 || sections[k].bias_pos % 64 ||
+               sections[k].weight_pos+sections[k].weight_count*4 > map.size() ||
+               sections[k].bias_pos+sections[k].bias_count*4 > map.size())
+                return 0;
+        return sections;
+    }
+    bool load_from_model_file(const char* file_name)
+    {
+        tipl::io::memory_map map;
+        const network_model_section* sections;
+        if(!map.open(file_name) || !(sections = open_model_file(map)))
+            return false;
+        for(size_t k = 0;k < layers.size();++k)
+        {
+            std::copy_n((const float*)(map.data()+sections[k].weight_pos),layers[k]->weight.size(),layers[k]->weight.begin());
+            std::copy_n((const float*)(map.data()+sections[k].bias_pos),layers[k]->bias.size(),layers[k]->bias.begin());
+        }
+        initialized = true;
+        set_test_mode(true);
+        return true;
+    }
 
 
 
@@ -1140,6 +2472,18 @@ public:
             out_ptr += layers[k]->output_size;
         }
     }
+    // n samples: sample i reads input+i*input_stride and fills out_ptr+i*data_size
+    void forward_propagation(const float* input,size_t input_stride,float* out_ptr,int n) const
+    {
+        for(int k = 0;k < layers.size();++k)
+        {
+            layers[k]->forward_propagation_batch(input,k ? data_size : input_stride,out_ptr,data_size,n);
+            for(int i = 0;i < n;++i)
+                layers[k]->forward_af(out_ptr+size_t(i)*data_size);
+            input = out_ptr;
+            out_ptr += layers[k]->output_size;
+        }
+    }
     void forward_propagation(std::vector<float>& in) const
     {
         std::vector<float> out(data_size);
@@ -1195,6 +2539,35 @@ public:
         }
 
     }
+    void back_propagation(const float* out_ptr2,float* df_ptr,int n) const
+    {
+        for(int k = (int)layers.size()-1;k >= 0;--k)
+        {
+            for(int i = 0;i < n;++i)
+                layers[k]->back_af(df_ptr+size_t(i)*data_size,out_ptr2+size_t(i)*data_size);
+            const float* next_out_ptr = out_ptr2 - layers[k]->input_size;
+            float* next_df_ptr = df_ptr - layers[k]->input_size;
+            if(k)
+                layers[k]->back_propagation_batch(df_ptr,next_df_ptr,next_out_ptr,data_size,n);
+            out_ptr2 = next_out_ptr;
+            df_ptr = next_df_ptr;
+        }
+    }
+    void calculate_dwdb(const float* data_entry,size_t data_stride,
+                        const float* dOut,const float* x,int n,
+                        std::vector<std::vector<float> >& dweight,
+                        std::vector<std::vector<float> >& dbias)
+    {
+        if(!layers[0]->weight.empty())
+            layers[0]->calculate_dwdb_batch(dOut,data_size,data_entry,data_stride,n,dweight[0],dbias[0]);
+        for(int k = 1;k < layers.size();++k)
+        {
+            dOut += layers[k]->input_size;
+            if(!layers[k]->weight.empty())
+                layers[k]->calculate_dwdb_batch(dOut,data_size,x,data_size,n,dweight[k],dbias[k]);
+            x += layers[k]->input_size;
+        }
+    }
     void calculate_dwdb(const float* data_entry,
                         const float* dOut,const float* x,
                         std::vector<std::vector<float> >& dweight,
@@ -1215,6 +2588,11 @@ public:
         for(auto layer : layers)
             layer->status = (test ? testing:training);
     }
+    void set_deterministic(bool deterministic)
+    {
+        for(auto layer : layers)
+            layer->deterministic = deterministic;
+    }
 
     template<typename output_type>
     void predict(std::vector<float>& in,output_type& output)const
@@ -1248,6 +2626,114 @@ public:
             predict(data.get_data(i),test_result[i]);
         });
     }
+private:
+    // class agreement and accuracy, for scalar labels and more than one output
+    void accumulate_agreement(quantization_report& report,const float* f,const float* q,float label) const
+    {
+        if(output_size == 1)
+            return;
+        report.classification = true;
+        size_t pf = std::max_element(f,f+output_size)-f;
+        size_t pq = std::max_element(q,q+output_size)-q;
+        if(pf == pq)
+            ++report.agreement;
+        if(pf == size_t(label))
+            ++report.float_correct;
+        if(pq == size_t(label))
+            ++report.int8_correct;
+    }
+    // vector labels are regression targets: only the output error is reported
+    void accumulate_agreement(quantization_report&,const float*,const float*,const std::vector<float>&) const{}
+    // outputs of samples [from,to), output_size each
+    template<typename label_type>
+    void batch_output(const network_data_proxy<label_type>& data,size_t from,size_t to,
+                      std::vector<float>& output,std::vector<float>* layer_input_max = 0) const
+    {
+        const size_t batch = 64;
+        unsigned int input_size = get_input_size();
+        output.resize((to-from)*output_size);
+        std::vector<float> input(batch*input_size),in_out(batch*data_size);
+        for(size_t i = from;i < to;i += batch)
+        {
+            int n = int(std::min(batch,to-i));
+            for(int m = 0;m < n;++m)
+                std::copy(data.get_data(i+m),data.get_data(i+m)+input_size,&input[0]+size_t(m)*input_size);
+            forward_propagation(&input[0],input_size,&in_out[0],n);
+            for(int m = 0;m < n;++m)
+                std::copy(&in_out[0]+size_t(m+1)*data_size-output_size,&in_out[0]+size_t(m+1)*data_size,
+                          &output[0]+(i-from+m)*output_size);
+            if(!layer_input_max)
+                continue;
+            // the input of layer k is the data or the output of layer k-1
+            for(int m = 0;m < n;++m)
+            {
+                const float* x = &input[0]+size_t(m)*input_size;
+                size_t size = input_size;
+                for(size_t k = 0;k < layers.size();++k)
+                {
+                    float& v = (*layer_input_max)[k];
+                    for(size_t j = 0;j < size;++j)
+                        v = std::max(v,std::fabs(x[j]));
+                    x = (k ? x+size : &in_out[0]+size_t(m)*data_size);
+                    size = layers[k]->output_size;
+                }
+            }
+        }
+    }
+public:
+    bool is_quantized(void) const
+    {
+        for(auto layer : layers)
+            if(!layer->qweight.empty())
+                return true;
+        return false;
+    }
+    void dequantize(void)
+    {
+        for(auto layer : layers)
+            layer->qweight.clear();
+    }
+    /*
+        Post-training int8 quantization of the convolutional, fully and
+        partially connected layers. The weights have one scale per output
+        channel, and the input scale of each layer is calibrated from the
+        largest input over the first calibration_count samples of data.
+        predict and forward_propagation then run in int8 until the weights
+        are updated or dequantize is called. The report compares the int8
+        outputs with the float outputs over all samples of data.
+    */
+    template<typename label_type>
+    quantization_report quantize(const network_data_proxy<label_type>& data,size_t calibration_count = 1024)
+    {
+        quantization_report report;
+        dequantize();
+        if(data.empty() || layers.empty())
+            return report;
+        std::vector<float> input_max(layers.size()),float_output,int8_output;
+        batch_output(data,0,std::min(calibration_count,data.size()),float_output,&input_max);
+        batch_output(data,0,data.size(),float_output);
+        for(size_t k = 0;k < layers.size();++k)
+            if(!layers[k]->weight.empty())
+                layers[k]->quantize(input_max[k] > 0.0f ? input_max[k]/127.0f : 1.0f);
+        batch_output(data,0,data.size(),int8_output);
+
+        report.sample_count = data.size();
+        double sum_error = 0.0;
+        for(size_t i = 0;i < data.size();++i)
+        {
+            const float* f = &float_output[0]+i*output_size;
+            const float* q = &int8_output[0]+i*output_size;
+            for(unsigned int j = 0;j < output_size;++j)
+            {
+                float e = std::fabs(f[j]-q[j]);
+                report.max_error = std::max(report.max_error,e);
+                sum_error += e;
+            }
+            accumulate_agreement(report,f,q,data.get_label(i));
+        }
+        report.mean_error = float(sum_error/double(data.size()*output_size));
+        return report;
+    }
 };
 
 inline bool operator << (network& n, const tipl::geometry<3>& dim)
@@ -1259,6 +2745,566 @@ inline bool operator << (network& n, const std::string& text)
     return n.add(text);
 }
 
+/*
+    Inference form of a network: dropout is removed, the activation is
+    applied by the layer that produces the output, and a max pooling that
+    follows a convolution is computed from bands of pool_size convolution
+    rows without storing the convolution output. The layers are called
+    through their concrete types. The intermediate outputs alternate
+    between the two ends of one arena, so the arena is as large as the
+    largest input plus output of a layer. The layers are shared with the
+    network; compile again after the weights change.
+*/
+class compiled_network{
+public:
+    enum op_type {conv_op,full_op,layer_op,pooling_op};
+    struct op{
+        op_type type;
+        std::shared_ptr<basic_layer> layer;
+        void (*forward)(basic_layer&,const float*,float*) = 0;    // layer_op
+        const float* weight = 0;        // conv_op and full_op
+        const float* bias = 0;
+        bool relu = false;
+        int pool_size = 1;              // conv_op and pooling_op
+        tipl::geometry<3> in_dim,out_dim;
+        size_t in_pos = 0,out_pos = 0;  // arena offsets
+    };
+private:
+    std::vector<op> ops;
+    size_t arena_size = 0;
+    unsigned int input_size = 0,output_size = 0;
+    std::shared_ptr<tipl::io::memory_map> model_map;    // weights used in place
+private:
+    template<typename layer_type>
+    static void layer_forward(basic_layer& l,const float* x,float* y)
+    {
+        static_cast<layer_type&>(l).layer_type::forward_propagation(x,y);
+    }
+    // convolution rows [y0,y0+rows) of output channel o, with width w, into tile
+    static void conv_rows(const op& p,const float* x,int o,int y0,int rows,int w,float* tile)
+    {
+        const convolutional_layer& l = static_cast<const convolutional_layer&>(*p.layer);
+        int k = l.kernel_size,in_w = l.in_dim.width(),in_h = l.in_dim.height();
+        for(int r = 0;r < rows;++r)
+            std::fill(tile+r*w,tile+(r+1)*w,p.bias[o]);
+        const float* weight = p.weight+size_t(o)*l.kernel_size2*l.in_dim.depth();
+        for(int inc = 0;inc < l.in_dim.depth();++inc)
+            for(int wy = 0;wy < k;++wy)
+                for(int wx = 0;wx < k;++wx)
+                {
+                    float v = *weight++;
+                    for(int r = 0;r < rows;++r)
+                    {
+                        const float* s = x+(size_t(inc)*in_h+y0+r+wy)*in_w+wx;
+                        float* t = tile+r*w;
+                        for(int xx = 0;xx < w;++xx)
+                            t[xx] += v*s[xx];
+                    }
+                }
+    }
+    static void conv(const op& p,const float* x,float* y,std::vector<float>& tile)
+    {
+        int ps = p.pool_size,w = p.out_dim.width(),h = p.out_dim.height();
+        if(ps == 1)
+        {
+            for(int o = 0;o < p.out_dim.depth();++o)
+            {
+                float* yo = y+size_t(o)*p.out_dim.plane_size();
+                conv_rows(p,x,o,0,h,w,yo);
+                if(p.relu)
+                    for(size_t i = 0;i < p.out_dim.plane_size();++i)
+                        yo[i] = std::max(yo[i],0.0f);
+            }
+            return;
+        }
+        // only the convolution rows and columns covered by the pooling
+        int tw = w*ps;
+        tile.resize(size_t(tw)*ps);
+        for(int o = 0;o < p.out_dim.depth();++o)
+            for(int py = 0;py < h;++py)
+            {
+                conv_rows(p,x,o,py*ps,ps,tw,&tile[0]);
+                float* yr = y+(size_t(o)*h+py)*w;
+                for(int px = 0;px < w;++px)
+                {
+                    float m = tile[px*ps];
+                    for(int r = 0;r < ps;++r)
+                        for(int c = 0;c < ps;++c)
+                            m = std::max(m,tile[r*tw+px*ps+c]);
+                    yr[px] = (p.relu && m < 0.0f) ? 0.0f : m;
+                }
+            }
+    }
+    static void pooling(const op& p,const float* x,float* y)
+    {
+        int ps = p.pool_size,in_w = p.in_dim.width(),in_h = p.in_dim.height();
+        for(int c = 0;c < p.out_dim.depth();++c)
+            for(int py = 0;py < p.out_dim.height();++py)
+                for(int px = 0;px < p.out_dim.width();++px,++y)
+                {
+                    const float* s = x+(size_t(c)*in_h+py*ps)*in_w+px*ps;
+                    float m = s[0];
+                    for(int r = 0;r < ps;++r,s += in_w)
+                        for(int q = 0;q < ps;++q)
+                            m = std::max(m,s[q]);
+                    *y = (p.relu && m < 0.0f) ? 0.0f : m;
+                }
+    }
+    static void full(const op& p,const float* x,float* y)
+    {
+        const basic_layer& l = *p.layer;
+        tipl::cu::y_Ax(y,p.weight,x,l.output_size,l.input_size,1,1);
+        for(int o = 0;o < l.output_size;++o)
+        {
+            float v = y[o]+p.bias[o];
+            y[o] = (p.relu && v < 0.0f) ? 0.0f : v;
+        }
+    }
+    static void run(const op& p,const float* x,float* y,std::vector<float>& tile)
+    {
+        switch(p.type)
+        {
+        case conv_op:
+            conv(p,x,y,tile);
+            return;
+        case pooling_op:
+            pooling(p,x,y);
+            return;
+        case full_op:
+            full(p,x,y);
+            return;
+        case layer_op:
+            if(p.forward)
+                p.forward(*p.layer,x,y);
+            else
+                p.layer->forward_propagation(x,y);
+            if(p.relu)
+                for(int i = 0;i < p.layer->output_size;++i)
+                    y[i] = std::max(y[i],0.0f);
+            return;
+        }
+    }
+public:
+    compiled_network(void){}
+    compiled_network(const network& nn){compile(nn);}
+    bool compile(const network& nn)
+    {
+        ops.clear();
+        model_map.reset();
+        arena_size = 0;
+        input_size = nn.get_input_size();
+        output_size = nn.get_output_size();
+        for(size_t k = 0;k < nn.layers.size();++k)
+        {
+            basic_layer* l = nn.layers[k].get();
+            op p;
+            p.layer = nn.layers[k];
+            p.relu = (l->af == activation_type::relu);
+            p.in_dim = nn.geo[k];
+            p.out_dim = nn.geo[k+1];
+            if(dynamic_cast<dropout_layer*>(l))
+                continue;
+            auto pool = dynamic_cast<max_pooling_layer*>(l);
+            if(pool && !ops.empty() && ops.back().type == conv_op && ops.back().pool_size == 1)
+            {
+                // max(relu(x)) = relu(max(x))
+                ops.back().pool_size = pool->pool_size;
+                ops.back().out_dim = p.out_dim;
+                ops.back().relu = ops.back().relu || p.relu;
+                continue;
+            }
+            p.type = layer_op;
+            if(pool)
+            {
+                p.type = pooling_op;
+                p.pool_size = pool->pool_size;
+            }
+            if(dynamic_cast<convolutional_layer*>(l))
+            {
+                p.type = l->qweight.empty() ? conv_op : layer_op;
+                p.forward = &layer_forward<convolutional_layer>;
+            }
+            if(dynamic_cast<fully_connected_layer*>(l))
+            {
+                p.type = l->qweight.empty() ? full_op : layer_op;
+                p.forward = &layer_forward<fully_connected_layer>;
+            }
+            if(dynamic_cast<partially_connected_layer*>(l))
+            {
+                p.type = layer_op;
+                p.forward = &layer_forward<partially_connected_layer>;
+            }
+            if(dynamic_cast<soft_max_layer*>(l))
+                p.forward = &layer_forward<soft_max_layer>;
+            if(p.type == conv_op || p.type == full_op)
+            {
+                p.weight = &l->weight[0];
+                p.bias = &l->bias[0];
+            }
+            ops.push_back(p);
+        }
+        if(ops.empty())
+            return false;
+        // output i at the other end of the arena from input i
+        for(size_t i = 0;i+1 < ops.size();++i)
+            arena_size = std::max(arena_size,(i ? ops[i].in_dim.size() : 0)+ops[i].out_dim.size());
+        for(size_t i = 0;i+1 < ops.size();++i)
+        {
+            ops[i].out_pos = (i & 1) ? arena_size-ops[i].out_dim.size() : 0;
+            ops[i+1].in_pos = ops[i].out_pos;
+        }
+        return true;
+    }
+    /*
+        Maps a file written by network::save_to_model_file. The convolutions
+        and the fully connected layers read their weights from the mapping,
+        which processes loading the same file share; the other layers get
+        a copy.
+    */
+    bool load_from_model_file(const char* file_name)
+    {
+        std::shared_ptr<tipl::io::memory_map> map(new tipl::io::memory_map);
+        network nn;
+        const network_model_section* sections;
+        if(!map->open(file_name) || !(sections = nn.open_model_file(*map)))
+            return false;
+        nn.initialized = true;
+        nn.set_test_mode(true);
+        if(!compile(nn))
+            return false;
+        for(size_t k = 0;k < nn.layers.size();++k)
+        {
+            basic_layer* l = nn.layers[k].get();
+            const float* weight = (const float*)(map->data()+sections[k].weight_pos);
+            const float* bias = (const float*)(map->data()+sections[k].bias_pos);
+            bool in_place = false;
+            for(auto& p : ops)
+                if(p.layer.get() == l && (p.type == conv_op || p.type == full_op))
+                {
+                    p.weight = weight;
+                    p.bias = bias;
+                    in_place = true;
+                }
+            if(in_place)
+            {
+                std::vector<float>().swap(l->weight);
+                std::vector<float>().swap(l->bias);
+            }
+            else
+            {
+                std::copy_n(weight,l->weight.size(),l->weight.begin());
+                std::copy_n(bias,l->bias.size(),l->bias.begin());
+            }
+        }
+        model_map = map;
+        return true;
+    }
+    bool empty(void) const{return ops.empty();}
+    const std::vector<op>& get_ops(void) const{return ops;}
+    size_t get_arena_size(void) const{return arena_size;}
+    unsigned int get_input_size(void) const{return input_size;}
+    unsigned int get_output_size(void) const{return output_size;}
+    // out: output_size values
+    void forward_propagation(const float* input,float* out,std::vector<float>& arena,std::vector<float>& tile) const
+    {
+        arena.resize(arena_size);
+        for(size_t i = 0;i < ops.size();++i)
+            run(ops[i],i ? &arena[0]+ops[i].in_pos : input,
+                i+1 < ops.size() ? &arena[0]+ops[i].out_pos : out,tile);
+    }
+    void forward_propagation(const float* input,float* out) const
+    {
+        std::vector<float> arena,tile;
+        forward_propagation(input,out,arena,tile);
+    }
+    template<typename output_type>
+    void predict(const float* in,output_type& output) const
+    {
+        std::vector<float> result(output_size);
+        forward_propagation(in,&result[0]);
+        if(output_size == 1)
+            output = result[0];
+        else
+            output = std::max_element(result.begin(),result.end())-result.begin();
+    }
+    void predict(const float* in,std::vector<float>& output) const
+    {
+        output.resize(output_size);
+        forward_propagation(in,&output[0]);
+    }
+    template<typename label_type,typename result_type>
+    void predict(const network_data_proxy<label_type>& data,result_type& test_result) const
+    {
+        test_result.resize(data.size());
+        size_t thread_count = available_thread_count();
+        std::vector<std::vector<float> > arena(thread_count),tile(thread_count),result(thread_count);
+        par_for2((int)data.size(),[&](int i,int id)
+        {
+            result[id].resize(output_size);
+            forward_propagation(data.get_data(i),&result[id][0],arena[id],tile[id]);
+            if(output_size == 1)
+                test_result[i] = result[id][0];
+            else
+                test_result[i] = std::max_element(result[id].begin(),result[id].end())-result[id].begin();
+        },int(thread_count));
+    }
+};
+
+
+/*
+    Dense (fully convolutional) inference over a whole slice. The input
+    is a width x height image with the network's input channels as planes,
+    and output(x,y) is the network output for the patch whose corner is at
+    (x,y), so the output is (width-patch_width+1) x (height-patch_height+1)
+    with output_size planes. Every layer runs once over the slice instead
+    of once per patch: after a max pooling of size s the following layers
+    sample their input at s times the previous step (a trous), and a fully
+    or partially connected layer becomes a convolution with a kernel as
+    large as its input. The output rows are processed in bands of
+    band_rows in parallel, which bounds the memory. Volumes are processed
+    slice by slice because the convolutions are 2D.
+*/
+class dense_network{
+public:
+    enum op_type {conv_op,pooling_op,partial_op,soft_max_op};
+    struct op{
+        op_type type;
+        std::shared_ptr<basic_layer> layer;
+        bool relu = false;
+        int kw = 1,kh = 1;          // kernel or pooling size
+        int step = 1;               // input sampling step
+        int in_c = 1,out_c = 1;
+        // partial_op: for output i, taps[tap_pos[i],tap_pos[i+1]) of (channel,y,x)
+        std::vector<int> taps;
+        std::vector<size_t> tap_pos;
+    };
+    int band_rows = 16;
+private:
+    struct map_type{
+        std::vector<float> data;
+        int w = 0,h = 0,c = 0;
+        void resize(int w_,int h_,int c_)
+        {
+            w = w_;
+            h = h_;
+            c = c_;
+            data.resize(size_t(w)*h*c);
+        }
+        float* plane(int ch){return &data[0]+size_t(ch)*w*h;}
+        const float* plane(int ch) const{return &data[0]+size_t(ch)*w*h;}
+    };
+    std::vector<op> ops;
+    tipl::geometry<3> input_dim;
+    unsigned int output_size = 0;
+private:
+    static size_t layer_count(const network& nn)
+    {
+        size_t count = 0;
+        for(auto l : nn.layers)
+            if(!dynamic_cast<dropout_layer*>(l.get()))
+                ++count;
+        return count;
+    }
+    // y += v * input plane ch shifted by (dx,dy) steps
+    static void add_shifted(const op& p,const map_type& in,int ch,int dx,int dy,float v,map_type& out,float* y)
+    {
+        const float* s = in.plane(ch)+size_t(dy*p.step)*in.w+dx*p.step;
+        for(int r = 0;r < out.h;++r,s += in.w,y += out.w)
+            for(int x = 0;x < out.w;++x)
+                y[x] += v*s[x];
+    }
+    static void run(const op& p,const map_type& in,map_type& out)
+    {
+        if(p.type == soft_max_op)
+        {
+            out = in;
+            size_t plane_size = size_t(in.w)*in.h;
+            for(size_t i = 0;i < plane_size;++i)
+            {
+                float* y = &out.data[0]+i;
+                float m = y[0];
+                for(int c = 1;c < in.c;++c)
+                    m = std::max(m,y[c*plane_size]);
+                float sum = 0.0f;
+                for(int c = 0;c < in.c;++c)
+                    sum += (y[c*plane_size] = expf(y[c*plane_size]-m));
+                if(sum != 0.0f)
+                    for(int c = 0;c < in.c;++c)
+                        y[c*plane_size] /= sum;
+            }
+            return;
+        }
+        out.resize(in.w-(p.kw-1)*p.step,in.h-(p.kh-1)*p.step,p.out_c);
+        size_t plane_size = size_t(out.w)*out.h;
+        if(p.type == pooling_op)
+        {
+            for(int c = 0;c < out.c;++c)
+            {
+                float* y = out.plane(c);
+                const float* s = in.plane(c);
+                for(int r = 0;r < out.h;++r)
+                    std::copy(s+size_t(r)*in.w,s+size_t(r)*in.w+out.w,y+size_t(r)*out.w);
+                for(int dy = 0;dy < p.kh;++dy)
+                    for(int dx = 0;dx < p.kw;++dx)
+                    {
+                        const float* sp = s+size_t(dy*p.step)*in.w+dx*p.step;
+                        float* yp = y;
+                        for(int r = 0;r < out.h;++r,sp += in.w,yp += out.w)
+                            for(int x = 0;x < out.w;++x)
+                                yp[x] = std::max(yp[x],sp[x]);
+                    }
+            }
+        }
+        else
+        {
+            const basic_layer& l = *p.layer;
+            const float* w = &l.weight[0];
+            for(int o = 0;o < out.c;++o)
+            {
+                float* y = out.plane(o);
+                std::fill(y,y+plane_size,l.bias[o]);
+                if(p.type == conv_op)
+                {
+                    for(int c = 0;c < p.in_c;++c)
+                        for(int dy = 0;dy < p.kh;++dy)
+                            for(int dx = 0;dx < p.kw;++dx,++w)
+                                if(*w != 0.0f)
+                                    add_shifted(p,in,c,dx,dy,*w,out,y);
+                }
+                else
+                    for(size_t t = p.tap_pos[o];t < p.tap_pos[o+1];++t,++w)
+                        add_shifted(p,in,p.taps[t*3],p.taps[t*3+2],p.taps[t*3+1],*w,out,y);
+            }
+        }
+        if(p.relu)
+            for(auto& v : out.data)
+                if(v < 0.0f)
+                    v = 0.0f;
+    }
+public:
+    dense_network(void){}
+    dense_network(const network& nn){compile(nn);}
+    // false if a layer cannot run densely, e.g. a convolution after a fully connected layer
+    bool compile(const network& nn)
+    {
+        ops.clear();
+        input_dim = nn.get_input_dim();
+        output_size = nn.get_output_size();
+        int step = 1;
+        bool position_wise = false;     // after a fully connected layer
+        for(size_t k = 0;k < nn.layers.size();++k)
+        {
+            basic_layer* l = nn.layers[k].get();
+            // the outputs of a fully connected layer are channels at each position
+            tipl::geometry<3> in = position_wise ? tipl::geometry<3>(1,1,nn.geo[k].size()) : nn.geo[k];
+            tipl::geometry<3> out = position_wise ? tipl::geometry<3>(1,1,nn.geo[k+1].size()) : nn.geo[k+1];
+            op p;
+            p.layer = nn.layers[k];
+            p.relu = (l->af == activation_type::relu);
+            p.step = step;
+            p.in_c = in.depth();
+            p.out_c = out.depth();
+            if(dynamic_cast<dropout_layer*>(l))
+                continue;
+            if(dynamic_cast<soft_max_layer*>(l))
+            {
+                if(!position_wise)
+                    break;
+                p.type = soft_max_op;
+                ops.push_back(p);
+                continue;
+            }
+            if(auto conv = dynamic_cast<convolutional_layer*>(l))
+            {
+                if(position_wise)
+                    break;
+                p.type = conv_op;
+                p.kw = p.kh = conv->kernel_size;
+                ops.push_back(p);
+                continue;
+            }
+            if(auto pool = dynamic_cast<max_pooling_layer*>(l))
+            {
+                if(position_wise)
+                    break;
+                p.type = pooling_op;
+                p.kw = p.kh = pool->pool_size;
+                step *= pool->pool_size;
+                ops.push_back(p);
+                continue;
+            }
+            if(!dynamic_cast<fully_connected_layer*>(l))
+                break;
+            // a kernel covering the whole input, one output channel per output
+            p.type = conv_op;
+            p.kw = in.width();
+            p.kh = in.height();
+            p.out_c = out.size();
+            if(auto partial = dynamic_cast<partially_connected_layer*>(l))
+            {
+                p.type = partial_op;
+                p.tap_pos.push_back(0);
+                for(int i = 0;i < l->output_size;++i)
+                {
+                    size_t tap_count = partial->mapping[i].empty() ? size_t(l->input_size) : partial->mapping[i].size();
+                    for(size_t j = 0;j < tap_count;++j)
+                    {
+                        int index = partial->mapping[i].empty() ? int(j) : partial->mapping[i][j];
+                        p.taps.push_back(index/int(in.plane_size()));
+                        p.taps.push_back((index/in.width()) % in.height());
+                        p.taps.push_back(index % in.width());
+                    }
+                    p.tap_pos.push_back(p.taps.size()/3);
+                }
+            }
+            ops.push_back(p);
+            position_wise = true;
+        }
+        if(ops.size() != layer_count(nn) || !position_wise)
+        {
+            ops.clear();
+            return false;
+        }
+        return true;
+    }
+    bool empty(void) const{return ops.empty();}
+    const std::vector<op>& get_ops(void) const{return ops;}
+    // I: width x height x input channels, out: valid patch corners x output_size
+    template<typename image_type>
+    bool predict(const image_type& I,tipl::image<float,3>& out) const
+    {
+        int pw = input_dim.width(),ph = input_dim.height();
+        if(ops.empty() || int(I.depth()) != input_dim.depth() || I.width() < pw || I.height() < ph)
+            return false;
+        int ow = I.width()-pw+1,oh = I.height()-ph+1;
+        out.resize(tipl::geometry<3>(ow,oh,output_size));
+        int rows = std::max<int>(1,band_rows);
+        const float* src = &*I.begin();
+        par_for((oh+rows-1)/rows,[&](int b)
+        {
+            int y0 = b*rows;
+            int n = std::min<int>(rows,oh-y0);
+            map_type m[2];
+            m[0].resize(I.width(),n+ph-1,I.depth());
+            for(int c = 0;c < m[0].c;++c)
+                std::copy(src+(size_t(c)*I.height()+y0)*I.width(),
+                          src+(size_t(c)*I.height()+y0+m[0].h)*I.width(),m[0].plane(c));
+            int cur = 0;
+            for(const auto& p : ops)
+            {
+                run(p,m[cur],m[1-cur]);
+                cur = 1-cur;
+            }
+            // pooling that drops the last rows leaves a larger map; keep the patch corners
+            const map_type& r = m[cur];
+            for(unsigned int c = 0;c < output_size;++c)
+                for(int y = 0;y < n;++y)
+                    std::copy(r.plane(c)+size_t(y)*r.w,r.plane(c)+size_t(y)*r.w+ow,
+                              &out[0]+(size_t(c)*oh+y0+y)*ow);
+        });
+        return true;
+    }
+};
 
 
 //template<typename optimizer>
@@ -1266,19 +3312,40 @@ class trainer{
 private:
     std::mt19937 rd_gen;
 private:// for training
-    std::vector<std::vector<std::vector<float> > > dweight,dbias;
-    std::vector<std::vector<float> > in_out,back_df;
-    std::vector<float*> in_out_ptr,back_df_ptr;
+    std::vector<std::vector<float> > dweight,dbias;
+    // batch_size samples, each with a data_size in_out and back_df block
+    std::vector<float> in_out,back_df,batch_input;
+    // per-thread statistics, padded so that two threads never write the same cache line
+    struct training_stat{
+        unsigned int count = 0;
+        unsigned int error_count = 0;
+        float error_value = 0.0f;
+        std::vector<unsigned int> error_table;
+        char pad[64];
+    };
+    std::vector<training_stat> stat;
+    std::vector<float> sample_error;
+    std::vector<std::vector<float> > optimizer_state;
+    unsigned int step_count = 0;
 public:
+    // rmsprop, adam and adamw use learning_rate as the step size (0.001 is typical);
+    // sgd and nesterov scale it by the first gradient of each layer
+    optimizer_type optimizer = sgd;
     float learning_rate = 0.01f;
     float rate_decay = 1.0f;
     //float w_decay_rate = 0.01f;
     float momentum = 0.9f;
+    float beta1 = 0.9f;
+    float beta2 = 0.999f;
+    float epsilon = 1e-8f;
+    float weight_decay = 0.0f;  // adamw
     float bias_cap = 10.0f;
     float weight_cap = 100.0f;
     int batch_size = 64;
     int epoch= 20;
     int repeat = 1;
+    // reproducible results regardless of the thread count
+    bool deterministic = false;
 public:
     std::vector<unsigned int> error_table;
     unsigned int training_count = 0;
@@ -1289,6 +3356,8 @@ public:
     {
         dweight.clear();
         dbias.clear();
+        optimizer_state.clear();
+        step_count = 0;
         training_count = 0;
         training_error_count = 0;
         training_error_value = 0.0f;
@@ -1304,106 +3373,153 @@ public:
     }
     void initialize_training(const network& nn)
     {
-        int thread_count = std::thread::hardware_concurrency();
-        dweight.resize(thread_count);
-        dbias.resize(thread_count);
-        in_out.resize(thread_count);
-        back_df.resize(thread_count);
-        in_out_ptr.resize(thread_count);
-        back_df_ptr.resize(thread_count);
-        for(int i = 0;i < thread_count;++i)
-        {
-            dweight[i].resize(nn.layers.size());
-            dbias[i].resize(nn.layers.size());
-            for(int j = 0;j < nn.layers.size();++j)
-            {
-                dweight[i][j].resize(nn.layers[j]->weight.size());
-                dbias[i][j].resize(nn.layers[j]->bias.size());
-            }
-            in_out[i].resize(nn.data_size);
-            back_df[i].resize(nn.data_size);
-            in_out_ptr[i] = &in_out[i][0];
-            back_df_ptr[i] = &back_df[i][0];
+        dweight.resize(nn.layers.size());
+        dbias.resize(nn.layers.size());
+        optimizer_state.resize(nn.layers.size());
+        for(int j = 0;j < nn.layers.size();++j)
+        {
+            dweight[j].resize(nn.layers[j]->weight.size());
+            dbias[j].resize(nn.layers[j]->bias.size());
         }
     }
 
-    void accumulate_error_table(float label,const float* ptr,int output_size)
+private:
+    void accumulate_error_table(training_stat& s,float label,const float* ptr,int output_size)
     {
         // accumulate error table
         if(output_size != 1)
         {
             size_t predicted_label = std::max_element(ptr,ptr+output_size)-ptr;
             if(label != predicted_label)
-                ++training_error_count;
-            if(!error_table.empty())
+                ++s.error_count;
+            if(!s.error_table.empty())
             {
                 size_t pos = output_size*label + predicted_label;
-                if(pos < error_table.size())
-                    ++error_table[pos];
+                if(pos < s.error_table.size())
+                    ++s.error_table[pos];
             }
         }
     }
-    void accumulate_error_table(const std::vector<float>&,const float*,int)
+    void accumulate_error_table(training_stat&,const std::vector<float>&,const float*,int)
+    {
+    }
+    // data types with get_data(index,out) fill the batch themselves
+    template<typename network_data_type>
+    static auto copy_sample(network_data_type& data,int index,float* out,int,int) -> decltype(data.get_data(index,out),void())
+    {
+        data.get_data(index,out);
+    }
+    template<typename network_data_type>
+    static void copy_sample(network_data_type& data,int index,float* out,int size,long)
     {
+        tipl::copy_ptr(data.get_data(index),out,size);
     }
+    // block-wise data sources hold a batch in at most two blocks
+    template<typename network_data_type>
+    auto check_block_size(const network_data_type& data,int) const -> decltype(data.get_block_size(),void())
+    {
+        if(data.get_block_size() < size_t(batch_size))
+            throw std::runtime_error("The block size is smaller than the batch size.");
+    }
+    template<typename network_data_type>
+    void check_block_size(const network_data_type&,long) const{}
+    void merge_stat(void)
+    {
+        for(auto& s : stat)
+        {
+            training_count += s.count;
+            training_error_count += s.error_count;
+            training_error_value += s.error_value;
+            for(size_t i = 0;i < s.error_table.size();++i)
+                error_table[i] += s.error_table[i];
+            s.count = s.error_count = 0;
+            s.error_value = 0.0f;
+            std::fill(s.error_table.begin(),s.error_table.end(),0);
+        }
+    }
+public:
 
     template <class network_data_type>
     void train_batch(network& nn,network_data_type& data,bool &terminated)
     {
+        check_block_size(data,0);
         nn.set_test_mode(false);
+        nn.set_deterministic(deterministic);
         int output_pos = nn.data_size - nn.output_size;
+        int input_size = nn.get_input_size();
         training_count = 0;
         training_error_count = 0;
         training_error_value = 0.0f;
         if(!error_table.empty())
             std::fill(error_table.begin(),error_table.end(),0);
+        in_out.resize(size_t(batch_size)*nn.data_size);
+        back_df.resize(in_out.size());
+        batch_input.resize(size_t(batch_size)*input_size);
+        sample_error.resize(batch_size);
+        stat.resize(available_thread_count());
+        for(auto& s : stat)
+            s.error_table.assign(error_table.size(),0);
         for(int i = 0;i < data.size() && !terminated;i += batch_size)
         {
-            // train a batch
-            par_for2(std::min<int>(batch_size,data.size()-i),[&](int m, int thread_id)
+            // train a batch: each layer processes all samples at once
+            int n = std::min<int>(batch_size,data.size()-i);
+            par_for(n,[&](int m)
             {
-                ++training_count;
-                int data_index = i+m;
-                if(terminated)
-                    return;
-                nn.forward_propagation(data.get_data(data_index),in_out_ptr[thread_id]);
-                const float* out_ptr2 = in_out_ptr[thread_id] + output_pos;
-                float* df_ptr = back_df_ptr[thread_id] + output_pos;
-
-                tipl::copy_ptr(out_ptr2,df_ptr,nn.output_size);
-                accumulate_error_table(data.get_label(data_index),out_ptr2,nn.output_size);
-                training_error_value += nn.calculate_error(data.get_label(data_index),df_ptr);
-                nn.back_propagation(out_ptr2,df_ptr);
-                nn.calculate_dwdb(data.get_data(data_index),back_df_ptr[thread_id],
-                                                            in_out_ptr[thread_id],
-                                                            dweight[thread_id],dbias[thread_id]);
+                copy_sample(data,i+m,&batch_input[0]+size_t(m)*input_size,input_size,0);
             });
+            nn.forward_propagation(&batch_input[0],input_size,&in_out[0],n);
+            par_for2(n,[&](int m,int thread_id)
+            {
+                training_stat& s = stat[thread_id];
+                const float* out_ptr2 = &in_out[0] + size_t(m)*nn.data_size + output_pos;
+                float* df_ptr = &back_df[0] + size_t(m)*nn.data_size + output_pos;
+                tipl::copy_ptr(out_ptr2,df_ptr,nn.output_size);
+                accumulate_error_table(s,data.get_label(i+m),out_ptr2,nn.output_size);
+                float error = nn.calculate_error(data.get_label(i+m),df_ptr);
+                if(deterministic)
+                    sample_error[m] = error;
+                else
+                    s.error_value += error;
+                ++s.count;
+            },int(stat.size()));
+            // the error values are summed in sample order in the deterministic mode
+            if(deterministic)
+                training_error_value = std::accumulate(sample_error.begin(),sample_error.begin()+n,training_error_value);
+            merge_stat();
+            nn.back_propagation(&in_out[0]+output_pos,&back_df[0]+output_pos,n);
+            nn.calculate_dwdb(&batch_input[0],input_size,&back_df[0],&in_out[0],n,dweight,dbias);
             // update_weights
-            par_for(nn.layers.size(),[this,&nn](int j)
+            ++step_count;
+            optimizer_param param;
+            param.type = optimizer;
+            param.momentum = momentum;
+            param.beta1 = beta1;
+            param.beta2 = beta2;
+            param.epsilon = epsilon;
+            param.weight_decay = weight_decay;
+            param.correction1 = 1.0f/(1.0f-std::pow(beta1,float(step_count)));
+            param.correction2 = 1.0f/(1.0f-std::pow(beta2,float(step_count)));
+            par_for(nn.layers.size(),[this,&nn,param](int j)
             {
                 if(nn.layers[j]->weight.empty())
                     return;
-                std::vector<float> dw(nn.layers[j]->weight.size());
-                std::vector<float> db(nn.layers[j]->bias.size());
-                par_for(dweight.size(),[this,&dw,&db,j](int k)
-                {
-                    tipl::add(dw,dweight[k][j]);
-                    tipl::add(db,dbias[k][j]);
-                    tipl::multiply_constant(dweight[k][j],momentum);
-                    tipl::multiply_constant(dbias[k][j],momentum);
-                });
-
-                //if(w_decay_rate != 0.0f)
-                //    tipl::multiply_constant(nn.layers[j]->weight,1.0f-w_decay_rate);
-
-                if(nn.layers[j]->wlearning_base_rate == 1.0f && nn.layers[j]->blearning_base_rate == 1.0f)
+                std::vector<float>& dw = dweight[j];
+                std::vector<float>& db = dbias[j];
+                optimizer_param p = param;
+                if(optimizer == sgd || optimizer == nesterov)
                 {
-                    nn.layers[j]->wlearning_base_rate = learning_rate*0.01f/(tipl::max_abs_value(dw)+1.0f);
-                    nn.layers[j]->blearning_base_rate = learning_rate*0.01f/(tipl::max_abs_value(db)+1.0f);
+                    if(nn.layers[j]->wlearning_base_rate == 1.0f && nn.layers[j]->blearning_base_rate == 1.0f)
+                    {
+                        nn.layers[j]->wlearning_base_rate = learning_rate*0.01f/(tipl::max_abs_value(dw)+1.0f);
+                        nn.layers[j]->blearning_base_rate = learning_rate*0.01f/(tipl::max_abs_value(db)+1.0f);
+                    }
+                    p.w_rate = nn.layers[j]->wlearning_base_rate*rate_decay;
+                    p.b_rate = nn.layers[j]->blearning_base_rate*rate_decay;
                 }
-
-                nn.layers[j]->update(-nn.layers[j]->wlearning_base_rate*rate_decay,dw,
-                                  -nn.layers[j]->blearning_base_rate*rate_decay,db);
+                else
+                    p.w_rate = p.b_rate = learning_rate*rate_decay;
+                // one fused pass per layer: the step, the decay and the optimizer state
+                nn.layers[j]->update(p,dw,db,optimizer_state[j]);
 
                 //tipl::upper_lower_threshold(nn.layers[j]->bias,-bias_cap,bias_cap);
                 //tipl::upper_lower_threshold(nn.layers[j]->weight,-weight_cap,weight_cap);
@@ -1411,32 +3527,133 @@ public:
         }
     }
 
+    /*
+        Trains search_count networks initialized from different seeds for up to 5 epochs
+        and keeps the one with the least training error. The candidates share the data and
+        are trained concurrently, job_count at a time (0: one per thread), with the same
+        sample order; after each epoch the candidates worse than the median are dropped.
+        The training statistics are those of the chosen candidate.
+    */
     template <typename label_type>
-    void seed_search(network& nn,network_data_proxy<label_type>& data,bool &terminated,int search_count = 0)
+    void seed_search(network& nn,network_data_proxy<label_type>& data,bool &terminated,int search_count = 0,int job_count = 0)
     {
-        float best_error = 0.0f;
-        for(int seed = 0;seed < search_count && !terminated;++seed)
+        if(search_count <= 0)
+            return;
+        std::vector<network> nets(search_count);
+        std::vector<trainer> trainers(search_count,*this);
+        std::vector<network_data_proxy<label_type> > order(search_count,data);
+        std::vector<int> alive(search_count);
+        unsigned int order_seed = rd_gen();
+        for(int seed = 0;seed < search_count;++seed)
+        {
+            nets[seed].add(nn.get_layer_text());
+            nets[seed].init_weights(seed);
+            trainers[seed].rd_gen.seed(order_seed);
+            trainers[seed].reset();
+            trainers[seed].initialize_training(nets[seed]);
+            alive[seed] = seed;
+        }
+        if(job_count <= 0)
+            job_count = available_thread_count();
+        for(int i = 0;i < 5 && !terminated;++i)
         {
-            network tmp;
-            tmp.add(nn.get_layer_text());
-            tmp.init_weights(seed);
-            reset();
-            initialize_training(tmp);
-            for(int i = 0;i < 5 && !terminated;++i)
+            par_for_jobs(alive.size(),[&](size_t j)
             {
-                data.shuffle(rd_gen);
-                train_batch(tmp,data,terminated);
-            }
-            if(get_training_error_value() < best_error || best_error == 0.0f)
+                int k = alive[j];
+                order[k].shuffle(trainers[k].rd_gen);
+                trainers[k].train_batch(nets[k],order[k],terminated);
+            },std::min<int>(job_count,int(alive.size())));
+            std::stable_sort(alive.begin(),alive.end(),[&](int lhs,int rhs)
             {
-                best_error = get_training_error_value();
-                nn = std::move(tmp);
-            }
+                return trainers[lhs].get_training_error_value() < trainers[rhs].get_training_error_value();
+            });
+            if(i+1 < 5)
+                alive.resize((alive.size()+1)/2);
+        }
+        if(terminated)
+            return;
+        nn = std::move(nets[alive[0]]);
+        // the statistics of the chosen candidate
+        error_table = trainers[alive[0]].error_table;
+        training_count = trainers[alive[0]].training_count;
+        training_error_count = trainers[alive[0]].training_error_count;
+        training_error_value = trainers[alive[0]].training_error_value;
+    }
+    /*
+        Trains nets[i] on data[i] with a copy of this trainer. The networks are trained
+        concurrently, job_count at a time (0: one per thread), and split the threads.
+    */
+    template <typename network_data_type>
+    void train_concurrently(std::vector<network>& nets,std::vector<network_data_type>& data,
+                            bool &terminated,int job_count = 0,int seed = 0)
+    {
+        if(job_count <= 0)
+            job_count = available_thread_count();
+        par_for_jobs(nets.size(),[&](size_t i)
+        {
+            trainer t(*this);
+            t.train(nets[i],data[i],terminated,[](){},seed);
+        },std::min<int>(job_count,int(nets.size())));
+    }
+private:
+    // 100 for a wrong class, or the absolute error of a single output
+    static double testing_error(const network& nn,const float* in,float label)
+    {
+        float result;
+        nn.predict(in,result);
+        if(nn.output_size == 1)
+            return std::fabs(result-label);
+        return result != label ? 100.0 : 0.0;
+    }
+    // the mean absolute error over the outputs
+    static double testing_error(const network& nn,const float* in,const std::vector<float>& label)
+    {
+        std::vector<float> result;
+        nn.predict(in,result);
+        double sum = 0.0;
+        for(size_t j = 0;j < result.size() && j < label.size();++j)
+            sum += std::fabs(result[j]-label[j]);
+        return result.empty() ? 0.0 : sum/result.size();
+    }
+public:
+    /*
+        total_fold cross validation of the architecture of nn, with the folds trained
+        concurrently. Returns the testing error in percent for classification, or the mean
+        absolute error for a single output or vector labels. The trained fold networks are
+        kept in fold_nets.
+    */
+    template <typename label_type>
+    float cross_validate(const network& nn,const network_data<label_type>& data,bool &terminated,
+                         int total_fold = 10,int job_count = 0,std::vector<network>* fold_nets = 0)
+    {
+        std::vector<network_data_proxy<label_type> > training_data,testing_data;
+        data_fold_for_cv(data,training_data,testing_data,total_fold);
+        std::vector<network> nets(total_fold);
+        for(auto& each : nets)
+            each.add(nn.get_layer_text());
+        train_concurrently(nets,training_data,terminated,job_count);
+        double error = 0.0;
+        size_t count = 0;
+        for(int fold = 0;fold < total_fold && !terminated;++fold)
+        {
+            const network_data_proxy<label_type>& test = testing_data[fold];
+            std::vector<double> sample_error(test.size());
+            nets[fold].set_test_mode(true);
+            par_for(test.size(),[&](size_t i)
+            {
+                sample_error[i] = testing_error(nets[fold],test.get_data(i),test.get_label(i));
+            });
+            error = std::accumulate(sample_error.begin(),sample_error.end(),error);
+            count += test.size();
         }
+        if(fold_nets)
+            fold_nets->swap(nets);
+        return count ? float(error/count) : 0.0f;
     }
-    template <typename label_type,typename iter_type>
+    // data: network_data_proxy or network_data_loader
+    template <typename network_data_type,typename iter_type>
     void train(network& nn,
-               network_data_proxy<label_type>& data,
+               network_data_type& data,
                bool &terminated,iter_type iter_fun,int seed = 0)
     {
         if(!nn.initialized)
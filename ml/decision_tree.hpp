@@ -1,89 +1,174 @@
 #ifndef ML_DECISION_TREE_HPP
 #define ML_DECISION_TREE_HPP
-#include <memory>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include "tipl/utility/multi_thread.hpp"
+#include "tipl/ml/utility.hpp"
 
 
 namespace tipl{
 
 namespace ml{
 
+/*
+    binary decision tree grown on binned attributes. Each node keeps a
+    histogram of the class counts per attribute bin; a child's histogram is
+    built from its samples only for the smaller child, the larger one is
+    the parent minus the smaller. Large nodes are processed in parallel
+    over attributes, and subtrees below parallel_size samples are grown
+    in parallel with each other. The nodes are stored in one flat array.
+*/
 template<class attribute_type,class classification_type>
 class decision_tree
 {
-
+public:
+    struct node_type{
+        attribute_type threshold;   // go to right if x[attribute] > threshold
+        unsigned int attribute;
+        unsigned int left,right;    // 0 for an end node
+        classification_type decision;
+    };
+    static const size_t parallel_size = 1 << 14;
+private:
+    std::vector<node_type> nodes;
+    size_t minimum_sample;
+    double termination_ratio;
 private:
-    template<class attributes_iterator_type>
-    std::pair<attribute_type,attribute_type> get_value_range(attributes_iterator_type attributes_from,
-            attributes_iterator_type attributes_to,size_t attribute_index)
+    struct context{
+        const binned_attributes<attribute_type>* data;
+        std::vector<unsigned char> y;
+        std::vector<unsigned int> index;  // samples of a node are index[from,to)
+        std::vector<size_t> offset;       // histogram offset of each attribute
+        size_t hist_size;
+    };
+    struct pending_type{
+        unsigned int id;
+        size_t from,to;
+    };
+    // counts of class 0 and 1 for each attribute bin, interleaved
+    static void build_histogram(const context& c,size_t from,size_t to,std::vector<double>& hist,bool parallel)
     {
-        attribute_type max_value = attributes_from[0][attribute_index];
-        attribute_type min_value = attributes_from[0][attribute_index];
-        for (;attributes_from != attributes_to;++attributes_from)
+        hist.assign(c.hist_size,0.0);
+        auto fun = [&](size_t a)
         {
-            if (attributes_from[0][attribute_index] > max_value)
-                max_value = attributes_from[0][attribute_index];
-            else
-                if (attributes_from[0][attribute_index] < min_value)
-                    min_value = attributes_from[0][attribute_index];
-        }
-        return std::make_pair(max_value,min_value);
+            const unsigned char* b = c.data->attribute_bins(a);
+            double* h = &hist[c.offset[a]];
+            for(size_t i = from;i < to;++i)
+            {
+                unsigned int s = c.index[i];
+                h[(size_t(b[s]) << 1)+c.y[s]] += 1.0;
+            }
+        };
+        if(parallel)
+            par_for(c.offset.size(),fun);
+        else
+            for(size_t a = 0;a < c.offset.size();++a)
+                fun(a);
     }
-    template<class attributes_iterator_type,class classifications_iterator_type>
-    double information_gain(attributes_iterator_type attributes_from,
-                            attributes_iterator_type attributes_to,
-                            classifications_iterator_type classifications_from)
+    static double entropy_sum(double n0,double n1)
     {
-        size_t sample_size = attributes_to-attributes_from;
-        size_t n_x0 = 0;
-        size_t n_x1 = 0;
-        size_t n_y0_x0 = 0;
-        size_t n_y1_x0 = 0;
-        size_t n_y0_x1 = 0;
-        size_t n_y1_x1 = 0;
-        for (size_t index = 0;index < sample_size;++index)
+        double n = n0+n1;
+        return -(n0 == 0.0 ? 0.0 : n0*std::log(n0/n))-(n1 == 0.0 ? 0.0 : n1*std::log(n1/n));
+    }
+    // the split with the least conditional entropy of the class
+    static bool find_split(const context& c,const std::vector<double>& hist,double n0,double n1,
+                           unsigned int& attribute,unsigned int& bin,bool parallel)
+    {
+        size_t dim = c.offset.size();
+        std::vector<double> best(dim,std::numeric_limits<double>::max());
+        std::vector<unsigned int> best_bin(dim);
+        auto fun = [&](size_t a)
         {
-            if (attributes_from[index][attribute_index] > param)// X=1
+            const double* h = &hist[c.offset[a]];
+            double l0 = 0.0,l1 = 0.0;
+            for(size_t b = 0;b+1 < c.data->bin_count(a);++b)
             {
-                ++n_x1;
-                if (classifications_from[index])
-                    ++n_y1_x1;
-                else
-                    ++n_y0_x1;
+                l0 += h[b << 1];
+                l1 += h[(b << 1)+1];
+                double r0 = n0-l0,r1 = n1-l1;
+                if(l0+l1 == 0.0 || r0+r1 == 0.0)
+                    continue;
+                double e = entropy_sum(l0,l1)+entropy_sum(r0,r1);
+                if(e < best[a])
+                {
+                    best[a] = e;
+                    best_bin[a] = (unsigned int)b;
+                }
             }
-            else
-                //X = 0
+        };
+        if(parallel)
+            par_for(dim,fun);
+        else
+            for(size_t a = 0;a < dim;++a)
+                fun(a);
+        attribute = (unsigned int)(std::min_element(best.begin(),best.end())-best.begin());
+        bin = best_bin[attribute];
+        return best[attribute] != std::numeric_limits<double>::max();
+    }
+    // grow the subtree at tree[id] from index[from,to). hist is the node's
+    // histogram or empty. Children smaller than parallel_size are deferred
+    // to pending when it is given.
+    void grow(context& c,std::vector<node_type>& tree,unsigned int id,size_t from,size_t to,
+              std::vector<double>& hist,std::vector<pending_type>* pending) const
+    {
+        size_t sample_size = to-from;
+        double n1 = 0.0;
+        for(size_t i = from;i < to;++i)
+            n1 += c.y[c.index[i]];
+        double n0 = double(sample_size)-n1;
+        tree[id].left = tree[id].right = 0;
+        tree[id].decision = n1 > n0 ? 1:0;
+        if(n0 == 0.0 || n1 == 0.0 ||
+           n0 > double(sample_size)*termination_ratio ||
+           n1 > double(sample_size)*termination_ratio ||
+           sample_size < minimum_sample)
+            return;
+        bool parallel = pending != 0;
+        if(hist.empty())
+            build_histogram(c,from,to,hist,parallel);
+        unsigned int attribute,bin;
+        if(!find_split(c,hist,n0,n1,attribute,bin,parallel))
+            return;
+        const unsigned char* b = c.data->attribute_bins(attribute);
+        size_t mid = std::stable_partition(c.index.begin()+from,c.index.begin()+to,
+                        [&](unsigned int s){return b[s] <= bin;})-c.index.begin();
+        unsigned int left = (unsigned int)tree.size();
+        tree.resize(tree.size()+2);
+        tree[id].attribute = attribute;
+        tree[id].threshold = c.data->edges[attribute][bin];
+        tree[id].left = left;
+        tree[id].right = left+1;
+
+        size_t child_from[2] = {from,mid},child_to[2] = {mid,to};
+        bool defer[2];
+        for(int k = 0;k < 2;++k)
+            if((defer[k] = (pending && child_to[k]-child_from[k] < parallel_size)))
             {
-                ++n_x0;
-                if (classifications_from[index])
-                    ++n_y1_x0;
-                else
-                    ++n_y0_x0;
+                pending_type p = {left+k,child_from[k],child_to[k]};
+                pending->push_back(p);
             }
+        int small = (mid-from < to-mid) ? 0 : 1;
+        int large = 1-small;
+        std::vector<double> small_hist;
+        if(!defer[large])
+        {
+            // sibling subtraction
+            build_histogram(c,child_from[small],child_to[small],small_hist,parallel);
+            for(size_t i = 0;i < hist.size();++i)
+                hist[i] -= small_hist[i];
         }
-        double p_x0 = ((double)n_x0)/((double)sample_size);
-        double p_x1 = ((double)n_x1)/((double)sample_size);
-        double p_y0_x0 = n_x0 == 0 ? 0.0: ((double)n_y0_x0)/((double)n_x0);
-        double p_y1_x0 = n_x0 == 0 ? 0.0: ((double)n_y1_x0)/((double)n_x0);
-        double p_y0_x1 = n_x1 == 0 ? 0.0: ((double)n_y0_x1)/((double)n_x1);
-        double p_y1_x1 = n_x1 == 0 ? 0.0: ((double)n_y1_x1)/((double)n_x1);
-        return -p_x0*((p_y0_x0 == 0 ? 0.0 : p_y0_x0*std::log(p_y0_x0))+
-                      (p_y1_x0 == 0 ? 0.0 : p_y1_x0*std::log(p_y1_x0)))
-               -p_x1*((p_y0_x1 == 0 ? 0.0 : p_y0_x1*std::log(p_y0_x1))+
-                      (p_y1_x1 == 0 ? 0.0 : p_y1_x1*std::log(p_y1_x1)));
+        else
+            hist.clear();
+        if(!defer[small])
+            grow(c,tree,left+small,child_from[small],child_to[small],small_hist,pending);
+        if(!defer[large])
+            grow(c,tree,left+large,child_from[large],child_to[large],hist,pending);
     }
-private:
-    std::auto_ptr<decision_tree<attribute_type,classification_type> > left_tree;
-    std::auto_ptr<decision_tree<attribute_type,classification_type> > right_tree;
-private:
-    size_t attribute_index;
-    double param;
-    size_t minimum_sample;
-    double termination_ratio;
-    bool is_end_node;
-    bool end_node_decision;
 public:
     decision_tree(size_t minimum_sample_,double termination_ratio_):
-            minimum_sample(minimum_sample_),termination_ratio(termination_ratio_),is_end_node(false) {}
+            minimum_sample(minimum_sample_),termination_ratio(termination_ratio_) {}
 
     template<class attributes_iterator_type,class classifications_iterator_type>
     void learn(attributes_iterator_type attributes_from,
@@ -91,88 +176,90 @@ public:
                size_t attribute_dimension,
                classifications_iterator_type classifications_from)
     {
-        size_t sample_size = attributes_to-attributes_from;
-        classifications_iterator_type classifications_to = classifications_from + sample_size;
-        // check for termination
+        binned_attributes<attribute_type> data(attributes_from,attributes_to,attribute_dimension);
+        learn(data,classifications_from);
+    }
+
+    template<class classifications_iterator_type>
+    void learn(const binned_attributes<attribute_type>& data,
+               classifications_iterator_type classifications_from)
+    {
+        size_t sample_size = data.sample_size;
+        context c;
+        c.data = &data;
+        c.y.resize(sample_size);
+        c.index.resize(sample_size);
+        for(size_t i = 0;i < sample_size;++i)
         {
-            size_t n_y0 = std::count(classifications_from,classifications_to,0);
-            size_t n_y1 = sample_size - n_y0;
-            if (n_y0 > ((double)sample_size)*termination_ratio ||
-                    n_y1 > ((double)sample_size)*termination_ratio ||
-                    sample_size < minimum_sample)
-            {
-                is_end_node = true;
-                end_node_decision = n_y1 > n_y0;
-                return;
-            }
+            c.y[i] = classifications_from[i] ? 1:0;
+            c.index[i] = (unsigned int)i;
         }
-        // decision the best decision
+        c.offset.resize(data.attribute_dimension());
+        c.hist_size = 0;
+        for(size_t a = 0;a < c.offset.size();++a)
         {
+            c.offset[a] = c.hist_size;
+            c.hist_size += data.bin_count(a) << 1;
+        }
 
-            std::vector<std::pair<size_t,double> > decision_list;
-            for (size_t index = 0;index < attribute_dimension;++index)
-            {
-                std::pair<attribute_type,attribute_type> range = get_value_range(attributes_from,attributes_to,index);
-                double step = (range.first-range.second)/5.0;
-                for (double value = range.second+step;value <= range.first-step;value += step)
-                    decision_list.push_back(std::make_pair(index,value));
-            }
-
-            std::vector<double> ig(decision_list.size());
-            for (size_t index = 0;index < decision_list.size();++index)
-            {
-                attribute_index = decision_list[index].first;
-                param = decision_list[index].second;
-                ig[index] = information_gain(attributes_from,attributes_to,classifications_from);
-            }
-            size_t best_decision_index = std::max_element(ig.begin(),ig.end())-ig.begin();
-
-            attribute_index = decision_list[best_decision_index].first;
-            param = decision_list[best_decision_index].second;
+        nodes.clear();
+        nodes.resize(1);
+        std::vector<pending_type> pending;
+        {
+            std::vector<double> hist;
+            grow(c,nodes,0,0,sample_size,hist,&pending);
         }
-        // split tree
+        // grow the small subtrees in parallel, then splice them in order
+        std::vector<std::vector<node_type> > subtrees(pending.size());
+        par_for_asyn(pending.size(),[&](size_t i)
         {
-            std::vector<std::vector<attribute_type> > right_attributes;
-            std::vector<std::vector<attribute_type> > left_attributes;
-            std::vector<classification_type>		  right_classification;
-            std::vector<classification_type>		  left_classification;
-            right_attributes.reserve(sample_size);
-            left_attributes.reserve(sample_size);
-            right_classification.reserve(sample_size);
-            left_classification.reserve(sample_size);
-
-            for (size_t index = 0;index < sample_size;++index)
-                if (attributes_from[index][attribute_index] > param)
-                {
-                    right_attributes.push_back(
-                        std::vector<attribute_type>(
-                            &(attributes_from[index][0]),&(attributes_from[index][0])+attribute_dimension));
-                    right_classification.push_back(classifications_from[index]);
-                }
-                else
+            std::vector<double> hist;
+            subtrees[i].resize(1);
+            grow(c,subtrees[i],0,pending[i].from,pending[i].to,hist,0);
+        });
+        for(size_t i = 0;i < pending.size();++i)
+        {
+            // local node k > 0 goes to base+k-1
+            unsigned int base = (unsigned int)nodes.size();
+            std::vector<node_type>& subtree = subtrees[i];
+            for(size_t k = 0;k < subtree.size();++k)
+                if(subtree[k].left)
                 {
-                    left_attributes.push_back(
-                        std::vector<attribute_type>(
-                            &(attributes_from[index][0]),&(attributes_from[index][0])+attribute_dimension));
-                    left_classification.push_back(classifications_from[index]);
+                    subtree[k].left += base-1;
+                    subtree[k].right += base-1;
                 }
-
-            right_tree.reset(new decision_tree(minimum_sample,termination_ratio));
-            left_tree.reset(new decision_tree(minimum_sample,termination_ratio));
-            right_tree->learn(right_attributes.begin(),right_attributes.end(),attribute_dimension,right_classification.begin());
-            left_tree->learn(left_attributes.begin(),left_attributes.end(),attribute_dimension,left_classification.begin());
-            is_end_node = false;
+            nodes[pending[i].id] = subtree[0];
+            nodes.insert(nodes.end(),subtree.begin()+1,subtree.end());
+            std::vector<node_type>().swap(subtree);
         }
     }
 
     template<class sample_iterator_type>
     classification_type predict(sample_iterator_type predict_attributes) const
     {
-        if (is_end_node)
-            return end_node_decision ? 1:0;
-        return (predict_attributes[attribute_index] > param) ?
-               right_tree->predict(predict_attributes):
-               left_tree->predict(predict_attributes);
+        const node_type* node = &nodes[0];
+        while(node->left)
+            node = &nodes[predict_attributes[node->attribute] > node->threshold ? node->right : node->left];
+        return node->decision;
+    }
+
+    template<class samples_iterator_type,class classifications_iterator_type>
+    void predict(samples_iterator_type samples_from,
+                 samples_iterator_type samples_to,
+                 classifications_iterator_type classifications_from) const
+    {
+        const size_t block_size = 4096;
+        size_t sample_size = samples_to-samples_from;
+        par_for((sample_size+block_size-1)/block_size,[&](size_t b)
+        {
+            size_t to = std::min(sample_size,(b+1)*block_size);
+            for(size_t i = b*block_size;i < to;++i)
+                classifications_from[i] = predict(&(samples_from[i][0]));
+        });
+    }
+    const std::vector<node_type>& get_nodes(void) const
+    {
+        return nodes;
     }
 };
 
@@ -181,4 +268,4 @@ public:
 }// image
 
 
-#endif
\ No newline at end of file
+#endif
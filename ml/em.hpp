@@ -1,6 +1,11 @@
 #ifndef ML_EM_HPP
 #define ML_EM_HPP
+#include <vector>
+#include <limits>
+#include <numeric>
+#include <cmath>
 #include "tipl/numerical/matrix.hpp"
+#include "tipl/utility/multi_thread.hpp"
 
 
 namespace tipl{
@@ -12,9 +17,11 @@ class multivariate_gaussian
     std::vector<double> mean;
     std::vector<double> covariance;
 private:
-    std::vector<double> iV,id;
+    // inverse of the Cholesky factor L (covariance = L*L'), lower triangle in row major
+    std::vector<double> iL;
     unsigned int dim;
-    double constant;
+    double log_constant;
+    bool diagonal = false;
     void assign_covariance(const std::vector<double>& co)
     {
         std::vector<double> covariance_matrix(dim*dim);
@@ -28,23 +35,48 @@ private:
     }
     void precompute_parameters(void)
     {
-        iV.resize(covariance.size());
-        id.resize(dim);
-        tipl::mat::eigen_decomposition_sym(covariance.begin(),iV.begin(),id.begin(),tipl::dyndim(dim,dim));
-        constant = 1.0;
-        unsigned int dimension = 0;
-        for (unsigned int i = 0;i < id.size();++i)
+        double trace = 0.0;
+        for (unsigned int i = 0;i < dim;++i)
+            trace += covariance[i*dim+i];
+        // add a ridge if the covariance is not positive definite
+        double ridge = 0.0;
+        std::vector<double> L,p(dim);
+        while(1)
         {
-            if (id[0] + id[i] == id[0] || id[i] < 0)
-                id[i] = 0;
+            L = covariance;
+            for (unsigned int i = 0;i < dim;++i)
+                L[i*dim+i] += ridge;
+            bool positive = true;
+            if(diagonal)
+            {
+                for (unsigned int i = 0;i < dim && positive;++i)
+                    if((positive = (L[i*dim+i] > 0.0)))
+                        p[i] = std::sqrt(L[i*dim+i]);
+            }
             else
+                positive = tipl::mat::ll_decomposition(L.begin(),p.begin(),tipl::dyndim(dim,dim));
+            if(positive)
+                break;
+            ridge = (ridge == 0.0) ? std::max<double>(1.0e-9*std::abs(trace)/dim,1.0e-12) : ridge*10.0;
+        }
+        iL.clear();
+        iL.resize(dim*dim);
+        log_constant = -0.918938533204673*((double)dim);
+        for (unsigned int c = 0;c < dim;++c)
+        {
+            log_constant -= std::log(p[c]);
+            iL[c*dim+c] = 1.0/p[c];
+            if(diagonal)
+                continue;
+            // column c of L^-1 by forward substitution
+            for (unsigned int i = c+1;i < dim;++i)
             {
-                constant *= id[i];
-                id[i] = 1.0/id[i];
-                ++dimension;
+                double sum = 0.0;
+                for (unsigned int k = c;k < i;++k)
+                    sum -= L[i*dim+k]*iL[k*dim+c];
+                iL[i*dim+c] = sum/p[i];
             }
         }
-        constant = std::exp(-0.5*std::log(constant)-0.918938533204673*((double)dimension));
     }
 public:
     multivariate_gaussian(void) {}
@@ -115,18 +147,49 @@ public:
         mean.swap(new_mean);
         precompute_parameters();
     }
+    // use only the variances, the covariances are treated as zero
+    void set_diagonal(bool diagonal_)
+    {
+        diagonal = diagonal_;
+    }
+    // covariance_ is a full dim-by-dim matrix
+    void set_parameters(const std::vector<double>& mean_,const std::vector<double>& covariance_)
+    {
+        dim = (unsigned int)mean_.size();
+        mean = mean_;
+        covariance = covariance_;
+        if(diagonal)
+            for (unsigned int i = 0;i < dim;++i)
+                for (unsigned int k = 0;k < dim;++k)
+                    if(i != k)
+                        covariance[i*dim+k] = 0.0;
+        precompute_parameters();
+    }
     template<class attributes_iterator_type>
-    double operator()(attributes_iterator_type attributes)
+    double log_density(attributes_iterator_type attributes) const
     {
-        std::vector<double> dx(mean);
-        for (unsigned int i = 0;i < dx.size();++i)
-            dx[i] -= attributes[i];
-        std::vector<double> idx(dx.size());
-        tipl::mat::vector_product(iV.begin(),dx.begin(),idx.begin(),tipl::dyndim(dim,dim));
         double sum = 0.0;
-        for (unsigned int i = 0;i < id.size();++i)
-            sum += idx[i]*idx[i]*id[i];
-        return std::exp(sum*-0.5)*constant;
+        if(diagonal)
+            for (unsigned int i = 0;i < dim;++i)
+            {
+                double y = (attributes[i]-mean[i])*iL[i*dim+i];
+                sum += y*y;
+            }
+        else
+            for (unsigned int i = 0;i < dim;++i)
+            {
+                const double* row = &iL[i*dim];
+                double y = 0.0;
+                for (unsigned int k = 0;k <= i;++k)
+                    y += row[k]*(attributes[k]-mean[k]);
+                sum += y*y;
+            }
+        return log_constant-0.5*sum;
+    }
+    template<class attributes_iterator_type>
+    double operator()(attributes_iterator_type attributes) const
+    {
+        return std::exp(log_density(attributes));
     }
     const std::vector<double>& get_mean(void) const
     {
@@ -139,11 +202,25 @@ public:
 };
 
 
+/*
+    soft EM for a Gaussian mixture. The E-step runs over blocks of samples
+    in parallel, evaluates the log densities with cached inverse Cholesky
+    factors, normalizes with log-sum-exp and accumulates the weighted
+    sufficient statistics per thread. Iterations stop when the mean
+    log-likelihood changes by less than tolerance (relative).
+*/
 template<class attribute_type,class classification_type>
 struct expectation_maximization
 {
     unsigned int k;
     std::vector<multivariate_gaussian> model;
+    std::vector<double> prior;
+    bool diagonal = false;
+    unsigned int max_iteration = 500;
+    double tolerance = 1.0e-8;
+    int thread_count = available_thread_count();
+    // mean log-likelihood per sample of the last iteration
+    double log_likelihood = 0.0;
 public:
     expectation_maximization(unsigned int k_):k(k_) {}
     unsigned int get_k(void) const
@@ -166,87 +243,117 @@ public:
                     unsigned int attribute_dimension,
                     classifications_iterator_type classifications_from)
     {
-        unsigned int sample_size = attributes_to-attributes;
-        tipl::dyndim variance_matrix_type(attribute_dimension,attribute_dimension);
-        tipl::dyndim mean_matrix_type(attribute_dimension,1);
+        const size_t block_size = 4096;
+        size_t sample_size = attributes_to-attributes;
+        if(!sample_size || !k)
+            return;
+        unsigned int dim = attribute_dimension;
         // initial guess
         model.resize(k);
         for (unsigned int index = 0;index < k;++index)
+        {
+            model[index].set_diagonal(diagonal);
             model[index].estimate(attributes+(sample_size/k)*index,
-                                  attributes+(sample_size/k)*(index+1),attribute_dimension);
+                                  attributes+std::max<size_t>((sample_size/k)*(index+1),(sample_size/k)*index+1),attribute_dimension);
+        }
+        prior.clear();
+        prior.resize(k,1.0/((double)k));
 
-        unsigned int change_count = 0;
+        size_t block_count = (sample_size+block_size-1)/block_size;
+        int thread_count_ = std::max<int>(1,std::min<int>(thread_count,int(block_count)));
+        // per cluster: weight, weighted sum of x-m and of (x-m)(x-m)', m being the current mean
+        size_t stat_size = 1+dim+dim*dim;
+        std::vector<std::vector<double> > stat(thread_count_,std::vector<double>(k*stat_size));
+        std::vector<double> block_log_likelihood(block_count),log_prior(k);
         std::vector<classification_type> classification(sample_size);
-        std::vector<std::vector<double> > T(k);
-        std::vector<double> prior(k);
-        std::fill(prior.begin(),prior.end(),1.0/((double)k));
-        for (unsigned int stable_iteration = 0,total_iteration = 0;stable_iteration <= total_iteration/20;++total_iteration)
+        double previous_log_likelihood = 0.0;
+        for (unsigned int iteration = 0;iteration < max_iteration;++iteration)
         {
+            for (int id = 0;id < thread_count_;++id)
+                std::fill(stat[id].begin(),stat[id].end(),0.0);
+            for (unsigned int c = 0;c < k;++c)
+                log_prior[c] = prior[c] > 0.0 ? std::log(prior[c]) : -std::numeric_limits<double>::infinity();
             // E-step
-
-            for (unsigned int index = 0;index < k;++index)
-            {
-                std::vector<double> cur_T(sample_size);
-				double prior_index = prior[index];
-                for (unsigned int j = 0;j < sample_size;++j)
-                    cur_T[j] = model[index](&attributes[j][0])*prior_index;
-                T[index].swap(cur_T);
-            }
-            // normalize T
-            for (unsigned int j = 0;j < sample_size;++j)
+            par_for2(block_count,[&](size_t b,int id)
             {
-                double sum = 0.0;
-                for (unsigned int index = 0;index < k;++index)
-                    sum += T[index][j];
-                if (sum != 0.0)
-                    for (unsigned int index = 0;index < k;++index)
-                        T[index][j] /= sum;
-            }
-            // determine classification
-            change_count = 0;
-            for (unsigned int j = 0;j < sample_size;++j)
-            {
-                unsigned int best_cluster = 0;
-                double best_T = T[0][j];
-                for (unsigned int index = 1;index < k;++index)
-                    if (T[index][j] > best_T)
+                std::vector<double> x(dim),dx(dim),p(k);
+                double* s = &stat[id][0];
+                double sum_log_likelihood = 0.0;
+                size_t to = std::min(sample_size,(b+1)*block_size);
+                for (size_t j = b*block_size;j < to;++j)
+                {
+                    for (unsigned int i = 0;i < dim;++i)
+                        x[i] = attributes[j][i];
+                    unsigned int best_cluster = 0;
+                    for (unsigned int c = 0;c < k;++c)
                     {
-                        best_cluster = index;
-                        best_T = T[index][j];
+                        p[c] = log_prior[c]+model[c].log_density(x.begin());
+                        if(p[c] > p[best_cluster])
+                            best_cluster = c;
                     }
-                if (best_cluster != classification[j])
-                {
+                    double max_p = p[best_cluster];
+                    double sum = 0.0;
+                    for (unsigned int c = 0;c < k;++c)
+                        sum += (p[c] = std::exp(p[c]-max_p));
+                    sum_log_likelihood += max_p+std::log(sum);
                     classification[j] = best_cluster;
-                    ++change_count;
+                    for (unsigned int c = 0;c < k;++c)
+                    {
+                        double r = p[c]/sum;
+                        if(r == 0.0)
+                            continue;
+                        double* sc = s+c*stat_size;
+                        double* sc2 = sc+1+dim;
+                        const std::vector<double>& m = model[c].get_mean();
+                        sc[0] += r;
+                        for (unsigned int i = 0;i < dim;++i)
+                        {
+                            dx[i] = x[i]-m[i];
+                            sc[1+i] += r*dx[i];
+                        }
+                        if(diagonal)
+                            for (unsigned int i = 0;i < dim;++i)
+                                sc2[i*dim+i] += r*dx[i]*dx[i];
+                        else
+                            for (unsigned int i = 0;i < dim;++i)
+                            {
+                                double rdx = r*dx[i];
+                                double* row = sc2+i*dim;
+                                for (unsigned int l = 0;l <= i;++l)
+                                    row[l] += rdx*dx[l];
+                            }
+                    }
                 }
-            }
+                block_log_likelihood[b] = sum_log_likelihood;
+            },thread_count_);
+            for (int id = 1;id < thread_count_;++id)
+                for (size_t i = 0;i < stat[0].size();++i)
+                    stat[0][i] += stat[id][i];
+            log_likelihood = std::accumulate(block_log_likelihood.begin(),block_log_likelihood.end(),0.0)/double(sample_size);
+            if(iteration && std::abs(log_likelihood-previous_log_likelihood) <= tolerance*std::abs(log_likelihood))
+                break;
+            previous_log_likelihood = log_likelihood;
 
-            // normalize prior
+            // M-step
+            for (unsigned int c = 0;c < k;++c)
             {
-                for (unsigned int index = 0;index < k;++index)
-                    prior[index] = std::accumulate(T[index].begin(),T[index].end(),0.0);
-                double sum = std::accumulate(prior.begin(),prior.end(),0.0);
-                
-                for (unsigned int index = 0;index < k;++index)
+                const double* sc = &stat[0][c*stat_size];
+                const double* sc2 = sc+1+dim;
+                double w = sc[0];
+                prior[c] = w/double(sample_size);
+                if(w <= 0.0) // empty cluster keeps its model but no longer takes samples
+                    continue;
+                std::vector<double> d(sc+1,sc+1+dim),mean(model[c].get_mean()),covariance(dim*dim);
+                for (unsigned int i = 0;i < dim;++i)
                 {
-					if (prior[index] == 0.0)
-                    {
-                        prior[index] = 1.0/((double)k);
-                        std::fill(T[index].begin(),T[index].end(),1.0);
-                    }
-					else
-						prior[index] /= sum;
+                    d[i] /= w;
+                    mean[i] += d[i];
                 }
+                for (unsigned int i = 0;i < dim;++i)
+                    for (unsigned int l = 0;l <= i;++l)
+                        covariance[i*dim+l] = covariance[l*dim+i] = sc2[i*dim+l]/w-d[i]*d[l];
+                model[c].set_parameters(mean,covariance);
             }
-
-            // M-step
-            for (unsigned int index = 0;index < k;++index)
-                model[index].estimate(attributes,attributes_to,attribute_dimension,T[index].begin());
-
-            if (!change_count)
-                ++stable_iteration;
-            else
-                stable_iteration = 0;
         }
         std::copy(classification.begin(),classification.end(),classifications_from);
     }
@@ -1,70 +1,351 @@
 #ifndef ML_K_MEANS_HPP
 #define ML_K_MEANS_HPP
+#include <vector>
+#include <random>
+#include <limits>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include "tipl/utility/multi_thread.hpp"
+#include "tipl/ml/utility.hpp"
 
 namespace tipl{
 
 namespace ml{
 
+struct k_means_param{
+    size_t max_iteration = 300;
+    // Lloyd stops once no center moves further than this (in normalized units)
+    double tolerance = 1.0e-4;
+    // 0 runs full-batch Lloyd iterations with Hamerly bounds,
+    // otherwise each iteration updates the centers from this many samples
+    size_t batch_size = 0;
+    // mini-batch stops after this many batches without a lower smoothed inertia
+    size_t max_no_improvement = 10;
+    unsigned int seed = 0;
+    int thread_count = available_thread_count();
+};
 
-template<class attribute_type,class classifications_iterator_type>
-void k_means_clustering(const normalized_attributes<attribute_type>& attributes,
-                        classifications_iterator_type classification,size_t k)
+namespace imp{
+
+const size_t k_means_block_size = 4096;
+
+template<class attribute_type>
+double k_means_distance2(const std::vector<attribute_type>& x,const double* c,size_t dim)
 {
-    size_t sample_size = attributes.size();
-    size_t attribute_dimension = attributes.attribute_dimension();
-    for (size_t index = 0;index < sample_size;++index)
-        classification[index] = index%k;
-    size_t change_cluster = 0;
-    do
+    double sum = 0.0;
+    for(size_t i = 0;i < dim;++i)
     {
-        // E-step
-        std::vector<std::vector<attribute_type> > means(k);
-        for (size_t index = 0;index < k;++index)
+        double d = double(x[i])-c[i];
+        sum += d*d;
+    }
+    return sum;
+}
+
+inline double k_means_distance2(const double* x,const double* c,size_t dim)
+{
+    double sum = 0.0;
+    for(size_t i = 0;i < dim;++i)
+    {
+        double d = x[i]-c[i];
+        sum += d*d;
+    }
+    return sum;
+}
+
+// nearest center and the squared distances to the nearest and second nearest
+template<class attribute_type>
+unsigned int k_means_nearest(const std::vector<attribute_type>& x,const std::vector<double>& centers,
+                             size_t k,size_t dim,double& d1,double& d2)
+{
+    unsigned int nearest = 0;
+    d1 = d2 = std::numeric_limits<double>::max();
+    for(size_t c = 0;c < k;++c)
+    {
+        double d = k_means_distance2(x,&centers[c*dim],dim);
+        if(d < d1)
         {
-            std::vector<attribute_type> cur_mean(attribute_dimension);
-            size_t count = 0;
-            for (size_t j = 0;j < sample_size;++j)
-                if (classification[j] == index)
-                {
-                    for (size_t k = 0;k < attribute_dimension;++k)
-                        cur_mean[k] += attributes[j][k];
-                    ++count;
-                }
-            if (count)
-                for (size_t k = 0;k < attribute_dimension;++k)
-                    cur_mean[k] /= (attribute_type)count;
-            means[index].swap(cur_mean);
+            d2 = d1;
+            d1 = d;
+            nearest = (unsigned int)c;
         }
-        // M-step
-        change_cluster = 0;
-        for (size_t j = 0;j < sample_size;++j)
+        else
+            if(d < d2)
+                d2 = d;
+    }
+    return nearest;
+}
+
+/*
+    k-means++ seeding: each new center is drawn with probability
+    proportional to the squared distance to the closest chosen center.
+    The partial sums are kept per fixed-size block, so the draw does not
+    depend on the thread count.
+*/
+template<class attribute_type>
+void k_means_plus_plus(const normalized_attributes<attribute_type>& attributes,size_t k,
+                       std::vector<double>& centers,std::mt19937& gen,int thread_count)
+{
+    size_t n = attributes.size();
+    size_t dim = attributes.attribute_dimension();
+    size_t block_count = (n+k_means_block_size-1)/k_means_block_size;
+    std::vector<double> D(n,std::numeric_limits<double>::max()),block_sum(block_count);
+    centers.resize(k*dim);
+    size_t pick = std::uniform_int_distribution<size_t>(0,n-1)(gen);
+    std::copy(attributes[pick].begin(),attributes[pick].begin()+dim,centers.begin());
+    for(size_t c = 1;c < k;++c)
+    {
+        const double* last = &centers[(c-1)*dim];
+        par_for(block_count,[&](size_t b)
         {
-            attribute_type min_dis = std::numeric_limits<attribute_type>::max();
-            size_t min_cluster = 0;
-            for (size_t index = 0;index < k;++index)
+            double sum = 0.0;
+            size_t to = std::min(n,(b+1)*k_means_block_size);
+            for(size_t i = b*k_means_block_size;i < to;++i)
             {
-                attribute_type dis2 = 0;
-                for (size_t i = 0;i < attribute_dimension;++i)
-                {
-                    attribute_type d = attributes[j][i] - means[index][i];
-                    dis2 += d*d;
-                    if (dis2 > min_dis)
-                        break;
-                }
-                if (dis2 < min_dis)
+                D[i] = std::min(D[i],k_means_distance2(attributes[i],last,dim));
+                sum += D[i];
+            }
+            block_sum[b] = sum;
+        },thread_count);
+        double total = std::accumulate(block_sum.begin(),block_sum.end(),0.0);
+        if(total <= 0.0) // every sample sits on a center
+            pick = std::uniform_int_distribution<size_t>(0,n-1)(gen);
+        else
+        {
+            double r = std::uniform_real_distribution<double>(0.0,total)(gen);
+            size_t b = 0;
+            for(;b+1 < block_count && r >= block_sum[b];++b)
+                r -= block_sum[b];
+            size_t to = std::min(n,(b+1)*k_means_block_size);
+            for(pick = b*k_means_block_size;pick+1 < to && r >= D[pick];++pick)
+                r -= D[pick];
+        }
+        std::copy(attributes[pick].begin(),attributes[pick].begin()+dim,centers.begin()+c*dim);
+    }
+}
+
+// recompute the means from the labels, empty clusters keep their center
+template<class attribute_type>
+void k_means_update_centers(const normalized_attributes<attribute_type>& attributes,
+                            const std::vector<unsigned int>& label,
+                            std::vector<double>& centers,size_t k,int thread_count)
+{
+    size_t n = attributes.size();
+    size_t dim = attributes.attribute_dimension();
+    size_t block_count = (n+k_means_block_size-1)/k_means_block_size;
+    thread_count = std::max<int>(1,std::min<int>(thread_count,int(block_count)));
+    std::vector<std::vector<double> > sum(thread_count,std::vector<double>(k*dim));
+    std::vector<std::vector<size_t> > count(thread_count,std::vector<size_t>(k));
+    par_for2(block_count,[&](size_t b,int id)
+    {
+        size_t to = std::min(n,(b+1)*k_means_block_size);
+        for(size_t i = b*k_means_block_size;i < to;++i)
+        {
+            double* s = &sum[id][label[i]*dim];
+            for(size_t j = 0;j < dim;++j)
+                s[j] += attributes[i][j];
+            ++count[id][label[i]];
+        }
+    },thread_count);
+    for(int id = 1;id < thread_count;++id)
+    {
+        for(size_t j = 0;j < k*dim;++j)
+            sum[0][j] += sum[id][j];
+        for(size_t c = 0;c < k;++c)
+            count[0][c] += count[id][c];
+    }
+    for(size_t c = 0;c < k;++c)
+        if(count[0][c])
+            for(size_t j = 0;j < dim;++j)
+                centers[c*dim+j] = sum[0][c*dim+j]/double(count[0][c]);
+}
+
+// how far each center moved, returns the largest move
+inline double k_means_center_shift(const std::vector<double>& old_centers,const std::vector<double>& centers,
+                                   size_t k,size_t dim,std::vector<double>& shift)
+{
+    shift.resize(k);
+    for(size_t c = 0;c < k;++c)
+    {
+        double sum = 0.0;
+        for(size_t j = 0;j < dim;++j)
+        {
+            double d = centers[c*dim+j]-old_centers[c*dim+j];
+            sum += d*d;
+        }
+        shift[c] = std::sqrt(sum);
+    }
+    return *std::max_element(shift.begin(),shift.end());
+}
+
+/*
+    Lloyd iterations with Hamerly's bounds: each sample keeps an upper bound
+    to its center and a lower bound to the second closest one, and is only
+    compared against all centers when the bounds can no longer rule out a
+    change of cluster.
+    Reference: G. Hamerly, "Making k-means even faster", SDM 2010.
+*/
+template<class attribute_type>
+void k_means_hamerly(const normalized_attributes<attribute_type>& attributes,
+                     std::vector<double>& centers,std::vector<unsigned int>& label,
+                     size_t k,const k_means_param& param,int thread_count)
+{
+    size_t n = attributes.size();
+    size_t dim = attributes.attribute_dimension();
+    size_t block_count = (n+k_means_block_size-1)/k_means_block_size;
+    std::vector<double> upper(n),lower(n),s(k),shift,old_centers;
+    std::vector<size_t> changes(block_count);
+    par_for(block_count,[&](size_t b)
+    {
+        size_t to = std::min(n,(b+1)*k_means_block_size);
+        for(size_t i = b*k_means_block_size;i < to;++i)
+        {
+            double d1,d2;
+            label[i] = k_means_nearest(attributes[i],centers,k,dim,d1,d2);
+            upper[i] = std::sqrt(d1);
+            lower[i] = std::sqrt(d2);
+        }
+    },thread_count);
+    for(size_t iteration = 0;iteration < param.max_iteration;++iteration)
+    {
+        old_centers = centers;
+        k_means_update_centers(attributes,label,centers,k,thread_count);
+        double max_shift = k_means_center_shift(old_centers,centers,k,dim,shift);
+        size_t max_c = size_t(std::max_element(shift.begin(),shift.end())-shift.begin());
+        double second_shift = 0.0;
+        for(size_t c = 0;c < k;++c)
+            if(c != max_c)
+                second_shift = std::max(second_shift,shift[c]);
+        // half the distance to the closest other center
+        for(size_t c = 0;c < k;++c)
+        {
+            double min_d = std::numeric_limits<double>::max();
+            for(size_t c2 = 0;c2 < k;++c2)
+                if(c2 != c)
+                    min_d = std::min(min_d,k_means_distance2(&centers[c*dim],&centers[c2*dim],dim));
+            s[c] = 0.5*std::sqrt(min_d);
+        }
+        par_for(block_count,[&](size_t b)
+        {
+            size_t to = std::min(n,(b+1)*k_means_block_size);
+            size_t change = 0;
+            for(size_t i = b*k_means_block_size;i < to;++i)
+            {
+                unsigned int l = label[i];
+                upper[i] += shift[l];
+                lower[i] -= (l == max_c) ? second_shift : max_shift;
+                double m = std::max(s[l],lower[i]);
+                if(upper[i] <= m)
+                    continue;
+                upper[i] = std::sqrt(k_means_distance2(attributes[i],&centers[l*dim],dim));
+                if(upper[i] <= m)
+                    continue;
+                double d1,d2;
+                unsigned int new_l = k_means_nearest(attributes[i],centers,k,dim,d1,d2);
+                upper[i] = std::sqrt(d1);
+                lower[i] = std::sqrt(d2);
+                if(new_l != l)
                 {
-                    min_dis = dis2;
-                    min_cluster = index;
+                    label[i] = new_l;
+                    ++change;
                 }
             }
-            if (classification[j] != min_cluster)
+            changes[b] = change;
+        },thread_count);
+        if(std::accumulate(changes.begin(),changes.end(),size_t(0)) == 0 || max_shift <= param.tolerance)
+            break;
+    }
+}
+
+/*
+    mini-batch k-means: each iteration draws batch_size samples and moves
+    their centers with a per-center learning rate of 1/count. The batch
+    inertia is smoothed over about one pass of the data, and the iterations
+    stop once it has not improved for max_no_improvement batches. A final
+    Lloyd step refines the centers on all samples.
+    Reference: D. Sculley, "Web-scale k-means clustering", WWW 2010.
+*/
+template<class attribute_type>
+void k_means_mini_batch(const normalized_attributes<attribute_type>& attributes,
+                        std::vector<double>& centers,std::vector<unsigned int>& label,
+                        size_t k,const k_means_param& param,std::mt19937& gen,int thread_count)
+{
+    size_t n = attributes.size();
+    size_t dim = attributes.attribute_dimension();
+    size_t batch_size = param.batch_size;
+    size_t batch_block_count = (batch_size+k_means_block_size-1)/k_means_block_size;
+    std::vector<size_t> batch(batch_size),count(k);
+    std::vector<unsigned int> batch_label(batch_size);
+    std::vector<double> batch_inertia(batch_block_count);
+    std::uniform_int_distribution<size_t> pick(0,n-1);
+    double alpha = std::min(1.0,2.0*double(batch_size)/double(n+1));
+    double ewa_inertia = 0.0,best_inertia = std::numeric_limits<double>::max();
+    size_t no_improvement = 0;
+    for(size_t iteration = 0;iteration < param.max_iteration;++iteration)
+    {
+        for(size_t j = 0;j < batch_size;++j)
+            batch[j] = pick(gen);
+        par_for(batch_block_count,[&](size_t b)
+        {
+            size_t to = std::min(batch_size,(b+1)*k_means_block_size);
+            double sum = 0.0;
+            for(size_t j = b*k_means_block_size;j < to;++j)
             {
-                classification[j] = min_cluster;
-                ++change_cluster;
+                double d1,d2;
+                batch_label[j] = k_means_nearest(attributes[batch[j]],centers,k,dim,d1,d2);
+                sum += d1;
             }
+            batch_inertia[b] = sum;
+        },thread_count);
+        for(size_t j = 0;j < batch_size;++j)
+        {
+            unsigned int c = batch_label[j];
+            double eta = 1.0/double(++count[c]);
+            double* center = &centers[c*dim];
+            const std::vector<attribute_type>& x = attributes[batch[j]];
+            for(size_t i = 0;i < dim;++i)
+                center[i] += eta*(double(x[i])-center[i]);
+        }
+        double inertia = std::accumulate(batch_inertia.begin(),batch_inertia.end(),0.0)/double(batch_size);
+        ewa_inertia = iteration ? ewa_inertia*(1.0-alpha)+inertia*alpha : inertia;
+        if(ewa_inertia < best_inertia)
+        {
+            best_inertia = ewa_inertia;
+            no_improvement = 0;
         }
+        else
+            if(++no_improvement >= param.max_no_improvement)
+                break;
     }
-    while (change_cluster);
+    // assign all samples, then one Lloyd update and reassignment
+    k_means_param lloyd_param = param;
+    lloyd_param.max_iteration = 1;
+    k_means_hamerly(attributes,centers,label,k,lloyd_param,thread_count);
+}
+
+}
+
+template<class attribute_type,class classifications_iterator_type>
+void k_means_clustering(const normalized_attributes<attribute_type>& attributes,
+                        classifications_iterator_type classification,size_t k,
+                        const k_means_param& param = k_means_param())
+{
+    size_t sample_size = attributes.size();
+    if(!sample_size || !k)
+        return;
+    // clusters beyond the sample size would stay empty
+    k = std::min(k,sample_size);
+    int thread_count = std::max<int>(1,param.thread_count);
+    std::mt19937 gen(param.seed);
+    std::vector<double> centers;
+    std::vector<unsigned int> label(sample_size);
+    imp::k_means_plus_plus(attributes,k,centers,gen,thread_count);
+    if(param.batch_size && param.batch_size < sample_size)
+        imp::k_means_mini_batch(attributes,centers,label,k,param,gen,thread_count);
+    else
+        imp::k_means_hamerly(attributes,centers,label,k,param,thread_count);
+    for (size_t index = 0;index < sample_size;++index)
+        classification[index] = label[index];
 }
 
 
@@ -74,9 +355,10 @@ class k_means
 protected:
     size_t k;
 public:
-
+    k_means_param param;
 public:
     k_means(size_t k_):k(k_) {}
+    k_means(size_t k_,const k_means_param& param_):k(k_),param(param_) {}
 
     template<class attributes_iterator_type,class classifications_iterator_type>
     void operator()(attributes_iterator_type attributes_from,
@@ -85,7 +367,7 @@ public:
                     classifications_iterator_type classifications_from)
     {
         normalized_attributes<attribute_type> attributes(attributes_from,attributes_to,attribute_dimension);
-        k_means_clustering(attributes,classifications_from,k);
+        k_means_clustering(attributes,classifications_from,k,param);
     }
 
     template<class attributes_iterator_type,class classifications_iterator_type>
@@ -94,7 +376,7 @@ public:
                     classifications_iterator_type classifications_from)
     {
         normalized_attributes<attribute_type> attributes(attributes_from,attributes_to);
-        k_means_clustering(attributes,classifications_from,k);
+        k_means_clustering(attributes,classifications_from,k,param);
     }
 };
 
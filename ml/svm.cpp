@@ -7,7 +7,14 @@
 #include <stdarg.h>
 #include <limits.h>
 #include <locale.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
 #include "svm.hpp"
+#include "tipl/utility/multi_thread.hpp"
 
 typedef float Qfloat;
 typedef signed char schar;
@@ -41,6 +48,22 @@ static inline double powi(double base, int times)
 	}
 	return ret;
 }
+// dot product of dense rows with independent partial sums so that it vectorizes
+static inline double dense_dot(const double *x, const double *y, int n)
+{
+	double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+	int k = 0;
+	for(;k+4<=n;k+=4)
+	{
+		s0 += x[k]*y[k];
+		s1 += x[k+1]*y[k+1];
+		s2 += x[k+2]*y[k+2];
+		s3 += x[k+3]*y[k+3];
+	}
+	for(;k<n;k++)
+		s0 += x[k]*y[k];
+	return (s0+s2)+(s1+s3);
+}
 #define INF HUGE_VAL
 #define TAU 1e-12
 #define Malloc(type,n) (type *)malloc((n)*sizeof(type))
@@ -191,6 +214,87 @@ void Cache::swap_index(int i, int j)
 	}
 }
 
+//
+// Worker threads kept for the lifetime of a Kernel. The solver asks for a
+// Q row on every cache miss, so the rows are split over these threads
+// instead of starting new ones each time.
+//
+class row_pool
+{
+public:
+	row_pool(int thread_count);
+	~row_pool();
+	// fun(c) for c in [0,count) on the workers and the calling thread
+	void run(int count, const std::function<void(int)>& fun);
+private:
+	void work();
+	std::vector<std::thread> workers;
+	std::mutex lock;
+	std::condition_variable started,finished;
+	const std::function<void(int)> *job;
+	int job_count;
+	std::atomic<int> next;
+	int active;
+	unsigned int generation;
+	bool quit;
+};
+
+row_pool::row_pool(int thread_count)
+:job(0),job_count(0),next(0),active(0),generation(0),quit(false)
+{
+	for(int i=1;i<thread_count;i++)
+		workers.push_back(std::thread(&row_pool::work,this));
+}
+
+row_pool::~row_pool()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		quit = true;
+	}
+	started.notify_all();
+	for(size_t i=0;i<workers.size();i++)
+		workers[i].join();
+}
+
+void row_pool::work()
+{
+	unsigned int seen = 0;
+	std::unique_lock<std::mutex> guard(lock);
+	while(true)
+	{
+		started.wait(guard,[&](){return quit || generation != seen;});
+		if(quit)
+			return;
+		seen = generation;
+		const std::function<void(int)> *fun = job;
+		int count = job_count;
+		guard.unlock();
+		for(int c;(c = next++) < count;)
+			(*fun)(c);
+		guard.lock();
+		if(--active == 0)
+			finished.notify_one();
+	}
+}
+
+void row_pool::run(int count, const std::function<void(int)>& fun)
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		job = &fun;
+		job_count = count;
+		next = 0;
+		active = (int)workers.size();
+		++generation;
+	}
+	started.notify_all();
+	for(int c;(c = next++) < count;)
+		fun(c);
+	std::unique_lock<std::mutex> guard(lock);
+	finished.wait(guard,[&](){return active == 0;});
+}
+
 //
 // Kernel evaluation
 //
@@ -218,15 +322,24 @@ public:
 	virtual void swap_index(int i, int j) const	// no so const...
 	{
 		swap(x[i],x[j]);
+		if(dense_x) swap(dense_x[i],dense_x[j]);
 		if(x_square) swap(x_square[i],x_square[j]);
 	}
 protected:
 
 	double (Kernel::*kernel_function)(int i, int j) const;
+	// data[j] = y[i]*y[j]*K(i,j) (or K(i,j) if y is null) for j in [start,len)
+	void kernel_row(int i, int start, int len, Qfloat *data, const schar *y) const;
 
 private:
 	const svm_node **x;
 	double *x_square;
+	// when every sample stores features 1..dense_dim, the kernels use these dense rows
+	double **dense_x;
+	double *dense_buf;
+	int dense_dim;
+	// created by the first row long enough to split
+	mutable row_pool *pool;
 
 	// svm_parameter
 	const int kernel_type;
@@ -235,21 +348,25 @@ private:
 	const double coef0;
 
 	static double dot(const svm_node *px, const svm_node *py);
+	double dot(int i, int j) const
+	{
+		return dense_x ? dense_dot(dense_x[i],dense_x[j],dense_dim) : dot(x[i],x[j]);
+	}
 	double kernel_linear(int i, int j) const
 	{
-		return dot(x[i],x[j]);
+		return dot(i,j);
 	}
 	double kernel_poly(int i, int j) const
 	{
-		return powi(gamma*dot(x[i],x[j])+coef0,degree);
+		return powi(gamma*dot(i,j)+coef0,degree);
 	}
 	double kernel_rbf(int i, int j) const
 	{
-		return exp(-gamma*(x_square[i]+x_square[j]-2*dot(x[i],x[j])));
+		return exp(-gamma*(x_square[i]+x_square[j]-2*dot(i,j)));
 	}
 	double kernel_sigmoid(int i, int j) const
 	{
-		return tanh(gamma*dot(x[i],x[j])+coef0);
+		return tanh(gamma*dot(i,j)+coef0);
 	}
 	double kernel_precomputed(int i, int j) const
 	{
@@ -282,11 +399,40 @@ Kernel::Kernel(int l, svm_node * const * x_, const svm_parameter& param)
 
 	clone(x,x_,l);
 
+	dense_x = 0;
+	dense_buf = 0;
+	dense_dim = 0;
+	pool = 0;
+	if(kernel_type != PRECOMPUTED && l)
+	{
+		bool dense = true;
+		while(x[0][dense_dim].index == dense_dim+1)
+			++dense_dim;
+		for(int i=0;i<l && dense;i++)
+		{
+			int k = 0;
+			while(x[i][k].index == k+1)
+				++k;
+			dense = (k == dense_dim && x[i][k].index == -1);
+		}
+		if(dense && dense_dim)
+		{
+			dense_x = new double*[l];
+			dense_buf = new double[(size_t)l*dense_dim];
+			for(int i=0;i<l;i++)
+			{
+				dense_x[i] = dense_buf+(size_t)i*dense_dim;
+				for(int k=0;k<dense_dim;k++)
+					dense_x[i][k] = x[i][k].value;
+			}
+		}
+	}
+
 	if(kernel_type == RBF)
 	{
 		x_square = new double[l];
 		for(int i=0;i<l;i++)
-			x_square[i] = dot(x[i],x[i]);
+			x_square[i] = dot(i,i);
 	}
 	else
 		x_square = 0;
@@ -296,6 +442,35 @@ Kernel::~Kernel()
 {
 	delete[] x;
 	delete[] x_square;
+	delete[] dense_x;
+	delete[] dense_buf;
+	delete pool;
+}
+
+void Kernel::kernel_row(int i, int start, int len, Qfloat *data, const schar *y) const
+{
+	const int chunk = 1024;
+	int chunk_count = (len-start+chunk-1)/chunk;
+	auto fun = [&](int c)
+	{
+		int to = min(len,start+(c+1)*chunk);
+		for(int j=start+c*chunk;j<to;j++)
+		{
+			double value = (this->*kernel_function)(i,j);
+			data[j] = (Qfloat)(y ? y[i]*y[j]*value : value);
+		}
+	};
+	// splitting only pays off for long rows
+	if(chunk_count > 1 && (long)(len-start)*(dense_dim ? dense_dim : 16) >= (1L << 16) &&
+	   (pool || available_thread_count() > 1))
+	{
+		if(!pool)
+			pool = new row_pool(available_thread_count());
+		pool->run(chunk_count,fun);
+	}
+	else
+		for(int c=0;c<chunk_count;c++)
+			fun(c);
 }
 
 double Kernel::dot(const svm_node *px, const svm_node *py)
@@ -1286,12 +1461,9 @@ public:
     Qfloat *get_Q(int i, int len) const
 	{
         Qfloat *data;
-		int start, j;
+		int start;
 		if((start = cache->get_data(i,&data,len)) < len)
-		{
-			for(j=start;j<len;j++)
-                data[j] = (Qfloat)(y[i]*y[j]*(this->*kernel_function)(i,j));
-		}
+			kernel_row(i,start,len,data,y);
 		return data;
 	}
 
@@ -1335,12 +1507,9 @@ public:
     Qfloat *get_Q(int i, int len) const
 	{
         Qfloat *data;
-		int start, j;
+		int start;
 		if((start = cache->get_data(i,&data,len)) < len)
-		{
-			for(j=start;j<len;j++)
-                data[j] = (Qfloat)(this->*kernel_function)(i,j);
-		}
+			kernel_row(i,start,len,data,0);
 		return data;
 	}
 
@@ -1403,10 +1572,7 @@ public:
         Qfloat *data;
 		int j, real_i = index[i];
 		if(cache->get_data(real_i,&data,l) < l)
-		{
-			for(j=0;j<l;j++)
-                data[j] = (Qfloat)(this->*kernel_function)(real_i,j);
-		}
+			kernel_row(real_i,0,l,data,0);
 
 		// reorder and copy
         Qfloat *buf = buffer[next_buffer];
@@ -2505,7 +2671,8 @@ double svm_get_svr_probability(const svm_model *model)
 	}
 }
 
-double svm_predict_values(const svm_model *model, const svm_node *x, double* dec_values)
+// decision from the kernel values between one sample and every SV
+static double svm_predict_kvalue(const svm_model *model, const double *kvalue, double* dec_values, int *vote)
 {
 	int i;
 	if(model->param.svm_type == ONE_CLASS ||
@@ -2515,7 +2682,7 @@ double svm_predict_values(const svm_model *model, const svm_node *x, double* dec
 		double *sv_coef = model->sv_coef[0];
 		double sum = 0;
 		for(i=0;i<model->l;i++)
-			sum += sv_coef[i] * Kernel::k_function(x,model->SV[i],model->param);
+			sum += sv_coef[i] * kvalue[i];
 		sum -= model->rho[0];
 		*dec_values = sum;
 
@@ -2527,28 +2694,14 @@ double svm_predict_values(const svm_model *model, const svm_node *x, double* dec
 	else
 	{
 		int nr_class = model->nr_class;
-		int l = model->l;
-		
-		double *kvalue = Malloc(double,l);
-		for(i=0;i<l;i++)
-			kvalue[i] = Kernel::k_function(x,model->SV[i],model->param);
-
-		int *start = Malloc(int,nr_class);
-		start[0] = 0;
-		for(i=1;i<nr_class;i++)
-			start[i] = start[i-1]+model->nSV[i-1];
-
-		int *vote = Malloc(int,nr_class);
 		for(i=0;i<nr_class;i++)
 			vote[i] = 0;
 
 		int p=0;
-		for(i=0;i<nr_class;i++)
-			for(int j=i+1;j<nr_class;j++)
+		for(int si=0,i=0;i<nr_class;si+=model->nSV[i],i++)
+			for(int sj=si+model->nSV[i],j=i+1;j<nr_class;sj+=model->nSV[j],j++)
 			{
 				double sum = 0;
-				int si = start[i];
-				int sj = start[j];
 				int ci = model->nSV[i];
 				int cj = model->nSV[j];
 				
@@ -2573,14 +2726,95 @@ double svm_predict_values(const svm_model *model, const svm_node *x, double* dec
 		for(i=1;i<nr_class;i++)
 			if(vote[i] > vote[vote_max_idx])
 				vote_max_idx = i;
-
-		free(kvalue);
-		free(start);
-		free(vote);
 		return model->label[vote_max_idx];
 	}
 }
 
+double svm_predict_values(const svm_model *model, const svm_node *x, double* dec_values)
+{
+	int l = model->l;
+	double *kvalue = Malloc(double,l);
+	int *vote = Malloc(int,model->nr_class);
+	for(int i=0;i<l;i++)
+		kvalue[i] = Kernel::k_function(x,model->SV[i],model->param);
+	double result = svm_predict_kvalue(model,kvalue,dec_values,vote);
+	free(kvalue);
+	free(vote);
+	return result;
+}
+
+void svm_predict_dense(const svm_model *model, const double *x, int n, int dim, double *result)
+{
+	const svm_parameter& param = model->param;
+	int l = model->l;
+	int nr_class = model->nr_class;
+	int dec_size = (param.svm_type == ONE_CLASS ||
+					param.svm_type == EPSILON_SVR ||
+					param.svm_type == NU_SVR) ? 1 : nr_class*(nr_class-1)/2;
+	const int block = 256;
+	int block_count = (n+block-1)/block;
+	if(param.kernel_type == PRECOMPUTED)
+	{
+		par_for(block_count,[&](int b)
+		{
+			std::vector<svm_node> node(dim+1);
+			int to = min(n,(b+1)*block);
+			for(int s=b*block;s<to;s++)
+			{
+				for(int k=0;k<dim;k++)
+				{
+					node[k].index = k+1;
+					node[k].value = x[(size_t)s*dim+k];
+				}
+				node[dim].index = -1;
+				result[s] = svm_predict(model,&node[0]);
+			}
+		});
+		return;
+	}
+	// dense SVs and their squared norms, shared by all samples
+	std::vector<double> sv((size_t)l*dim),sv_square(l);
+	for(int i=0;i<l;i++)
+	{
+		double *row = &sv[0]+(size_t)i*dim;
+		for(const svm_node *p = model->SV[i];p->index != -1;++p)
+			if(p->index >= 1 && p->index <= dim)
+				row[p->index-1] = p->value;
+		sv_square[i] = dense_dot(row,row,dim);
+	}
+	par_for(block_count,[&](int b)
+	{
+		std::vector<double> kvalue(l+1),dec_values(dec_size);
+		std::vector<int> vote(nr_class);
+		int to = min(n,(b+1)*block);
+		for(int s=b*block;s<to;s++)
+		{
+			const double *xs = x+(size_t)s*dim;
+			double x_square = dense_dot(xs,xs,dim);
+			for(int i=0;i<l;i++)
+			{
+				double d = dense_dot(xs,&sv[0]+(size_t)i*dim,dim);
+				switch(param.kernel_type)
+				{
+					case LINEAR:
+						kvalue[i] = d;
+						break;
+					case POLY:
+						kvalue[i] = powi(param.gamma*d+param.coef0,param.degree);
+						break;
+					case RBF:
+						kvalue[i] = exp(-param.gamma*max(x_square+sv_square[i]-2*d,0.0));
+						break;
+					case SIGMOID:
+						kvalue[i] = tanh(param.gamma*d+param.coef0);
+						break;
+				}
+			}
+			result[s] = svm_predict_kvalue(model,&kvalue[0],&dec_values[0],&vote[0]);
+		}
+	});
+}
+
 double svm_predict(const svm_model *model, const svm_node *x)
 {
 	int nr_class = model->nr_class;
@@ -2,6 +2,7 @@
 #define ML_SVM_HPP
 #include <memory>
 #include <vector>
+#include <algorithm>
 #define LIBSVM_VERSION 317
 
 namespace tipl{
@@ -88,6 +89,8 @@ double svm_get_svr_probability(const struct svm_model *model);
 
 double svm_predict_values(const struct svm_model *model, const struct svm_node *x, double* dec_values);
 double svm_predict(const struct svm_model *model, const struct svm_node *x);
+// predicts n samples stored row by row with dim features each, using all threads
+void svm_predict_dense(const struct svm_model *model, const double *x, int n, int dim, double *result);
 double svm_predict_probability(const struct svm_model *model, const struct svm_node *x, double* prob_estimates);
 
 void svm_free_model_content(struct svm_model *model_ptr);
@@ -181,6 +184,27 @@ public:
         x.back().index = -1;// libsvm has -1 index at the end
         return svm_predict(model,&x[0]);
     }
+    template<typename samples_iterator_type,typename classifications_iterator_type>
+    void predict(samples_iterator_type samples_from,
+                 samples_iterator_type samples_to,
+                 classifications_iterator_type classifications_from) const
+    {
+        const size_t chunk_size = 65536;
+        size_t sample_size = samples_to-samples_from;
+        std::vector<double> x,result;
+        for(size_t from = 0;from < sample_size;from += chunk_size)
+        {
+            size_t size = std::min(chunk_size,sample_size-from);
+            x.resize(size*attribute_dimension);
+            result.resize(size);
+            for(size_t i = 0;i < size;++i)
+                for(unsigned int j = 0;j < attribute_dimension;++j)
+                    x[i*attribute_dimension+j] = samples_from[from+i][j];
+            svm_predict_dense(model,&x[0],int(size),int(attribute_dimension),&result[0]);
+            for(size_t i = 0;i < size;++i)
+                classifications_from[from+i] = classification_type(result[i]);
+        }
+    }
 };
 
 
@@ -3,6 +3,8 @@
 #include <vector>
 #include <cmath>
 #include <set>
+#include <algorithm>
+#include "tipl/utility/multi_thread.hpp"
 
 
 namespace tipl
@@ -433,6 +435,66 @@ public:
     }
 };
 
+/*
+    attributes quantized at their quantiles to at most 256 bins each, stored
+    attribute by attribute for building histograms. Bin b of attribute a
+    holds the values in (edges[a][b-1],edges[a][b]], so a split between
+    bins b and b+1 is the test x[a] > edges[a][b] on the raw value.
+*/
+template<class attribute_type>
+class binned_attributes
+{
+public:
+    std::vector<std::vector<attribute_type> > edges;
+    std::vector<unsigned char> bins; // bins[a*sample_size+i]
+    size_t sample_size = 0;
+public:
+    template<class attributes_iterator_type>
+    binned_attributes(attributes_iterator_type attributes_from,
+                      attributes_iterator_type attributes_to,
+                      size_t attribute_dimension):
+        edges(attribute_dimension),
+        bins(attribute_dimension*size_t(attributes_to-attributes_from)),
+        sample_size(attributes_to-attributes_from)
+    {
+        const size_t max_edge = 255;
+        // quantiles are estimated from at most 65536 samples
+        size_t step = std::max<size_t>(1,sample_size >> 16);
+        par_for(attribute_dimension,[&](size_t a)
+        {
+            std::vector<attribute_type> values;
+            for(size_t i = 0;i < sample_size;i += step)
+                values.push_back(attributes_from[i][a]);
+            std::sort(values.begin(),values.end());
+            values.erase(std::unique(values.begin(),values.end()),values.end());
+            std::vector<attribute_type>& e = edges[a];
+            if(values.size() <= max_edge)
+                e = values;
+            else
+            {
+                for(size_t b = 1;b <= max_edge;++b)
+                    e.push_back(values[b*values.size()/(max_edge+1)-1]);
+                e.erase(std::unique(e.begin(),e.end()),e.end());
+            }
+            unsigned char* out = &bins[a*sample_size];
+            for(size_t i = 0;i < sample_size;++i)
+                out[i] = (unsigned char)(std::lower_bound(e.begin(),e.end(),attribute_type(attributes_from[i][a]))-e.begin());
+        });
+    }
+    size_t attribute_dimension(void) const
+    {
+        return edges.size();
+    }
+    size_t bin_count(size_t a) const
+    {
+        return edges[a].size()+1;
+    }
+    const unsigned char* attribute_bins(size_t a) const
+    {
+        return &bins[a*sample_size];
+    }
+};
+
 }// ml
 
 }// image
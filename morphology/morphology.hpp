@@ -9,6 +9,7 @@
 #include "tipl/utility/pixel_index.hpp"
 #include "tipl/numerical/index_algorithm.hpp"
 #include "tipl/numerical/window.hpp"
+#include "tipl/utility/multi_thread.hpp"
 
 
 namespace tipl
@@ -106,6 +107,99 @@ void dilation2(ImageType& image,int radius)
     dilation(image,neighborhood.index_shift);
 }
 
+/*
+    squared Euclidean distance to the nearest pixel where is_target is true,
+    using the lower envelope of parabolas one dimension at a time
+    (Felzenszwalb & Huttenlocher), so the cost does not depend on distance
+*/
+template<class ImageType,class DistanceImageType,class TargetFunc>
+void distance_transform2(const ImageType& image,DistanceImageType& dt,TargetFunc is_target)
+{
+    const float inf = 1.0e20f;
+    const unsigned int dim = ImageType::dimension;
+    dt.resize(image.geometry());
+    for(size_t index = 0;index < image.size();++index)
+        dt[index] = is_target(image[index]) ? 0.0f : inf;
+    size_t stride = 1;
+    for(unsigned int d = 0;d < dim;++d)
+    {
+        int n = image.geometry()[d];
+        size_t line_count = image.size()/n;
+        int thread_count = available_thread_count();
+        std::vector<std::vector<float> > f(thread_count,std::vector<float>(n)),
+                                         z(thread_count,std::vector<float>(n+1));
+        std::vector<std::vector<int> > v(thread_count,std::vector<int>(n));
+        par_for2(line_count,[&](size_t line,int id)
+        {
+            size_t base = (line/stride)*stride*n+(line%stride);
+            float* f_ = &f[id][0];
+            float* z_ = &z[id][0];
+            int* v_ = &v[id][0];
+            for(int q = 0;q < n;++q)
+                f_[q] = dt[base+q*stride];
+            int k = 0;
+            v_[0] = 0;
+            z_[0] = -inf;
+            z_[1] = inf;
+            for(int q = 1;q < n;++q)
+            {
+                float s;
+                while(1)
+                {
+                    s = float(((double(f_[q])+double(q)*q)-(double(f_[v_[k]])+double(v_[k])*v_[k]))/(2.0*(q-v_[k])));
+                    if(s > z_[k] || k == 0)
+                        break;
+                    --k;
+                }
+                if(s <= z_[k])
+                    k = -1; // the new parabola dominates the whole envelope
+                ++k;
+                v_[k] = q;
+                z_[k] = (k == 0) ? -inf : s;
+                z_[k+1] = inf;
+            }
+            k = 0;
+            for(int q = 0;q < n;++q)
+            {
+                while(z_[k+1] < q)
+                    ++k;
+                float dq = float(q-v_[k]);
+                dt[base+q*stride] = std::min<float>(inf,dq*dq+f_[v_[k]]);
+            }
+        },thread_count);
+        stride *= n;
+    }
+}
+
+/*
+    dilation and erosion with the same ball as dilation2/erosion2
+    (|offset| < radius), computed from the distance transform so that the
+    cost does not grow with the radius
+*/
+template<class ImageType>
+void dilation_ball(ImageType& image,int radius)
+{
+    typedef typename ImageType::value_type value_type;
+    tipl::image<float,ImageType::dimension> dt_image;
+    distance_transform2(image,dt_image,[](value_type v){return v != value_type(0);});
+    float r2 = float(radius)*float(radius);
+    for(size_t index = 0;index < image.size();++index)
+        if(!image[index] && dt_image[index] < r2)
+            image[index] = 1;
+}
+
+template<class ImageType>
+void erosion_ball(ImageType& image,int radius)
+{
+    typedef typename ImageType::value_type value_type;
+    tipl::image<float,ImageType::dimension> dt_image;
+    distance_transform2(image,dt_image,[](value_type v){return v == value_type(0);});
+    float r2 = float(radius)*float(radius);
+    for(size_t index = 0;index < image.size();++index)
+        if(image[index] && dt_image[index] < r2)
+            image[index] = 0;
+}
+
 /*
 template<class ImageType>
 void opening(ImageType& image)
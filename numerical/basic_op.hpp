@@ -4,6 +4,7 @@
 #include "tipl/utility/pixel_index.hpp"
 #include "tipl/utility/basic_image.hpp"
 #include "tipl/utility/multi_thread.hpp"
+#include "tipl/numerical/expression.hpp"
 
 namespace tipl
 {
@@ -340,7 +341,7 @@ void bounding_box_mt(const std::vector<point_type>& points,point_type& max_value
 {
     if(points.empty())
         return;
-    unsigned int thread_count = std::thread::hardware_concurrency();
+    unsigned int thread_count = available_thread_count();
     std::vector<point_type> max_values(thread_count),
                             min_values(thread_count);
     for(int i = 0;i < thread_count;++i)
@@ -356,7 +357,7 @@ void bounding_box_mt(const std::vector<point_type>& points,point_type& max_value
                 max_values[id][d] = points[index][d];
             else if (points[index][d] < min_values[id][d])
                 min_values[id][d] = points[index][d];
-    });
+    },thread_count);
     max_value = max_values[0];
     min_value = min_values[0];
 
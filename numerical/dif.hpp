@@ -1,5 +1,9 @@
 #ifndef DIF_HPP
 #define DIF_HPP
+#include "tipl/utility/basic_image.hpp"
+#include "tipl/utility/vector_image.hpp"
+#include "tipl/utility/multi_thread.hpp"
+#include "tipl/numerical/interpolation.hpp"
 
 namespace tipl
 {
@@ -66,18 +70,13 @@ void compose_displacement_with_jacobian(const ImageType& src,const ComposeImageT
 }
 //---------------------------------------------------------------------------
 template<class ComposeImageType>
+float invert_displacement(const ComposeImageType& v0,ComposeImageType& v1,
+                          unsigned int max_iteration,float tolerance = 0.01f);
+//---------------------------------------------------------------------------
+template<class ComposeImageType>
 void invert_displacement(const ComposeImageType& v0,ComposeImageType& v1)
 {
-    ComposeImageType vv;
-    v1.resize(v0.geometry());
-    for (int index = 0;index < v1.size();++index)
-        v1[index] = -v0[index];
-    for(int i = 0;i < 15;++i)
-    {
-        tipl::compose_displacement(v0,v1,vv);
-        for (int index = 0;index < v1.size();++index)
-            v1[index] = -vv[index];
-    }
+    invert_displacement(v0,v1,15,0.0f);
 }
 //---------------------------------------------------------------------------
 template<class ComposeImageType>
@@ -98,22 +97,18 @@ void invert_mapping(const ComposeImageType& s0,ComposeImageType& s1)
     displacement_to_mapping(s1);
 }
 //---------------------------------------------------------------------------
+// vout(x) = vv(x) + vin(x+vv(x)) in one pass
 template<class ComposeImageType>
 void accumulate_displacement(const ComposeImageType& vin,
                              const ComposeImageType& vv,
-                             ComposeImageType& vout)
-{
-    compose_displacement(vin,vv,vout);
-    vout += vv;
-}
+                             ComposeImageType& vout);
 //---------------------------------------------------------------------------
 template<class ComposeImageType>
 void accumulate_displacement(ComposeImageType& v0,const ComposeImageType& vv)
 {
     ComposeImageType nv;
-    compose_displacement(v0,vv,nv);
-    v0 = nv;
-    v0 += vv;
+    accumulate_displacement(v0,vv,nv);
+    v0.swap(nv);
 }
 //---------------------------------------------------------------------------
 // v = vx compose vy
@@ -288,5 +283,304 @@ void jacobian_determinant_dis(const image<VectorType,2>& src,image<PixelType,2>&
     }
 }
 
+//---------------------------------------------------------------------------
+// structure-of-arrays displacement fields, see tipl/utility/vector_image.hpp
+//---------------------------------------------------------------------------
+template<unsigned int dimension,class value_type>
+void make_identity(vector_image<dimension,value_type>& s)
+{
+    for (tipl::pixel_index<dimension> index(s.geometry()); index < s.size();++index)
+        for(unsigned int d = 0;d < dimension;++d)
+            s.plane(d)[index.index()] = index[d];
+}
+//---------------------------------------------------------------------------
+template<unsigned int dimension,class value_type>
+void displacement_to_mapping(vector_image<dimension,value_type>& s)
+{
+    for (tipl::pixel_index<dimension> index(s.geometry()); index < s.size();++index)
+        for(unsigned int d = 0;d < dimension;++d)
+            s.plane(d)[index.index()] += index[d];
+}
+//---------------------------------------------------------------------------
+template<unsigned int dimension,class value_type>
+void mapping_to_displacement(vector_image<dimension,value_type>& s)
+{
+    for (tipl::pixel_index<dimension> index(s.geometry()); index < s.size();++index)
+        for(unsigned int d = 0;d < dimension;++d)
+            s.plane(d)[index.index()] -= index[d];
+}
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
+// scan-line kernels shared by image<tipl::vector<dim> > and vector_image
+//---------------------------------------------------------------------------
+// visit x+displace(x) one scan line at a time. Lines are distributed over
+// threads and fun(index,location,thread_id) is called for every pixel,
+// with thread_id < thread_count.
+template<class ComposeImageType,class fun_type>
+void displacement_scanline(const ComposeImageType& displace,fun_type fun,
+                           int thread_count = available_thread_count())
+{
+    const unsigned int dimension = ComposeImageType::dimension;
+    const geometry<dimension>& geo = displace.geometry();
+    if(displace.empty())
+        return;
+    int w = geo.width();
+    size_t row_count = geo.size()/w;
+    tipl::par_for2(row_count,[&](size_t row,int id)
+    {
+        tipl::pixel_index<dimension> index(int(row*w),geo);
+        tipl::vector<dimension,float> pos;
+        for(unsigned int d = 1;d < dimension;++d)
+            pos[d] = float(index[d]);
+        for(int x = 0,i = index.index();x < w;++x,++i)
+        {
+            pos[0] = float(x);
+            tipl::vector<dimension,float> location(pos);
+            location += displace[i];
+            fun(i,location,id);
+        }
+    },thread_count);
+}
+//---------------------------------------------------------------------------
+// trilinear sample of a vector field, gives zero and returns false outside the image
+template<class ImageType,class VTorType>
+bool sample_displacement(const ImageType& v,const VTorType& location,
+                         typename ImageType::value_type& result)
+{
+    result = typename ImageType::value_type();
+    return tipl::estimate(v,location,result);
+}
+//---------------------------------------------------------------------------
+// the interpolation weights are computed once and applied to each plane
+template<unsigned int dimension,class value_type,class VTorType>
+bool sample_displacement(const vector_image<dimension,value_type>& v,const VTorType& location,
+                         tipl::vector<dimension,value_type>& result)
+{
+    typedef interpolation<linear_weighting,dimension> interpolation_type;
+    interpolation_type interp;
+    if(!interp.get_location(v.geometry(),location))
+    {
+        result = tipl::vector<dimension,value_type>();
+        return false;
+    }
+    for(unsigned int d = 0;d < dimension;++d)
+    {
+        const value_type* in = v.plane(d);
+        float sum = 0.0f;
+        for(unsigned int k = 0;k < interpolation_type::ref_count;++k)
+            sum += in[interp.dindex[k]]*interp.ratio[k];
+        result[d] = sum;
+    }
+    return true;
+}
+//---------------------------------------------------------------------------
+template<class ImageType,unsigned int dimension,class value_type,class OutImageType>
+void compose_displacement(const ImageType& src,const vector_image<dimension,value_type>& displace,OutImageType& dest)
+{
+    dest.clear();
+    dest.resize(src.geometry());
+    displacement_scanline(displace,[&](int i,const tipl::vector<dimension,float>& location,int)
+    {
+        tipl::estimate(src,location,dest[i]);
+    });
+}
+//---------------------------------------------------------------------------
+template<unsigned int dimension,class value_type>
+void compose_displacement(const vector_image<dimension,value_type>& src,
+                          const vector_image<dimension,value_type>& displace,
+                          vector_image<dimension,value_type>& dest)
+{
+    vector_image<dimension,value_type> result(src.geometry());
+    displacement_scanline(displace,[&](int i,const tipl::vector<dimension,float>& location,int)
+    {
+        tipl::vector<dimension,value_type> v;
+        sample_displacement(src,location,v);
+        for(unsigned int d = 0;d < dimension;++d)
+            result.plane(d)[i] = v[d];
+    });
+    dest.swap(result);
+}
+//---------------------------------------------------------------------------
+template<class ComposeImageType>
+void accumulate_displacement(const ComposeImageType& vin,
+                             const ComposeImageType& vv,
+                             ComposeImageType& vout)
+{
+    ComposeImageType result(vv.geometry());
+    displacement_scanline(vv,[&](int i,const tipl::vector<ComposeImageType::dimension,float>& location,int)
+    {
+        typename ComposeImageType::value_type v;
+        sample_displacement(vin,location,v);
+        v += vv[i];
+        result[i] = v;
+    });
+    vout.swap(result);
+}
+//---------------------------------------------------------------------------
+/*
+ *  Invert a displacement field by the fixed-point iteration
+ *      v1(x) <- -v0(x+v1(x))
+ *  Each iteration is one multithreaded scan-line pass. The residual
+ *  |v1(x)+v0(x+v1(x))| is the change made by the update, so the iteration
+ *  stops as soon as its maximum falls below tolerance (in voxels). Pixels
+ *  mapped outside the image are not counted. Returns the maximum residual
+ *  of the last iteration so that callers can trade accuracy for time.
+ */
+template<class ComposeImageType>
+float invert_displacement(const ComposeImageType& v0,ComposeImageType& v1,
+                          unsigned int max_iteration,float tolerance)
+{
+    typedef typename ComposeImageType::value_type vtor_type;
+    ComposeImageType next(v0.geometry());
+    v1.resize(v0.geometry());
+    for (size_t index = 0;index < v1.size();++index)
+        v1[index] = -vtor_type(v0[index]);
+    float residual = 0.0f;
+    int thread_count = available_thread_count();
+    std::vector<float> thread_residual(thread_count);
+    for(unsigned int iter = 0;iter < max_iteration;++iter)
+    {
+        std::fill(thread_residual.begin(),thread_residual.end(),0.0f);
+        displacement_scanline(v1,[&](int i,const tipl::vector<ComposeImageType::dimension,float>& location,int id)
+        {
+            vtor_type v;
+            bool inside = sample_displacement(v0,location,v);
+            v = -v;
+            next[i] = v;
+            if(!inside)
+                return;
+            v -= vtor_type(v1[i]);
+            float r = v.length2();
+            if(r > thread_residual[id])
+                thread_residual[id] = r;
+        },thread_count);
+        v1.swap(next);
+        residual = std::sqrt(*std::max_element(thread_residual.begin(),thread_residual.end()));
+        if(residual < tolerance)
+            break;
+    }
+    return residual;
+}
+//---------------------------------------------------------------------------
+/*
+ *  Scaling and squaring: displacement = exp(velocity) for a stationary
+ *  velocity field. The field is scaled by 2^-steps and then composed with
+ *  itself steps times. The inverse warp is exp(-velocity), which avoids the
+ *  fixed-point iteration entirely.
+ */
+template<class ComposeImageType>
+void velocity_to_displacement(const ComposeImageType& velocity,ComposeImageType& displacement,
+                              unsigned int steps = 6)
+{
+    ComposeImageType d(velocity.geometry()),next;
+    float scale = 1.0f/float(1 << steps);
+    for (size_t index = 0;index < d.size();++index)
+    {
+        typename ComposeImageType::value_type v(velocity[index]);
+        v *= scale;
+        d[index] = v;
+    }
+    for(unsigned int i = 0;i < steps;++i)
+    {
+        accumulate_displacement(d,d,next);
+        d.swap(next);
+    }
+    displacement.swap(d);
+}
+//---------------------------------------------------------------------------
+template<class ComposeImageType>
+void velocity_to_displacement(const ComposeImageType& velocity,ComposeImageType& displacement,
+                              ComposeImageType& inv_displacement,unsigned int steps = 6)
+{
+    typedef typename ComposeImageType::value_type vtor_type;
+    ComposeImageType neg_velocity(velocity.geometry());
+    for (size_t index = 0;index < velocity.size();++index)
+        neg_velocity[index] = -vtor_type(velocity[index]);
+    velocity_to_displacement(velocity,displacement,steps);
+    velocity_to_displacement(neg_velocity,inv_displacement,steps);
+}
+//---------------------------------------------------------------------------
+template<class value_type,class DetType>
+void jacobian_determinant(const vector_image<3,value_type>& src,DetType& dest)
+{
+    geometry<3> geo(src.geometry());
+    dest.resize(geo);
+    int w = src.width();
+    int h = src.height();
+    int wh = src.plane_size();
+    const value_type* v[3] = {src.plane(0),src.plane(1),src.plane(2)};
+    tipl::par_for(geo.depth(),[&](int z)
+    {
+        for(int y = 0;y < h;++y)
+        {
+            int base = z*wh+y*w;
+            if(z == 0 || y == 0 || z+1 == geo.depth() || y+1 == h)
+            {
+                for(int x = 0;x < w;++x)
+                    dest[base+x] = 1;
+                continue;
+            }
+            dest[base] = 1;
+            dest[base+w-1] = 1;
+            for(int x = 1,i = base+1;x+1 < w;++x,++i)
+            {
+                value_type d1_0 = v[0][i+1]-v[0][i-1];
+                value_type d1_1 = v[1][i+1]-v[1][i-1];
+                value_type d1_2 = v[2][i+1]-v[2][i-1];
+                value_type d2_0 = v[0][i+w]-v[0][i-w];
+                value_type d2_1 = v[1][i+w]-v[1][i-w];
+                value_type d2_2 = v[2][i+w]-v[2][i-w];
+                value_type d3_0 = v[0][i+wh]-v[0][i-wh];
+                value_type d3_1 = v[1][i+wh]-v[1][i-wh];
+                value_type d3_2 = v[2][i+wh]-v[2][i-wh];
+                dest[i] = d1_0*(d2_1*d3_2-d2_2*d3_1)+
+                          d1_1*(d2_2*d3_0-d2_0*d3_2)+
+                          d1_2*(d2_0*d3_1-d2_1*d3_0);
+            }
+        }
+    });
+}
+//---------------------------------------------------------------------------
+template<class value_type,class DetType>
+void jacobian_determinant_dis(const vector_image<3,value_type>& src,DetType& dest)
+{
+    geometry<3> geo(src.geometry());
+    dest.resize(geo);
+    int w = src.width();
+    int h = src.height();
+    int wh = src.plane_size();
+    const value_type* v[3] = {src.plane(0),src.plane(1),src.plane(2)};
+    tipl::par_for(geo.depth(),[&](int z)
+    {
+        for(int y = 0;y < h;++y)
+        {
+            int base = z*wh+y*w;
+            if(z == 0 || y == 0 || z+1 == geo.depth() || y+1 == h)
+            {
+                for(int x = 0;x < w;++x)
+                    dest[base+x] = 1;
+                continue;
+            }
+            dest[base] = 1;
+            dest[base+w-1] = 1;
+            for(int x = 1,i = base+1;x+1 < w;++x,++i)
+            {
+                value_type d1_0 = v[0][i+1]-v[0][i-1]+1.0f;
+                value_type d1_1 = v[1][i+1]-v[1][i-1];
+                value_type d1_2 = v[2][i+1]-v[2][i-1];
+                value_type d2_0 = v[0][i+w]-v[0][i-w];
+                value_type d2_1 = v[1][i+w]-v[1][i-w]+1.0f;
+                value_type d2_2 = v[2][i+w]-v[2][i-w];
+                value_type d3_0 = v[0][i+wh]-v[0][i-wh];
+                value_type d3_1 = v[1][i+wh]-v[1][i-wh];
+                value_type d3_2 = v[2][i+wh]-v[2][i-wh]+1.0f;
+                dest[i] = d1_0*(d2_1*d3_2-d2_2*d3_1)+
+                          d1_1*(d2_2*d3_0-d2_0*d3_2)+
+                          d1_2*(d2_0*d3_1-d2_1*d3_0);
+            }
+        }
+    });
+}
+
 }
 #endif // DIF_HPP
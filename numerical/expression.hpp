@@ -0,0 +1,355 @@
+//---------------------------------------------------------------------------
+#ifndef EXPRESSION_HPP
+#define EXPRESSION_HPP
+#include <type_traits>
+#include <utility>
+#include <cmath>
+#include <stdexcept>
+#include "tipl/utility/basic_image.hpp"
+#include "tipl/utility/multi_thread.hpp"
+
+/*
+ *  Lazy element-wise image arithmetic
+ *
+ *  tipl::image<float,3> a,b,c,d;
+ *  tipl::image<tipl::vector<3>,3> v,w;
+ *  d = a*0.5f + b*c;               // one pass over a,b,c,d
+ *  w = v*0.5f + w*a;               // vector pixels are supported
+ *  d += tipl::expr::square(a-b);
+ *
+ *  The right-hand side only builds a small tree of delegates. The loop runs
+ *  at the assignment, split into blocks over all threads and written as a
+ *  plain indexed loop on raw pointers so that the compiler can vectorize it.
+ */
+
+namespace tipl
+{
+
+namespace expr
+{
+
+// number of pixels handled by one thread-block at the assignment
+const size_t block_size = 16384;
+
+template<class pixel_type,unsigned int dim>
+struct image_node{
+    typedef pixel_type value_type;
+    typedef tipl::geometry<dim> geometry_type;
+    static const unsigned int dimension = dim;
+    static const bool is_scalar = false;
+    const pixel_type* ptr;
+    geometry_type geo;
+    size_t size_;
+    template<class storage_type>
+    image_node(const image<pixel_type,dim,storage_type>& I):
+        ptr(I.empty() ? 0 : &*I.begin()),geo(I.geometry()),size_(I.size()){}
+    const value_type& operator[](size_t index) const{return ptr[index];}
+    const geometry_type& geometry(void) const{return geo;}
+    size_t size(void) const{return size_;}
+};
+
+template<class value_type_>
+struct scalar_node{
+    typedef value_type_ value_type;
+    static const bool is_scalar = true;
+    value_type value;
+    scalar_node(value_type value_):value(value_){}
+    value_type operator[](size_t) const{return value;}
+};
+
+// pick the operand that carries the geometry
+template<class lhs_type,class rhs_type,bool lhs_is_scalar = lhs_type::is_scalar>
+struct select_operand{
+    typedef lhs_type type;
+    static const type& get(const lhs_type& lhs,const rhs_type&){return lhs;}
+};
+template<class lhs_type,class rhs_type>
+struct select_operand<lhs_type,rhs_type,true>{
+    typedef rhs_type type;
+    static const type& get(const lhs_type&,const rhs_type& rhs){return rhs;}
+};
+
+// image operands must have the same size
+template<class lhs_type,class rhs_type,bool check = !lhs_type::is_scalar && !rhs_type::is_scalar>
+struct check_operand{
+    static void run(const lhs_type& lhs,const rhs_type& rhs)
+    {
+        if(lhs.size() != rhs.size())
+            throw std::runtime_error("Inconsistent image size");
+    }
+};
+template<class lhs_type,class rhs_type>
+struct check_operand<lhs_type,rhs_type,false>{
+    static void run(const lhs_type&,const rhs_type&){}
+};
+
+template<class lhs_type,class rhs_type,class op_type>
+struct binary_node{
+    typedef select_operand<lhs_type,rhs_type> select_type;
+    typedef typename select_type::type::geometry_type geometry_type;
+    typedef typename std::decay<decltype(op_type()(std::declval<typename lhs_type::value_type>(),
+                                                   std::declval<typename rhs_type::value_type>()))>::type value_type;
+    static const unsigned int dimension = select_type::type::dimension;
+    static const bool is_scalar = false;
+    lhs_type lhs;
+    rhs_type rhs;
+    binary_node(const lhs_type& lhs_,const rhs_type& rhs_):lhs(lhs_),rhs(rhs_)
+    {
+        check_operand<lhs_type,rhs_type>::run(lhs,rhs);
+    }
+    value_type operator[](size_t index) const{return op_type()(lhs[index],rhs[index]);}
+    const geometry_type& geometry(void) const{return select_type::get(lhs,rhs).geometry();}
+    size_t size(void) const{return select_type::get(lhs,rhs).size();}
+};
+
+template<class node_type,class op_type>
+struct unary_node{
+    typedef typename node_type::geometry_type geometry_type;
+    typedef typename std::decay<decltype(op_type()(std::declval<typename node_type::value_type>()))>::type value_type;
+    static const unsigned int dimension = node_type::dimension;
+    static const bool is_scalar = false;
+    node_type node;
+    unary_node(const node_type& node_):node(node_){}
+    value_type operator[](size_t index) const{return op_type()(node[index]);}
+    const geometry_type& geometry(void) const{return node.geometry();}
+    size_t size(void) const{return node.size();}
+};
+
+struct plus{
+    template<class lhs_type,class rhs_type>
+    auto operator()(const lhs_type& lhs,const rhs_type& rhs) const -> decltype(lhs+rhs){return lhs+rhs;}
+};
+struct minus{
+    template<class lhs_type,class rhs_type>
+    auto operator()(const lhs_type& lhs,const rhs_type& rhs) const -> decltype(lhs-rhs){return lhs-rhs;}
+};
+// tipl::vector only defines vector*scalar, so scalar*vector is evaluated in the reverse order
+template<class lhs_type,class rhs_type,
+         bool reverse = std::is_arithmetic<lhs_type>::value && !std::is_arithmetic<rhs_type>::value>
+struct multiplies_order{
+    static auto get(const lhs_type& lhs,const rhs_type& rhs) -> decltype(lhs*rhs){return lhs*rhs;}
+};
+template<class lhs_type,class rhs_type>
+struct multiplies_order<lhs_type,rhs_type,true>{
+    static auto get(const lhs_type& lhs,const rhs_type& rhs) -> decltype(rhs*lhs){return rhs*lhs;}
+};
+struct multiplies{
+    template<class lhs_type,class rhs_type>
+    auto operator()(const lhs_type& lhs,const rhs_type& rhs) const
+    -> decltype(multiplies_order<lhs_type,rhs_type>::get(lhs,rhs))
+    {
+        return multiplies_order<lhs_type,rhs_type>::get(lhs,rhs);
+    }
+};
+struct divides{
+    template<class lhs_type,class rhs_type>
+    auto operator()(const lhs_type& lhs,const rhs_type& rhs) const -> decltype(lhs/rhs){return lhs/rhs;}
+};
+struct negate{
+    template<class value_type>
+    auto operator()(const value_type& v) const -> decltype(-v){return -v;}
+};
+struct square_op{
+    template<class value_type>
+    value_type operator()(const value_type& v) const{return v*v;}
+};
+struct sqrt_op{
+    template<class value_type>
+    value_type operator()(const value_type& v) const{return std::sqrt(v);}
+};
+struct log_op{
+    template<class value_type>
+    value_type operator()(const value_type& v) const{return std::log(v);}
+};
+struct exp_op{
+    template<class value_type>
+    value_type operator()(const value_type& v) const{return std::exp(v);}
+};
+struct abs_op{
+    template<class value_type>
+    value_type operator()(const value_type& v) const{return std::abs(v);}
+};
+
+template<class pixel_type,unsigned int dim,class storage_type>
+std::true_type is_image_test(const image<pixel_type,dim,storage_type>*);
+template<class node_type>
+std::true_type is_image_test(const image_expr<node_type>*);
+std::false_type is_image_test(...);
+
+template<class T>
+struct is_operand : decltype(is_image_test(static_cast<const T*>(0))){};
+
+template<class lhs_type,class rhs_type>
+struct is_operand_pair{
+    static const bool value = (is_operand<lhs_type>::value && (is_operand<rhs_type>::value || std::is_arithmetic<rhs_type>::value)) ||
+                              (std::is_arithmetic<lhs_type>::value && is_operand<rhs_type>::value);
+};
+
+template<class pixel_type,unsigned int dim,class storage_type>
+image_node<pixel_type,dim> make_node(const image<pixel_type,dim,storage_type>& I)
+{
+    return image_node<pixel_type,dim>(I);
+}
+template<class node_type>
+const node_type& make_node(const image_expr<node_type>& e)
+{
+    return e.node;
+}
+template<class value_type>
+typename std::enable_if<std::is_arithmetic<value_type>::value,scalar_node<value_type> >::type
+    make_node(value_type value)
+{
+    return scalar_node<value_type>(value);
+}
+
+template<class T>
+struct node_of{
+    typedef typename std::decay<decltype(make_node(std::declval<const T&>()))>::type type;
+};
+
+// only defines type for operands that form an image expression so that the
+// operators below drop out of overload resolution for everything else
+template<class lhs_type,class rhs_type,class op_type,
+         bool valid = is_operand_pair<lhs_type,rhs_type>::value>
+struct binary_result{};
+template<class lhs_type,class rhs_type,class op_type>
+struct binary_result<lhs_type,rhs_type,op_type,true>{
+    typedef image_expr<binary_node<typename node_of<lhs_type>::type,
+                                   typename node_of<rhs_type>::type,op_type> > type;
+};
+template<class T,class op_type,bool valid = is_operand<T>::value>
+struct unary_result{};
+template<class T,class op_type>
+struct unary_result<T,op_type,true>{
+    typedef image_expr<unary_node<typename node_of<T>::type,op_type> > type;
+};
+
+template<class op_type,class lhs_type,class rhs_type>
+typename binary_result<lhs_type,rhs_type,op_type>::type make_binary(const lhs_type& lhs,const rhs_type& rhs)
+{
+    typedef typename binary_result<lhs_type,rhs_type,op_type>::type result_type;
+    return result_type(typename result_type::node_type(make_node(lhs),make_node(rhs)));
+}
+
+template<class op_type,class T>
+typename unary_result<T,op_type>::type make_unary(const T& v)
+{
+    typedef typename unary_result<T,op_type>::type result_type;
+    return result_type(typename result_type::node_type(make_node(v)));
+}
+
+template<class T>
+typename unary_result<T,square_op>::type square(const T& v){return make_unary<square_op>(v);}
+template<class T>
+typename unary_result<T,sqrt_op>::type sqrt(const T& v){return make_unary<sqrt_op>(v);}
+template<class T>
+typename unary_result<T,log_op>::type log(const T& v){return make_unary<log_op>(v);}
+template<class T>
+typename unary_result<T,exp_op>::type exp(const T& v){return make_unary<exp_op>(v);}
+template<class T>
+typename unary_result<T,abs_op>::type abs(const T& v){return make_unary<abs_op>(v);}
+
+struct assign{
+    template<class out_type,class value_type>
+    void operator()(out_type& out,const value_type& v) const{out = out_type(v);}
+};
+struct plus_assign{
+    template<class out_type,class value_type>
+    void operator()(out_type& out,const value_type& v) const{out += v;}
+};
+struct minus_assign{
+    template<class out_type,class value_type>
+    void operator()(out_type& out,const value_type& v) const{out -= v;}
+};
+struct multiplies_assign{
+    template<class out_type,class value_type>
+    void operator()(out_type& out,const value_type& v) const{out *= v;}
+};
+struct divides_assign{
+    template<class out_type,class value_type>
+    void operator()(out_type& out,const value_type& v) const{out /= v;}
+};
+
+}//namespace expr
+
+
+template<class node_type_>
+class image_expr{
+public:
+    typedef node_type_ node_type;
+    typedef typename node_type::value_type value_type;
+    typedef typename node_type::geometry_type geometry_type;
+    static const unsigned int dimension = node_type::dimension;
+    typedef expr::assign assign_type;
+    typedef expr::plus_assign plus_assign_type;
+    typedef expr::minus_assign minus_assign_type;
+    typedef expr::multiplies_assign multiplies_assign_type;
+    typedef expr::divides_assign divides_assign_type;
+public:
+    node_type node;
+public:
+    image_expr(const node_type& node_):node(node_){}
+    value_type operator[](size_t index) const{return node[index];}
+    const geometry_type& geometry(void) const{return node.geometry();}
+    size_t size(void) const{return node.size();}
+public:
+    // out[i] = op(out[i],node[i]) for all pixels, fused in one multithreaded loop
+    template<class out_type,class op_type>
+    void apply(out_type* out,op_type op) const
+    {
+        const node_type& n = node;
+        size_t total_size = n.size();
+        if(total_size < expr::block_size*2)
+        {
+            for(size_t i = 0;i < total_size;++i)
+                op(out[i],n[i]);
+            return;
+        }
+        size_t block_count = (total_size+expr::block_size-1)/expr::block_size;
+        tipl::par_for(block_count,[&](size_t block)
+        {
+            size_t from = block*expr::block_size;
+            size_t to = std::min<size_t>(total_size,from+expr::block_size);
+            for(size_t i = from;i < to;++i)
+                op(out[i],n[i]);
+        });
+    }
+};
+
+template<class lhs_type,class rhs_type>
+typename expr::binary_result<lhs_type,rhs_type,expr::plus>::type
+    operator+(const lhs_type& lhs,const rhs_type& rhs)
+{
+    return expr::make_binary<expr::plus>(lhs,rhs);
+}
+
+template<class lhs_type,class rhs_type>
+typename expr::binary_result<lhs_type,rhs_type,expr::minus>::type
+    operator-(const lhs_type& lhs,const rhs_type& rhs)
+{
+    return expr::make_binary<expr::minus>(lhs,rhs);
+}
+
+template<class lhs_type,class rhs_type>
+typename expr::binary_result<lhs_type,rhs_type,expr::multiplies>::type
+    operator*(const lhs_type& lhs,const rhs_type& rhs)
+{
+    return expr::make_binary<expr::multiplies>(lhs,rhs);
+}
+
+template<class lhs_type,class rhs_type>
+typename expr::binary_result<lhs_type,rhs_type,expr::divides>::type
+    operator/(const lhs_type& lhs,const rhs_type& rhs)
+{
+    return expr::make_binary<expr::divides>(lhs,rhs);
+}
+
+template<class T>
+typename expr::unary_result<T,expr::negate>::type
+    operator-(const T& v)
+{
+    return expr::make_unary<expr::negate>(v);
+}
+
+}
+#endif//EXPRESSION_HPP
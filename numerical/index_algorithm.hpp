@@ -426,5 +426,41 @@ public:
 
 
 
+/**
+    face-connected neighbors of a linear index, visited in the same order as
+    get_connected_neighbors but without building pixel_index objects
+*/
+template<int dim>
+class connected_neighbor_index
+{
+    size_t shift[dim];
+    size_t length[dim];
+public:
+    connected_neighbor_index(const geometry<dim>& geo)
+    {
+        size_t s = 1;
+        for(int d = 0;d < dim;++d)
+        {
+            shift[d] = s;
+            length[d] = geo[d];
+            s *= geo[d];
+        }
+    }
+    template<class fun_type>
+    void operator()(size_t index,fun_type&& fun) const
+    {
+        size_t rest = index;
+        for(int d = 0;d < dim;++d)
+        {
+            size_t coordinate = rest % length[d];
+            rest /= length[d];
+            if(coordinate >= 1)
+                fun(index-shift[d]);
+            if(coordinate+1 < length[d])
+                fun(index+shift[d]);
+        }
+    }
+};
+
 }
 #endif
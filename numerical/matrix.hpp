@@ -34,6 +34,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <limits>
 #include <algorithm>
 #include <vector>
+#include <type_traits>
+#include "tipl/utility/multi_thread.hpp"
 
 namespace tipl
 {
@@ -365,7 +367,519 @@ void gen(left_input_iterator x,left_input_iterator x_end,right_input_iterator y,
 namespace mat
 {
 
+/*
+    Cache-blocked kernels behind product, product_transpose, square and the
+    LU/Cholesky/QR decompositions. They are used when the operands are
+    contiguous float/double storage and the problem is large enough to pay
+    for threading; the inner loops are unit-stride axpy loops so that the
+    compiler vectorizes them.
+*/
+namespace blocked
+{
+
+const unsigned int row_block = 64;
+const unsigned int col_block = 256;
+const unsigned int depth_block = 128;
+const unsigned int panel_width = 48;
+const size_t min_product_size = size_t(1) << 20;
+const unsigned int min_decomposition_size = 128;
+
+template<class iterator_type,class value_type = typename std::iterator_traits<iterator_type>::value_type>
+struct contiguous : std::integral_constant<bool,
+            (std::is_same<value_type,float>::value || std::is_same<value_type,double>::value) &&
+            (std::is_pointer<iterator_type>::value ||
+             std::is_same<iterator_type,typename std::vector<value_type>::iterator>::value ||
+             std::is_same<iterator_type,typename std::vector<value_type>::const_iterator>::value)>{};
+
+template<class lhs_type,class rhs_type,class out_type>
+struct contiguous3{
+    static const bool value = contiguous<lhs_type>::value && contiguous<rhs_type>::value && contiguous<out_type>::value &&
+            std::is_same<typename std::iterator_traits<lhs_type>::value_type,typename std::iterator_traits<rhs_type>::value_type>::value &&
+            std::is_same<typename std::iterator_traits<lhs_type>::value_type,typename std::iterator_traits<out_type>::value_type>::value;
+};
+
+/*
+    C[i0:i1,j0:j1] += alpha*A[i0:i1,:]*B[:,j0:j1], four rows of C at a time
+*/
+template<class value_type>
+void gemm_block(const value_type* A,const value_type* B,value_type* C,
+                unsigned int i0,unsigned int i1,unsigned int j0,unsigned int j1,unsigned int k,
+                unsigned int lda,unsigned int ldb,unsigned int ldc,value_type alpha)
+{
+    unsigned int width = j1-j0;
+    for(unsigned int p0 = 0;p0 < k;p0 += depth_block)
+    {
+        unsigned int p1 = std::min<unsigned int>(p0+depth_block,k);
+        unsigned int i = i0;
+        for(;i+4 <= i1;i += 4)
+        {
+            value_type* c0 = C+size_t(i)*ldc+j0;
+            value_type* c1 = c0+ldc;
+            value_type* c2 = c1+ldc;
+            value_type* c3 = c2+ldc;
+            const value_type* a0 = A+size_t(i)*lda;
+            const value_type* a1 = a0+lda;
+            const value_type* a2 = a1+lda;
+            const value_type* a3 = a2+lda;
+            for(unsigned int p = p0;p < p1;++p)
+            {
+                value_type a0p = alpha*a0[p],a1p = alpha*a1[p],a2p = alpha*a2[p],a3p = alpha*a3[p];
+                const value_type* b = B+size_t(p)*ldb+j0;
+                for(unsigned int j = 0;j < width;++j)
+                {
+                    value_type bj = b[j];
+                    c0[j] += a0p*bj;
+                    c1[j] += a1p*bj;
+                    c2[j] += a2p*bj;
+                    c3[j] += a3p*bj;
+                }
+            }
+        }
+        for(;i < i1;++i)
+        {
+            value_type* c = C+size_t(i)*ldc+j0;
+            const value_type* a = A+size_t(i)*lda;
+            for(unsigned int p = p0;p < p1;++p)
+            {
+                value_type ap = alpha*a[p];
+                const value_type* b = B+size_t(p)*ldb+j0;
+                for(unsigned int j = 0;j < width;++j)
+                    c[j] += ap*b[j];
+            }
+        }
+    }
+}
+
+/*
+    C = alpha*A*B (+ C if accumulate), A:m-by-k B:k-by-n C:m-by-n
+*/
+template<class value_type>
+void gemm(const value_type* A,const value_type* B,value_type* C,
+          unsigned int m,unsigned int n,unsigned int k,
+          unsigned int lda,unsigned int ldb,unsigned int ldc,
+          bool accumulate = false,value_type alpha = value_type(1),
+          int thread_count = available_thread_count())
+{
+    if(!accumulate)
+        for(unsigned int i = 0;i < m;++i)
+            std::fill(C+size_t(i)*ldc,C+size_t(i)*ldc+n,value_type(0));
+    unsigned int row_blocks = (m+row_block-1)/row_block;
+    unsigned int col_blocks = (n+col_block-1)/col_block;
+    par_for(row_blocks*col_blocks,[&](unsigned int b)
+    {
+        unsigned int i0 = (b/col_blocks)*row_block;
+        unsigned int j0 = (b%col_blocks)*col_block;
+        gemm_block(A,B,C,i0,std::min<unsigned int>(i0+row_block,m),
+                         j0,std::min<unsigned int>(j0+col_block,n),k,lda,ldb,ldc,alpha);
+    },thread_count);
+}
+
+// out = transpose of in (m-by-n)
+template<class value_type>
+void transpose(const value_type* in,value_type* out,unsigned int m,unsigned int n,
+               int thread_count = available_thread_count())
+{
+    par_for((n+row_block-1)/row_block,[&](unsigned int b)
+    {
+        unsigned int j1 = std::min<unsigned int>(b*row_block+row_block,n);
+        for(unsigned int i0 = 0;i0 < m;i0 += row_block)
+        {
+            unsigned int i1 = std::min<unsigned int>(i0+row_block,m);
+            for(unsigned int j = b*row_block;j < j1;++j)
+                for(unsigned int i = i0;i < i1;++i)
+                    out[size_t(j)*m+i] = in[size_t(i)*n+j];
+        }
+    },thread_count);
+}
+
+template<class lhs_type,class rhs_type,class out_type>
+typename std::enable_if<contiguous3<lhs_type,rhs_type,out_type>::value,bool>::type
+product(lhs_type lhs,rhs_type rhs,out_type out,unsigned int m,unsigned int k,unsigned int n)
+{
+    if(size_t(m)*size_t(n)*size_t(k) < min_product_size)
+        return false;
+    gemm(&*lhs,&*rhs,&*out,m,n,k,k,n,n);
+    return true;
+}
+
+template<class lhs_type,class rhs_type,class out_type>
+typename std::enable_if<!contiguous3<lhs_type,rhs_type,out_type>::value,bool>::type
+product(lhs_type,rhs_type,out_type,unsigned int,unsigned int,unsigned int)
+{
+    return false;
+}
+
+// out = lhs*rhs', lhs:m-by-k rhs:n-by-k
+template<class lhs_type,class rhs_type,class out_type>
+typename std::enable_if<contiguous3<lhs_type,rhs_type,out_type>::value,bool>::type
+product_transpose(lhs_type lhs,rhs_type rhs,out_type out,unsigned int m,unsigned int k,unsigned int n)
+{
+    typedef typename std::iterator_traits<out_type>::value_type value_type;
+    if(size_t(m)*size_t(n)*size_t(k) < min_product_size)
+        return false;
+    std::vector<value_type> rhs_t(size_t(k)*n);
+    transpose(&*rhs,&rhs_t[0],n,k);
+    gemm(&*lhs,&rhs_t[0],&*out,m,n,k,k,n,n);
+    return true;
+}
+
+template<class lhs_type,class rhs_type,class out_type>
+typename std::enable_if<!contiguous3<lhs_type,rhs_type,out_type>::value,bool>::type
+product_transpose(lhs_type,rhs_type,out_type,unsigned int,unsigned int,unsigned int)
+{
+    return false;
+}
+
+// out = A*A', A:m-by-k, only the upper blocks are computed
+template<class input_type,class out_type>
+typename std::enable_if<contiguous3<input_type,input_type,out_type>::value,bool>::type
+square(input_type lhs,out_type out,unsigned int m,unsigned int k)
+{
+    typedef typename std::iterator_traits<out_type>::value_type value_type;
+    if(size_t(m)*size_t(m)*size_t(k) < min_product_size)
+        return false;
+    std::vector<value_type> lhs_t(size_t(k)*m);
+    transpose(&*lhs,&lhs_t[0],m,k);
+    value_type* C = &*out;
+    std::fill(C,C+size_t(m)*m,value_type(0));
+    unsigned int row_blocks = (m+row_block-1)/row_block;
+    unsigned int col_blocks = (m+col_block-1)/col_block;
+    par_for(row_blocks*col_blocks,[&](unsigned int b)
+    {
+        unsigned int i0 = (b/col_blocks)*row_block;
+        unsigned int j0 = (b%col_blocks)*col_block;
+        unsigned int j1 = std::min<unsigned int>(j0+col_block,m);
+        if(j1 <= i0)
+            return;
+        gemm_block(&*lhs,&lhs_t[0],C,i0,std::min<unsigned int>(i0+row_block,m),j0,j1,k,k,m,m,value_type(1));
+    });
+    par_for(m,[&](unsigned int i)
+    {
+        for(unsigned int j = 0;j < i;++j)
+            C[size_t(i)*m+j] = C[size_t(j)*m+i];
+    });
+    return true;
+}
+
+template<class input_type,class out_type>
+typename std::enable_if<!contiguous3<input_type,input_type,out_type>::value,bool>::type
+square(input_type,out_type,unsigned int,unsigned int)
+{
+    return false;
+}
+
+/*
+    right-looking LU with partial pivoting. Rows are swapped in full as in the
+    unblocked version, so A and pivot come out in the same layout.
+*/
+template<class value_type,class pivot_iterator>
+bool lu(value_type* A,pivot_iterator pivot,unsigned int n)
+{
+    for(unsigned int k = 0;k < n;++k)
+        pivot[k] = k;
+    for(unsigned int k0 = 0;k0 < n;k0 += panel_width)
+    {
+        unsigned int k1 = std::min<unsigned int>(k0+panel_width,n);
+        // factorize the panel A[k0:n,k0:k1]
+        for(unsigned int k = k0;k < k1;++k)
+        {
+            value_type max_value(0);
+            unsigned int max_row = k;
+            for(unsigned int i = k;i < n;++i)
+            {
+                value_type value = std::abs(A[size_t(i)*n+k]);
+                if(value > max_value)
+                {
+                    max_value = value;
+                    max_row = i;
+                }
+            }
+            if(max_value == 0)
+                return false; // singularity
+            value_type* row_k = A+size_t(k)*n;
+            if(max_row != k)
+            {
+                std::swap_ranges(row_k,row_k+n,A+size_t(max_row)*n);
+                std::swap(pivot[k],pivot[max_row]);
+            }
+            value_type bjj = row_k[k];
+            for(unsigned int i = k+1;i < n;++i)
+            {
+                value_type* row_i = A+size_t(i)*n;
+                value_type t = row_i[k] /= bjj;
+                for(unsigned int j = k+1;j < k1;++j)
+                    row_i[j] -= t*row_k[j];
+            }
+        }
+        if(k1 == n)
+            break;
+        // U12 = inv(L11)*A12
+        unsigned int chunks = (n-k1+col_block-1)/col_block;
+        par_for(chunks,[&](unsigned int b)
+        {
+            unsigned int j0 = k1+b*col_block;
+            unsigned int j1 = std::min<unsigned int>(j0+col_block,n);
+            for(unsigned int i = k0+1;i < k1;++i)
+            {
+                value_type* row_i = A+size_t(i)*n;
+                for(unsigned int p = k0;p < i;++p)
+                {
+                    value_type t = row_i[p];
+                    const value_type* row_p = A+size_t(p)*n;
+                    for(unsigned int j = j0;j < j1;++j)
+                        row_i[j] -= t*row_p[j];
+                }
+            }
+        });
+        // A22 -= L21*U12
+        gemm(A+size_t(k1)*n+k0,A+size_t(k0)*n+k1,A+size_t(k1)*n+k1,
+             n-k1,n-k1,k1-k0,n,n,n,true,value_type(-1));
+    }
+    return true;
+}
+
+/*
+    right-looking Cholesky working on the lower triangle. The upper triangle
+    and the diagonal of A are left untouched as in the unblocked version.
+*/
+template<class value_type,class pivot_iterator>
+bool ll(value_type* A,pivot_iterator p,unsigned int n)
+{
+    std::vector<value_type> diag(n),buf;
+    for(unsigned int i = 0;i < n;++i)
+    {
+        diag[i] = A[size_t(i)*n+i];
+        for(unsigned int j = i+1;j < n;++j)
+            A[size_t(j)*n+i] = A[size_t(i)*n+j];
+    }
+    bool result = true;
+    for(unsigned int k0 = 0;k0 < n && result;k0 += panel_width)
+    {
+        unsigned int k1 = std::min<unsigned int>(k0+panel_width,n);
+        // L11
+        for(unsigned int i = k0;i < k1 && result;++i)
+        {
+            const value_type* row_i = A+size_t(i)*n;
+            for(unsigned int j = i;j < k1;++j)
+            {
+                value_type* row_j = A+size_t(j)*n;
+                value_type sum = row_j[i];
+                for(unsigned int q = k0;q < i;++q)
+                    sum -= row_i[q]*row_j[q];
+                if(i == j)
+                {
+                    if(sum <= 0.0)
+                    {
+                        result = false;
+                        break;
+                    }
+                    p[i] = std::sqrt(sum);
+                }
+                else
+                    row_j[i] = sum/p[i];
+            }
+        }
+        if(!result || k1 == n)
+            break;
+        unsigned int rest = n-k1;
+        // L21 = A21*inv(L11')
+        par_for(rest,[&](unsigned int r)
+        {
+            value_type* row_j = A+size_t(k1+r)*n;
+            for(unsigned int i = k0;i < k1;++i)
+            {
+                const value_type* row_i = A+size_t(i)*n;
+                value_type sum = row_j[i];
+                for(unsigned int q = k0;q < i;++q)
+                    sum -= row_j[q]*row_i[q];
+                row_j[i] = sum/p[i];
+            }
+        });
+        // A22 -= L21*L21' on the lower triangle
+        buf.resize(size_t(k1-k0)*rest);
+        for(unsigned int r = 0;r < rest;++r)
+            for(unsigned int q = k0;q < k1;++q)
+                buf[size_t(q-k0)*rest+r] = A[size_t(k1+r)*n+q];
+        par_for(rest,[&](unsigned int r)
+        {
+            value_type* row_j = A+size_t(k1+r)*n;
+            value_type* out = row_j+k1;
+            unsigned int q = k0;
+            for(;q+2 <= k1;q += 2)
+            {
+                value_type a0 = row_j[q],a1 = row_j[q+1];
+                const value_type* b0 = &buf[size_t(q-k0)*rest];
+                const value_type* b1 = b0+rest;
+                for(unsigned int c = 0;c <= r;++c)
+                    out[c] -= a0*b0[c]+a1*b1[c];
+            }
+            for(;q < k1;++q)
+            {
+                value_type a = row_j[q];
+                const value_type* b = &buf[size_t(q-k0)*rest];
+                for(unsigned int c = 0;c <= r;++c)
+                    out[c] -= a*b[c];
+            }
+        });
+    }
+    for(unsigned int i = 0;i < n;++i)
+        A[size_t(i)*n+i] = diag[i];
+    return result;
+}
+
+/*
+    blocked Householder QR using the compact WY form: each panel is reduced
+    column by column, and its reflectors H = I-v*v'/c are then applied to the
+    trailing columns as A2 -= V*T'*(V'*A2).
+*/
+template<class value_type,class output_iterator1,class output_iterator2>
+bool qr(value_type* A,output_iterator1 c,output_iterator2 d,unsigned int m,unsigned int n)
+{
+    bool singular = false;
+    unsigned int min_mn = std::min<unsigned int>(m,n);
+    std::vector<value_type> w,T,W,W2;
+    for(unsigned int k0 = 0;k0 < min_mn;k0 += panel_width)
+    {
+        unsigned int k1 = std::min<unsigned int>(k0+panel_width,min_mn);
+        unsigned int nb = k1-k0;
+        // panel A[k0:m,k0:k1]
+        for(unsigned int k = k0;k < k1;++k)
+        {
+            value_type scale(0);
+            for(unsigned int i = k;i < m;++i)
+                scale = std::max<value_type>(scale,std::abs(A[size_t(i)*n+k]));
+            if(scale == 0.0)
+            {
+                c[k] = d[k] = 0.0;
+                singular = true;
+                continue;
+            }
+            value_type sum(0);
+            for(unsigned int i = k;i < m;++i)
+            {
+                value_type t = (A[size_t(i)*n+k] /= scale);
+                sum += t*t;
+            }
+            value_type* row_k = A+size_t(k)*n;
+            value_type sigma = (row_k[k] >= 0) ? std::sqrt(sum):-std::sqrt(sum);
+            row_k[k] += sigma;
+            c[k] = sigma*row_k[k];
+            d[k] = -scale*sigma;
+            if(k+1 == k1)
+                continue;
+            w.assign(k1-k-1,value_type(0));
+            for(unsigned int i = k;i < m;++i)
+            {
+                const value_type* row_i = A+size_t(i)*n;
+                value_type v = row_i[k];
+                for(unsigned int j = k+1;j < k1;++j)
+                    w[j-k-1] += v*row_i[j];
+            }
+            value_type tau = value_type(1)/c[k];
+            for(unsigned int j = 0;j < w.size();++j)
+                w[j] *= tau;
+            for(unsigned int i = k;i < m;++i)
+            {
+                value_type* row_i = A+size_t(i)*n;
+                value_type v = row_i[k];
+                for(unsigned int j = k+1;j < k1;++j)
+                    row_i[j] -= v*w[j-k-1];
+            }
+        }
+        if(k1 == n)
+            break;
+        // T: H(k0)...H(k1-1) = I-V*T*V'
+        T.assign(size_t(nb)*nb,value_type(0));
+        for(unsigned int q = 0;q < nb;++q)
+        {
+            unsigned int k = k0+q;
+            value_type tau = (c[k] == 0.0) ? value_type(0) : value_type(1)/c[k];
+            T[q*nb+q] = tau;
+            if(tau == 0.0)
+                continue;
+            // z = V(:,0:q)'*v_q
+            w.assign(q,value_type(0));
+            for(unsigned int i = k;i < m;++i)
+            {
+                const value_type* row_i = A+size_t(i)*n+k0;
+                value_type v = row_i[q];
+                for(unsigned int r = 0;r < q;++r)
+                    w[r] += row_i[r]*v;
+            }
+            for(unsigned int r = 0;r < q;++r)
+            {
+                value_type sum(0);
+                for(unsigned int s = r;s < q;++s)
+                    sum += T[r*nb+s]*w[s];
+                T[r*nb+q] = -tau*sum;
+            }
+        }
+        unsigned int rest = n-k1;
+        unsigned int chunks = (rest+col_block-1)/col_block;
+        // W = T'*V'*A2
+        W.assign(size_t(nb)*rest,value_type(0));
+        W2.assign(size_t(nb)*rest,value_type(0));
+        par_for(chunks,[&](unsigned int b)
+        {
+            unsigned int j0 = b*col_block;
+            unsigned int j1 = std::min<unsigned int>(j0+col_block,rest);
+            for(unsigned int i = k0;i < m;++i)
+            {
+                const value_type* v = A+size_t(i)*n+k0;
+                const value_type* a = A+size_t(i)*n+k1;
+                for(unsigned int q = 0;q < nb && k0+q <= i;++q)
+                {
+                    value_type vq = v[q];
+                    value_type* out = &W[size_t(q)*rest];
+                    for(unsigned int j = j0;j < j1;++j)
+                        out[j] += vq*a[j];
+                }
+            }
+            for(unsigned int q = 0;q < nb;++q)
+            {
+                value_type* out = &W2[size_t(q)*rest];
+                for(unsigned int r = 0;r <= q;++r)
+                {
+                    value_type t = T[r*nb+q];
+                    const value_type* in = &W[size_t(r)*rest];
+                    for(unsigned int j = j0;j < j1;++j)
+                        out[j] += t*in[j];
+                }
+            }
+        });
+        // A2 -= V*W
+        par_for(m-k0,[&](unsigned int r)
+        {
+            unsigned int i = k0+r;
+            const value_type* v = A+size_t(i)*n+k0;
+            value_type* a = A+size_t(i)*n+k1;
+            for(unsigned int q = 0;q < nb && k0+q <= i;++q)
+            {
+                value_type vq = v[q];
+                const value_type* in = &W2[size_t(q)*rest];
+                for(unsigned int j = 0;j < rest;++j)
+                    a[j] -= vq*in[j];
+            }
+        });
+    }
+    return !singular;
+}
 
+// tag-dispatched entries used by the iterator-based decompositions
+template<class io_iterator,class pivot_iterator>
+bool lu(io_iterator A,pivot_iterator pivot,unsigned int n,std::true_type){return lu(&*A,pivot,n);}
+template<class io_iterator,class pivot_iterator>
+bool lu(io_iterator,pivot_iterator,unsigned int,std::false_type){return false;}
+template<class io_iterator,class pivot_iterator>
+bool ll(io_iterator A,pivot_iterator p,unsigned int n,std::true_type){return ll(&*A,p,n);}
+template<class io_iterator,class pivot_iterator>
+bool ll(io_iterator,pivot_iterator,unsigned int,std::false_type){return false;}
+template<class io_iterator,class output_iterator1,class output_iterator2>
+bool qr(io_iterator A,output_iterator1 c,output_iterator2 d,unsigned int m,unsigned int n,std::true_type){return qr(&*A,c,d,m,n);}
+template<class io_iterator,class output_iterator1,class output_iterator2>
+bool qr(io_iterator,output_iterator1,output_iterator2,unsigned int,unsigned int,std::false_type){return false;}
+
+}
 
 /*
 perform y = Ax
@@ -434,6 +948,8 @@ void product(left_input_iterator lhs			    /*A*/,
                     const left_dim_type& ldim			/* the dimension of A*/,
                     const right_dim_type& rdim			/* the dimension of B*/)
 {
+    if(blocked::product(lhs,rhs,out,ldim.row_count(),ldim.col_count(),rdim.col_count()))
+        return;
     unsigned int common_col_count = ldim.col_count();
     unsigned int right_col_count = rdim.col_count();
     left_input_iterator lhs_end = lhs + ldim.size();
@@ -479,6 +995,8 @@ void product_transpose(
     const left_dim_type& ldim			/* the dimension of A*/,
     const right_dim_type& rdim			/* the dimension of B*/)
 {
+    if(blocked::product_transpose(lhs,rhs,out,ldim.row_count(),ldim.col_count(),rdim.row_count()))
+        return;
     unsigned int common_col_count = ldim.col_count();
     left_input_iterator lhs_end = lhs + ldim.size();
     right_input_iterator rhs_end = rhs + rdim.size();
@@ -501,6 +1019,8 @@ typename output_iterator,
 typename dim_type>
 void square(input_iterator lhs,output_iterator out,const dim_type& dim)
 {
+    if(blocked::square(lhs,out,dim.row_count(),dim.col_count()))
+        return;
     output_iterator iter = out;
 
     unsigned int common_col_count = dim.col_count();
@@ -710,6 +1230,8 @@ bool lu_decomposition(io_iterator A,pivot_iterator pivot,const dim_type& dim)
 {
     typedef typename std::iterator_traits<io_iterator>::value_type value_type;
     const unsigned int dimension = dim.row_count();
+    if(blocked::contiguous<io_iterator>::value && dimension >= blocked::min_decomposition_size)
+        return blocked::lu(A,pivot,dimension,blocked::contiguous<io_iterator>());
     const unsigned int size = dim.size();
     for (unsigned int k = 0;k < dimension;++k)
         pivot[k] = k;
@@ -772,6 +1294,8 @@ bool ll_decomposition(io_iterator A,pivot_iterator p,const dim_type& dim)
 {
     typedef typename std::iterator_traits<io_iterator>::value_type value_type;
     const unsigned int dimension = dim.row_count();
+    if(blocked::contiguous<io_iterator>::value && dimension >= blocked::min_decomposition_size)
+        return blocked::ll(A,p,dimension,blocked::contiguous<io_iterator>());
     for (unsigned int i = 0,row_i = 0;i < dimension;i++,row_i += dimension)
     {
         for (unsigned int j = i,row_j = row_i;j < dimension;j++,row_j += dimension)
@@ -832,6 +1356,8 @@ bool qr_decomposition(io_iterator A,output_iterator1 c,output_iterator2 d,const
     unsigned int m = dim.row_count();
     unsigned int n = dim.col_count();
     unsigned int min = std::min<unsigned int>(m,n);
+    if(blocked::contiguous<io_iterator>::value && min >= blocked::min_decomposition_size)
+        return blocked::qr(A,c,d,m,n,blocked::contiguous<io_iterator>());
     io_iterator A_row_k = A;
     for (unsigned int k = 0;k < min;k++,A_row_k += n)
     {
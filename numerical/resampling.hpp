@@ -2,6 +2,7 @@
 #ifndef RESAMPLING_HPP
 #define RESAMPLING_HPP
 #include "tipl/utility/basic_image.hpp"
+#include "tipl/utility/vector_image.hpp"
 #include "tipl/numerical/transformation.hpp"
 #include "tipl/numerical/numerical.hpp"
 #include "tipl/numerical/basic_op.hpp"
@@ -280,7 +281,7 @@ OutputIterator upsampling_x(IteratorType from,IteratorType to,OutputIterator out
         do{
             --line_iter;
             --out;
-            *out = pixel_average<typename IteratorType::value_type>()(*line_iter,*(line_iter+1));
+            *out = pixel_average<typename std::iterator_traits<IteratorType>::value_type>()(*line_iter,*(line_iter+1));
             *(--out) = *line_iter;
         }
         while(line_iter != to);
@@ -351,7 +352,7 @@ OutputIterator upsampling_y(IteratorType from,IteratorType to,OutputIterator out
             plane_iter -= width;
 
             for(int i = 0; i < width;++i)
-                out[i] = pixel_average<typename IteratorType::value_type>()(out[i],plane_iter[i]);
+                out[i] = pixel_average<typename std::iterator_traits<IteratorType>::value_type>()(out[i],plane_iter[i]);
 
             out -= width;
             std::copy(plane_iter,plane_end,out);
@@ -632,6 +633,35 @@ void upsample_with_padding(const image_type1& I,image_type2& uI,const geo_type&
     tipl::draw(new_I,uI,pixel_index<image_type1::dimension>(I.geometry()));
 }
 
+// structure-of-arrays vector fields are resampled plane by plane
+template<unsigned int dimension,class value_type>
+void downsample_with_padding(const vector_image<dimension,value_type>& I,vector_image<dimension,value_type>& rI)
+{
+    vector_image<dimension,value_type> result;
+    for(unsigned int d = 0;d < dimension;++d)
+    {
+        image<value_type,dimension> r;
+        downsample_with_padding(I.plane_image(d),r);
+        if(d == 0)
+            result.resize(r.geometry());
+        std::copy(r.begin(),r.end(),result.plane(d));
+    }
+    rI.swap(result);
+}
+
+template<unsigned int dimension,class value_type,class geo_type>
+void upsample_with_padding(const vector_image<dimension,value_type>& I,vector_image<dimension,value_type>& uI,const geo_type& geo)
+{
+    vector_image<dimension,value_type> result(geo);
+    for(unsigned int d = 0;d < dimension;++d)
+    {
+        image<value_type,dimension> u;
+        upsample_with_padding(I.plane_image(d),u,geo);
+        std::copy(u.begin(),u.end(),result.plane(d));
+    }
+    uI.swap(result);
+}
+
 
 template<class PixelType>
 void shrink(const tipl::image<PixelType,3>& image,
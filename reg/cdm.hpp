@@ -427,17 +427,12 @@ double cdm(const image<pixel_type,dimension>& It,
                    theta = l;
             });
         }
-        multiply_constant_mt(new_d,0.5f/theta);
-        add(new_d,d);
+        new_d = new_d*(0.5f/theta) + d;
 
         image<vtor_type,dimension> new_ds(new_d);
         filter::gaussian2(new_ds);
-        par_for(new_d.size(),[&](int i){
-           new_ds[i] *= cdm_smoothness;
-           new_d[i] *= cdm_smoothness2;
-           new_d[i] += new_ds[i];
-        });
         new_d.swap(d);
+        d = new_ds*cdm_smoothness + d*cdm_smoothness2;
     }
     return r;
 }
@@ -1,3 +1,5 @@
+#ifndef TIPL_DISJOINT_SET_HPP
+#define TIPL_DISJOINT_SET_HPP
 #include <vector>
 
 namespace tipl{
@@ -38,3 +40,4 @@ struct disjoint_set{
 };
 
 }
+#endif//TIPL_DISJOINT_SET_HPP
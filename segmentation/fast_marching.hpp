@@ -1,6 +1,10 @@
 #include <vector>
 #include <limits>
 #include <memory>
+#include <algorithm>
+#include <cmath>
+#include "tipl/utility/basic_image.hpp"
+#include "tipl/utility/pixel_index.hpp"
 
 namespace tipl
 {
@@ -11,124 +15,243 @@ namespace segmentation
 namespace imp
 {
 
-// The subrutine for fast marching
-template<class pass_time_type>
-float fast_marching_estimateT(const pass_time_type& T,float g,const geometry<2>& geo,const pixel_index<2>& index)
+/*
+    binary min-heap of voxel indices keyed by T, with a position table so
+    that a trial point can be moved up when its time decreases
+*/
+class fast_marching_heap
 {
-    float Tx,Ty;
-    {
-        float Tx1 = (index.x()) ? T[index.index()-1] : std::numeric_limits<float>::max();
-        float Tx2 = (index.x() + 1 < geo.height()) ? T[index.index()+1] : std::numeric_limits<float>::max();
-        Tx = std::min(Tx1,Tx2);
-    }
+    std::vector<unsigned int> heap;
+    std::vector<unsigned int> pos;
+    const float* T;
+public:
+    static const unsigned int npos = std::numeric_limits<unsigned int>::max();
+    fast_marching_heap(const float* T_,size_t size):pos(size,std::numeric_limits<unsigned int>::max()),T(T_){}
+private:
+    void move_up(unsigned int h)
     {
-        float Ty1 = (index.y()) ? T[index.index()-geo.width()] : std::numeric_limits<float>::max();
-        float Ty2 = (index.y() + 1 < geo.height()) ? T[index.index()+geo.width()] : std::numeric_limits<float>::max();
-        Ty = std::min(Ty1,Ty2);
+        unsigned int i = heap[h];
+        float t = T[i];
+        while(h)
+        {
+            unsigned int parent = (h-1) >> 1;
+            if(T[heap[parent]] <= t)
+                break;
+            heap[h] = heap[parent];
+            pos[heap[h]] = h;
+            h = parent;
+        }
+        heap[h] = i;
+        pos[i] = h;
     }
-    // sort Tx,Ty,Tz
-    if(Tx > Ty)
-        std::swap(Tx,Ty);
-    if(Ty == std::numeric_limits<float>::max())
-        return Tx+g;
-    float Td;
-    if((Td = Ty - Tx) > g)
-        return Tx+g;
-    // T = [Tx+Ty + (2g^2-(Tx-Tx)^2)^1/2]/2
-    return 0.5*(Tx+Ty+sqrt(2.0*g*g-Td*Td));
-}
-
-// The subrutine for fast marching
-template<class pass_time_type>
-float fast_marching_estimateT(const pass_time_type& T,float g,const geometry<3>& geo,const pixel_index<3>& index)
-{
-    float Tx,Ty,Tz;
+    void move_down(unsigned int h)
     {
-        float Tx1 = (index.x()) ? T[index.index()-1] : std::numeric_limits<float>::max();
-        float Tx2 = (index.x() + 1 < geo.height()) ? T[index.index()+1] : std::numeric_limits<float>::max();
-        Tx = std::min(Tx1,Tx2);
+        unsigned int i = heap[h];
+        float t = T[i];
+        unsigned int size = (unsigned int)heap.size();
+        while(1)
+        {
+            unsigned int child = (h << 1)+1;
+            if(child >= size)
+                break;
+            if(child+1 < size && T[heap[child+1]] < T[heap[child]])
+                ++child;
+            if(t <= T[heap[child]])
+                break;
+            heap[h] = heap[child];
+            pos[heap[h]] = h;
+            h = child;
+        }
+        heap[h] = i;
+        pos[i] = h;
     }
+public:
+    bool empty(void) const{return heap.empty();}
+    bool contains(size_t i) const{return pos[i] != npos;}
+    unsigned int top(void) const{return heap[0];}
+    // insert i or restore the order after T[i] decreased
+    void push(size_t i)
     {
-        float Ty1 = (index.y()) ? T[index.index()-geo.width()] : std::numeric_limits<float>::max();
-        float Ty2 = (index.y() + 1 < geo.height()) ? T[index.index()+geo.width()] : std::numeric_limits<float>::max();
-        Ty = std::min(Ty1,Ty2);
+        if(pos[i] == npos)
+        {
+            heap.push_back((unsigned int)i);
+            pos[i] = (unsigned int)(heap.size()-1);
+        }
+        move_up(pos[i]);
     }
+    unsigned int pop(void)
     {
-        float Tz1 = (index.z()) ? T[index.index()-geo.plane_size()] : std::numeric_limits<float>::max();
-        float Tz2 = (index.z() + 1 < geo.depth()) ? T[index.index()+geo.plane_size()] : std::numeric_limits<float>::max();
-        Tz = std::min(Tz1,Tz2);
+        unsigned int i = heap[0];
+        pos[i] = npos;
+        heap[0] = heap.back();
+        heap.pop_back();
+        if(!heap.empty())
+        {
+            pos[heap[0]] = 0;
+            move_down(0);
+        }
+        return i;
     }
-    // sort Tx,Ty,Tz
-    if(Tx > Ty)
-        std::swap(Tx,Ty);
-    if(Tx > Tz)
-        std::swap(Tx,Tz);
-    if(Ty > Tz)
-        std::swap(Ty,Tz);
-    if(Ty == std::numeric_limits<float>::max())
-        return Tx+g;
-    if(Tz == std::numeric_limits<float>::max())
+    template<class fun_type>
+    void for_each(fun_type&& fun) const
     {
-        float Td;
-        if((Td = Ty - Tx) > g)
-            return Tx+g;
-        return 0.5*(Tx+Ty+sqrt(2.0*g*g-Td*Td));
+        for(size_t h = 0;h < heap.size();++h)
+            fun(heap[h]);
     }
-    float Tsum = Tx+Ty+Tz;
-    float b2_4ac = Tsum*Tsum-3*(Tx*Tx+Ty*Ty+Tz*Tz-g*g);
-    if(b2_4ac <= 0)
-        return Tx+g;
-    b2_4ac = std::sqrt(b2_4ac);
-    return (Tsum + b2_4ac)/3.0;
-}
+};
 
-template<class narrow_band_point>
-struct fast_marching_T_comp: public std::binary_function<narrow_band_point*, narrow_band_point*, bool>
+/*
+    solve sum_d ((T-T_d)/h_d)^2 = g^2 using the upwind neighbors in the
+    dimensions that are already known, adding dimensions in ascending T_d
+*/
+template<unsigned int dim>
+float fast_marching_solve(float T_d[dim],const float h2[dim],float g)
 {
-    bool operator()(const narrow_band_point* p1,const narrow_band_point* p2) const
+    unsigned int order[dim];
+    for(unsigned int d = 0;d < dim;++d)
+        order[d] = d;
+    std::sort(order,order+dim,[&](unsigned int a,unsigned int b){return T_d[a] < T_d[b];});
+    float T = T_d[order[0]]+g*std::sqrt(h2[order[0]]);
+    double a = 0.0,b = 0.0,c = 0.0,g2 = double(g)*double(g);
+    for(unsigned int k = 0;k < dim;++k)
     {
-        return p1->first > p2->first;
+        unsigned int d = order[k];
+        if(T_d[d] == std::numeric_limits<float>::max() || T <= T_d[d])
+            break;
+        double w = 1.0/h2[d];
+        a += w;
+        b += w*T_d[d];
+        c += w*double(T_d[d])*double(T_d[d]);
+        // a*T^2-2*b*T+c-g^2 = 0
+        double disc = b*b-a*(c-g2);
+        if(disc < 0.0)
+            break;
+        T = float((b+std::sqrt(disc))/a);
     }
-};
+    return T;
+}
+
 }
 
 
 /**
-   Fast marching method
+   Fast marching method with multiple labeled seeds
    Referece: J.A. Sethian, "A fast marching level set method for monotonically advancing fronts", PNAS, 93, pp.1591-1595, 1996.
-*/
 
-template<class ImageType,class TimeType,class IndexType>
-void fast_marching(const ImageType& gradient_image,TimeType& pass_time,IndexType seed)
+   cost: the inverse speed at each voxel
+   label: nonzero voxels are seeds (time 0). On return each reached voxel
+          has the label of the seed whose front arrived first, which gives
+          a geodesic Voronoi partition.
+   spacing: voxel size in each dimension
+   max_time: marching stops once the front passes this time, and the
+             voxels beyond it keep infinity and label 0
+*/
+template<class ImageType,class TimeType,class LabelImageType,class SpacingType>
+void fast_marching(const ImageType& cost,TimeType& pass_time,LabelImageType& label,
+                   const SpacingType& spacing,float max_time = std::numeric_limits<float>::max())
 {
-    typedef std::pair<float,pixel_index<ImageType::dimension> > narrow_band_point;
+    const unsigned int dim = ImageType::dimension;
+    const float infinity_time = std::numeric_limits<float>::max();
+    size_t size = cost.size();
+    std::vector<float> T(size,infinity_time);
+    std::vector<unsigned char> known(size);
+    imp::fast_marching_heap narrow_band(&T[0],size);
 
-    std::vector<narrow_band_point*> narrow_band;
-    std::vector<pixel_index<ImageType::dimension> > neighbor_points;
-    narrow_band.push_back(new narrow_band_point(0.001,seed));
-
-    float infinity_time = std::numeric_limits<float>::max();
-    pass_time.resize(gradient_image.geometry());
-    std::fill(pass_time.begin(),pass_time.end(),infinity_time);
-    pass_time[seed.index()] = 0;
+    size_t shift[dim],length[dim];
+    float h2[dim];
+    for(unsigned int d = 0,s = 1;d < dim;++d)
+    {
+        shift[d] = s;
+        length[d] = cost.geometry()[d];
+        s *= length[d];
+        h2[d] = float(spacing[d])*float(spacing[d]);
+    }
+    for(size_t i = 0;i < size;++i)
+        if(label[i])
+        {
+            T[i] = 0.0f;
+            narrow_band.push(i);
+        }
 
+    size_t coordinate[dim];
+    auto get_coordinate = [&](size_t index)
+    {
+        for(unsigned int d = 0;d < dim;++d)
+        {
+            coordinate[d] = index % length[d];
+            index /= length[d];
+        }
+    };
     while(!narrow_band.empty())
     {
-        std::auto_ptr<narrow_band_point> active_point(narrow_band.front());
-        std::pop_heap(narrow_band.begin(),narrow_band.end(),imp::fast_marching_T_comp<narrow_band_point>());
-        narrow_band.pop_back();
-        get_connected_neighbors(active_point->second,gradient_image.geometry(),neighbor_points);
-        for(size_t index = 0; index < neighbor_points.size(); ++index)
+        size_t p = narrow_band.pop();
+        if(T[p] > max_time)
         {
-            size_t cur_index = neighbor_points[index].index();
-            if(pass_time[cur_index] != infinity_time)
-                continue;
-            float cur_T = imp::fast_marching_estimateT(pass_time,gradient_image[cur_index],gradient_image.geometry(),neighbor_points[index]);
-            pass_time[cur_index] = cur_T;
-            narrow_band.push_back(new narrow_band_point(cur_T,neighbor_points[index]));
-            std::push_heap(narrow_band.begin(),narrow_band.end(),imp::fast_marching_T_comp<narrow_band_point>());
+            T[p] = infinity_time;
+            label[p] = 0;
+            break;
         }
+        known[p] = 1;
+        get_coordinate(p);
+        size_t p_coordinate[dim];
+        std::copy(coordinate,coordinate+dim,p_coordinate);
+        for(unsigned int nd = 0;nd < dim;++nd)
+            for(int dir = -1;dir <= 1;dir += 2)
+            {
+                if(dir < 0 ? p_coordinate[nd] == 0 : p_coordinate[nd]+1 >= length[nd])
+                    continue;
+                size_t q = dir < 0 ? p-shift[nd] : p+shift[nd];
+                if(known[q])
+                    continue;
+                // upwind times of q from known neighbors, and the earliest of them
+                float T_d[dim];
+                size_t upwind = p;
+                std::copy(p_coordinate,p_coordinate+dim,coordinate);
+                coordinate[nd] += dir;
+                for(unsigned int d = 0;d < dim;++d)
+                {
+                    T_d[d] = infinity_time;
+                    auto add = [&](size_t r)
+                    {
+                        if(!known[r] || T[r] >= T_d[d])
+                            return;
+                        T_d[d] = T[r];
+                        if(T[r] < T[upwind])
+                            upwind = r;
+                    };
+                    if(coordinate[d])
+                        add(q-shift[d]);
+                    if(coordinate[d]+1 < length[d])
+                        add(q+shift[d]);
+                }
+                float new_T = imp::fast_marching_solve<dim>(T_d,h2,float(cost[q]));
+                if(new_T < T[q])
+                {
+                    T[q] = new_T;
+                    // the front that arrives first owns q
+                    label[q] = label[upwind];
+                    narrow_band.push(q);
+                }
+            }
     }
+    // anything still in the band is beyond max_time
+    narrow_band.for_each([&](size_t i)
+    {
+        T[i] = infinity_time;
+        label[i] = 0;
+    });
+    pass_time.resize(cost.geometry());
+    std::copy(T.begin(),T.end(),pass_time.begin());
+}
+
+template<class ImageType,class TimeType,class IndexType>
+void fast_marching(const ImageType& gradient_image,TimeType& pass_time,IndexType seed)
+{
+    tipl::image<unsigned char,ImageType::dimension> label(gradient_image.geometry());
+    float spacing[ImageType::dimension];
+    std::fill(spacing,spacing+ImageType::dimension,1.0f);
+    label[seed.index()] = 1;
+    fast_marching(gradient_image,pass_time,label,spacing);
 }
 
 
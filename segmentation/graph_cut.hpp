@@ -2,6 +2,9 @@
 #define TIPL_SEGMENTATION_GRAPH_CUT
 #include <vector>
 #include <algorithm>
+#include <limits>
+#include <cstdint>
+#include "tipl/utility/multi_thread.hpp"
 #include "disjoint_set.hpp"
 
 namespace tipl
@@ -45,68 +48,251 @@ struct graph_cut_dis<tipl::rgb>{
     }
 };
 
-template<class image_type,class label_type>
-void graph_cut(const image_type& I,label_type& out,float c,unsigned int min_size)
+namespace imp
 {
-    typedef tipl::pixel_index<image_type::dimension> index_type;
-    typedef typename image_type::value_type value_type;
-    std::vector<graph_edge> edges;
-    edges.reserve(I.size() * 2* image_type::dimension);
-    float max_w = 0.0;
-    for(index_type index(I.geometry());index < I.size();++index)
+/*
+    The half of the 8/26-neighborhood with a smaller linear index. An edge
+    is identified by voxel*slot_count+slot, so it never has to be stored
+    with its end points and weight.
+*/
+template<int dim>
+struct graph_cut_neighbor
+{
+    std::vector<int> shift;
+    std::vector<int> displacement;
+    graph_cut_neighbor(const tipl::geometry<dim>& geo)
     {
-        std::vector<index_type> neighbor;
-        tipl::get_neighbors(index,I.geometry(),neighbor);
-        for(int i = 0; i < neighbor.size(); ++i)
-            if(index.index() > neighbor[i].index())
+        int d[dim];
+        std::fill(d,d+dim,-1);
+        while(1)
+        {
+            // keep the displacements lexicographically before zero
+            int last = dim-1;
+            while(last >= 0 && d[last] == 0)
+                --last;
+            if(last >= 0 && d[last] < 0)
             {
-                edges.push_back(graph_edge());
-                edges.back().n1 = index.index();
-                edges.back().n2 = neighbor[i].index();
-                edges.back().w = graph_cut_dis<value_type>()(I[edges.back().n1],I[edges.back().n2]);
-                if(edges.back().w > max_w)
-                    max_w = edges.back().w;
-
+                int s = 0;
+                for(int k = dim-1;k >= 0;--k)
+                    s = s*int(geo[k])+d[k];
+                shift.push_back(s);
+                displacement.insert(displacement.end(),d,d+dim);
             }
+            int k = 0;
+            while(k < dim && d[k] == 1)
+                d[k++] = -1;
+            if(k == dim)
+                break;
+            ++d[k];
+        }
     }
-    c *= max_w;
-    std::sort(edges.begin(),edges.end());
-    disjoint_set dset;
-    dset.label.resize(I.size());
-    dset.rank.resize(I.size());
-    for(unsigned int index = 0; index < I.size(); ++index)
-        dset.label[index] = index;
+    unsigned int slot_count(void) const{return (unsigned int)shift.size();}
+    // visit the edges of voxels [from,to): fun(index,slot,neighbor index,weight)
+    template<class image_type,class fun_type>
+    void for_each_edge(const image_type& I,size_t from,size_t to,fun_type&& fun) const
     {
-        std::vector<unsigned int> size(I.size());
-        std::vector<float> threshold(I.size());
-        std::fill(size.begin(),size.end(),1);
-        std::fill(threshold.begin(),threshold.end(),c);
-        for (int i = 0; i < edges.size(); i++)
+        graph_cut_dis<typename image_type::value_type> dis;
+        int coordinate[dim];
+        {
+            size_t rest = from;
+            for(int d = 0;d < dim;++d)
+            {
+                coordinate[d] = int(rest % I.geometry()[d]);
+                rest /= I.geometry()[d];
+            }
+        }
+        for(size_t index = from;index < to;++index)
         {
-            unsigned int s1 = dset.find_set(edges[i].n1);
-            unsigned int s2 = dset.find_set(edges[i].n2);
-            float w = edges[i].w;
-            if(s1 == s2)
-                continue;
-            if(w <= threshold[s1] && w <= threshold[s2])
+            for(unsigned int slot = 0;slot < shift.size();++slot)
             {
-                unsigned int total_size = size[s1]+size[s2];
-                unsigned int s12 = dset.join_set(s1,s2);
-                size[s12] = total_size;
-                threshold[s12] = w + c/total_size;
+                const int* disp = &displacement[slot*dim];
+                bool inside = true;
+                for(int d = 0;d < dim && inside;++d)
+                {
+                    int pos = coordinate[d]+disp[d];
+                    inside = pos >= 0 && pos < int(I.geometry()[d]);
+                }
+                if(!inside)
+                    continue;
+                size_t j = size_t(int64_t(index)+shift[slot]);
+                fun(index,slot,j,dis(I[index],I[j]));
+            }
+            for(int d = 0;d < dim;++d)
+            {
+                if(++coordinate[d] < int(I.geometry()[d]))
+                    break;
+                coordinate[d] = 0;
             }
         }
+    }
+};
+
+template<class edge_id_type,class image_type,class label_type>
+void graph_cut(const image_type& I,label_type& out,float c,unsigned int min_size)
+{
+    const int dim = image_type::dimension;
+    typedef typename image_type::value_type value_type;
+    const unsigned int bin_count = 65536;
+    graph_cut_neighbor<dim> neighbor(I.geometry());
+    const unsigned int slot_count = neighbor.slot_count();
+    size_t size = I.size();
+    // The blocks depend only on the image size, so the result does not
+    // depend on the thread count.
+    const size_t max_block_count = 16;
+    int block_count = int(std::min<size_t>(max_block_count,size/65536+1));
+    std::vector<size_t> block_from(block_count+1);
+    for(int t = 0;t <= block_count;++t)
+        block_from[t] = size*t/block_count;
 
-        for (int i = 0; i < edges.size(); i++)
+    std::vector<float> block_max(block_count);
+    par_for(block_count,[&](int t)
+    {
+        neighbor.for_each_edge(I,block_from[t],block_from[t+1],[&](size_t,unsigned int,size_t,float w)
+        {
+            block_max[t] = std::max(block_max[t],w);
+        });
+    });
+    float max_w = *std::max_element(block_max.begin(),block_max.end());
+    float bin_scale = max_w == 0.0f ? 0.0f : float(bin_count-1)/max_w;
+    c *= max_w;
+
+    // radix pass on the quantized weight. Edges inside block t are kept
+    // in its own range; edges across blocks go to a shared boundary list.
+    std::vector<std::vector<size_t> > inner(block_count,std::vector<size_t>(bin_count+1)),
+                                      boundary(block_count,std::vector<size_t>(bin_count+1));
+    par_for(block_count,[&](int t)
+    {
+        neighbor.for_each_edge(I,block_from[t],block_from[t+1],[&](size_t,unsigned int,size_t j,float w)
+        {
+            unsigned int bin = (unsigned int)(w*bin_scale);
+            if(j < block_from[t])
+                ++boundary[t][bin];
+            else
+                ++inner[t][bin];
+        });
+    });
+    std::vector<std::vector<size_t> > inner_start(block_count,std::vector<size_t>(bin_count+1));
+    std::vector<size_t> boundary_start(bin_count+1);
+    size_t sum = 0;
+    for(int t = 0;t < block_count;++t)
+        for(unsigned int bin = 0;bin <= bin_count;++bin)
         {
-            unsigned int s1 = dset.find_set(edges[i].n1);
-            unsigned int s2 = dset.find_set(edges[i].n2);
-            if(s1 == s2)
-                continue;
-            if(size[s1] < min_size || size[s2] < min_size)
-                dset.join_set(s1,s2);
+            inner_start[t][bin] = sum;
+            size_t n = inner[t][bin];
+            inner[t][bin] = sum;
+            sum += n;
+        }
+    for(unsigned int bin = 0;bin <= bin_count;++bin)
+    {
+        boundary_start[bin] = sum;
+        for(int t = 0;t < block_count;++t)
+        {
+            size_t n = boundary[t][bin];
+            boundary[t][bin] = sum;
+            sum += n;
         }
     }
+    std::vector<edge_id_type> edges(sum);
+    par_for(block_count,[&](int t)
+    {
+        neighbor.for_each_edge(I,block_from[t],block_from[t+1],[&](size_t index,unsigned int slot,size_t j,float w)
+        {
+            unsigned int bin = (unsigned int)(w*bin_scale);
+            edge_id_type id = edge_id_type(index)*slot_count+slot;
+            if(j < block_from[t])
+                edges[boundary[t][bin]++] = id;
+            else
+                edges[inner[t][bin]++] = id;
+        });
+    });
+    inner.clear();
+    boundary.clear();
+    // exact order inside each bin
+    auto sort_range = [&](size_t from,size_t to,std::vector<std::pair<float,edge_id_type> >& buf)
+    {
+        if(to-from < 2)
+            return;
+        graph_cut_dis<value_type> dis;
+        buf.resize(to-from);
+        for(size_t i = from;i < to;++i)
+        {
+            size_t index = size_t(edges[i]/slot_count);
+            size_t j = size_t(int64_t(index)+neighbor.shift[edges[i]%slot_count]);
+            buf[i-from] = std::make_pair(dis(I[index],I[j]),edges[i]);
+        }
+        std::stable_sort(buf.begin(),buf.end(),
+            [](const std::pair<float,edge_id_type>& lhs,const std::pair<float,edge_id_type>& rhs)
+            {return lhs.first < rhs.first;});
+        for(size_t i = from;i < to;++i)
+            edges[i] = buf[i-from].second;
+    };
+    par_for(block_count,[&](int t)
+    {
+        std::vector<std::pair<float,edge_id_type> > buf;
+        for(unsigned int bin = 0;bin < bin_count;++bin)
+            sort_range(inner_start[t][bin],inner_start[t][bin+1],buf);
+        for(unsigned int bin = bin_count*t/block_count;bin < bin_count*(t+1)/block_count;++bin)
+            sort_range(boundary_start[bin],boundary_start[bin+1],buf);
+    });
+
+    disjoint_set dset;
+    dset.label.resize(size);
+    dset.rank.resize(size);
+    std::vector<unsigned int> region_size(size,1);
+    std::vector<float> threshold(size,c);
+    for(size_t index = 0;index < size;++index)
+        dset.label[index] = (unsigned int)index;
+    auto merge = [&](edge_id_type id)
+    {
+        size_t index = size_t(id/slot_count);
+        unsigned int slot = (unsigned int)(id%slot_count);
+        size_t j = size_t(int64_t(index)+neighbor.shift[slot]);
+        unsigned int s1 = dset.find_set((unsigned int)index);
+        unsigned int s2 = dset.find_set((unsigned int)j);
+        if(s1 == s2)
+            return;
+        float w = graph_cut_dis<value_type>()(I[index],I[j]);
+        if(w <= threshold[s1] && w <= threshold[s2])
+        {
+            unsigned int total_size = region_size[s1]+region_size[s2];
+            unsigned int s12 = dset.join_set(s1,s2);
+            region_size[s12] = total_size;
+            threshold[s12] = w + c/total_size;
+        }
+    };
+    auto merge_small = [&](edge_id_type id)
+    {
+        size_t index = size_t(id/slot_count);
+        size_t j = size_t(int64_t(index)+neighbor.shift[id%slot_count]);
+        unsigned int s1 = dset.find_set((unsigned int)index);
+        unsigned int s2 = dset.find_set((unsigned int)j);
+        if(s1 == s2)
+            return;
+        if(region_size[s1] < min_size || region_size[s2] < min_size)
+        {
+            unsigned int total_size = region_size[s1]+region_size[s2];
+            region_size[dset.join_set(s1,s2)] = total_size;
+        }
+    };
+    // Blocks only touch their own voxels until the boundary edges are
+    // merged, so each block runs through its sorted edges in parallel.
+    par_for(block_count,[&](int t)
+    {
+        for(size_t i = inner_start[t][0];i < inner_start[t][bin_count];++i)
+            merge(edges[i]);
+    });
+    for(size_t i = boundary_start[0];i < boundary_start[bin_count];++i)
+        merge(edges[i]);
+    if(min_size > 1)
+        for(unsigned int bin = 0;bin < bin_count;++bin)
+        {
+            for(int t = 0;t < block_count;++t)
+                for(size_t i = inner_start[t][bin];i < inner_start[t][bin+1];++i)
+                    merge_small(edges[i]);
+            for(size_t i = boundary_start[bin];i < boundary_start[bin+1];++i)
+                merge_small(edges[i]);
+        }
+
     // re-labeling
     out.clear();
     out.resize(I.geometry());
@@ -123,6 +309,19 @@ void graph_cut(const image_type& I,label_type& out,float c,unsigned int min_size
     }
 }
 
+}
+
+template<class image_type,class label_type>
+void graph_cut(const image_type& I,label_type& out,float c,unsigned int min_size)
+{
+    // 32-bit edge ids whenever they fit
+    if(uint64_t(I.size())*imp::graph_cut_neighbor<image_type::dimension>(I.geometry()).slot_count() <
+       uint64_t(std::numeric_limits<unsigned int>::max()))
+        imp::graph_cut<unsigned int>(I,out,c,min_size);
+    else
+        imp::graph_cut<uint64_t>(I,out,c,min_size);
+}
+
 template<class label_type1,class label_type2>
 void refine_contour(const label_type1& I,label_type2& out)
 {
@@ -163,6 +163,32 @@ void stochastic_competition_update_pivots(
 }
 
 
+// copy the box starting at from with the size of to_image
+template<typename FromImageType,typename ToImageType,typename PosType>
+void stochastic_competition_crop(const FromImageType& from_image,ToImageType& to_image,const PosType& from)
+{
+    const unsigned int dim = FromImageType::dimension;
+    size_t width = to_image.geometry()[0];
+    size_t line_count = to_image.size()/width;
+    for(size_t line = 0;line < line_count;++line)
+    {
+        // coordinates of the line start in to_image, mapped to from_image
+        size_t pos[dim];
+        pos[0] = 0;
+        size_t l = line;
+        for(unsigned int d = 1;d < dim;++d)
+        {
+            pos[d] = l % to_image.geometry()[d];
+            l /= to_image.geometry()[d];
+        }
+        size_t from_index = 0;
+        for(int d = dim-1;d >= 0;--d)
+            from_index = from_index*from_image.geometry()[d]+pos[d]+from[d];
+        std::copy(from_image.begin()+from_index,from_image.begin()+from_index+width,
+                  to_image.begin()+line*width);
+    }
+}
+
 // randomly select a pivot from pool
 inline unsigned int stochastic_competition_select_pivot(const std::vector<unsigned int>& pivot_list)
 {
@@ -287,6 +313,8 @@ void stochastic_competition_with_lostinfo(const ImageType& src,
     Zr /= clique_size;
     Zc /= clique_size;
     long t = std::clock()+CLOCKS_PER_SEC*5;
+    std::vector<index_type> neighbor_list;
+    std::vector<label_type> other_label;
     for(unsigned int iteration = 0,success_pivot = 0;
         !pivot_list.empty() && std::clock() < t; ++iteration)
     {
@@ -297,8 +325,6 @@ void stochastic_competition_with_lostinfo(const ImageType& src,
         pixel_type pivot_intensity = src[pivot_index];
         label_type cur_label = label[pivot_index];
 
-        std::vector<index_type> neighbor_list;
-        std::vector<index_type> supporting_neighbors;
         label_type expected_label;
         bool pivot_without_info = no_info_map[pivot_index];
         bool neighbor_without_info = pivot_without_info;
@@ -308,7 +334,7 @@ void stochastic_competition_with_lostinfo(const ImageType& src,
         {
             tipl::get_neighbors(pivot_full_index,label.geometry(),2,neighbor_list);
 
-            std::vector<label_type> other_label;
+            other_label.clear();
             for(unsigned int j = 0; j < neighbor_list.size(); ++j)
             {
                 unsigned int neighbor_index = neighbor_list[j].index();
@@ -317,10 +343,7 @@ void stochastic_competition_with_lostinfo(const ImageType& src,
                 if(label[neighbor_index] != cur_label)
                     other_label.push_back(label[neighbor_index]);
                 else
-                {
-                    supporting_neighbors.push_back(neighbor_list[j]);
                     --clique_potential;
-                }
             }
             // don't include pivot it self
             ++clique_potential;
@@ -425,6 +448,8 @@ void stochastic_competition_with_lostinfo(const ImageType& src,
 }
 /*
 initial_contour has 1 insid the contour and 0 elsewhere.
+Only a padded bounding box around the contour is copied and processed.
+An empty contour gives an empty label.
 */
 template<typename ImageType,typename LabelImageType>
 void stochastic_competition(const ImageType& src,
@@ -433,38 +458,48 @@ void stochastic_competition(const ImageType& src,
                             double Zr = 5.0,
                             bool consider_region_intensity = true)
 {
-    tipl::image<unsigned char,LabelImageType::dimension> outter_contour(initial_contour);
-    tipl::geometry<ImageType::dimension> range_max,range_min,new_geo;
+    const unsigned int dimension = ImageType::dimension;
+    tipl::geometry<dimension> range_max,range_min,new_geo;
 
     tipl::bounding_box(initial_contour,range_min,range_max,0);
+    for(unsigned int dim = 0;dim < dimension;++dim)
+        if(range_max[dim] <= range_min[dim])
+        {
+            std::fill(initial_contour.begin(),initial_contour.end(),0);
+            return;
+        }
+    int radius = (range_max[0]-range_min[0])/5;
 
-    tipl::morphology::dilation2(outter_contour,(range_max[0]-range_min[0])/5);
-    tipl::morphology::erosion2(initial_contour,(range_max[0]-range_min[0])/5);
-
-    tipl::bounding_box(outter_contour,range_min,range_max,0);
-
-    for(int dim = 0;dim < ImageType::dimension;++dim)
+    // the ball reaches radius-1 voxels beyond the contour, then add a 1/4 margin
+    int reach = std::max<int>(radius-1,0);
+    for(int dim = 0;dim < dimension;++dim)
     {
-        int min_value  = std::max((int)0,(int)range_min[dim]*5/4-(int)range_max[dim]/4);
-        range_max[dim] = std::min((int)src.geometry()[dim],(int)range_max[dim]*5/4-(int)range_min[dim]/4);
-        range_min[dim] = min_value;
+        int lower = std::max<int>(0,int(range_min[dim])-reach);
+        int upper = std::min<int>(src.geometry()[dim],int(range_max[dim])+reach);
+        range_min[dim] = std::max<int>(0,lower*5/4-upper/4);
+        range_max[dim] = std::min<int>(src.geometry()[dim],upper*5/4-lower/4);
         new_geo[dim] = range_max[dim]-range_min[dim];
     }
 
-    for(unsigned int index = 0;index < initial_contour.size();++index)
+    tipl::image<unsigned char,dimension> outter_contour(new_geo),inner_contour;
+    tipl::image<typename ImageType::value_type,dimension> crop_image(new_geo);
+    imp::stochastic_competition_crop(initial_contour,outter_contour,range_min);
+    imp::stochastic_competition_crop(src,crop_image,range_min);
+    inner_contour = outter_contour;
+
+    tipl::morphology::dilation_ball(outter_contour,radius);
+    tipl::morphology::erosion_ball(inner_contour,radius);
+
+    for(unsigned int index = 0;index < outter_contour.size();++index)
     {
-        if(outter_contour[index] && initial_contour[index])
+        if(outter_contour[index] && inner_contour[index])
             outter_contour[index] = 1;
         else
-            if(outter_contour[index] && !initial_contour[index])
+            if(outter_contour[index] && !inner_contour[index])
                 outter_contour[index] = 0;
             else
                 outter_contour[index] = 2;
     }
-    tipl::image<typename ImageType::value_type,ImageType::dimension> crop_image(src);
-
-    tipl::crop(outter_contour,range_min,range_max);
-    tipl::crop(crop_image,range_min,range_max);
 
     if(consider_region_intensity)
         stochastic_competition_with_lostinfo(crop_image,outter_contour,imp::intensity_enabled(),Zc,Zr);
@@ -473,9 +508,8 @@ void stochastic_competition(const ImageType& src,
 
     std::replace(outter_contour.begin(),outter_contour.end(),0,1);
     std::replace(outter_contour.begin(),outter_contour.end(),2,0);
-    std::fill(initial_contour.begin(),initial_contour.end(),0);
+    // the contour lies inside the box, so the rest of initial_contour is already 0
     tipl::draw(outter_contour,initial_contour,range_min);
-\
 }
 
 
@@ -1,5 +1,9 @@
 #include <vector>
-#include <list>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <type_traits>
+#include "tipl/utility/multi_thread.hpp"
 #include "tipl/numerical/index_algorithm.hpp"
 #include "tipl/numerical/numerical.hpp"
 #include "tipl/numerical/basic_op.hpp"
@@ -17,93 +21,257 @@ namespace segmentation
 {
 
 
-template<class ImageType,class LabelImageType>
-void watershed(const ImageType& input_image,LabelImageType& label)
+/*
+    Flood levels of the input. Integer images whose range fits in level_count
+    keep their own values, otherwise the intensity is scaled to level_count
+    levels as tipl::normalize does. Returns the number of levels used.
+*/
+template<class ImageType,class level_type>
+unsigned int watershed_level(const ImageType& I,std::vector<level_type>& level,unsigned int level_count)
 {
-    label.clear();
-    label.resize(input_image.geometry());
-    tipl::image<unsigned char,ImageType::dimension> I(input_image.geometry());
-    tipl::normalize(input_image,I);
-
-    std::vector<std::list<pixel_index<ImageType::dimension> > > presort_table(256);
-    for (pixel_index<ImageType::dimension> index(I.geometry());
-         index < I.size();++index)
-        presort_table[I[index.index()]].push_back(index);
+    typedef typename ImageType::value_type value_type;
+    level.resize(I.size());
+    if(I.empty())
+        return 0;
+    auto min_max = std::minmax_element(I.begin(),I.end());
+    value_type min_value = *min_max.first;
+    double range = double(*min_max.second)-double(min_value);
+    if(std::is_integral<value_type>::value && range < level_count)
+    {
+        par_for_block(I.size(),[&](size_t i)
+        {
+            level[i] = level_type(I[i]-min_value);
+        });
+        return (unsigned int)(range)+1;
+    }
+    float scale = range == 0.0 ? 0.0f : float(level_count-1)/float(range);
+    par_for_block(I.size(),[&](size_t i)
+    {
+        level[i] = level_type(std::min<float>((float(I[i])-float(min_value))*scale,float(level_count-1)));
+    });
+    return level_count;
+}
 
-    std::list<std::pair<pixel_index<ImageType::dimension>,size_t> > flooding_points;
-    size_t basin_id = 1;
-    for (typename ImageType::value_type intensity = 0; intensity < presort_table.size(); ++intensity)
+/*
+    Counting sort of the voxels by level. sorted[offset[t]..offset[t+1]) are
+    the voxels at level t in raster order. Each thread histograms and
+    scatters its own contiguous range, so the result does not depend on the
+    thread count.
+*/
+template<class level_type>
+void watershed_sort(const std::vector<level_type>& level,unsigned int level_count,
+                    std::vector<size_t>& offset,std::vector<unsigned int>& sorted)
+{
+    size_t size = level.size();
+    int thread_count = int(std::min<size_t>(available_thread_count(),size/65536+1));
+    std::vector<std::vector<size_t> > count(thread_count,std::vector<size_t>(level_count+1));
+    par_for(thread_count,[&](int id)
+    {
+        size_t to = size*(id+1)/thread_count;
+        std::vector<size_t>& c = count[id];
+        for(size_t i = size*id/thread_count;i < to;++i)
+            ++c[level[i]];
+    });
+    offset.resize(level_count+1);
+    size_t sum = 0;
+    for(unsigned int t = 0;t < level_count;++t)
     {
-        if(presort_table[intensity].empty())
-            continue;
-        // new basin
+        offset[t] = sum;
+        for(int id = 0;id < thread_count;++id)
         {
-            typename std::list<pixel_index<ImageType::dimension> >::const_iterator iter = presort_table[intensity].begin();
-            typename std::list<pixel_index<ImageType::dimension> >::const_iterator end = presort_table[intensity].end();
-            for (; iter != end; ++iter)
-            {
-                if (label[iter->index()])
-                    continue;
-                flooding_points.push_back(std::make_pair(*iter,size_t(0)));
-            }
-            presort_table[intensity].clear();
+            size_t n = count[id][t];
+            count[id][t] = sum;
+            sum += n;
         }
-        typename std::list<std::pair<pixel_index<ImageType::dimension>,size_t> >::iterator iter = flooding_points.begin();
-        typename std::list<std::pair<pixel_index<ImageType::dimension>,size_t> >::iterator end = flooding_points.end();
-        while (iter != end)
+    }
+    offset[level_count] = sum;
+    sorted.resize(size);
+    par_for(thread_count,[&](int id)
+    {
+        size_t to = size*(id+1)/thread_count;
+        std::vector<size_t>& pos = count[id];
+        for(size_t i = size*id/thread_count;i < to;++i)
+            sorted[pos[level[i]]++] = (unsigned int)i;
+    });
+}
+
+/*
+    Priority flood on a hierarchical queue. The queue of level t is the
+    slice [offset[t],offset[t+1]) of one flat array: a voxel is labeled when
+    it is queued and only ever queued at its own level, so a slice never
+    overflows. Voxels at or below the current level go to a FIFO instead.
+    With new_basin, unreached voxels start a new basin at their level;
+    otherwise the labels already in label act as markers.
+*/
+template<class level_type,class LabelImageType>
+void watershed_flood(const std::vector<level_type>& level,
+                     const std::vector<size_t>& offset,
+                     const std::vector<unsigned int>& sorted,
+                     LabelImageType& label,bool new_basin)
+{
+    typedef typename LabelImageType::value_type label_type;
+    connected_neighbor_index<LabelImageType::dimension> neighbors(label.geometry());
+    unsigned int level_count = (unsigned int)(offset.size()-1);
+    std::vector<unsigned int> queue(level.size()),fifo;
+    std::vector<size_t> tail(offset.begin(),offset.end()-1);
+    for(size_t i = 0;i < sorted.size();++i)
+        if(label[sorted[i]])
+            queue[tail[level[sorted[i]]]++] = sorted[i];
+    label_type basin = 0;
+    for(unsigned int t = 0;t < level_count;++t)
+    {
+        auto flood = [&](void)
         {
-            if(I[iter->first.index()] != intensity)
+            for(size_t head = 0;head < fifo.size();++head)
             {
-                ++iter;
-                continue;
+                size_t p = fifo[head];
+                label_type cur_basin = label[p];
+                neighbors(p,[&](size_t q)
+                {
+                    if(label[q])
+                        return;
+                    label[q] = cur_basin;
+                    if(level[q] <= t)
+                        fifo.push_back((unsigned int)q);
+                    else
+                        queue[tail[level[q]]++] = (unsigned int)q;
+                });
             }
-            if (label[iter->first.index()] == 0)
-            {
-
-                size_t cur_basin;
-                if(iter->second == 0)
+            fifo.clear();
+        };
+        fifo.assign(queue.begin()+offset[t],queue.begin()+tail[t]);
+        flood();
+        if(new_basin)
+            for(size_t i = offset[t];i < offset[t+1];++i)
+                if(!label[sorted[i]])
                 {
-                    cur_basin = basin_id;
-                    ++basin_id;
+                    label[sorted[i]] = ++basin;
+                    fifo.push_back(sorted[i]);
+                    flood();
                 }
-                else
-                    cur_basin = iter->second;
-                label[iter->first.index()] = cur_basin;
-
-                pixel_index<ImageType::dimension> active_point(I.geometry());
-                std::vector<pixel_index<ImageType::dimension> > front,neighbor_points;
-                front.push_back(iter->first);
-                while(!front.empty())
+    }
+}
+
+/*
+    level_count: number of flood levels. The default 256 keeps the former
+    8-bit behavior; use 65536 for 16-bit or float data.
+*/
+template<class ImageType,class LabelImageType>
+void watershed(const ImageType& input_image,LabelImageType& label,unsigned int level_count = 256)
+{
+    label.clear();
+    label.resize(input_image.geometry());
+    std::vector<size_t> offset;
+    std::vector<unsigned int> sorted;
+    if(level_count <= 65536)
+    {
+        std::vector<unsigned short> level;
+        watershed_sort(level,watershed_level(input_image,level,level_count),offset,sorted);
+        watershed_flood(level,offset,sorted,label,true);
+    }
+    else
+    {
+        std::vector<unsigned int> level;
+        watershed_sort(level,watershed_level(input_image,level,level_count),offset,sorted);
+        watershed_flood(level,offset,sorted,label,true);
+    }
+}
+
+/*
+    Marker-controlled watershed: nonzero voxels in label are the markers and
+    the rest of label is flooded from them. Each level is flooded by
+    breadth-first fronts processed in parallel; a voxel reached by several
+    basins in the same step takes the smallest label, so the result does not
+    depend on the thread count.
+    level_count: number of flood levels as in watershed, at most 65536.
+*/
+template<class ImageType,class LabelImageType>
+void watershed_marker(const ImageType& input_image,LabelImageType& label,unsigned int level_count = 256)
+{
+    typedef typename LabelImageType::value_type label_type;
+    std::vector<unsigned short> level;
+    std::vector<size_t> offset;
+    std::vector<unsigned int> sorted;
+    watershed_sort(level,watershed_level(input_image,level,std::min<unsigned int>(level_count,65536)),offset,sorted);
+
+    size_t size = level.size();
+    unsigned int levels = (unsigned int)(offset.size()-1);
+    connected_neighbor_index<LabelImageType::dimension> neighbors(label.geometry());
+    std::unique_ptr<std::atomic<unsigned int>[]> owner(new std::atomic<unsigned int>[size]);
+    std::vector<unsigned char> finished(size);
+    std::vector<unsigned int> queue(size),front;
+    std::vector<size_t> tail(offset.begin(),offset.end()-1);
+    par_for_block(size,[&](size_t i)
+    {
+        owner[i] = (unsigned int)(label[i]);
+        finished[i] = label[i] ? 1 : 0;
+    });
+    for(size_t i = 0;i < size;++i)
+        if(finished[sorted[i]])
+            queue[tail[level[sorted[i]]]++] = sorted[i];
+
+    const size_t parallel_size = 4096;
+    int thread_count = available_thread_count();
+    std::vector<std::vector<unsigned int> > claimed(thread_count);
+    for(unsigned int t = 0;t < levels;++t)
+    {
+        front.assign(queue.begin()+offset[t],queue.begin()+tail[t]);
+        while(!front.empty())
+        {
+            auto expand = [&](size_t from,size_t to,std::vector<unsigned int>& out)
+            {
+                for(size_t j = from;j < to;++j)
                 {
-                    active_point = front.back();
-                    front.pop_back();
-                    get_connected_neighbors(active_point,I.geometry(),neighbor_points);
-                    for(size_t index = 0; index < neighbor_points.size(); ++index)
+                    unsigned int cur_basin = owner[front[j]].load(std::memory_order_relaxed);
+                    neighbors(front[j],[&](size_t q)
                     {
-                        size_t cur_index = neighbor_points[index].index();
-                        if(I[cur_index] == intensity)
-                        {
-                            if(label[cur_index] != cur_basin)
+                        if(finished[q])
+                            return;
+                        unsigned int cur = owner[q].load(std::memory_order_relaxed);
+                        while(cur == 0 || cur_basin < cur)
+                            if(owner[q].compare_exchange_weak(cur,cur_basin))
                             {
-                                front.push_back(neighbor_points[index]);
-                                label[cur_index] = cur_basin;
+                                if(cur == 0)
+                                    out.push_back((unsigned int)q);
+                                break;
                             }
-                        }
-                        else if(!label[cur_index])
-                            flooding_points.insert(iter,std::make_pair(neighbor_points[index],cur_basin));
-                    }
+                    });
+                }
+            };
+            int block_count = front.size() < parallel_size ? 1 : thread_count;
+            for(int id = 0;id < block_count;++id)
+                claimed[id].clear();
+            if(block_count == 1)
+                expand(0,front.size(),claimed[0]);
+            else
+                par_for(block_count,[&](int id)
+                {
+                    expand(front.size()*id/block_count,front.size()*(id+1)/block_count,claimed[id]);
+                });
+            front.clear();
+            for(int id = 0;id < block_count;++id)
+                for(size_t j = 0;j < claimed[id].size();++j)
+                {
+                    unsigned int q = claimed[id][j];
+                    finished[q] = 1;
+                    if(level[q] <= t)
+                        front.push_back(q);
+                    else
+                        queue[tail[level[q]]++] = q;
                 }
-            }
-            flooding_points.erase(iter++);
         }
     }
+    par_for_block(size,[&](size_t i)
+    {
+        label[i] = label_type(owner[i].load(std::memory_order_relaxed));
+    });
 }
 
-
 template<class ImageType,class LabelImageType>
 void watershed2(const ImageType& input_image,LabelImageType& label,unsigned int size_threshold,double detail_level = 1.0)
 {
-    typedef tipl::pixel_index<ImageType::dimension> pixel_type;
+    typedef typename LabelImageType::value_type label_type;
+    connected_neighbor_index<ImageType::dimension> neighbors(input_image.geometry());
     label.clear();
     label.resize(input_image.geometry());
     ImageType I(input_image);
@@ -119,31 +287,49 @@ void watershed2(const ImageType& input_image,LabelImageType& label,unsigned int
         tipl::threshold(I,mask,level*L);
         tipl::morphology::connected_component_labeling(mask,cur_label,regions);
 
-        // merge
+        // merge: grow the labeled regions into the mask one layer at a time
         if(L != 2.0)
-        while(1)
         {
-            std::vector<unsigned int> grow_pos;
-            std::vector<unsigned int> grow_index;
-            for(pixel_type pos(label.geometry()); pos < label.size();++pos)
-                if(cur_label[pos.index()])
+            std::vector<unsigned int> grow_pos,next_pos;
+            std::vector<label_type> grow_index;
+            std::vector<unsigned char> queued(label.size());
+            for(size_t pos = 0;pos < label.size();++pos)
+                if(cur_label[pos])
+                {
+                    bool has_label = false;
+                    neighbors(pos,[&](size_t q){if(label[q])has_label = true;});
+                    if(has_label)
+                    {
+                        grow_pos.push_back((unsigned int)pos);
+                        queued[pos] = 1;
+                    }
+                }
+            while(!grow_pos.empty())
+            {
+                grow_index.resize(grow_pos.size());
+                for(size_t i = 0;i < grow_pos.size();++i)
+                {
+                    label_type first = 0;
+                    neighbors(grow_pos[i],[&](size_t q){if(!first)first = label[q];});
+                    grow_index[i] = first;
+                }
+                for(size_t i = 0;i < grow_pos.size();++i)
                 {
-                    std::vector<pixel_type> neighbor_points;
-                    get_connected_neighbors(pos,label.geometry(),neighbor_points);
-                    for(unsigned int index = 0;index < neighbor_points.size();++index)
-                        if(label[neighbor_points[index].index()])
+                    label[grow_pos[i]] = grow_index[i];
+                    cur_label[grow_pos[i]] = 0;
+                }
+                next_pos.clear();
+                for(size_t i = 0;i < grow_pos.size();++i)
+                    neighbors(grow_pos[i],[&](size_t q)
+                    {
+                        if(cur_label[q] && !queued[q])
                         {
-                            grow_pos.push_back(pos.index());
-                            grow_index.push_back(label[neighbor_points[index].index()]);
-                            cur_label[pos.index()] = 0;
-                            break;
+                            queued[q] = 1;
+                            next_pos.push_back((unsigned int)q);
                         }
-
-                }
-            if(grow_pos.empty())
-                break;
-            for(unsigned int index = 0;index < grow_pos.size();++index)
-                label[grow_pos[index]] = grow_index[index];
+                    });
+                grow_pos.swap(next_pos);
+            }
         }
 
         // new regions
@@ -0,0 +1,112 @@
+// tiled anisotropic diffusion against a serial reference of the same scheme
+#include <numeric>
+#include <random>
+#include "tipl/utility/basic_image.hpp"
+#include "tipl/utility/multi_thread.hpp"
+#include "tipl/filter/anisotropic_diffusion.hpp"
+#include "check.hpp"
+
+namespace reference
+{
+// explicit Perona-Malik steps over the whole volume, one voxel at a time
+template<class fun_type>
+void anisotropic_diffusion(tipl::image<float,3>& I,const float spacing[3],float K2_scale,int iteration,fun_type g)
+{
+    int n[3] = {I.width(),I.height(),I.depth()};
+    size_t shift[3] = {1,size_t(n[0]),size_t(n[0])*n[1]};
+    float inv_h2[3],sum_inv_h2 = 0.0f;
+    for(int d = 0;d < 3;++d)
+        sum_inv_h2 += inv_h2[d] = 1.0f/(spacing[d]*spacing[d]);
+    float dt = 0.5f/sum_inv_h2;
+    for(int iter = 0;iter < iteration;++iter)
+    {
+        float inv_K2[3];
+        for(int d = 0;d < 3;++d)
+        {
+            double sum2 = 0.0,count = 0.0;
+            for(tipl::pixel_index<3> index(I.geometry());index < I.size();++index)
+                if(index[d]+1 < n[d])
+                {
+                    double dif = I[index.index()+shift[d]]-I[index.index()];
+                    sum2 += dif*dif;
+                    ++count;
+                }
+            inv_K2[d] = sum2 > 0.0 ? float(count/(sum2*K2_scale)) : 0.0f;
+        }
+        tipl::image<float,3> J(I);
+        for(tipl::pixel_index<3> index(I.geometry());index < I.size();++index)
+        {
+            size_t i = index.index();
+            float sum = 0.0f;
+            for(int d = 0;d < 3;++d)
+            {
+                auto flux = [&](size_t from,size_t to)
+                {
+                    float dif = I[to]-I[from];
+                    return g(dif*dif*inv_K2[d])*dif*inv_h2[d];
+                };
+                if(index[d]+1 < n[d])
+                    sum += flux(i,i+shift[d]);
+                if(index[d] > 0)
+                    sum -= flux(i-shift[d],i);
+            }
+            J[i] = I[i]+dt*sum;
+        }
+        I.swap(J);
+    }
+}
+}
+
+int main(void)
+{
+    // a noisy step with anisotropic voxels
+    tipl::geometry<3> geo(48,40,24);
+    tipl::image<float,3> I(geo);
+    std::mt19937 gen(0);
+    std::normal_distribution<float> noise(0.0f,10.0f);
+    for(tipl::pixel_index<3> index(geo);index < geo.size();++index)
+        I[index.index()] = (index[0]+index[2] > 36 ? 100.0f : 0.0f)+noise(gen);
+    const float spacing[3] = {1.0f,1.0f,2.0f};
+    const float conductance = 1.5f;
+    double sum = std::accumulate(I.begin(),I.end(),0.0);
+    float min_value = *std::min_element(I.begin(),I.end());
+    float max_value = *std::max_element(I.begin(),I.end());
+
+    tipl::image<float,3> expected(I),expected_inv(I);
+    reference::anisotropic_diffusion(expected,spacing,2.0f*conductance*conductance,5,
+                                     tipl::filter::imp::perona_malik_exp());
+    reference::anisotropic_diffusion(expected_inv,spacing,conductance*conductance,5,
+                                     tipl::filter::imp::perona_malik_inv());
+    unsigned int budget[3] = {1,3,8};
+    for(int j = 0;j < 3;++j)
+    {
+        tipl::thread_budget() = budget[j];
+        tipl::image<float,3> result(I),result_inv(I);
+        tipl::filter::anisotropic_diffusion(result,spacing,conductance,5);
+        tipl::filter::anisotropic_diffusion_inv(result_inv,spacing,conductance,5);
+        CHECK(max_difference(result,expected,geo.size()) < 1.0e-3);
+        CHECK(max_difference(result_inv,expected_inv,geo.size()) < 1.0e-3);
+        // no flux through the boundary and the maximum principle
+        CHECK(std::fabs(std::accumulate(result.begin(),result.end(),0.0)-sum) < 1.0e-5*geo.size()*max_value);
+        CHECK(*std::min_element(result.begin(),result.end()) >= min_value);
+        CHECK(*std::max_element(result.begin(),result.end()) <= max_value);
+    }
+    tipl::thread_budget() = 0;
+    // the noise is smoothed
+    CHECK(max_difference(expected,I,geo.size()) > 1.0);
+
+    // integer images are rounded
+    {
+        tipl::image<short,3> S(tipl::geometry<3>(32,32,8));
+        tipl::image<float,3> F(S.geometry());
+        for(size_t i = 0;i < S.size();++i)
+            F[i] = S[i] = short(i%32 < 16 ? 0 : 100)+short(noise(gen));
+        const float unit[3] = {1.0f,1.0f,1.0f};
+        tipl::filter::anisotropic_diffusion(S);
+        reference::anisotropic_diffusion(F,unit,2.0f,5,tipl::filter::imp::perona_malik_exp());
+        for(size_t i = 0;i < S.size();++i)
+            F[i] = std::floor(F[i]+0.5f);
+        CHECK(max_difference(S,F,S.size()) <= 1.0);
+    }
+    return check_result("anisotropic_diffusion");
+}
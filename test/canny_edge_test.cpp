@@ -0,0 +1,123 @@
+// tiled, multithreaded Canny against a whole-image serial reference
+#include <random>
+#include "tipl/utility/basic_image.hpp"
+#include "tipl/utility/multi_thread.hpp"
+#include "tipl/filter/canny_edge.hpp"
+#include "check.hpp"
+
+namespace reference
+{
+// [1 2 1] smoothing, Sobel, non-maximum suppression and hysteresis by
+// flooding from the strong pixels, each over the whole image
+void canny_edge(const tipl::image<float,2>& src,tipl::image<unsigned char,2>& edge,float low_ratio,float high_ratio)
+{
+    int w = src.width(),h = src.height();
+    auto at = [&](const std::vector<float>& I,int x,int y)
+    {
+        return I[size_t(std::min(h-1,std::max(0,y)))*w+std::min(w-1,std::max(0,x))];
+    };
+    std::vector<float> I(src.begin(),src.end()),col(src.size()),s(src.size()),gx(src.size()),gy(src.size()),m(src.size()),nms(src.size());
+    for(int y = 0;y < h;++y)
+        for(int x = 0;x < w;++x)
+            col[size_t(y)*w+x] = at(I,x,y-1)+2.0f*at(I,x,y)+at(I,x,y+1);
+    for(int y = 0;y < h;++y)
+        for(int x = 0;x < w;++x)
+            s[size_t(y)*w+x] = (at(col,x-1,y)+2.0f*at(col,x,y)+at(col,x+1,y))*0.0625f;
+    for(int y = 0;y < h;++y)
+        for(int x = 0;x < w;++x)
+        {
+            size_t i = size_t(y)*w+x;
+            gx[i] = (at(s,x+1,y-1)+2.0f*at(s,x+1,y)+at(s,x+1,y+1))-(at(s,x-1,y-1)+2.0f*at(s,x-1,y)+at(s,x-1,y+1));
+            gy[i] = (at(s,x-1,y+1)-at(s,x-1,y-1))+2.0f*(at(s,x,y+1)-at(s,x,y-1))+(at(s,x+1,y+1)-at(s,x+1,y-1));
+            m[i] = std::sqrt(gx[i]*gx[i]+gy[i]*gy[i]);
+        }
+    for(int y = 0;y < h;++y)
+        for(int x = 0;x < w;++x)
+        {
+            size_t i = size_t(y)*w+x;
+            float ax = std::fabs(gx[i]),ay = std::fabs(gy[i]);
+            int dx = 1,dy = 1;
+            if(ax > ay*2.41421356f)
+                dy = 0;
+            else
+            if(ay > ax*2.41421356f)
+                dx = 0;
+            else
+                dx = (gx[i] > 0.0f) == (gy[i] > 0.0f) ? 1 : -1;
+            float m1 = (x-dx >= 0 && x-dx < w && y-dy >= 0) ? m[i-dx-dy*w] : 0.0f;
+            float m2 = (x+dx >= 0 && x+dx < w && y+dy < h) ? m[i+dx+dy*w] : 0.0f;
+            nms[i] = (m[i] == 0.0f || m[i] < m1 || m[i] < m2) ? 0.0f : m[i];
+        }
+    float max_m = *std::max_element(nms.begin(),nms.end());
+    float low = max_m*low_ratio,high = max_m*high_ratio;
+    edge.resize(src.geometry());
+    std::fill(edge.begin(),edge.end(),0);
+    std::vector<size_t> front;
+    for(size_t i = 0;i < nms.size();++i)
+        if(nms[i] > high)
+        {
+            edge[i] = 1;
+            front.push_back(i);
+        }
+    while(!front.empty())
+    {
+        size_t i = front.back();
+        front.pop_back();
+        int x = int(i%w),y = int(i/w);
+        for(int dy = -1;dy <= 1;++dy)
+            for(int dx = -1;dx <= 1;++dx)
+            {
+                if(x+dx < 0 || x+dx >= w || y+dy < 0 || y+dy >= h)
+                    continue;
+                size_t j = size_t(y+dy)*w+x+dx;
+                if(!edge[j] && nms[j] > low)
+                {
+                    edge[j] = 1;
+                    front.push_back(j);
+                }
+            }
+    }
+}
+}
+
+int main(void)
+{
+    // several tiles of rows, with edges running across the tile seams
+    tipl::geometry<3> geo(300,500,4);
+    tipl::image<float,3> I(geo);
+    std::mt19937 gen(0);
+    std::normal_distribution<float> noise(0.0f,4.0f);
+    for(int z = 0,i = 0;z < geo.depth();++z)
+        for(int y = 0;y < geo.height();++y)
+            for(int x = 0;x < geo.width();++x,++i)
+            {
+                float dx = x-150.0f,dy = y-250.0f-10.0f*z;
+                I[i] = (dx*dx+dy*dy < 120.0f*120.0f ? 100.0f : 0.0f)+(x/40)*20.0f+noise(gen);
+            }
+    tipl::geometry<2> slice_geo(geo.width(),geo.height());
+    std::vector<tipl::image<unsigned char,2> > expected(geo.depth());
+    for(int z = 0;z < geo.depth();++z)
+    {
+        tipl::image<float,2> slice(slice_geo);
+        std::copy(I.begin()+z*slice.size(),I.begin()+(z+1)*slice.size(),slice.begin());
+        reference::canny_edge(slice,expected[z],0.1f,0.2f);
+        CHECK(std::count(expected[z].begin(),expected[z].end(),1) > 1000);
+        unsigned int budget[2] = {1,8};
+        for(int j = 0;j < 2;++j)
+        {
+            tipl::thread_budget() = budget[j];
+            tipl::image<unsigned char,2> edge;
+            tipl::filter::canny_edge(slice,edge,0.1f,0.2f);
+            CHECK(max_difference(edge,expected[z],slice.size()) == 0.0);
+        }
+        tipl::thread_budget() = 0;
+    }
+    // a volume runs its slices in parallel, each with the serial 2D kernel
+    {
+        tipl::image<unsigned char,3> edge;
+        tipl::filter::canny_edge(I,edge,0.1f,0.2f);
+        for(int z = 0;z < geo.depth();++z)
+            CHECK(max_difference(edge.begin()+z*slice_geo.size(),expected[z],slice_geo.size()) == 0.0);
+    }
+    return check_result("canny_edge");
+}
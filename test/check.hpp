@@ -0,0 +1,41 @@
+#ifndef TIPL_TEST_CHECK_HPP
+#define TIPL_TEST_CHECK_HPP
+#include <cmath>
+#include <cstdio>
+#include <cstddef>
+
+/*
+    Minimal checks for the test programs: each failed check is printed
+    and the program returns the failure count.
+*/
+inline int& check_failure_count(void)
+{
+    static int count = 0;
+    return count;
+}
+inline void check(bool condition,const char* what,const char* file,int line)
+{
+    if(condition)
+        return;
+    ++check_failure_count();
+    std::printf("%s:%d: check failed: %s\n",file,line,what);
+}
+#define CHECK(condition) check(!!(condition),#condition,__FILE__,__LINE__)
+
+// largest absolute difference of two sequences of size n
+template<class lhs_type,class rhs_type>
+double max_difference(const lhs_type& lhs,const rhs_type& rhs,size_t n)
+{
+    double result = 0.0;
+    for(size_t i = 0;i < n;++i)
+        result = std::fmax(result,std::fabs(double(lhs[i])-double(rhs[i])));
+    return result;
+}
+
+inline int check_result(const char* name)
+{
+    std::printf("%s: %s\n",name,check_failure_count() ? "FAILED" : "passed");
+    return check_failure_count();
+}
+
+#endif
@@ -0,0 +1,185 @@
+// augmentation queue: identity output, fixed-seed determinism, termination and the block size check
+#include <random>
+#include "tipl/ml/cnn.hpp"
+#include "check.hpp"
+
+typedef tipl::ml::network_data_augmentation<int> augmentation;
+
+// reads every sample in increasing order, as train_batch does
+std::vector<float> read_all(augmentation& a,size_t sample_size)
+{
+    std::vector<float> result(a.size()*sample_size);
+    for(size_t i = 0;i < a.size();++i)
+        a.get_data(i,&result[i*sample_size]);
+    return result;
+}
+
+int main(void)
+{
+    std::mt19937 gen(5);
+    std::uniform_real_distribution<float> u(-1.0f,1.0f);
+    const tipl::geometry<3> dim(6,5,2);
+    tipl::ml::network_data<int> data;
+    data.input = dim;
+    data.output = tipl::geometry<3>(1,1,3);
+    const size_t n = 203;
+    for(size_t i = 0;i < n;++i)
+    {
+        std::vector<float> v(dim.size());
+        for(auto& x : v)
+            x = u(gen);
+        data.data.push_back(v);
+        data.data_label.push_back(int(i%3));
+    }
+    // the identity transform passes the samples and labels through the queue unchanged
+    {
+        tipl::ml::network_data_proxy<int> proxy(data);
+        augmentation::param_type param;
+        augmentation a(proxy,dim,param,1,16,3,3);
+        std::mt19937 order_gen(4);
+        for(int epoch = 0;epoch < 3;++epoch)
+        {
+            if(epoch)
+                a.shuffle(order_gen);
+            bool same = true;
+            for(size_t i = 0;i < n;++i)
+            {
+                same = same && max_difference(proxy.get_data(i),a.get_data(i),dim.size()) == 0.0;
+                same = same && a.get_label(i) == proxy.get_label(i);
+            }
+            CHECK(same);
+        }
+    }
+    // a network trained through the identity augmentation matches the one
+    // trained on the data directly
+    {
+        tipl::ml::network nn;
+        CHECK(nn << std::string("6,5,2|full,relu|1,1,8|full,identity|1,1,3"));
+        nn.init_weights(3);
+        tipl::ml::network nn2;
+        nn2 = nn;
+        tipl::ml::trainer t,t2;
+        t.epoch = t2.epoch = 3;
+        t.batch_size = t2.batch_size = 16;
+        t.deterministic = t2.deterministic = true;
+        bool terminated = false;
+        tipl::ml::network_data_proxy<int> proxy(data),proxy2(data);
+        augmentation::param_type param;
+        t.train(nn,proxy,terminated,[](){});
+        augmentation a(proxy2,dim,param,1,32);
+        t2.train(nn2,a,terminated,[](){});
+        for(size_t k = 0;k < nn.layers.size();++k)
+        {
+            CHECK(nn.layers[k]->weight == nn2.layers[k]->weight);
+            CHECK(nn.layers[k]->bias == nn2.layers[k]->bias);
+        }
+        // a block smaller than a batch is rejected
+        augmentation small_block(proxy2,dim,param,1,8);
+        bool thrown = false;
+        try
+        {
+            t2.train(nn2,small_block,terminated,[](){});
+        }
+        catch(const std::runtime_error&)
+        {
+            thrown = true;
+        }
+        CHECK(thrown);
+    }
+    // the same seed gives the same samples whatever the number of threads,
+    // in every shuffled epoch; another seed does not
+    {
+        augmentation::param_type param;
+        param.flip_x = param.flip_y = true;
+        param.intensity_scale = 0.2f;
+        param.intensity_shift = 0.1f;
+        param.noise = 0.05f;
+        param.rotation = 0.3f;
+        param.scaling = 0.1f;
+        param.translation = 1.0f;
+        tipl::ml::network_data_proxy<int> p1(data),p2(data),p3(data);
+        augmentation a1(p1,dim,param,7,16,4,1),a2(p2,dim,param,7,16,4,3),a3(p3,dim,param,8,16,4,2);
+        std::mt19937 g1(9),g2(9),g3(9);
+        for(int epoch = 0;epoch < 3;++epoch)
+        {
+            if(epoch)
+            {
+                a1.shuffle(g1);
+                a2.shuffle(g2);
+                a3.shuffle(g3);
+            }
+            auto x1 = read_all(a1,dim.size()),x2 = read_all(a2,dim.size()),x3 = read_all(a3,dim.size());
+            CHECK(x1 == x2);
+            CHECK(x1 != x3);
+            // the samples are transformed
+            bool changed = false;
+            for(size_t i = 0;i < n;++i)
+                changed = changed || max_difference(p1.get_data(i),&x1[i*dim.size()],dim.size()) != 0.0;
+            CHECK(changed);
+        }
+    }
+    // flips only: each sample is the source or one of its mirror images
+    {
+        augmentation::param_type param;
+        param.flip_x = param.flip_y = true;
+        tipl::ml::network_data_proxy<int> proxy(data);
+        augmentation a(proxy,dim,param,2,16);
+        auto x = read_all(a,dim.size());
+        std::vector<int> flip_count(4);
+        bool mirrored = true;
+        for(size_t i = 0;i < n;++i)
+        {
+            const float* from = proxy.get_data(i);
+            const float* to = &x[i*dim.size()];
+            int match = -1;
+            for(int flip = 0;flip < 4 && match < 0;++flip)
+            {
+                bool same = true;
+                for(size_t j = 0;j < dim.size();++j)
+                {
+                    size_t px = j % dim.width(),py = (j/dim.width()) % dim.height(),c = j/dim.plane_size();
+                    if(flip & 1)
+                        px = dim.width()-1-px;
+                    if(flip & 2)
+                        py = dim.height()-1-py;
+                    same = same && to[j] == from[(c*dim.height()+py)*dim.width()+px];
+                }
+                if(same)
+                    match = flip;
+            }
+            mirrored = mirrored && match >= 0;
+            if(match >= 0)
+                ++flip_count[match];
+        }
+        CHECK(mirrored);
+        for(int flip = 0;flip < 4;++flip)
+            CHECK(flip_count[flip] > 0);
+        // the pointer access goes through the queue and gives the same samples
+        bool same = true;
+        for(size_t i = 0;i < n;++i)
+            same = same && max_difference(&x[i*dim.size()],a.get_data(i),dim.size()) == 0.0;
+        CHECK(same);
+    }
+    // the workers stop when the queue is abandoned part way, after the last
+    // block, or before any sample is read
+    {
+        augmentation::param_type param;
+        param.noise = 0.1f;
+        tipl::ml::network_data_proxy<int> proxy(data);
+        {
+            augmentation a(proxy,dim,param,1,16,3,4);
+        }
+        {
+            augmentation a(proxy,dim,param,1,16,3,4);
+            a.get_data(40);
+        }
+        {
+            augmentation a(proxy,dim,param,1,16,3,4);
+            std::mt19937 order_gen(1);
+            read_all(a,dim.size());
+            a.shuffle(order_gen);
+            a.get_data(17);
+        }
+    }
+    return check_result("cnn_augmentation");
+}
@@ -0,0 +1,59 @@
+// mini-batch forward, backward and dw/db against the single-sample path
+#include <random>
+#include "tipl/ml/cnn.hpp"
+#include "check.hpp"
+
+int main(void)
+{
+    tipl::ml::network nn;
+    nn << std::string("10,10,2|conv,relu,3|8,8,4|max_pooling,identity,2|4,4,4|conv,relu,3|2,2,3|"
+                      "full,relu|1,1,6|partially,identity|1,1,3");
+    CHECK(!nn.empty());
+    nn.init_weights(1);
+    const int n = 7;
+    const int input_size = nn.get_input_size(),data_size = nn.data_size,output_pos = data_size-nn.output_size;
+    std::mt19937 gen(2);
+    std::normal_distribution<float> normal;
+    std::vector<float> X(n*input_size);
+    for(auto& v : X)
+        v = normal(gen);
+
+    // one batch of n samples in the per-sample in_out layout
+    std::vector<float> in_out(n*data_size),df(n*data_size);
+    nn.forward_propagation(&X[0],input_size,&in_out[0],n);
+    for(int m = 0;m < n;++m)
+        for(int j = 0;j < nn.output_size;++j)
+            df[m*data_size+output_pos+j] = normal(gen);
+    std::vector<float> output_df(df);
+    std::vector<std::vector<float> > batch_dw(nn.layers.size()),batch_db(nn.layers.size());
+    for(size_t k = 0;k < nn.layers.size();++k)
+    {
+        batch_dw[k].resize(nn.layers[k]->weight.size());
+        batch_db[k].resize(nn.layers[k]->bias.size());
+    }
+    std::vector<std::vector<float> > dw(batch_dw),db(batch_db);
+    nn.back_propagation(&in_out[0]+output_pos,&df[0]+output_pos,n);
+    nn.calculate_dwdb(&X[0],input_size,&df[0],&in_out[0],n,batch_dw,batch_db);
+
+    // the same samples one at a time
+    double difference = 0.0;
+    std::vector<float> in_out1(data_size),df1(data_size);
+    for(int m = 0;m < n;++m)
+    {
+        nn.forward_propagation(&X[m*input_size],&in_out1[0]);
+        difference = std::max(difference,max_difference(in_out1,&in_out[m*data_size],data_size));
+        std::fill(df1.begin(),df1.end(),0.0f);
+        std::copy(&output_df[m*data_size+output_pos],&output_df[m*data_size+data_size],&df1[output_pos]);
+        nn.back_propagation(&in_out1[0]+output_pos,&df1[0]+output_pos);
+        size_t first = nn.layers[0]->output_size;
+        difference = std::max(difference,max_difference(&df1[first],&df[m*data_size+first],data_size-first));
+        nn.calculate_dwdb(&X[m*input_size],&df1[0],&in_out1[0],dw,db);
+    }
+    CHECK(difference < 1.0e-5);
+    for(size_t k = 0;k < nn.layers.size();++k)
+    {
+        CHECK(max_difference(batch_dw[k],dw[k],dw[k].size()) < 1.0e-4);
+        CHECK(max_difference(batch_db[k],db[k],db[k].size()) < 1.0e-4);
+    }
+    return check_result("cnn_batch");
+}
@@ -0,0 +1,62 @@
+// compiled_network against network::predict
+#include <random>
+#include "tipl/ml/cnn.hpp"
+#include "check.hpp"
+
+int main(void)
+{
+    std::mt19937 gen(5);
+    std::normal_distribution<float> normal(0.0f,0.3f);
+    tipl::ml::network_data<unsigned char> data;
+    data.input = tipl::geometry<3>(24,24,2);
+    data.output = tipl::geometry<3>(1,1,4);
+    for(int i = 0;i < 200;++i)
+    {
+        std::vector<float> v(24*24*2);
+        for(auto& x : v)
+            x = normal(gen);
+        data.data.push_back(v);
+        data.data_label.push_back(i%4);
+    }
+    tipl::ml::network_data_proxy<unsigned char> proxy(data);
+    // fused convolution and pooling, dropout, partially connected, residual
+    // and soft-max layers, a pooling that is not fused, and a single output
+    const char* text[] = {
+        "24,24,2|conv,relu,5|20,20,8|max_pooling,identity,2|10,10,8|dropout,0.5|10,10,8|conv,identity,3|8,8,6|"
+        "max_pooling,relu,2|4,4,6|max_pooling,identity,2|2,2,6|full,relu|1,1,20|partially,relu|1,1,10|"
+        "res,identity|1,1,10|full,identity|1,1,4|soft_max|1,1,4",
+        "24,24,2|conv,relu,3|22,22,6|max_pooling,identity,3|7,7,6|full,relu|1,1,16|full,identity|1,1,4",
+        "24,24,2|full,relu|1,1,32|full,identity|1,1,1"};
+    for(int k = 0;k < 3;++k)
+    {
+        tipl::ml::network nn;
+        CHECK(nn << std::string(text[k]));
+        nn.init_weights(3);
+        nn.set_test_mode(true);
+        for(int quantized = 0;quantized < 2;++quantized)
+        {
+            if(quantized)
+                nn.quantize(proxy,256);
+            tipl::ml::compiled_network cn(nn);
+            CHECK(cn.get_arena_size() <= nn.data_size);
+            double difference = 0.0,max_output = 0.0;
+            std::vector<float> expected,result;
+            for(size_t i = 0;i < data.size();++i)
+            {
+                nn.predict(&data.data[i][0],expected);
+                cn.predict(&data.data[i][0],result);
+                CHECK(result.size() == expected.size());
+                difference = std::max(difference,max_difference(result,expected,expected.size()));
+                max_output = std::max(max_output,max_difference(expected,std::vector<float>(expected.size()),expected.size()));
+            }
+            CHECK(max_output > 0.0);
+            CHECK(difference < 1.0e-5*std::max(1.0,max_output));
+            std::vector<float> all_expected,all_result;
+            nn.predict(proxy,all_expected);
+            cn.predict(proxy,all_result);
+            CHECK(all_result.size() == all_expected.size());
+            CHECK(max_difference(all_result,all_expected,all_expected.size()) < 1.0e-5*std::max(1.0,max_output));
+        }
+    }
+    return check_result("cnn_compiled");
+}
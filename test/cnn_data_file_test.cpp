@@ -0,0 +1,108 @@
+// memory-mapped sample file round trip and the block loader order
+#include <random>
+#include "tipl/ml/cnn.hpp"
+#include "check.hpp"
+
+int main(void)
+{
+    std::mt19937 gen(8);
+    std::uniform_real_distribution<float> u(-0.5f,2.0f);
+    // the label of each sample is its index
+    tipl::ml::network_data<int> data;
+    data.input = tipl::geometry<3>(5,4,3);
+    data.output = tipl::geometry<3>(1,1,7);
+    const size_t n = 1000,dim = 60;
+    for(size_t i = 0;i < n;++i)
+    {
+        std::vector<float> v(dim);
+        for(auto& x : v)
+            x = u(gen);
+        data.data.push_back(v);
+        data.data_label.push_back(int(i));
+    }
+    // float32 is exact, float16 keeps 11 bits, uint8 rounds to 255 steps over [-0.5,2]
+    const tipl::ml::network_data_storage storage[] = {tipl::ml::float32_storage,tipl::ml::float16_storage,tipl::ml::uint8_storage};
+    const double tolerance[] = {0.0,1.0e-3,0.5*2.5/255.0+1.0e-6};
+    for(int s = 0;s < 3;++s)
+    {
+        CHECK(tipl::ml::save_to_mapped_file(data,"data.bin",storage[s]));
+        tipl::ml::network_data_file<int> file;
+        CHECK(file.load_from_file("data.bin"));
+        CHECK(file.size() == n && file.sample_dim() == dim && file.storage() == storage[s]);
+        CHECK(file.input == data.input && file.output == data.output);
+        CHECK((file.get_raw_data(0) != 0) == (storage[s] == tipl::ml::float32_storage));
+        tipl::ml::network_data<int> loaded;
+        CHECK(file.load(loaded));
+        CHECK(loaded.data_label == data.data_label);
+        double difference = 0.0;
+        for(size_t i = 0;i < n;++i)
+            difference = std::max(difference,max_difference(loaded.data[i],data.data[i],dim));
+        CHECK(difference <= tolerance[s]);
+        // a file with another label type is rejected
+        tipl::ml::network_data_file<double> wrong_label;
+        CHECK(!wrong_label.load_from_file("data.bin"));
+    }
+
+    // the loader visits the blocks of 64 samples in the shuffled order and
+    // every sample once, with its own label
+    CHECK(tipl::ml::save_to_mapped_file(data,"data.bin",tipl::ml::float32_storage));
+    tipl::ml::network_data_file<int> file;
+    CHECK(file.load_from_file("data.bin"));
+    const size_t block_size = 64;
+    tipl::ml::network_data_loader<int> loader(file,block_size);
+    CHECK(loader.size() == n);
+    std::mt19937 order_gen(3);
+    std::vector<int> previous_order;
+    for(int epoch = 0;epoch < 3;++epoch)
+    {
+        if(epoch)
+            loader.shuffle(order_gen);
+        std::vector<int> order(n);
+        std::vector<unsigned char> seen(n);
+        bool content = true;
+        for(size_t i = 0;i < n;++i)
+        {
+            int label = order[i] = loader.get_label(i);
+            CHECK(label >= 0 && label < int(n));
+            if(label < 0 || label >= int(n))
+                break;
+            ++seen[label];
+            content = content && max_difference(data.data[label],loader.get_data(i),dim) == 0.0;
+        }
+        CHECK(content);
+        CHECK(std::count(seen.begin(),seen.end(),1) == int(n));
+        // consecutive positions hold whole source blocks
+        size_t block_count = 0;
+        bool whole_block = true;
+        for(size_t i = 0;i < n;)
+        {
+            size_t block = size_t(order[i])/block_size;
+            size_t length = std::min(block_size,n-block*block_size);
+            for(size_t k = i;k < i+length && k < n;++k)
+                whole_block = whole_block && size_t(order[k])/block_size == block;
+            i += length;
+            ++block_count;
+        }
+        CHECK(whole_block);
+        CHECK(block_count == (n+block_size-1)/block_size);
+        // before the first shuffle the blocks come in file order
+        bool ascending = true;
+        for(size_t i = 0;i+1 < n;++i)
+            ascending = ascending && size_t(order[i])/block_size <= size_t(order[i+1])/block_size;
+        CHECK(ascending == (epoch == 0));
+        CHECK(order != previous_order);
+        previous_order = order;
+    }
+    // the same generator state gives the same order
+    {
+        tipl::ml::network_data_loader<int> a(file,block_size),b(file,block_size);
+        std::mt19937 gen_a(11),gen_b(11);
+        a.shuffle(gen_a);
+        b.shuffle(gen_b);
+        bool same = true;
+        for(size_t i = 0;i < n;++i)
+            same = same && a.get_label(i) == b.get_label(i);
+        CHECK(same);
+    }
+    return check_result("cnn_data_file");
+}
@@ -0,0 +1,71 @@
+// dense_network against network::predict on every patch of a slice
+#include <random>
+#include "tipl/ml/cnn.hpp"
+#include "check.hpp"
+
+int main(void)
+{
+    std::mt19937 gen(5);
+    std::normal_distribution<float> normal(0.0f,0.5f);
+    // a trous sampling after pooling, pooling sizes that drop rows, fully and
+    // partially connected layers as convolutions, dropout and soft-max
+    const char* text[] = {
+        "24,24,2|conv,relu,5|20,20,8|max_pooling,identity,2|10,10,8|dropout,0.5|10,10,8|conv,identity,3|8,8,6|"
+        "max_pooling,relu,2|4,4,6|max_pooling,identity,2|2,2,6|full,relu|1,1,20|partially,relu|1,1,10|"
+        "res,identity|1,1,10|full,identity|1,1,4|soft_max|1,1,4",
+        "24,24,2|conv,relu,3|22,22,6|max_pooling,identity,3|7,7,6|full,relu|2,2,4|full,identity|1,1,3",
+        "24,24,2|conv,relu,3|22,22,4|partially,relu|1,1,6|full,identity|1,1,1",
+        "24,24,2|full,relu|1,1,1"};
+    for(int k = 0;k < 4;++k)
+    {
+        tipl::ml::network nn;
+        CHECK(nn << std::string(text[k]));
+        if(k == 2)
+        {
+            // a sparse mapping with some outputs left unconnected
+            auto layer = dynamic_cast<tipl::ml::partially_connected_layer*>(nn.layers[1].get());
+            for(int i = 0;i < 6;i += 2)
+                for(int j = 0;j < 50;++j)
+                    layer->mapping[i].push_back((i*977+j*131)%(22*22*4));
+        }
+        nn.init_weights(3);
+        nn.set_test_mode(true);
+        tipl::image<float,3> I(tipl::geometry<3>(60,50,2));
+        for(auto& v : I)
+            v = normal(gen);
+        tipl::ml::dense_network dn;
+        dn.band_rows = 7;
+        CHECK(dn.compile(nn));
+        tipl::image<float,3> out;
+        CHECK(dn.predict(I,out));
+        CHECK(out.geometry() == tipl::geometry<3>(60-24+1,50-24+1,nn.output_size));
+        double difference = 0.0,max_output = 0.0;
+        std::vector<float> patch(24*24*2),expected;
+        for(int y = 0;y < out.height();++y)
+            for(int x = 0;x < out.width();++x)
+            {
+                for(int c = 0;c < 2;++c)
+                    for(int py = 0;py < 24;++py)
+                        for(int px = 0;px < 24;++px)
+                            patch[(c*24+py)*24+px] = I[(c*50+y+py)*60+x+px];
+                nn.predict(&patch[0],expected);
+                for(size_t o = 0;o < expected.size();++o)
+                {
+                    difference = std::max<double>(difference,std::fabs(expected[o]-out[(o*out.height()+y)*out.width()+x]));
+                    max_output = std::max<double>(max_output,std::fabs(expected[o]));
+                }
+            }
+        CHECK(max_output > 0.0);
+        CHECK(difference < 1.0e-5*std::max(1.0,max_output));
+    }
+    // a convolution after a fully connected layer has no dense form
+    {
+        tipl::ml::network nn;
+        CHECK(nn << std::string("24,24,2|full,relu|4,4,2|conv,relu,3|2,2,1|full,identity|1,1,2"));
+        nn.init_weights(1);
+        tipl::ml::dense_network dn;
+        CHECK(!dn.compile(nn));
+        CHECK(dn.empty());
+    }
+    return check_result("cnn_dense");
+}
@@ -0,0 +1,74 @@
+// deterministic training gives bitwise-equal networks and statistics for any thread budget
+#include <random>
+#include "tipl/ml/cnn.hpp"
+#include "check.hpp"
+
+struct result_type
+{
+    std::vector<std::vector<float> > weight,bias;
+    std::vector<unsigned int> error_table;
+    unsigned int training_error_count;
+    float training_error_value;
+};
+
+result_type train(tipl::ml::network_data<int>& data,tipl::ml::optimizer_type optimizer,unsigned int thread_count)
+{
+    tipl::thread_budget_scope budget(thread_count);
+    tipl::ml::network nn;
+    nn << std::string("8,8,2|conv,relu,3|6,6,4|max_pooling,identity,2|3,3,4|full,relu|1,1,10|full,identity|1,1,3");
+    tipl::ml::trainer t;
+    t.epoch = 4;
+    t.batch_size = 64;
+    t.optimizer = optimizer;
+    t.deterministic = true;
+    t.error_table.resize(9);
+    bool terminated = false;
+    tipl::ml::network_data_proxy<int> proxy(data);
+    t.train(nn,proxy,terminated,[](){},5);
+    result_type result;
+    for(auto& layer : nn.layers)
+    {
+        result.weight.push_back(layer->weight);
+        result.bias.push_back(layer->bias);
+    }
+    result.error_table = t.error_table;
+    result.training_error_count = t.training_error_count;
+    result.training_error_value = t.training_error_value;
+    return result;
+}
+
+int main(void)
+{
+    std::mt19937 gen(3);
+    std::normal_distribution<float> normal;
+    tipl::ml::network_data<int> data;
+    data.input = tipl::geometry<3>(8,8,2);
+    data.output = tipl::geometry<3>(1,1,3);
+    for(int i = 0;i < 500;++i)
+    {
+        int label = i%3;
+        std::vector<float> v(data.input.size());
+        for(auto& x : v)
+            x = normal(gen);
+        v[label*20] += 2.0f;
+        data.data.push_back(v);
+        data.data_label.push_back(label);
+    }
+    // 500 samples leave a last batch of 52, split into uneven chunks
+    const tipl::ml::optimizer_type optimizer[] = {tipl::ml::sgd,tipl::ml::adam};
+    for(auto o : optimizer)
+    {
+        result_type serial = train(data,o,1);
+        CHECK(serial.training_error_value > 0.0f);
+        for(unsigned int thread_count : {2,3,8})
+        {
+            result_type parallel = train(data,o,thread_count);
+            CHECK(serial.weight == parallel.weight);
+            CHECK(serial.bias == parallel.bias);
+            CHECK(serial.error_table == parallel.error_table);
+            CHECK(serial.training_error_count == parallel.training_error_count);
+            CHECK(serial.training_error_value == parallel.training_error_value);
+        }
+    }
+    return check_result("cnn_deterministic");
+}
@@ -0,0 +1,73 @@
+// binary model file: save, load into network and compiled_network, reject bad files
+#include <fstream>
+#include <iterator>
+#include <random>
+#include "tipl/ml/cnn.hpp"
+#include "check.hpp"
+
+int main(void)
+{
+    tipl::ml::network nn;
+    CHECK(nn << std::string("32,32,1|conv,relu,5|28,28,8|max_pooling,identity,2|14,14,8|conv,relu,3|12,12,8|"
+                            "full,relu|1,1,32|partially,relu|1,1,16|dropout,0.5|1,1,16|full,identity|1,1,4|soft_max|1,1,4"));
+    nn.init_weights(3);
+    nn.set_test_mode(true);
+    CHECK(nn.save_to_model_file("model.tnn"));
+
+    tipl::ml::network loaded;
+    tipl::ml::compiled_network compiled;
+    CHECK(loaded.load_from_model_file("model.tnn"));
+    CHECK(compiled.load_from_model_file("model.tnn"));
+    CHECK(loaded.get_layer_text() == nn.get_layer_text());
+    for(size_t k = 0;k < nn.layers.size();++k)
+    {
+        CHECK(loaded.layers[k]->weight == nn.layers[k]->weight);
+        CHECK(loaded.layers[k]->bias == nn.layers[k]->bias);
+    }
+    std::mt19937 gen(1);
+    std::uniform_real_distribution<float> u(0.0f,1.0f);
+    std::vector<float> input(32*32);
+    double difference = 0.0,compiled_difference = 0.0;
+    for(int s = 0;s < 10;++s)
+    {
+        for(auto& v : input)
+            v = u(gen);
+        std::vector<float> expected,result,compiled_result;
+        nn.predict(&input[0],expected);
+        loaded.predict(&input[0],result);
+        compiled.predict(&input[0],compiled_result);
+        difference = std::max(difference,max_difference(result,expected,expected.size()));
+        compiled_difference = std::max(compiled_difference,max_difference(compiled_result,expected,expected.size()));
+    }
+    CHECK(difference == 0.0);
+    CHECK(compiled_difference < 1.0e-5);
+
+    // a copy keeps the mapping alive
+    {
+        tipl::ml::compiled_network copy = compiled;
+        compiled = tipl::ml::compiled_network();
+        std::vector<float> expected,result;
+        nn.predict(&input[0],expected);
+        copy.predict(&input[0],result);
+        CHECK(max_difference(result,expected,expected.size()) < 1.0e-5);
+    }
+
+    // truncated, corrupted and missing files are rejected
+    std::string file;
+    {
+        std::ifstream in("model.tnn",std::ios::binary);
+        file.assign(std::istreambuf_iterator<char>(in),std::istreambuf_iterator<char>());
+    }
+    std::ofstream("truncated.tnn",std::ios::binary).write(file.data(),std::streamsize(file.size()-100));
+    file[0] ^= 1;
+    std::ofstream("corrupted.tnn",std::ios::binary).write(file.data(),std::streamsize(file.size()));
+    const char* bad_file[] = {"truncated.tnn","corrupted.tnn","missing.tnn"};
+    for(int i = 0;i < 3;++i)
+    {
+        tipl::ml::network bad;
+        tipl::ml::compiled_network bad_compiled;
+        CHECK(!bad.load_from_model_file(bad_file[i]));
+        CHECK(!bad_compiled.load_from_model_file(bad_file[i]));
+    }
+    return check_result("cnn_model_file");
+}
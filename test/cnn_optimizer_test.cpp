@@ -0,0 +1,157 @@
+// optimizer_step against textbook updates, and SGD against the previous axpy update
+#include <random>
+#include "tipl/ml/cnn.hpp"
+#include "check.hpp"
+
+namespace reference
+{
+// the previous SGD update: w += -rate*g, then the gradient keeps momentum*g
+void sgd_update(std::vector<float>& w,std::vector<float>& g,float rate,float momentum)
+{
+    tipl::vec::axpy(&w[0],&w[0]+w.size(),-rate,&g[0]);
+    tipl::multiply_constant(g,momentum);
+}
+
+// textbook updates in double precision, m and v start at zero
+struct optimizer
+{
+    tipl::ml::optimizer_type type;
+    double rate,momentum,beta1,beta2,epsilon,decay;
+    std::vector<double> w,m,v;
+    int t = 0;
+    void step(const std::vector<double>& g)
+    {
+        ++t;
+        m.resize(w.size());
+        v.resize(w.size());
+        for(size_t i = 0;i < w.size();++i)
+            switch(type)
+            {
+            case tipl::ml::sgd:
+                // m is the velocity: the sum of momentum^k times the past gradients
+                m[i] = momentum*m[i]+g[i];
+                w[i] -= rate*m[i];
+                break;
+            case tipl::ml::nesterov:
+                m[i] = momentum*m[i]+g[i];
+                w[i] -= rate*(g[i]+momentum*m[i]);
+                break;
+            case tipl::ml::rmsprop:
+                m[i] = beta2*m[i]+(1.0-beta2)*g[i]*g[i];
+                w[i] -= rate*g[i]/(std::sqrt(m[i])+epsilon);
+                break;
+            case tipl::ml::adam:
+            case tipl::ml::adamw:
+            {
+                m[i] = beta1*m[i]+(1.0-beta1)*g[i];
+                v[i] = beta2*v[i]+(1.0-beta2)*g[i]*g[i];
+                double m_hat = m[i]/(1.0-std::pow(beta1,t));
+                double v_hat = v[i]/(1.0-std::pow(beta2,t));
+                w[i] -= rate*(m_hat/(std::sqrt(v_hat)+epsilon)+(type == tipl::ml::adamw ? decay*w[i] : 0.0));
+                break;
+            }
+            }
+    }
+};
+}
+
+int main(void)
+{
+    std::mt19937 gen(1);
+    std::normal_distribution<float> normal;
+    const size_t n = 5;
+    std::vector<float> w0(n);
+    for(auto& x : w0)
+        x = normal(gen);
+    std::vector<std::vector<float> > gradient(6,std::vector<float>(n));
+    for(auto& g : gradient)
+        for(auto& x : g)
+            x = normal(gen);
+
+    // six steps of each optimizer from the same weights and gradients
+    const tipl::ml::optimizer_type type[] = {tipl::ml::sgd,tipl::ml::nesterov,tipl::ml::rmsprop,tipl::ml::adam,tipl::ml::adamw};
+    for(auto o : type)
+    {
+        tipl::ml::optimizer_param p;
+        p.type = o;
+        p.momentum = 0.8f;
+        p.beta1 = 0.85f;
+        p.beta2 = 0.95f;
+        p.epsilon = 1.0e-6f;
+        p.weight_decay = 0.1f;
+        const float rate = 0.05f;
+        reference::optimizer r{o,rate,p.momentum,p.beta1,p.beta2,p.epsilon,p.weight_decay};
+        r.w.assign(w0.begin(),w0.end());
+        std::vector<float> w(w0),g(n),state(n*p.state_count());
+        float* m = state.empty() ? 0 : &state[0];
+        float* v = p.state_count() > 1 ? m+n : 0;
+        bool cleared = true;
+        for(int t = 1;t <= 6;++t)
+        {
+            // the batch gradient is added to the buffer left by the previous step
+            tipl::add(g,gradient[t-1]);
+            p.correction1 = 1.0f/(1.0f-std::pow(p.beta1,float(t)));
+            p.correction2 = 1.0f/(1.0f-std::pow(p.beta2,float(t)));
+            tipl::ml::optimizer_step(p,rate,o == tipl::ml::adamw ? p.weight_decay : 0.0f,&w[0],&g[0],m,v,n);
+            r.step(std::vector<double>(gradient[t-1].begin(),gradient[t-1].end()));
+            if(o != tipl::ml::sgd)
+                cleared = cleared && tipl::max_abs_value(g) == 0.0f;
+            CHECK(max_difference(w,r.w,n) < 1.0e-5);
+        }
+        CHECK(cleared);
+    }
+
+    // the first Adam step moves each weight by rate*sign(g), AdamW also by rate*decay*w
+    {
+        tipl::ml::optimizer_param p;
+        p.type = tipl::ml::adamw;
+        p.weight_decay = 0.5f;
+        p.correction1 = 1.0f/(1.0f-p.beta1);
+        p.correction2 = 1.0f/(1.0f-p.beta2);
+        std::vector<float> w = {1.0f,-2.0f,0.5f},g = {0.3f,-4.0f,0.0f},state(6);
+        tipl::ml::optimizer_step(p,0.1f,p.weight_decay,&w[0],&g[0],&state[0],&state[3],3);
+        std::vector<float> expected = {1.0f-0.1f-0.05f,-2.0f+0.1f+0.1f,0.5f-0.025f};
+        CHECK(max_difference(w,expected,3) < 1.0e-6);
+    }
+
+    // SGD gives the previous update bitwise over several batches
+    {
+        tipl::ml::optimizer_param p;
+        std::vector<float> w(w0),g(n),w_ref(w0),g_ref(n);
+        for(auto& grad : gradient)
+        {
+            tipl::add(g,grad);
+            tipl::add(g_ref,grad);
+            tipl::ml::optimizer_step(p,0.05f,0.0f,&w[0],&g[0],0,0,n);
+            reference::sgd_update(w_ref,g_ref,0.05f,p.momentum);
+        }
+        CHECK(w == w_ref);
+        CHECK(g == g_ref);
+    }
+
+    // a layer keeps separate state for the weights and the biases
+    {
+        tipl::ml::network nn;
+        CHECK(nn << std::string("1,1,4|full,identity|1,1,3"));
+        nn.init_weights(2);
+        auto& layer = *nn.layers[0];
+        std::vector<float> w(layer.weight),b(layer.bias),dw(w.size()),db(b.size());
+        for(auto& x : dw)
+            x = normal(gen);
+        for(auto& x : db)
+            x = normal(gen);
+        std::vector<float> dw2(dw),db2(db),state,wm(w.size()),wv(w.size()),bm(b.size()),bv(b.size());
+        tipl::ml::optimizer_param p;
+        p.type = tipl::ml::adamw;
+        p.weight_decay = 0.2f;
+        p.w_rate = 0.01f;
+        p.b_rate = 0.03f;
+        layer.update(p,dw,db,state);
+        tipl::ml::optimizer_step(p,p.w_rate,p.weight_decay,&w[0],&dw2[0],&wm[0],&wv[0],w.size());
+        tipl::ml::optimizer_step(p,p.b_rate,0.0f,&b[0],&db2[0],&bm[0],&bv[0],b.size());
+        CHECK(state.size() == 2*(w.size()+b.size()));
+        CHECK(layer.weight == w);
+        CHECK(layer.bias == b);
+    }
+    return check_result("cnn_optimizer");
+}
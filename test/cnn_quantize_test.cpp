@@ -0,0 +1,113 @@
+// int8 quantized inference against the float network
+#include <random>
+#include "tipl/ml/cnn.hpp"
+#include "check.hpp"
+
+int main(void)
+{
+    // four classes: a bright square in one of the four quadrants
+    std::mt19937 gen(5);
+    std::normal_distribution<float> noise(0.0f,0.3f);
+    tipl::ml::network_data<unsigned char> data;
+    data.input = tipl::geometry<3>(20,20,1);
+    data.output = tipl::geometry<3>(1,1,4);
+    for(int i = 0;i < 1000;++i)
+    {
+        int c = i%4;
+        std::vector<float> v(400);
+        for(auto& x : v)
+            x = noise(gen);
+        int cx = ((c & 1) ? 14 : 5)+int(gen()%3)-1,cy = ((c & 2) ? 14 : 5)+int(gen()%3)-1;
+        for(int y = -2;y <= 2;++y)
+            for(int x = -2;x <= 2;++x)
+                v[(cy+y)*20+cx+x] += 1.0f;
+        data.data.push_back(v);
+        data.data_label.push_back(c);
+    }
+    tipl::ml::network_data_proxy<unsigned char> proxy(data);
+    tipl::ml::network nn;
+    nn << std::string("20,20,1|conv,relu,5|16,16,8|max_pooling,identity,2|8,8,8|full,relu|1,1,32|"
+                      "partially,relu|1,1,16|full,identity|1,1,4");
+    tipl::ml::trainer t;
+    t.epoch = 20;
+    t.learning_rate = 0.1f;
+    t.error_table.resize(16);
+    bool terminated = false;
+    t.train(nn,proxy,terminated,[](){});
+    nn.set_test_mode(true);
+
+    std::vector<int> float_result,int8_result;
+    nn.predict(proxy,float_result);
+    auto report = nn.quantize(proxy,512);
+    CHECK(nn.is_quantized());
+    CHECK(report.classification);
+    CHECK(report.sample_count == data.size());
+    CHECK(report.agreement >= data.size()*95/100);
+    CHECK(report.float_correct >= data.size()*9/10);
+    CHECK(report.int8_correct+data.size()/50 >= report.float_correct);
+    nn.predict(proxy,int8_result);
+    size_t agreement = 0,int8_correct = 0;
+    for(size_t i = 0;i < data.size();++i)
+    {
+        agreement += float_result[i] == int8_result[i];
+        int8_correct += int8_result[i] == int(proxy.get_label(i));
+    }
+    CHECK(agreement == report.agreement);
+    CHECK(int8_correct == report.int8_correct);
+
+    // the int8 batch path gives the single-sample results
+    {
+        const int n = 8;
+        std::vector<float> X(n*400),in_out(n*nn.data_size),one(nn.data_size);
+        for(int m = 0;m < n;++m)
+            std::copy(data.data[m].begin(),data.data[m].end(),&X[m*400]);
+        nn.forward_propagation(&X[0],400,&in_out[0],n);
+        double difference = 0.0;
+        for(int m = 0;m < n;++m)
+        {
+            nn.forward_propagation(&X[m*400],&one[0]);
+            difference = std::max(difference,max_difference(one,&in_out[m*nn.data_size],nn.data_size));
+        }
+        CHECK(difference < 1.0e-4);
+    }
+    // dequantize restores the float network
+    nn.dequantize();
+    CHECK(!nn.is_quantized());
+    nn.predict(proxy,int8_result);
+    CHECK(int8_result == float_result);
+
+    // vector labels report only the output error, and reordering the fully
+    // connected weights drops the int8 weights
+    {
+        std::uniform_real_distribution<float> u(0.0f,1.0f);
+        tipl::ml::network_data<std::vector<float> > vector_data;
+        vector_data.input = tipl::geometry<3>(8,8,1);
+        vector_data.output = tipl::geometry<3>(1,1,3);
+        for(int i = 0;i < 200;++i)
+        {
+            std::vector<float> v(64);
+            for(auto& x : v)
+                x = u(gen);
+            vector_data.data.push_back(v);
+            vector_data.data_label.push_back({u(gen),u(gen),u(gen)});
+        }
+        tipl::ml::network_data_proxy<std::vector<float> > vector_proxy(vector_data);
+        tipl::ml::network vnn;
+        vnn << std::string("8,8,1|full,relu|1,1,16|full,identity|1,1,16|full,identity|1,1,3");
+        vnn.init_weights(1);
+        vnn.set_test_mode(true);
+        std::vector<float> float_output,int8_output;
+        vnn.predict(&vector_data.data[0][0],float_output);
+        auto vector_report = vnn.quantize(vector_proxy,100);
+        CHECK(!vector_report.classification);
+        CHECK(vector_report.agreement == 0);
+        vnn.predict(&vector_data.data[0][0],int8_output);
+        CHECK(max_difference(float_output,int8_output,3) <= vector_report.max_error);
+        CHECK(vector_report.max_error < 0.05f*std::fabs(float_output[0])+0.05f);
+        vnn.sort_fully_layer();
+        CHECK(!vnn.is_quantized());
+        vnn.predict(&vector_data.data[0][0],int8_output);
+        CHECK(max_difference(float_output,int8_output,3) < 1.0e-4);
+    }
+    return check_result("cnn_quantize");
+}
@@ -0,0 +1,294 @@
+// binned decision tree and AdaBoost stumps against the previous exact-value versions
+#include <map>
+#include <random>
+#include "tipl/ml/decision_tree.hpp"
+#include "tipl/ml/ada_boost.hpp"
+#include "check.hpp"
+
+namespace reference
+{
+// the previous tree: four thresholds per attribute at fifths of the value range
+template<class attribute_type,class classification_type>
+class decision_tree
+{
+private:
+    template<class attributes_iterator_type>
+    std::pair<attribute_type,attribute_type> get_value_range(attributes_iterator_type attributes_from,
+            attributes_iterator_type attributes_to,size_t attribute_index)
+    {
+        attribute_type max_value = attributes_from[0][attribute_index];
+        attribute_type min_value = attributes_from[0][attribute_index];
+        for (;attributes_from != attributes_to;++attributes_from)
+        {
+            if (attributes_from[0][attribute_index] > max_value)
+                max_value = attributes_from[0][attribute_index];
+            else
+                if (attributes_from[0][attribute_index] < min_value)
+                    min_value = attributes_from[0][attribute_index];
+        }
+        return std::make_pair(max_value,min_value);
+    }
+    template<class attributes_iterator_type,class classifications_iterator_type>
+    double information_gain(attributes_iterator_type attributes_from,
+                            attributes_iterator_type attributes_to,
+                            classifications_iterator_type classifications_from)
+    {
+        size_t sample_size = attributes_to-attributes_from;
+        size_t n_x0 = 0,n_x1 = 0,n_y0_x0 = 0,n_y1_x0 = 0,n_y0_x1 = 0,n_y1_x1 = 0;
+        for (size_t index = 0;index < sample_size;++index)
+        {
+            if (attributes_from[index][attribute_index] > param)// X=1
+            {
+                ++n_x1;
+                if (classifications_from[index])
+                    ++n_y1_x1;
+                else
+                    ++n_y0_x1;
+            }
+            else
+            {
+                ++n_x0;
+                if (classifications_from[index])
+                    ++n_y1_x0;
+                else
+                    ++n_y0_x0;
+            }
+        }
+        double p_x0 = ((double)n_x0)/((double)sample_size);
+        double p_x1 = ((double)n_x1)/((double)sample_size);
+        double p_y0_x0 = n_x0 == 0 ? 0.0: ((double)n_y0_x0)/((double)n_x0);
+        double p_y1_x0 = n_x0 == 0 ? 0.0: ((double)n_y1_x0)/((double)n_x0);
+        double p_y0_x1 = n_x1 == 0 ? 0.0: ((double)n_y0_x1)/((double)n_x1);
+        double p_y1_x1 = n_x1 == 0 ? 0.0: ((double)n_y1_x1)/((double)n_x1);
+        return -p_x0*((p_y0_x0 == 0 ? 0.0 : p_y0_x0*std::log(p_y0_x0))+
+                      (p_y1_x0 == 0 ? 0.0 : p_y1_x0*std::log(p_y1_x0)))
+               -p_x1*((p_y0_x1 == 0 ? 0.0 : p_y0_x1*std::log(p_y0_x1))+
+                      (p_y1_x1 == 0 ? 0.0 : p_y1_x1*std::log(p_y1_x1)));
+    }
+private:
+    std::unique_ptr<decision_tree<attribute_type,classification_type> > left_tree;
+    std::unique_ptr<decision_tree<attribute_type,classification_type> > right_tree;
+private:
+    size_t attribute_index;
+    double param;
+    size_t minimum_sample;
+    double termination_ratio;
+    bool is_end_node;
+    bool end_node_decision;
+public:
+    decision_tree(size_t minimum_sample_,double termination_ratio_):
+            minimum_sample(minimum_sample_),termination_ratio(termination_ratio_),is_end_node(false) {}
+
+    template<class attributes_iterator_type,class classifications_iterator_type>
+    void learn(attributes_iterator_type attributes_from,
+               attributes_iterator_type attributes_to,
+               size_t attribute_dimension,
+               classifications_iterator_type classifications_from)
+    {
+        size_t sample_size = attributes_to-attributes_from;
+        classifications_iterator_type classifications_to = classifications_from + sample_size;
+        size_t n_y0 = std::count(classifications_from,classifications_to,0);
+        size_t n_y1 = sample_size - n_y0;
+        {
+            if (n_y0 > ((double)sample_size)*termination_ratio ||
+                    n_y1 > ((double)sample_size)*termination_ratio ||
+                    sample_size < minimum_sample)
+            {
+                is_end_node = true;
+                end_node_decision = n_y1 > n_y0;
+                return;
+            }
+        }
+        {
+            std::vector<std::pair<size_t,double> > decision_list;
+            for (size_t index = 0;index < attribute_dimension;++index)
+            {
+                std::pair<attribute_type,attribute_type> range = get_value_range(attributes_from,attributes_to,index);
+                double step = (range.first-range.second)/5.0;
+                // a constant attribute gave step 0 and never ended in the previous code
+                if (step > 0.0)
+                    for (double value = range.second+step;value <= range.first-step;value += step)
+                        decision_list.push_back(std::make_pair(index,value));
+            }
+            if (decision_list.empty())
+            {
+                is_end_node = true;
+                end_node_decision = n_y1 > n_y0;
+                return;
+            }
+            std::vector<double> ig(decision_list.size());
+            for (size_t index = 0;index < decision_list.size();++index)
+            {
+                attribute_index = decision_list[index].first;
+                param = decision_list[index].second;
+                ig[index] = information_gain(attributes_from,attributes_to,classifications_from);
+            }
+            size_t best_decision_index = std::max_element(ig.begin(),ig.end())-ig.begin();
+            attribute_index = decision_list[best_decision_index].first;
+            param = decision_list[best_decision_index].second;
+        }
+        {
+            std::vector<std::vector<attribute_type> > right_attributes,left_attributes;
+            std::vector<classification_type> right_classification,left_classification;
+            for (size_t index = 0;index < sample_size;++index)
+                if (attributes_from[index][attribute_index] > param)
+                {
+                    right_attributes.push_back(
+                        std::vector<attribute_type>(
+                            &(attributes_from[index][0]),&(attributes_from[index][0])+attribute_dimension));
+                    right_classification.push_back(classifications_from[index]);
+                }
+                else
+                {
+                    left_attributes.push_back(
+                        std::vector<attribute_type>(
+                            &(attributes_from[index][0]),&(attributes_from[index][0])+attribute_dimension));
+                    left_classification.push_back(classifications_from[index]);
+                }
+            right_tree.reset(new decision_tree(minimum_sample,termination_ratio));
+            left_tree.reset(new decision_tree(minimum_sample,termination_ratio));
+            right_tree->learn(right_attributes.begin(),right_attributes.end(),attribute_dimension,right_classification.begin());
+            left_tree->learn(left_attributes.begin(),left_attributes.end(),attribute_dimension,left_classification.begin());
+            is_end_node = false;
+        }
+    }
+
+    template<class sample_iterator_type>
+    classification_type predict(sample_iterator_type predict_attributes) const
+    {
+        if (is_end_node)
+            return end_node_decision ? 1:0;
+        return (predict_attributes[attribute_index] > param) ?
+               right_tree->predict(predict_attributes):
+               left_tree->predict(predict_attributes);
+    }
+};
+
+// the previous stump: every distinct value is a threshold, x >= threshold
+template<typename attribute_type,typename classification_type>
+class decision_stump
+{
+private:
+    size_t which_attribute;
+    attribute_type threshold;
+    bool reverse;
+public:
+    template<typename attributes_iterator_type,typename sample_weighting_type,typename classifications_iterator_type>
+    void learn(attributes_iterator_type attributes_from,
+               attributes_iterator_type attributes_to,
+               size_t attribute_dimension,
+               sample_weighting_type Dt,
+               classifications_iterator_type classifications_from)
+    {
+        size_t sample_size = attributes_to-attributes_from;
+        which_attribute = 0;
+        threshold = 0;
+        reverse = false;
+        double classification_number = 0.0;
+        for (size_t index = 0;index < attribute_dimension;++index)
+        {
+            double cur_classification_number = 0.0;
+            std::map<attribute_type,double,std::greater<attribute_type> > sorted_attribute;
+            for (size_t i = 0;i < sample_size;++i)
+                sorted_attribute[attributes_from[i][index]] += (classifications_from[i] ? Dt[i] : -Dt[i]);
+            for (auto iter = sorted_attribute.begin();iter != sorted_attribute.end();++iter)
+            {
+                cur_classification_number -= iter->second;
+                if (std::abs(cur_classification_number) > classification_number)
+                {
+                    classification_number = std::abs(cur_classification_number);
+                    which_attribute = index;
+                    threshold = iter->first;
+                    reverse = cur_classification_number > 0.0;
+                }
+            }
+        }
+    }
+    template<typename attribute_iterator_type>
+    classification_type predict(attribute_iterator_type attributes) const
+    {
+        return ((attributes[which_attribute] >= threshold) ^ reverse) ? 1:0;
+    }
+};
+}
+
+template<class model_type>
+double training_error(const model_type& model,const std::vector<std::vector<float> >& X,const std::vector<int>& y)
+{
+    size_t wrong = 0;
+    for(size_t i = 0;i < X.size();++i)
+        wrong += model.predict(&X[i][0]) != y[i];
+    return double(wrong)/double(X.size());
+}
+
+template<class model_type>
+double weighted_error(const model_type& model,const std::vector<std::vector<float> >& X,const std::vector<int>& y,
+                      const std::vector<double>& w)
+{
+    double wrong = 0.0;
+    for(size_t i = 0;i < X.size();++i)
+        if(model.predict(&X[i][0]) != y[i])
+            wrong += w[i];
+    return wrong;
+}
+
+int main(void)
+{
+    std::mt19937 gen(6);
+    std::uniform_real_distribution<float> u(0.0f,1.0f);
+    const size_t n = 20000,dim = 5;
+    for(int quantized = 1;quantized >= 0;--quantized)
+    {
+        // an axis-aligned separable class, on 50 levels or continuous values
+        std::vector<std::vector<float> > X(n,std::vector<float>(dim));
+        std::vector<int> y(n);
+        for(size_t i = 0;i < n;++i)
+        {
+            for(auto& v : X[i])
+                v = quantized ? std::floor(u(gen)*50.0f)/50.0f : u(gen);
+            y[i] = (X[i][0] > 0.3f) != (X[i][1] > 0.6f) || X[i][2] > 0.9f;
+        }
+        tipl::ml::decision_tree<float,int> tree(2,1.0);
+        tree.learn(X.begin(),X.end(),dim,y.begin());
+        reference::decision_tree<float,int> previous_tree(2,1.0);
+        previous_tree.learn(X.begin(),X.end(),dim,y.begin());
+        double error = training_error(tree,X,y),previous_error = training_error(previous_tree,X,y);
+        // the quantile edges resolve every level, or cost at most the boundary bins
+        CHECK(quantized ? error == 0.0 : error <= previous_error+0.01);
+
+        // batch prediction gives the single-sample results
+        std::vector<int> batch(n);
+        tree.predict(X.begin(),X.end(),batch.begin());
+        bool same = true;
+        for(size_t i = 0;i < n;++i)
+            same = same && batch[i] == tree.predict(&X[i][0]);
+        CHECK(same);
+
+        // stumps on random weights: x > edge against x >= value
+        std::vector<double> w(n);
+        for(int round = 0;round < 3;++round)
+        {
+            double sum = 0.0;
+            for(auto& v : w)
+                sum += (v = u(gen));
+            for(auto& v : w)
+                v /= sum;
+            tipl::ml::decision_stump<float,int> stump;
+            stump.learn(X.begin(),X.end(),dim,w.begin(),y.begin());
+            reference::decision_stump<float,int> previous_stump;
+            previous_stump.learn(X.begin(),X.end(),dim,w.begin(),y.begin());
+            double stump_error = weighted_error(stump,X,y,w),previous_stump_error = weighted_error(previous_stump,X,y,w);
+            CHECK(quantized ? std::fabs(stump_error-previous_stump_error) < 1.0e-12 :
+                              stump_error <= previous_stump_error+0.01);
+        }
+
+        // boosted stumps separate a single threshold exactly
+        std::vector<int> y0(n);
+        for(size_t i = 0;i < n;++i)
+            y0[i] = X[i][3] > 0.42f;
+        tipl::ml::ada_boost<tipl::ml::decision_stump<float,int> > boost(size_t(10));
+        boost.learn(X.begin(),X.end(),dim,y0.begin());
+        CHECK(training_error(boost,X,y0) <= (quantized ? 0.0 : 0.01));
+    }
+    return check_result("decision_tree");
+}
@@ -0,0 +1,146 @@
+// displacement inversion, accumulation and scaling and squaring against the previous loops
+#include <iostream>
+#include <random>
+#include "tipl/utility/basic_image.hpp"
+#include "tipl/numerical/dif.hpp"
+#include "tipl/filter/gaussian.hpp"
+#include "check.hpp"
+
+namespace reference
+{
+// the previous inversion: 15 full compose passes
+template<class ComposeImageType>
+void invert_displacement(const ComposeImageType& v0,ComposeImageType& v1)
+{
+    ComposeImageType vv;
+    v1.resize(v0.geometry());
+    for (int index = 0;index < v1.size();++index)
+        v1[index] = -v0[index];
+    for(int i = 0;i < 15;++i)
+    {
+        tipl::compose_displacement(v0,v1,vv);
+        for (int index = 0;index < v1.size();++index)
+            v1[index] = -vv[index];
+    }
+}
+// the previous accumulation: compose, then add
+template<class ComposeImageType>
+void accumulate_displacement(const ComposeImageType& vin,
+                             const ComposeImageType& vv,
+                             ComposeImageType& vout)
+{
+    tipl::compose_displacement(vin,vv,vout);
+    for (size_t index = 0;index < vout.size();++index)
+        vout[index] += vv[index];
+}
+}
+
+typedef tipl::image<tipl::vector<3>,3> field_type;
+
+// largest |v| over the voxels at least margin away from the border
+double interior_max(const field_type& v,int margin)
+{
+    double result = 0.0;
+    for(tipl::pixel_index<3> index(v.geometry());index < v.size();++index)
+    {
+        bool inside = true;
+        for(unsigned int d = 0;d < 3;++d)
+            inside = inside && index[d] >= margin && index[d]+margin < v.geometry()[d];
+        if(inside)
+            result = std::max<double>(result,v[index.index()].length());
+    }
+    return result;
+}
+
+double max_difference(const field_type& lhs,const field_type& rhs)
+{
+    double result = 0.0;
+    for(size_t i = 0;i < lhs.size();++i)
+        for(unsigned int d = 0;d < 3;++d)
+            result = std::max<double>(result,std::fabs(lhs[i][d]-rhs[i][d]));
+    return result;
+}
+
+int main(void)
+{
+    std::mt19937 gen(4);
+    std::uniform_real_distribution<float> u(-1.0f,1.0f);
+    // a smooth field of up to about a voxel, invertible everywhere
+    const tipl::geometry<3> geo(24,20,18);
+    field_type v0(geo);
+    for(auto& v : v0)
+        v = tipl::vector<3>(3.0f*u(gen),3.0f*u(gen),3.0f*u(gen));
+    for(int i = 0;i < 6;++i)
+        tipl::filter::gaussian(v0);
+
+    // one scan-line pass gives compose and add
+    {
+        field_type vv(v0),expected,result;
+        for(auto& v : vv)
+            v *= -0.7f;
+        reference::accumulate_displacement(v0,vv,expected);
+        tipl::accumulate_displacement(v0,vv,result);
+        CHECK(max_difference(result,expected) < 1.0e-5);
+        tipl::vector_image<3> p0(v0),pv(vv),p;
+        tipl::accumulate_displacement(p0,pv,p);
+        field_type planar;
+        p.save_to_image(planar);
+        CHECK(max_difference(planar,expected) < 1.0e-5);
+    }
+    // 15 iterations without a tolerance give the previous inverse
+    field_type expected;
+    reference::invert_displacement(v0,expected);
+    {
+        field_type v1;
+        tipl::invert_displacement(v0,v1);
+        CHECK(max_difference(v1,expected) < 1.0e-5);
+    }
+    // with a tolerance the iteration stops early with the residual below it,
+    // and v1(x)+v0(x+v1(x)) is within the tolerance inside the image. Border
+    // voxels that map in and out of the image alternate between iterations,
+    // so the inverses are compared away from the border.
+    {
+        field_type v1;
+        float residual = tipl::invert_displacement(v0,v1,100,0.01f);
+        CHECK(residual < 0.01f);
+        field_type round_trip;
+        reference::accumulate_displacement(v0,v1,round_trip);
+        CHECK(interior_max(round_trip,3) < 0.01);
+        for(size_t i = 0;i < v1.size();++i)
+            v1[i] -= expected[i];
+        CHECK(interior_max(v1,2) < 0.01);
+        // a single iteration reports the change it made
+        CHECK(tipl::invert_displacement(v0,v1,1,0.0f) > 0.01f);
+    }
+    // scaling and squaring: exp(v) and exp(-v) are inverse warps, and a
+    // constant velocity gives the same constant displacement away from the
+    // border, where the samples outside the image are zero
+    {
+        field_type velocity(v0),d,inv_d,round_trip;
+        tipl::velocity_to_displacement(velocity,d,inv_d);
+        reference::accumulate_displacement(d,inv_d,round_trip);
+        CHECK(interior_max(round_trip,4) < 0.02);
+        reference::accumulate_displacement(inv_d,d,round_trip);
+        CHECK(interior_max(round_trip,4) < 0.02);
+        // the flow of a small velocity is close to the velocity itself
+        CHECK(interior_max(d,0) > 0.5*interior_max(velocity,0));
+
+        field_type constant(geo);
+        for(auto& v : constant)
+            v = tipl::vector<3>(0.5f,-0.25f,1.0f);
+        tipl::velocity_to_displacement(constant,d);
+        field_type difference(d);
+        for(size_t i = 0;i < d.size();++i)
+            difference[i] -= constant[i];
+        CHECK(interior_max(difference,5) < 1.0e-5);
+
+        // the planar field gives the same flow
+        tipl::vector_image<3> pv(velocity),pd;
+        tipl::velocity_to_displacement(pv,pd);
+        field_type planar;
+        pd.save_to_image(planar);
+        tipl::velocity_to_displacement(velocity,d);
+        CHECK(max_difference(planar,d) < 1.0e-5);
+    }
+    return check_result("dif");
+}
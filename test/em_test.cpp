@@ -0,0 +1,99 @@
+// soft EM on a separable Gaussian mixture: monotone likelihood and recovered clusters
+#include <random>
+#include "tipl/ml/em.hpp"
+#include "check.hpp"
+
+int main(void)
+{
+    std::mt19937 gen(2);
+    std::normal_distribution<double> normal;
+    // three anisotropic, correlated clusters of different sizes, shuffled
+    const unsigned int dim = 3,k = 3;
+    const double mean[k][dim] = {{0.0,0.0,0.0},{8.0,1.0,-2.0},{-3.0,9.0,4.0}};
+    const double scale[k][dim] = {{1.0,0.5,0.8},{0.6,1.5,0.4},{1.2,0.7,1.0}};
+    const size_t cluster_size[k] = {5000,3000,2000};
+    std::vector<std::vector<double> > X;
+    std::vector<unsigned int> truth;
+    for(unsigned int c = 0;c < k;++c)
+        for(size_t j = 0;j < cluster_size[c];++j)
+        {
+            double z[dim];
+            for(auto& v : z)
+                v = normal(gen);
+            X.push_back({mean[c][0]+scale[c][0]*z[0],
+                         mean[c][1]+scale[c][1]*(z[1]+0.5*z[0]),
+                         mean[c][2]+scale[c][2]*(z[2]-0.3*z[1])});
+            truth.push_back(c);
+        }
+    std::vector<size_t> order(X.size());
+    for(size_t i = 0;i < order.size();++i)
+        order[i] = i;
+    std::shuffle(order.begin(),order.end(),gen);
+    {
+        std::vector<std::vector<double> > X2(X.size());
+        std::vector<unsigned int> truth2(X.size());
+        for(size_t i = 0;i < order.size();++i)
+        {
+            X2[i] = X[order[i]];
+            truth2[i] = truth[order[i]];
+        }
+        X.swap(X2);
+        truth.swap(truth2);
+    }
+
+    for(int diagonal = 0;diagonal < 2;++diagonal)
+    {
+        // the likelihood of the t-th E-step, from runs stopped after t iterations
+        std::vector<double> log_likelihood;
+        for(unsigned int t = 1;t <= 30;++t)
+        {
+            tipl::ml::expectation_maximization<double,unsigned int> em(k);
+            em.diagonal = diagonal;
+            em.max_iteration = t;
+            em.tolerance = 0.0;
+            std::vector<unsigned int> label(X.size());
+            em(X.begin(),X.end(),dim,label.begin());
+            log_likelihood.push_back(em.log_likelihood);
+        }
+        bool monotone = true;
+        for(size_t t = 1;t < log_likelihood.size();++t)
+            monotone = monotone && log_likelihood[t] >= log_likelihood[t-1]-1.0e-12*std::abs(log_likelihood[t-1]);
+        CHECK(monotone);
+        CHECK(log_likelihood.back() > log_likelihood.front());
+
+        // converged labels agree with the generating clusters up to a permutation,
+        // and the thread count does not change them
+        std::vector<unsigned int> label(X.size()),serial_label(X.size());
+        tipl::ml::expectation_maximization<double,unsigned int> em(k),serial_em(k);
+        em.diagonal = serial_em.diagonal = diagonal;
+        em.thread_count = 3;
+        serial_em.thread_count = 1;
+        em(X.begin(),X.end(),dim,label.begin());
+        serial_em(X.begin(),X.end(),dim,serial_label.begin());
+        CHECK(label == serial_label);
+        CHECK(std::abs(em.log_likelihood-serial_em.log_likelihood) < 1.0e-9*std::abs(em.log_likelihood));
+        CHECK(em.log_likelihood >= log_likelihood.back()-1.0e-9*std::abs(log_likelihood.back()));
+
+        std::vector<unsigned int> permutation = {0,1,2};
+        size_t best_agreement = 0;
+        do
+        {
+            size_t agreement = 0;
+            for(size_t i = 0;i < X.size();++i)
+                agreement += permutation[truth[i]] == label[i];
+            best_agreement = std::max(best_agreement,agreement);
+        }
+        while(std::next_permutation(permutation.begin(),permutation.end()));
+        CHECK(double(best_agreement) > 0.995*double(X.size()));
+
+        // each generating mean is recovered by one of the clusters
+        for(unsigned int c = 0;c < k;++c)
+        {
+            double nearest = std::numeric_limits<double>::max();
+            for(unsigned int l = 0;l < em.get_k();++l)
+                nearest = std::min(nearest,max_difference(em.get_mean(l),mean[c],dim));
+            CHECK(nearest < 0.1);
+        }
+    }
+    return check_result("em");
+}
@@ -0,0 +1,71 @@
+// fused image expressions against eager element-wise loops
+#include <random>
+#include <stdexcept>
+#include "tipl/utility/basic_image.hpp"
+#include "tipl/utility/pixel_value.hpp"
+#include "tipl/numerical/basic_op.hpp"
+#include "check.hpp"
+
+int main(void)
+{
+    // larger than two blocks, so that the assignment runs in parallel
+    tipl::geometry<3> geo(40,40,30);
+    tipl::image<float,3> a(geo),b(geo),c(geo),d(geo);
+    std::mt19937 gen(0);
+    std::uniform_real_distribution<float> u(0.5f,2.0f);
+    for(size_t i = 0;i < geo.size();++i)
+    {
+        a[i] = u(gen);
+        b[i] = u(gen);
+        c[i] = u(gen);
+        d[i] = u(gen);
+    }
+    {
+        tipl::image<float,3> result,expected(geo);
+        result = a*0.5f+b*c-d/a;
+        for(size_t i = 0;i < geo.size();++i)
+            expected[i] = a[i]*0.5f+b[i]*c[i]-d[i]/a[i];
+        CHECK(result.geometry() == geo);
+        CHECK(max_difference(result,expected,geo.size()) == 0.0);
+    }
+    {
+        tipl::image<float,3> result(d),expected(d);
+        result += tipl::expr::square(a-b);
+        result -= tipl::expr::sqrt(c)*2.0f;
+        result *= tipl::expr::abs(-a);
+        result /= tipl::expr::exp(b*0.1f)+tipl::expr::log(c+1.0f);
+        for(size_t i = 0;i < geo.size();++i)
+        {
+            expected[i] += (a[i]-b[i])*(a[i]-b[i]);
+            expected[i] -= std::sqrt(c[i])*2.0f;
+            expected[i] *= std::abs(-a[i]);
+            expected[i] /= std::exp(b[i]*0.1f)+std::log(c[i]+1.0f);
+        }
+        CHECK(max_difference(result,expected,geo.size()) < 1e-6);
+    }
+    {
+        tipl::image<tipl::vector<3>,3> v(geo),result;
+        for(size_t i = 0;i < geo.size();++i)
+            v[i] = tipl::vector<3>(a[i],b[i],c[i]);
+        result = v*0.5f+v*a;
+        double error = 0.0;
+        for(size_t i = 0;i < geo.size();++i)
+        {
+            tipl::vector<3> expected = v[i]*0.5f+v[i]*a[i];
+            error = std::fmax(error,(result[i]-expected).length());
+        }
+        CHECK(error < 1e-6);
+    }
+    {
+        tipl::image<float,3> small(tipl::geometry<3>(4,4,4)),result;
+        bool thrown = false;
+        try{result = a+small;}
+        catch(const std::runtime_error&){thrown = true;}
+        CHECK(thrown);
+        thrown = false;
+        try{small += a*2.0f;}
+        catch(const std::runtime_error&){thrown = true;}
+        CHECK(thrown);
+    }
+    return check_result("expression");
+}
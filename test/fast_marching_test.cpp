@@ -0,0 +1,170 @@
+// fast marching against exact distances and the previous implementation
+#include <algorithm>
+#include <random>
+#include "tipl/utility/basic_image.hpp"
+#include "tipl/utility/pixel_index.hpp"
+#include "tipl/numerical/index_algorithm.hpp"
+#include "tipl/segmentation/fast_marching.hpp"
+#include "check.hpp"
+
+namespace reference
+{
+float estimate_time(const tipl::image<float,2>& T,float g,const tipl::geometry<2>& geo,const tipl::pixel_index<2>& index)
+{
+    const float infinity_time = std::numeric_limits<float>::max();
+    float Tx = std::min(index.x() ? T[index.index()-1] : infinity_time,
+                        index.x()+1 < geo.width() ? T[index.index()+1] : infinity_time);
+    float Ty = std::min(index.y() ? T[index.index()-geo.width()] : infinity_time,
+                        index.y()+1 < geo.height() ? T[index.index()+geo.width()] : infinity_time);
+    if(Tx > Ty)
+        std::swap(Tx,Ty);
+    float Td = Ty-Tx;
+    if(Ty == infinity_time || Td > g)
+        return Tx+g;
+    return 0.5f*(Tx+Ty+std::sqrt(2.0f*g*g-Td*Td));
+}
+// the fast marching before the rewrite: a voxel keeps its first estimate
+void fast_marching(const tipl::image<float,2>& cost,tipl::image<float,2>& pass_time,tipl::pixel_index<2> seed)
+{
+    typedef std::pair<float,tipl::pixel_index<2> > band_point;
+    auto greater = [](const band_point& lhs,const band_point& rhs){return lhs.first > rhs.first;};
+    const float infinity_time = std::numeric_limits<float>::max();
+    std::vector<band_point> narrow_band(1,band_point(0.0f,seed));
+    std::vector<tipl::pixel_index<2> > neighbor_points;
+    pass_time.resize(cost.geometry());
+    std::fill(pass_time.begin(),pass_time.end(),infinity_time);
+    pass_time[seed.index()] = 0.0f;
+    while(!narrow_band.empty())
+    {
+        std::pop_heap(narrow_band.begin(),narrow_band.end(),greater);
+        tipl::pixel_index<2> active_point = narrow_band.back().second;
+        narrow_band.pop_back();
+        tipl::get_connected_neighbors(active_point,cost.geometry(),neighbor_points);
+        for(size_t index = 0;index < neighbor_points.size();++index)
+        {
+            size_t cur_index = neighbor_points[index].index();
+            if(pass_time[cur_index] != infinity_time)
+                continue;
+            pass_time[cur_index] = estimate_time(pass_time,cost[cur_index],cost.geometry(),neighbor_points[index]);
+            narrow_band.push_back(band_point(pass_time[cur_index],neighbor_points[index]));
+            std::push_heap(narrow_band.begin(),narrow_band.end(),greater);
+        }
+    }
+}
+}
+
+int main(void)
+{
+    const int w = 65,c = 32;
+    tipl::geometry<2> geo(w,w);
+    tipl::image<float,2> cost(geo),T,old_T;
+    std::fill(cost.begin(),cost.end(),1.0f);
+    tipl::pixel_index<2> seed(c,c,geo);
+
+    // unit speed from one seed: the same times as before, which approximate
+    // the Euclidean distance and are exact along the axes
+    {
+        tipl::segmentation::fast_marching(cost,T,seed);
+        reference::fast_marching(cost,old_T,seed);
+        CHECK(max_difference(T,old_T,geo.size()) < 1.0e-4);
+        double error = 0.0,axis_error = 0.0;
+        for(tipl::pixel_index<2> index(geo);index < geo.size();++index)
+        {
+            double dx = index.x()-c,dy = index.y()-c;
+            double distance = std::sqrt(dx*dx+dy*dy);
+            error = std::max(error,std::fabs(T[index.index()]-distance));
+            if(dx == 0.0 || dy == 0.0)
+                axis_error = std::max(axis_error,std::fabs(T[index.index()]-distance));
+        }
+        CHECK(axis_error < 1.0e-4);
+        CHECK(error < 0.1*c);
+    }
+
+    // varying cost: every voxel solves the upwind update from its earlier
+    // neighbors, which the old code missed when a neighbor improved after the
+    // first estimate
+    {
+        std::mt19937 gen(0);
+        std::uniform_real_distribution<float> u(1.0f,5.0f);
+        tipl::image<float,2> random_cost(geo);
+        for(size_t i = 0;i < geo.size();++i)
+            random_cost[i] = u(gen);
+        tipl::image<float,2> random_T,old_random_T;
+        tipl::segmentation::fast_marching(random_cost,random_T,seed);
+        reference::fast_marching(random_cost,old_random_T,seed);
+        auto residual = [&](const tipl::image<float,2>& time)
+        {
+            const float h2[2] = {1.0f,1.0f};
+            double result = 0.0;
+            for(tipl::pixel_index<2> index(geo);index < geo.size();++index)
+            {
+                size_t i = index.index();
+                if(i == seed.index())
+                    continue;
+                float T_d[2];
+                for(int d = 0;d < 2;++d)
+                {
+                    size_t shift = d ? size_t(w) : 1;
+                    int x = d ? index.y() : index.x();
+                    T_d[d] = std::numeric_limits<float>::max();
+                    if(x && time[i-shift] < time[i])
+                        T_d[d] = std::min(T_d[d],time[i-shift]);
+                    if(x+1 < w && time[i+shift] < time[i])
+                        T_d[d] = std::min(T_d[d],time[i+shift]);
+                }
+                result = std::max(result,std::fabs(double(time[i])-
+                    tipl::segmentation::imp::fast_marching_solve<2>(T_d,h2,random_cost[i]))/time[i]);
+            }
+            return result;
+        };
+        CHECK(residual(random_T) < 1.0e-4);
+        CHECK(residual(old_random_T) > residual(random_T));
+    }
+
+    // the voxel size scales the time
+    {
+        tipl::image<float,2> T2;
+        tipl::image<unsigned char,2> label(geo);
+        label[seed.index()] = 1;
+        float spacing[2] = {2.0f,2.0f};
+        tipl::segmentation::fast_marching(cost,T2,label,spacing);
+        for(size_t i = 0;i < geo.size();++i)
+            T2[i] *= 0.5f;
+        CHECK(max_difference(T2,T,geo.size()) < 1.0e-4);
+    }
+
+    // several seeds: each voxel clearly closer to one seed takes its label,
+    // and max_time stops the front
+    {
+        std::mt19937 gen(0);
+        std::uniform_int_distribution<int> u(0,w-1);
+        tipl::image<unsigned char,2> label(geo);
+        std::vector<tipl::pixel_index<2> > seeds;
+        for(int k = 1;k <= 5;++k)
+        {
+            seeds.push_back(tipl::pixel_index<2>(u(gen),u(gen),geo));
+            label[seeds.back().index()] = (unsigned char)k;
+        }
+        float spacing[2] = {1.0f,1.0f};
+        const float max_time = 20.0f;
+        tipl::image<float,2> T2;
+        tipl::segmentation::fast_marching(cost,T2,label,spacing,max_time);
+        for(tipl::pixel_index<2> index(geo);index < geo.size();++index)
+        {
+            std::vector<std::pair<double,int> > distance;
+            for(size_t k = 0;k < seeds.size();++k)
+            {
+                double dx = index.x()-seeds[k].x(),dy = index.y()-seeds[k].y();
+                distance.push_back(std::make_pair(std::sqrt(dx*dx+dy*dy),int(label[seeds[k].index()])));
+            }
+            std::sort(distance.begin(),distance.end());
+            if(distance[0].first*1.1 < max_time && distance[1].first-distance[0].first > 2.0)
+                CHECK(label[index.index()] == distance[0].second);
+            if(label[index.index()])
+                CHECK(T2[index.index()] <= max_time);
+            else
+                CHECK(T2[index.index()] == std::numeric_limits<float>::max());
+        }
+    }
+    return check_result("fast_marching");
+}
@@ -0,0 +1,134 @@
+// graph_cut against the previous explicit-edge implementation
+#include <map>
+#include <random>
+#include "tipl/utility/basic_image.hpp"
+#include "tipl/utility/pixel_index.hpp"
+#include "tipl/utility/multi_thread.hpp"
+#include "tipl/numerical/index_algorithm.hpp"
+#include "tipl/segmentation/graph_cut.hpp"
+#include "check.hpp"
+
+namespace reference
+{
+// the graph_cut before the implicit-edge rewrite, with the region sizes
+// updated in the min_size pass as in the published implementation
+template<class image_type,class label_type>
+void graph_cut(const image_type& I,label_type& out,float c,unsigned int min_size)
+{
+    typedef tipl::pixel_index<image_type::dimension> index_type;
+    std::vector<tipl::segmentation::graph_edge> edges;
+    float max_w = 0.0f;
+    std::vector<index_type> neighbor;
+    for(index_type index(I.geometry());index < I.size();++index)
+    {
+        tipl::get_neighbors(index,I.geometry(),neighbor);
+        for(size_t i = 0;i < neighbor.size();++i)
+            if(index.index() > neighbor[i].index())
+            {
+                tipl::segmentation::graph_edge e;
+                e.n1 = (unsigned int)index.index();
+                e.n2 = (unsigned int)neighbor[i].index();
+                e.w = std::fabs(float(I[e.n1])-float(I[e.n2]));
+                max_w = std::max(max_w,e.w);
+                edges.push_back(e);
+            }
+    }
+    c *= max_w;
+    std::stable_sort(edges.begin(),edges.end());
+    tipl::disjoint_set dset;
+    dset.label.resize(I.size());
+    dset.rank.resize(I.size());
+    std::vector<unsigned int> size(I.size(),1);
+    std::vector<float> threshold(I.size(),c);
+    for(unsigned int index = 0;index < I.size();++index)
+        dset.label[index] = index;
+    for(size_t i = 0;i < edges.size();++i)
+    {
+        unsigned int s1 = dset.find_set(edges[i].n1);
+        unsigned int s2 = dset.find_set(edges[i].n2);
+        if(s1 != s2 && edges[i].w <= threshold[s1] && edges[i].w <= threshold[s2])
+        {
+            unsigned int total_size = size[s1]+size[s2];
+            unsigned int s12 = dset.join_set(s1,s2);
+            size[s12] = total_size;
+            threshold[s12] = edges[i].w+c/total_size;
+        }
+    }
+    for(size_t i = 0;i < edges.size();++i)
+    {
+        unsigned int s1 = dset.find_set(edges[i].n1);
+        unsigned int s2 = dset.find_set(edges[i].n2);
+        if(s1 != s2 && (size[s1] < min_size || size[s2] < min_size))
+        {
+            unsigned int total_size = size[s1]+size[s2];
+            size[dset.join_set(s1,s2)] = total_size;
+        }
+    }
+    out.clear();
+    out.resize(I.geometry());
+    unsigned int num_region = 0;
+    for(unsigned int index = 0;index < out.size();++index)
+    {
+        unsigned int s1 = dset.find_set(index);
+        if(out[s1] == 0)
+            out[s1] = ++num_region;
+        out[index] = out[s1];
+    }
+}
+}
+
+// piecewise constant regions with noise, so that the cut is not trivial
+template<class image_type>
+void make_image(image_type& I,unsigned int seed)
+{
+    std::mt19937 gen(seed);
+    std::uniform_real_distribution<float> u(0.0f,1.0f);
+    for(size_t i = 0;i < I.size();++i)
+        I[i] = float((i/7+(i/I.width())/9)%4)+0.3f*u(gen);
+}
+
+template<class label_type>
+unsigned int min_region_size(const label_type& label)
+{
+    std::map<unsigned int,unsigned int> count;
+    for(size_t i = 0;i < label.size();++i)
+        ++count[label[i]];
+    unsigned int result = (unsigned int)label.size();
+    for(auto& each : count)
+        result = std::min(result,each.second);
+    return result;
+}
+
+int main(void)
+{
+    // one block: the same segmentation as the sequential algorithm
+    for(unsigned int min_size = 1;min_size <= 20;min_size += 19)
+    {
+        tipl::image<float,2> I(tipl::geometry<2>(96,80));
+        make_image(I,min_size);
+        tipl::image<unsigned int,2> label,old_label;
+        tipl::segmentation::graph_cut(I,label,0.05f,min_size);
+        reference::graph_cut(I,old_label,0.05f,min_size);
+        CHECK(*std::max_element(label.begin(),label.end()) > 1);
+        CHECK(max_difference(label,old_label,label.size()) == 0.0);
+        CHECK(min_region_size(label) >= min_size);
+    }
+    // several blocks: the result does not depend on the thread count
+    {
+        tipl::image<float,3> I(tipl::geometry<3>(64,64,40));
+        make_image(I,0);
+        std::vector<tipl::image<unsigned int,3> > label(3);
+        unsigned int budget[3] = {1,2,8};
+        for(int j = 0;j < 3;++j)
+        {
+            tipl::thread_budget() = budget[j];
+            tipl::segmentation::graph_cut(I,label[j],0.05f,20);
+        }
+        tipl::thread_budget() = 0;
+        CHECK(*std::max_element(label[0].begin(),label[0].end()) > 1);
+        CHECK(max_difference(label[0],label[1],I.size()) == 0.0);
+        CHECK(max_difference(label[0],label[2],I.size()) == 0.0);
+        CHECK(min_region_size(label[0]) >= 20);
+    }
+    return check_result("graph_cut");
+}
@@ -0,0 +1,153 @@
+// k-means: Hamerly, mini-batch and k-means++ seeding against plain Lloyd iterations
+#include <random>
+#include <algorithm>
+#include "tipl/ml/k_means.hpp"
+#include "check.hpp"
+
+namespace reference
+{
+// Lloyd iterations as in the previous k_means_clustering, from given centers
+template<class attribute_type>
+void lloyd(const tipl::ml::normalized_attributes<attribute_type>& attributes,
+           std::vector<double> centers,size_t k,std::vector<unsigned int>& label)
+{
+    size_t n = attributes.size(),dim = attributes.attribute_dimension();
+    label.assign(n,0);
+    for(bool change = true;change;)
+    {
+        change = false;
+        for(size_t i = 0;i < n;++i)
+        {
+            double min_dis = std::numeric_limits<double>::max();
+            unsigned int min_cluster = 0;
+            for(size_t c = 0;c < k;++c)
+            {
+                double dis2 = 0.0;
+                for(size_t j = 0;j < dim;++j)
+                {
+                    double d = attributes[i][j]-centers[c*dim+j];
+                    dis2 += d*d;
+                }
+                if(dis2 < min_dis)
+                {
+                    min_dis = dis2;
+                    min_cluster = (unsigned int)c;
+                }
+            }
+            if(label[i] != min_cluster)
+            {
+                label[i] = min_cluster;
+                change = true;
+            }
+        }
+        std::vector<double> sum(k*dim);
+        std::vector<size_t> count(k);
+        for(size_t i = 0;i < n;++i)
+        {
+            for(size_t j = 0;j < dim;++j)
+                sum[label[i]*dim+j] += attributes[i][j];
+            ++count[label[i]];
+        }
+        for(size_t c = 0;c < k;++c)
+            if(count[c])
+                for(size_t j = 0;j < dim;++j)
+                    centers[c*dim+j] = sum[c*dim+j]/double(count[c]);
+    }
+}
+}
+
+// mean squared distance to the cluster means
+template<class attribute_type>
+double inertia(const tipl::ml::normalized_attributes<attribute_type>& attributes,
+               const std::vector<unsigned int>& label,size_t k)
+{
+    size_t n = attributes.size(),dim = attributes.attribute_dimension();
+    std::vector<double> sum(k*dim);
+    std::vector<size_t> count(k);
+    for(size_t i = 0;i < n;++i)
+    {
+        for(size_t j = 0;j < dim;++j)
+            sum[label[i]*dim+j] += attributes[i][j];
+        ++count[label[i]];
+    }
+    double result = 0.0;
+    for(size_t i = 0;i < n;++i)
+        for(size_t j = 0;j < dim;++j)
+        {
+            double d = attributes[i][j]-sum[label[i]*dim+j]/double(count[label[i]]);
+            result += d*d;
+        }
+    return result/double(n);
+}
+
+int main(void)
+{
+    // eight gaussian blobs in 4D with random membership
+    const size_t n = 20000,dim = 4,k = 8;
+    std::mt19937 gen(3);
+    std::normal_distribution<float> normal(0.0f,1.0f);
+    std::uniform_real_distribution<float> u(-6.0f,6.0f);
+    std::vector<std::vector<float> > center(k,std::vector<float>(dim)),X(n,std::vector<float>(dim));
+    for(auto& c : center)
+        for(auto& v : c)
+            v = u(gen);
+    for(auto& x : X)
+    {
+        size_t c = gen()%k;
+        for(size_t j = 0;j < dim;++j)
+            x[j] = center[c][j]+normal(gen);
+    }
+    tipl::ml::normalized_attributes<float> attributes(X.begin(),X.end(),dim);
+
+    double lloyd_sum = 0.0,mini_batch_sum = 0.0;
+    for(unsigned int seed = 0;seed < 5;++seed)
+    {
+        // k-means++ seeding does not depend on the thread count
+        std::vector<double> seeds,seeds3;
+        {
+            std::mt19937 g1(seed),g3(seed);
+            tipl::ml::imp::k_means_plus_plus(attributes,k,seeds,g1,1);
+            tipl::ml::imp::k_means_plus_plus(attributes,k,seeds3,g3,3);
+        }
+        CHECK(seeds == seeds3);
+        // the seeds are distinct samples
+        for(size_t c = 0;c < k;++c)
+        {
+            bool is_sample = false;
+            for(size_t i = 0;i < n && !is_sample;++i)
+                is_sample = std::equal(attributes[i].begin(),attributes[i].end(),seeds.begin()+c*dim);
+            CHECK(is_sample);
+            for(size_t c2 = 0;c2 < c;++c2)
+                CHECK(!std::equal(seeds.begin()+c*dim,seeds.begin()+c*dim+dim,seeds.begin()+c2*dim));
+        }
+        std::vector<unsigned int> expected;
+        reference::lloyd(attributes,seeds,k,expected);
+        double lloyd_inertia = inertia(attributes,expected,k);
+        lloyd_sum += lloyd_inertia;
+
+        // Hamerly bounds give exactly the Lloyd labels
+        tipl::ml::k_means_param param;
+        param.seed = seed;
+        param.tolerance = 0.0;
+        std::vector<unsigned int> label(n),label3(n);
+        param.thread_count = 1;
+        tipl::ml::k_means_clustering(attributes,label.begin(),k,param);
+        CHECK(label == expected);
+        param.thread_count = 3;
+        tipl::ml::k_means_clustering(attributes,label3.begin(),k,param);
+        CHECK(label3 == expected);
+
+        // mini-batch stops well before max_iteration and stays close to Lloyd
+        param.batch_size = 500;
+        param.thread_count = 1;
+        tipl::ml::k_means_clustering(attributes,label.begin(),k,param);
+        param.max_iteration = 100000;
+        tipl::ml::k_means_clustering(attributes,label3.begin(),k,param);
+        CHECK(label == label3);
+        double mini_batch_inertia = inertia(attributes,label,k);
+        CHECK(mini_batch_inertia < lloyd_inertia*1.15);
+        mini_batch_sum += mini_batch_inertia;
+    }
+    CHECK(mini_batch_sum < lloyd_sum*1.05);
+    return check_result("k_means");
+}
@@ -0,0 +1,255 @@
+// blocked product, LU, Cholesky and QR against the previous unblocked loops
+#include <random>
+#include "tipl/numerical/matrix.hpp"
+#include "check.hpp"
+
+namespace reference
+{
+template<class left_input_iterator,class right_input_iterator,class output_iterator,class left_dim_type,class right_dim_type>
+void product(left_input_iterator lhs,right_input_iterator rhs,output_iterator out,
+             const left_dim_type& ldim,const right_dim_type& rdim)
+{
+    unsigned int common_col_count = ldim.col_count();
+    unsigned int right_col_count = rdim.col_count();
+    left_input_iterator lhs_end = lhs + ldim.size();
+    right_input_iterator rhs_end = rhs + rdim.col_count();
+    while (lhs != lhs_end)
+    {
+        left_input_iterator lhs_to = lhs + common_col_count;
+        for (right_input_iterator rhs_col = rhs;rhs_col != rhs_end;++rhs_col,++out)
+        {
+            right_input_iterator rhs_from = rhs_col;
+            left_input_iterator lhs_from = lhs;
+            typename std::iterator_traits<left_input_iterator>::value_type sum((*lhs_from)*(*rhs_from));
+            if (++lhs_from != lhs_to)
+                do
+                {
+                    rhs_from += right_col_count;
+                    sum += (*lhs_from)*(*rhs_from);
+                }
+                while (++lhs_from != lhs_to);
+            *out = sum;
+        }
+        lhs = lhs_to;
+    }
+}
+
+template<class left_input_iterator,class right_input_iterator,class output_iterator,class left_dim_type,class right_dim_type>
+void product_transpose(left_input_iterator lhs,right_input_iterator rhs,output_iterator out,
+                       const left_dim_type& ldim,const right_dim_type& rdim)
+{
+    unsigned int common_col_count = ldim.col_count();
+    left_input_iterator lhs_end = lhs + ldim.size();
+    right_input_iterator rhs_end = rhs + rdim.size();
+    for (;lhs != lhs_end;lhs += common_col_count)
+        for (right_input_iterator rhs_iter = rhs;rhs_iter != rhs_end;rhs_iter += common_col_count,++out)
+            *out = tipl::vec::dot(lhs,lhs+common_col_count,rhs_iter);
+}
+
+template<class io_iterator,class pivot_iterator,class dim_type>
+bool lu_decomposition(io_iterator A,pivot_iterator pivot,const dim_type& dim)
+{
+    typedef typename std::iterator_traits<io_iterator>::value_type value_type;
+    const unsigned int dimension = dim.row_count();
+    const unsigned int size = dim.size();
+    for (unsigned int k = 0;k < dimension;++k)
+        pivot[k] = k;
+    for (unsigned int k = 0,row_k = 0;k < dimension;++k,row_k+=dimension)
+    {
+        {
+            value_type max_value(0);
+            unsigned int max_index = 0;
+            unsigned int max_row = k;
+            for (unsigned int i = k,index_ik = row_k + k;i < dimension;++i,index_ik += dimension)
+            {
+                value_type value = A[index_ik];
+                if (value < 0)
+                    value = -value;
+                if (value > max_value)
+                {
+                    max_value = value;
+                    max_index = index_ik;
+                    max_row = i;
+                }
+            }
+            if (max_value == 0)
+                return false; // singularity
+            if (max_row != k) // row swap is needed
+            {
+                tipl::vec::swap(A+row_k,A+row_k+dim.col_count(),A+max_index-k);
+                std::swap(pivot[k],pivot[max_row]);
+            }
+        }
+        //  reduce the matrix
+        value_type bjj = A[row_k + k];
+        for (unsigned int row_i = row_k + dimension;row_i < size;row_i += dimension)
+        {
+            value_type temp = A[row_i + k] /= bjj;
+            unsigned int offset = row_i-row_k;
+            unsigned int max_row_i_j = row_i + dimension;
+            for (unsigned int row_i_j = row_i + k+ 1;row_i_j < max_row_i_j;++row_i_j)
+                A[row_i_j] -= temp*A[row_i_j-offset];
+        }
+    }
+    return true;
+}
+
+template<class io_iterator,class pivot_iterator,class dim_type>
+bool ll_decomposition(io_iterator A,pivot_iterator p,const dim_type& dim)
+{
+    typedef typename std::iterator_traits<io_iterator>::value_type value_type;
+    const unsigned int dimension = dim.row_count();
+    for (unsigned int i = 0,row_i = 0;i < dimension;i++,row_i += dimension)
+    {
+        for (unsigned int j = i,row_j = row_i;j < dimension;j++,row_j += dimension)
+        {
+            unsigned int offset = row_j-row_i;
+            value_type sum = A[row_i + j];
+            if(i > 0)
+            for (unsigned int row_i_k = row_i+i-1;row_i_k >= row_i;--row_i_k)
+                sum -= A[row_i_k]*A[row_i_k+offset];
+            if(i == j)
+            {
+                if (sum <= 0.0)
+                    return false;
+                p[i]=std::sqrt(sum);
+            }
+            else
+                A[row_j+i]=sum/p[i];
+        }
+    }
+    return true;
+}
+
+template<class io_iterator,class output_iterator1,class output_iterator2,class dim_type>
+bool qr_decomposition(io_iterator A,output_iterator1 c,output_iterator2 d,const dim_type& dim)
+{
+    typedef typename std::iterator_traits<io_iterator>::value_type value_type;
+    bool singular = false;
+    unsigned int m = dim.row_count();
+    unsigned int n = dim.col_count();
+    unsigned int min = std::min<unsigned int>(m,n);
+    io_iterator A_row_k = A;
+    for (unsigned int k = 0;k < min;k++,A_row_k += n)
+    {
+        value_type scale(0);
+        {
+            io_iterator A_i_k = A_row_k+k;
+            for (unsigned int i=k;i<m;i++,A_i_k += n)
+                scale=std::max<value_type>(scale,*A_i_k < 0 ? -*A_i_k : *A_i_k);
+        }
+        if (scale == 0.0)
+        {
+            c[k]=d[k]=0.0;
+            singular = true;
+        }
+        else
+        {
+            value_type sum(0);
+            io_iterator A_i_k = A_row_k+k;
+            for (unsigned int i=k;i<m;i++,A_i_k += n)
+            {
+                value_type t = (*A_i_k /= scale);
+                sum += t*t;
+            }
+            value_type sigma = (A_row_k[k] >= 0) ? std::sqrt(sum):-std::sqrt(sum);
+            A_row_k[k] += sigma;
+            c[k]=sigma*A_row_k[k];
+            d[k] = -scale*sigma;
+            for (unsigned int j=k+1;j < n;j++)
+            {
+                io_iterator A_row_i = A_row_k;
+                sum = 0.0;
+                for (unsigned int i=k;i<m;i++,A_row_i += n)
+                    sum += A_row_i[k]*A_row_i[j];
+                value_type tau=sum/c[k];
+                A_row_i = A_row_k;
+                for (unsigned int i=k;i<m;i++,A_row_i += n)
+                    A_row_i[j] -= tau*A_row_i[k];
+            }
+        }
+    }
+    return !singular;
+}
+}
+
+std::mt19937 gen(7);
+
+template<class value_type>
+std::vector<value_type> random_matrix(size_t size)
+{
+    std::uniform_real_distribution<value_type> u(-1.0,1.0);
+    std::vector<value_type> A(size);
+    for(auto& v : A)
+        v = u(gen);
+    return A;
+}
+
+int main(void)
+{
+    // products around the 64/256/128 blocks, and at the 2^20 dispatch threshold
+    const unsigned int product_size[][3] = {{64,256,64},{65,257,63},{127,129,257},{200,300,130},{33,1000,47}};
+    for(auto& s : product_size)
+    {
+        unsigned int m = s[0],k = s[1],n = s[2];
+        auto A = random_matrix<double>(size_t(m)*k),B = random_matrix<double>(size_t(k)*n),Bt = random_matrix<double>(size_t(n)*k);
+        std::vector<double> C(size_t(m)*n),expected(C.size());
+        tipl::mat::product(A.begin(),B.begin(),C.begin(),tipl::dyndim(m,k),tipl::dyndim(k,n));
+        reference::product(A.begin(),B.begin(),expected.begin(),tipl::dyndim(m,k),tipl::dyndim(k,n));
+        CHECK(max_difference(C,expected,C.size()) < 1.0e-12*k);
+        tipl::mat::product_transpose(A.begin(),Bt.begin(),C.begin(),tipl::dyndim(m,k),tipl::dyndim(n,k));
+        reference::product_transpose(A.begin(),Bt.begin(),expected.begin(),tipl::dyndim(m,k),tipl::dyndim(n,k));
+        CHECK(max_difference(C,expected,C.size()) < 1.0e-12*k);
+        std::vector<double> S(size_t(m)*m),S_expected(S.size());
+        tipl::mat::square(A.begin(),S.begin(),tipl::dyndim(m,k));
+        reference::product_transpose(A.begin(),A.begin(),S_expected.begin(),tipl::dyndim(m,k),tipl::dyndim(m,k));
+        CHECK(max_difference(S,S_expected,S.size()) < 1.0e-12*k);
+
+        auto Af = random_matrix<float>(size_t(m)*k),Bf = random_matrix<float>(size_t(k)*n);
+        std::vector<float> Cf(size_t(m)*n),expected_f(Cf.size());
+        tipl::mat::product(&Af[0],&Bf[0],&Cf[0],tipl::dyndim(m,k),tipl::dyndim(k,n));
+        reference::product(&Af[0],&Bf[0],&expected_f[0],tipl::dyndim(m,k),tipl::dyndim(k,n));
+        CHECK(max_difference(Cf,expected_f,Cf.size()) < 1.0e-6*k);
+    }
+    // decompositions below, at and past the 128 threshold and the 48-wide panels
+    const unsigned int n_list[] = {127,128,144,145,200};
+    for(unsigned int n : n_list)
+    {
+        auto A = random_matrix<double>(size_t(n)*n);
+        {
+            auto LU = A,expected = A;
+            std::vector<unsigned int> pivot(n),expected_pivot(n);
+            CHECK(tipl::mat::lu_decomposition(LU.begin(),pivot.begin(),tipl::dyndim(n,n)));
+            CHECK(reference::lu_decomposition(expected.begin(),expected_pivot.begin(),tipl::dyndim(n,n)));
+            CHECK(pivot == expected_pivot);
+            CHECK(max_difference(LU,expected,LU.size()) < 1.0e-9);
+        }
+        {
+            // a symmetric positive definite matrix A*A'+n*I
+            std::vector<double> P(size_t(n)*n);
+            reference::product_transpose(A.begin(),A.begin(),P.begin(),tipl::dyndim(n,n),tipl::dyndim(n,n));
+            for(unsigned int i = 0;i < n;++i)
+                P[size_t(i)*n+i] += n;
+            auto expected = P;
+            std::vector<double> p(n),expected_p(n);
+            CHECK(tipl::mat::ll_decomposition(P.begin(),p.begin(),tipl::dyndim(n,n)));
+            CHECK(reference::ll_decomposition(expected.begin(),expected_p.begin(),tipl::dyndim(n,n)));
+            CHECK(max_difference(p,expected_p,n) < 1.0e-10);
+            CHECK(max_difference(P,expected,P.size()) < 1.0e-10);
+        }
+    }
+    const unsigned int qr_size[][2] = {{127,127},{128,128},{200,130},{130,200},{145,145},{300,193}};
+    for(auto& s : qr_size)
+    {
+        unsigned int m = s[0],n = s[1];
+        auto A = random_matrix<double>(size_t(m)*n),expected = A;
+        unsigned int min_mn = std::min(m,n);
+        std::vector<double> c(min_mn),d(min_mn),expected_c(min_mn),expected_d(min_mn);
+        CHECK(tipl::mat::qr_decomposition(A.begin(),c.begin(),d.begin(),tipl::dyndim(m,n)));
+        CHECK(reference::qr_decomposition(expected.begin(),expected_c.begin(),expected_d.begin(),tipl::dyndim(m,n)));
+        CHECK(max_difference(c,expected_c,min_mn) < 1.0e-9);
+        CHECK(max_difference(d,expected_d,min_mn) < 1.0e-9);
+        CHECK(max_difference(A,expected,A.size()) < 1.0e-9);
+    }
+    return check_result("matrix");
+}
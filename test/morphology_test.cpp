@@ -0,0 +1,128 @@
+// distance-transform balls against dilation2/erosion2 and a brute-force distance
+#include <random>
+#include "tipl/utility/basic_image.hpp"
+#include "tipl/morphology/morphology.hpp"
+#include "tipl/segmentation/stochastic_competition.hpp"
+#include "check.hpp"
+
+namespace reference
+{
+// squared distance to the nearest nonzero pixel by exhaustive search
+template<class ImageType>
+std::vector<float> distance2(const ImageType& image)
+{
+    const unsigned int dim = ImageType::dimension;
+    std::vector<tipl::pixel_index<dim> > target;
+    for(tipl::pixel_index<dim> index(image.geometry());index < image.size();++index)
+        if(image[index.index()])
+            target.push_back(index);
+    std::vector<float> result(image.size(),1.0e20f);
+    for(tipl::pixel_index<dim> index(image.geometry());index < image.size();++index)
+        for(const auto& t : target)
+        {
+            float d2 = 0.0f;
+            for(unsigned int d = 0;d < dim;++d)
+                d2 += float(index[d]-t[d])*float(index[d]-t[d]);
+            result[index.index()] = std::min(result[index.index()],d2);
+        }
+    return result;
+}
+}
+
+std::mt19937 gen(3);
+
+// random blobs with a zero margin, where dilation2/erosion2 do not wrap
+template<int dim>
+tipl::image<unsigned char,dim> random_blobs(const tipl::geometry<dim>& geo,int margin,int blob_count)
+{
+    tipl::image<unsigned char,dim> I(geo);
+    for(int b = 0;b < blob_count;++b)
+    {
+        int center[dim];
+        for(unsigned int d = 0;d < dim;++d)
+            center[d] = std::uniform_int_distribution<int>(margin,geo[d]-1-margin)(gen);
+        int r = std::uniform_int_distribution<int>(0,4)(gen);
+        for(tipl::pixel_index<dim> index(geo);index < I.size();++index)
+        {
+            int d2 = 0;
+            bool inside = true;
+            for(unsigned int d = 0;d < dim;++d)
+            {
+                d2 += (index[d]-center[d])*(index[d]-center[d]);
+                inside = inside && index[d] >= margin && index[d] < int(geo[d])-margin;
+            }
+            if(inside && d2 <= r*r)
+                I[index.index()] = 1;
+        }
+    }
+    return I;
+}
+
+template<int dim>
+void check_ball(const tipl::geometry<dim>& geo,int radius)
+{
+    auto I = random_blobs(geo,radius+1,6);
+    {
+        auto expected = I,result = I;
+        tipl::morphology::dilation2(expected,radius);
+        tipl::morphology::dilation_ball(result,radius);
+        CHECK(std::equal(result.begin(),result.end(),expected.begin()));
+    }
+    {
+        // erode the dilated blobs so that the holes and gaps matter
+        auto D = I;
+        tipl::morphology::dilation2(D,radius);
+        auto expected = D,result = D;
+        tipl::morphology::erosion2(expected,radius);
+        tipl::morphology::erosion_ball(result,radius);
+        CHECK(std::equal(result.begin(),result.end(),expected.begin()));
+    }
+}
+
+int main(void)
+{
+    // exact squared distances, including targets on the border and an empty image
+    {
+        tipl::image<unsigned char,2> I(tipl::geometry<2>(37,23));
+        std::bernoulli_distribution b(0.01);
+        for(auto& v : I)
+            v = b(gen);
+        I[0] = I[I.size()-1] = 1;
+        tipl::image<float,2> dt;
+        tipl::morphology::distance_transform2(I,dt,[](unsigned char v){return v != 0;});
+        CHECK(max_difference(dt,reference::distance2(I),I.size()) == 0.0);
+
+        tipl::image<unsigned char,3> J(tipl::geometry<3>(13,17,11));
+        std::bernoulli_distribution b3(0.002);
+        for(auto& v : J)
+            v = b3(gen);
+        J[5] = 1;
+        tipl::image<float,3> dt3;
+        tipl::morphology::distance_transform2(J,dt3,[](unsigned char v){return v != 0;});
+        CHECK(max_difference(dt3,reference::distance2(J),J.size()) == 0.0);
+
+        std::fill(J.begin(),J.end(),0);
+        tipl::morphology::distance_transform2(J,dt3,[](unsigned char v){return v != 0;});
+        CHECK(*std::min_element(dt3.begin(),dt3.end()) == 1.0e20f);
+    }
+    // the same ball as the index-shift versions away from the border
+    for(int radius : {1,2,3,5,8})
+    {
+        check_ball(tipl::geometry<2>(64,48),radius);
+        check_ball(tipl::geometry<3>(30,26,22),radius);
+    }
+    // the bounding-box copy of stochastic_competition against tipl::crop
+    {
+        tipl::image<float,3> I(tipl::geometry<3>(20,15,12));
+        std::uniform_real_distribution<float> u;
+        for(auto& v : I)
+            v = u(gen);
+        tipl::geometry<3> from(3,2,4),to(17,15,9);
+        tipl::image<float,3> expected(I),result(tipl::geometry<3>(14,13,5));
+        tipl::crop(expected,from,to);
+        tipl::segmentation::imp::stochastic_competition_crop(I,result,from);
+        CHECK(result.geometry() == expected.geometry());
+        CHECK(std::equal(result.begin(),result.end(),expected.begin()));
+    }
+    return check_result("morphology");
+}
@@ -0,0 +1,98 @@
+// par_for_jobs coverage, thread budget propagation and concurrent cross validation
+#include <atomic>
+#include <random>
+#include "tipl/ml/cnn.hpp"
+#include "check.hpp"
+
+int main(void)
+{
+    // every index runs exactly once
+    {
+        std::vector<std::atomic<int> > count(1000);
+        for(auto& c : count)
+            c = 0;
+        tipl::par_for_jobs(count.size(),[&](size_t i){++count[i];},3,8);
+        bool once = true;
+        for(auto& c : count)
+            once = once && c == 1;
+        CHECK(once);
+    }
+    // the budget reaches the workers of nested par_for calls and is restored afterwards
+    {
+        std::atomic<int> wrong_budget(0),job_budget(0);
+        tipl::par_for_jobs(8,[&](size_t)
+        {
+            if(tipl::available_thread_count() != 4)
+                ++job_budget;
+            tipl::par_for(16,[&](int)
+            {
+                if(tipl::available_thread_count() != 4)
+                    ++wrong_budget;
+                tipl::par_for_asyn(4,[&](int)
+                {
+                    if(tipl::available_thread_count() != 4)
+                        ++wrong_budget;
+                });
+            });
+        },2,8);
+        CHECK(job_budget == 0);
+        CHECK(wrong_budget == 0);
+        CHECK(tipl::thread_budget() == 0);
+
+        tipl::thread_budget() = 3;
+        tipl::par_for2(6,[&](int,int)
+        {
+            if(tipl::available_thread_count() != 3)
+                ++wrong_budget;
+        },6);
+        tipl::par_for_block(6,[&](size_t)
+        {
+            if(tipl::available_thread_count() != 3)
+                ++wrong_budget;
+        },6);
+        tipl::thread th;
+        th.run([&](){if(tipl::available_thread_count() != 3)++wrong_budget;});
+        th.wait();
+        tipl::thread_budget() = 0;
+        CHECK(wrong_budget == 0);
+    }
+    // concurrent folds give the serial fold networks and score
+    {
+        std::mt19937 gen(2);
+        std::uniform_real_distribution<float> u(0.0f,1.0f);
+        tipl::ml::network_data<std::vector<float> > data;
+        data.input = tipl::geometry<3>(6,6,1);
+        data.output = tipl::geometry<3>(1,1,2);
+        for(int i = 0;i < 240;++i)
+        {
+            std::vector<float> v(36);
+            for(auto& x : v)
+                x = u(gen);
+            data.data.push_back(v);
+            data.data_label.push_back({v[0]+v[7],v[35]-v[14]});
+        }
+        tipl::ml::network nn;
+        CHECK(nn << std::string("6,6,1|full,relu|1,1,12|full,identity|1,1,2"));
+        tipl::ml::trainer t;
+        t.epoch = 3;
+        t.batch_size = 16;
+        t.deterministic = true;
+        bool terminated = false;
+        std::vector<tipl::ml::network> serial_nets,concurrent_nets;
+        tipl::thread_budget() = 1;
+        float serial_error = t.cross_validate(nn,data,terminated,4,1,&serial_nets);
+        tipl::thread_budget() = 8;
+        float concurrent_error = t.cross_validate(nn,data,terminated,4,4,&concurrent_nets);
+        tipl::thread_budget() = 0;
+        CHECK(serial_error > 0.0f);
+        CHECK(serial_error == concurrent_error);
+        CHECK(serial_nets.size() == 4 && concurrent_nets.size() == 4);
+        for(size_t fold = 0;fold < serial_nets.size() && fold < concurrent_nets.size();++fold)
+            for(size_t k = 0;k < serial_nets[fold].layers.size();++k)
+            {
+                CHECK(serial_nets[fold].layers[k]->weight == concurrent_nets[fold].layers[k]->weight);
+                CHECK(serial_nets[fold].layers[k]->bias == concurrent_nets[fold].layers[k]->bias);
+            }
+    }
+    return check_result("multi_thread");
+}
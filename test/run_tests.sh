@@ -0,0 +1,24 @@
+#!/bin/sh
+# Builds and runs every test/*_test.cpp. The library is included as
+# "tipl/...", so the tree is linked as tipl into a temporary directory.
+# CXX and CXXFLAGS can be overridden. Tests run in that directory, so
+# files they write are removed with it.
+root=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+ln -s "$root" "$work/tipl"
+CXX=${CXX:-g++}
+CXXFLAGS=${CXXFLAGS:-"-std=c++14 -O2"}
+failed=0
+for source in "$root"/test/*_test.cpp
+do
+    name=$(basename "$source" .cpp)
+    if ! $CXX $CXXFLAGS -I"$work" "$source" -o "$work/$name" -pthread; then
+        echo "$name: build FAILED"
+        failed=$((failed+1))
+        continue
+    fi
+    (cd "$work" && "./$name") || failed=$((failed+1))
+done
+[ $failed -eq 0 ] && echo "all tests passed" || echo "$failed test(s) failed"
+[ $failed -eq 0 ]
@@ -0,0 +1,102 @@
+// svm: batch prediction against svm_predict, and training with split kernel rows
+#include <random>
+#include "tipl/ml/svm.cpp"
+#include "check.hpp"
+
+struct problem
+{
+    std::vector<std::vector<tipl::ml::svm_node> > node;
+    std::vector<tipl::ml::svm_node*> x;
+    std::vector<double> y,dense;
+    tipl::ml::svm_problem prob;
+    problem(int l,int dim,bool regression,std::mt19937& gen):node(l),x(l),y(l),dense(size_t(l)*dim)
+    {
+        std::normal_distribution<double> normal(0.0,1.0);
+        for(int i = 0;i < l;++i)
+        {
+            int c = i%3;
+            node[i].resize(dim+1);
+            for(int k = 0;k < dim;++k)
+            {
+                double v = normal(gen)+(k == c ? 2.0 : 0.0);
+                node[i][k].index = k+1;
+                node[i][k].value = dense[size_t(i)*dim+k] = v;
+            }
+            node[i][dim].index = -1;
+            x[i] = &node[i][0];
+            y[i] = regression ? dense[size_t(i)*dim]-0.5*dense[size_t(i)*dim+1] : c;
+        }
+        prob.l = l;
+        prob.x = &x[0];
+        prob.y = &y[0];
+    }
+};
+
+tipl::ml::svm_parameter default_param(int svm_type,int kernel_type,int dim)
+{
+    tipl::ml::svm_parameter param;
+    param.svm_type = svm_type;
+    param.kernel_type = kernel_type;
+    param.degree = 3;
+    param.gamma = 1.0/dim;
+    param.coef0 = 0.5;
+    param.nu = 0.5;
+    param.cache_size = 100;
+    param.C = 10;
+    param.eps = 1e-3;
+    param.p = 0.1;
+    param.shrinking = 1;
+    param.probability = 0;
+    param.nr_weight = 0;
+    param.weight_label = 0;
+    param.weight = 0;
+    return param;
+}
+
+int main(void)
+{
+    tipl::ml::svm_set_print_string_function([](const char*){});
+    std::mt19937 gen(4);
+    // svm_predict_dense gives the svm_predict results
+    const int svm_type[] = {tipl::ml::C_SVC,tipl::ml::NU_SVC,tipl::ml::ONE_CLASS,tipl::ml::EPSILON_SVR,tipl::ml::NU_SVR};
+    const int kernel_type[] = {tipl::ml::LINEAR,tipl::ml::POLY,tipl::ml::RBF,tipl::ml::SIGMOID};
+    for(int s : svm_type)
+        for(int k : kernel_type)
+        {
+            const int l = 300,dim = 6;
+            bool regression = s == tipl::ml::EPSILON_SVR || s == tipl::ml::NU_SVR;
+            problem train(l,dim,regression,gen),test(500,dim,regression,gen);
+            auto param = default_param(s,k,dim);
+            tipl::ml::svm_model* model = tipl::ml::svm_train(&train.prob,&param);
+            std::vector<double> result(test.prob.l);
+            tipl::ml::svm_predict_dense(model,&test.dense[0],test.prob.l,dim,&result[0]);
+            double difference = 0.0;
+            for(int i = 0;i < test.prob.l;++i)
+            {
+                double expected = tipl::ml::svm_predict(model,test.x[i]);
+                difference = std::max(difference,std::fabs(expected-result[i]));
+            }
+            // regression values differ by the rounding of |x|^2+|sv|^2-2x.sv
+            CHECK(regression ? difference < 1.0e-8 : difference == 0.0);
+            tipl::ml::svm_free_and_destroy_model(&model);
+        }
+    // rows long enough to be split over the row pool give the single thread
+    // model, each one-against-one problem has 2200 samples
+    {
+        const int l = 3300,dim = 32;
+        problem train(l,dim,false,gen);
+        auto param = default_param(tipl::ml::C_SVC,tipl::ml::RBF,dim);
+        tipl::thread_budget() = 1;
+        tipl::ml::svm_model* serial = tipl::ml::svm_train(&train.prob,&param);
+        tipl::thread_budget() = 4;
+        tipl::ml::svm_model* pooled = tipl::ml::svm_train(&train.prob,&param);
+        tipl::thread_budget() = 0;
+        CHECK(serial->l == pooled->l);
+        for(int c = 0;c+1 < serial->nr_class;++c)
+            CHECK(std::equal(serial->sv_coef[c],serial->sv_coef[c]+serial->l,pooled->sv_coef[c]));
+        CHECK(std::equal(serial->sv_indices,serial->sv_indices+serial->l,pooled->sv_indices));
+        tipl::ml::svm_free_and_destroy_model(&serial);
+        tipl::ml::svm_free_and_destroy_model(&pooled);
+    }
+    return check_result("svm");
+}
@@ -0,0 +1,139 @@
+// planar vector_image kernels against the interleaved image<tipl::vector<3> > versions
+#include <iostream>
+#include <random>
+#include "tipl/utility/basic_image.hpp"
+#include "tipl/utility/vector_image.hpp"
+#include "tipl/numerical/dif.hpp"
+#include "tipl/numerical/resampling.hpp"
+#include "tipl/filter/gaussian.hpp"
+#include "check.hpp"
+
+typedef tipl::image<tipl::vector<3>,3> interleaved_type;
+typedef tipl::vector_image<3> planar_type;
+
+// largest component difference between the two layouts
+double max_difference(const planar_type& lhs,const interleaved_type& rhs)
+{
+    if(lhs.geometry() != rhs.geometry())
+        return 1.0e20;
+    double result = 0.0;
+    for(size_t i = 0;i < rhs.size();++i)
+        for(unsigned int d = 0;d < 3;++d)
+            result = std::max<double>(result,std::fabs(lhs.plane(d)[i]-rhs[i][d]));
+    return result;
+}
+
+int main(void)
+{
+    std::mt19937 gen(1);
+    std::uniform_real_distribution<float> u(-1.0f,1.0f);
+    // a smooth random displacement of up to about two voxels, odd sizes for the padding
+    const tipl::geometry<3> geo(23,19,17);
+    interleaved_type dis(geo);
+    for(auto& v : dis)
+        v = tipl::vector<3>(2.0f*u(gen),2.0f*u(gen),2.0f*u(gen));
+    for(int i = 0;i < 3;++i)
+        tipl::filter::gaussian(dis);
+    tipl::image<float,3> I(geo);
+    for(auto& v : I)
+        v = u(gen);
+
+    // conversion both ways and the write-through pixel reference
+    planar_type vdis(dis);
+    CHECK(max_difference(vdis,dis) == 0.0);
+    {
+        interleaved_type back;
+        vdis.save_to_image(back);
+        bool same = true;
+        for(size_t i = 0;i < dis.size();++i)
+            same = same && back[i] == dis[i];
+        CHECK(same);
+        planar_type p(vdis);
+        interleaved_type q(dis);
+        tipl::vector<3> shift(0.5f,-0.25f,2.0f);
+        for(size_t i = 0;i < q.size();i += 7)
+        {
+            p[i] += shift;
+            q[i] += shift;
+            p[i+1] *= 3.0f;
+            q[i+1] *= 3.0f;
+        }
+        p[5] = p[6];
+        q[5] = q[6];
+        p[9][2] = 4.0f;
+        q[9][2] = 4.0f;
+        CHECK(max_difference(p,q) == 0.0);
+        CHECK(tipl::vector<3>(p[9]) == q[9]);
+    }
+    // identity and mapping conversions, the interleaved versions do not
+    // compile for tipl::vector<3>, so the mapping is written out here
+    interleaved_type mapping(dis);
+    for(tipl::pixel_index<3> index(geo);index < geo.size();++index)
+        mapping[index.index()] += tipl::vector<3>(index);
+    {
+        planar_type p(vdis);
+        tipl::displacement_to_mapping(p);
+        CHECK(max_difference(p,mapping) == 0.0);
+        tipl::mapping_to_displacement(p);
+        CHECK(max_difference(p,dis) < 1.0e-5);
+        interleaved_type q(geo);
+        tipl::make_identity(q);
+        tipl::make_identity(p);
+        CHECK(max_difference(p,q) == 0.0);
+    }
+    // warping a scalar image and a vector field
+    {
+        tipl::image<float,3> expected,result;
+        tipl::compose_displacement(I,dis,expected);
+        tipl::compose_displacement(I,vdis,result);
+        CHECK(max_difference(result,expected,I.size()) < 1.0e-6);
+        interleaved_type q;
+        planar_type p;
+        tipl::compose_displacement(dis,dis,q);
+        tipl::compose_displacement(vdis,vdis,p);
+        CHECK(max_difference(p,q) < 1.0e-5);
+    }
+    // Jacobian determinants of the mapping and of the displacement
+    {
+        planar_type p(mapping);
+        tipl::image<float,3> expected,result;
+        tipl::jacobian_determinant(mapping,expected);
+        tipl::jacobian_determinant(p,result);
+        CHECK(max_difference(result,expected,expected.size()) < 1.0e-4);
+        tipl::jacobian_determinant_dis(dis,expected);
+        tipl::jacobian_determinant_dis(vdis,result);
+        CHECK(max_difference(result,expected,expected.size()) < 1.0e-4);
+    }
+    // smoothing each component
+    {
+        interleaved_type q(dis);
+        planar_type p(vdis);
+        tipl::filter::gaussian(q);
+        tipl::filter::gaussian(p);
+        CHECK(max_difference(p,q) < 1.0e-6);
+        tipl::filter::gaussian2(q);
+        tipl::filter::gaussian2(p);
+        CHECK(max_difference(p,q) < 1.0e-6);
+    }
+    // the multiresolution pyramid gives the scalar pyramid of each component,
+    // pixel_average has no tipl::vector<3> version for the interleaved layout
+    {
+        planar_type p,up;
+        tipl::downsample_with_padding(vdis,p);
+        tipl::upsample_with_padding(p,up,geo);
+        bool same = true;
+        for(unsigned int d = 0;d < 3;++d)
+        {
+            tipl::image<float,3> component(geo),down,expected;
+            for(size_t i = 0;i < geo.size();++i)
+                component[i] = dis[i][d];
+            tipl::downsample_with_padding(component,down);
+            same = same && down.geometry() == p.geometry() &&
+                   std::equal(down.begin(),down.end(),p.plane(d));
+            tipl::upsample_with_padding(down,expected,geo);
+            same = same && std::equal(expected.begin(),expected.end(),up.plane(d));
+        }
+        CHECK(same);
+    }
+    return check_result("vector_image");
+}
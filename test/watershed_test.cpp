@@ -0,0 +1,164 @@
+// watershed against the previous list-based implementation
+#include <list>
+#include <map>
+#include <random>
+#include "tipl/utility/basic_image.hpp"
+#include "tipl/utility/multi_thread.hpp"
+#include "tipl/segmentation/watershed.hpp"
+#include "check.hpp"
+
+namespace reference
+{
+// the watershed before the counting-sort rewrite
+template<class ImageType,class LabelImageType>
+void watershed(const ImageType& input_image,LabelImageType& label)
+{
+    typedef tipl::pixel_index<ImageType::dimension> index_type;
+    label.clear();
+    label.resize(input_image.geometry());
+    tipl::image<unsigned char,ImageType::dimension> I(input_image.geometry());
+    tipl::normalize(input_image,I);
+
+    std::vector<std::list<index_type> > presort_table(256);
+    for(index_type index(I.geometry());index < I.size();++index)
+        presort_table[I[index.index()]].push_back(index);
+
+    std::list<std::pair<index_type,size_t> > flooding_points;
+    size_t basin_id = 1;
+    for(unsigned int intensity = 0;intensity < presort_table.size();++intensity)
+    {
+        if(presort_table[intensity].empty())
+            continue;
+        for(auto iter = presort_table[intensity].begin();iter != presort_table[intensity].end();++iter)
+            if(!label[iter->index()])
+                flooding_points.push_back(std::make_pair(*iter,size_t(0)));
+        presort_table[intensity].clear();
+        auto iter = flooding_points.begin();
+        auto end = flooding_points.end();
+        while(iter != end)
+        {
+            if(I[iter->first.index()] != intensity)
+            {
+                ++iter;
+                continue;
+            }
+            if(label[iter->first.index()] == 0)
+            {
+                size_t cur_basin = iter->second;
+                if(cur_basin == 0)
+                    cur_basin = basin_id++;
+                label[iter->first.index()] = cur_basin;
+                std::vector<index_type> front,neighbor_points;
+                front.push_back(iter->first);
+                while(!front.empty())
+                {
+                    index_type active_point = front.back();
+                    front.pop_back();
+                    tipl::get_connected_neighbors(active_point,I.geometry(),neighbor_points);
+                    for(size_t index = 0;index < neighbor_points.size();++index)
+                    {
+                        size_t cur_index = neighbor_points[index].index();
+                        if(I[cur_index] == intensity)
+                        {
+                            if(label[cur_index] != cur_basin)
+                            {
+                                front.push_back(neighbor_points[index]);
+                                label[cur_index] = cur_basin;
+                            }
+                        }
+                        else if(!label[cur_index])
+                            flooding_points.insert(iter,std::make_pair(neighbor_points[index],cur_basin));
+                    }
+                }
+            }
+            flooding_points.erase(iter++);
+        }
+    }
+}
+}
+
+// fraction of voxels whose label is the most frequent truth label of its basin
+template<class LabelImageType>
+double agreement(const LabelImageType& label,const LabelImageType& truth)
+{
+    std::map<std::pair<size_t,size_t>,size_t> count;
+    for(size_t i = 0;i < label.size();++i)
+        ++count[std::make_pair(size_t(label[i]),size_t(truth[i]))];
+    std::map<size_t,size_t> best;
+    for(auto& each : count)
+        best[each.first.first] = std::max(best[each.first.first],each.second);
+    size_t sum = 0;
+    for(auto& each : best)
+        sum += each.second;
+    return double(sum)/double(label.size());
+}
+
+int main(void)
+{
+    // distance to the nearest of a few centers: the ideal basins are the
+    // Voronoi cells of the centers
+    for(unsigned int seed = 0;seed < 5;++seed)
+    {
+        std::mt19937 gen(seed);
+        std::uniform_real_distribution<float> u(0.0f,64.0f);
+        const int center_count = 6;
+        std::vector<float> cx(center_count),cy(center_count);
+        for(int k = 0;k < center_count;++k)
+        {
+            cx[k] = u(gen);
+            cy[k] = u(gen);
+        }
+        tipl::geometry<2> geo(64,64);
+        tipl::image<float,2> I(geo);
+        tipl::image<unsigned int,2> voronoi(geo);
+        for(int y = 0,i = 0;y < 64;++y)
+            for(int x = 0;x < 64;++x,++i)
+            {
+                float min_d2 = 1.0e9f;
+                for(int k = 0;k < center_count;++k)
+                {
+                    float d2 = (x-cx[k])*(x-cx[k])+(y-cy[k])*(y-cy[k]);
+                    if(d2 < min_d2)
+                    {
+                        min_d2 = d2;
+                        voronoi[i] = k+1;
+                    }
+                }
+                I[i] = std::min<float>(std::sqrt(min_d2),50.0f);
+            }
+        tipl::image<unsigned int,2> label,old_label;
+        tipl::segmentation::watershed(I,label);
+        reference::watershed(I,old_label);
+        CHECK(*std::min_element(label.begin(),label.end()) > 0);
+        CHECK(*std::max_element(label.begin(),label.end()) ==
+              *std::max_element(old_label.begin(),old_label.end()));
+        CHECK(agreement(label,voronoi) >= agreement(old_label,voronoi));
+        CHECK(agreement(label,voronoi) > 0.85);
+    }
+
+    // the marker flood runs in parallel on large fronts and must not depend
+    // on the thread count: four levels give plateaus large enough for that
+    {
+        tipl::geometry<3> geo(64,64,32);
+        tipl::image<float,3> I(geo);
+        tipl::image<unsigned int,3> marker(geo);
+        std::mt19937 gen(0);
+        std::uniform_real_distribution<float> u(0.0f,1.0f);
+        for(size_t i = 0;i < geo.size();++i)
+            I[i] = std::floor(u(gen)*4.0f);
+        for(int k = 1;k <= 20;++k)
+            marker[size_t(u(gen)*geo.size())] = k;
+        std::vector<tipl::image<unsigned int,3> > label(3,marker);
+        unsigned int budget[3] = {1,2,8};
+        for(int j = 0;j < 3;++j)
+        {
+            tipl::thread_budget() = budget[j];
+            tipl::segmentation::watershed_marker(I,label[j]);
+        }
+        tipl::thread_budget() = 0;
+        CHECK(*std::min_element(label[0].begin(),label[0].end()) > 0);
+        CHECK(max_difference(label[0],label[1],geo.size()) == 0.0);
+        CHECK(max_difference(label[0],label[2],geo.size()) == 0.0);
+    }
+    return check_result("watershed");
+}
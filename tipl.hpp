@@ -27,6 +27,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include "tipl/utility/basic_image.hpp"
+#include "tipl/utility/vector_image.hpp"
 
 
 #include "tipl/morphology/morphology.hpp"
@@ -37,6 +38,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "tipl/numerical/interpolation.hpp"
 #include "tipl/numerical/window.hpp"
 #include "tipl/numerical/basic_op.hpp"
+#include "tipl/numerical/expression.hpp"
 #include "tipl/numerical/numerical.hpp"
 #include "tipl/numerical/resampling.hpp"
 #include "tipl/numerical/slice.hpp"
@@ -4,6 +4,7 @@
 #include <vector>
 #include <thread>
 #include <future>
+#include <stdexcept>
 #include "geometry.hpp"
 #include "pixel_value.hpp"
 #include "pixel_index.hpp"
@@ -198,6 +199,9 @@ public:
     }
 };
 
+// lazy element-wise expression, see tipl/numerical/expression.hpp
+template<class node_type>
+class image_expr;
 
 template <class pixel_type,unsigned int dim,class storage_type = std::vector<pixel_type> >
 class image
@@ -264,6 +268,8 @@ public:
     image(any_pixel_type* pointer,const geometry_type& geo_):data(pointer,pointer+geo_.size()),geo(geo_) {}
     template <typename any_pixel_type>
     image(const any_pixel_type* pointer,const geometry_type& geo_):data(pointer,pointer+geo_.size()),geo(geo_) {}
+    template <class node_type>
+    image(const image_expr<node_type>& rhs){operator=(rhs);}
 public:
     template <class rhs_pixel_type,class rhs_storage_type>
     const image& operator=(const image<rhs_pixel_type,dim,rhs_storage_type>& rhs)
@@ -286,6 +292,15 @@ public:
         geo.swap(rhs.geo);
         return *this;
     }
+    template <class node_type>
+    const image& operator=(const image_expr<node_type>& rhs)
+    {
+        if(geo != rhs.geometry())
+            resize(rhs.geometry());
+        if(!data.empty())
+            rhs.apply(&*data.begin(),typename image_expr<node_type>::assign_type());
+        return *this;
+    }
 public:
     void swap(image& rhs)
     {
@@ -423,6 +438,42 @@ public:
             *iter /= *iter2;
         return *this;
     }
+    template <class node_type>
+    const image& operator+=(const image_expr<node_type>& rhs)
+    {
+        if(data.size() != rhs.size())
+            throw std::runtime_error("Inconsistent image size");
+        if(!data.empty())
+            rhs.apply(&*data.begin(),typename image_expr<node_type>::plus_assign_type());
+        return *this;
+    }
+    template <class node_type>
+    const image& operator-=(const image_expr<node_type>& rhs)
+    {
+        if(data.size() != rhs.size())
+            throw std::runtime_error("Inconsistent image size");
+        if(!data.empty())
+            rhs.apply(&*data.begin(),typename image_expr<node_type>::minus_assign_type());
+        return *this;
+    }
+    template <class node_type>
+    const image& operator*=(const image_expr<node_type>& rhs)
+    {
+        if(data.size() != rhs.size())
+            throw std::runtime_error("Inconsistent image size");
+        if(!data.empty())
+            rhs.apply(&*data.begin(),typename image_expr<node_type>::multiplies_assign_type());
+        return *this;
+    }
+    template <class node_type>
+    const image& operator/=(const image_expr<node_type>& rhs)
+    {
+        if(data.size() != rhs.size())
+            throw std::runtime_error("Inconsistent image size");
+        if(!data.empty())
+            rhs.apply(&*data.begin(),typename image_expr<node_type>::divides_assign_type());
+        return *this;
+    }
 public:
     template<class format_type>
     bool save_to_file(const char* file_name) const
@@ -1,17 +1,99 @@
 //---------------------------------------------------------------------------
 #ifndef cuH
 #define cuH
+#include <vector>
+#include <stdexcept>
+#include <algorithm>
+#include "tipl/utility/multi_thread.hpp"
+#include "tipl/numerical/matrix.hpp"
 
 #ifdef USE_CUBLAS
-
 #include <cuda_runtime.h>
 #include "cublas_v2.h"
 #include "cublasXt.h"
+#endif//USE_CUBLAS
 
 
 namespace tipl{
 namespace cu{
 
+/*
+    The matrix and context below run on cuBLAS when it is compiled in
+    (USE_CUBLAS) and a device is present, and on the multithreaded CPU
+    kernels otherwise. The backend is picked at runtime:
+
+    tipl::cu::default_backend() = tipl::cu::cpu; // force CPU
+    tipl::cu::context ctx;
+    tipl::cu::matrix A(W,r,k),x(X,k,c),y;
+    ctx.y_Ax(y,A,x);
+*/
+enum backend_type {cpu,cuda};
+
+inline bool cuda_available(void)
+{
+#ifdef USE_CUBLAS
+    int nDevices = 0;
+    if(cudaGetDeviceCount(&nDevices) != cudaSuccess)
+        return false;
+    return nDevices > 0;
+#else
+    return false;
+#endif
+}
+
+inline backend_type& default_backend(void)
+{
+    static backend_type backend = cuda_available() ? cuda : cpu;
+    return backend;
+}
+
+/*
+    y = A*x for c vectors: A is r-by-k (row major), x holds c vectors of k
+    elements and y receives c vectors of r elements. Large batches go to
+    the blocked GEMM in tipl::mat, others to 8-lane dot products split
+    into row blocks over the threads.
+*/
+inline void y_Ax(float* y,const float* A,const float* x,int r,int k,int c,
+                 int thread_count = tipl::available_thread_count())
+{
+    if(c >= 16 && thread_count > 1 &&
+       size_t(r)*size_t(k)*size_t(c) >= tipl::mat::blocked::min_product_size)
+    {
+        std::vector<float> At(size_t(k)*size_t(r));
+        tipl::mat::blocked::transpose(A,&At[0],r,k,thread_count);
+        tipl::mat::blocked::gemm(x,&At[0],y,c,r,k,k,r,r,false,1.0f,thread_count);
+        return;
+    }
+    const int row_block = 64;
+    auto fun = [&](int b)
+    {
+        int i1 = std::min<int>(b*row_block+row_block,r);
+        for(int j = 0;j < c;++j)
+        {
+            const float* xj = x+size_t(j)*k;
+            float* yj = y+size_t(j)*r;
+            for(int i = b*row_block;i < i1;++i)
+            {
+                const float* a = A+size_t(i)*k;
+                float sum8[8] = {0.0f,0.0f,0.0f,0.0f,0.0f,0.0f,0.0f,0.0f};
+                int p = 0;
+                for(;p+8 <= k;p += 8)
+                    for(int l = 0;l < 8;++l)
+                        sum8[l] += a[p+l]*xj[p+l];
+                float sum = (sum8[0]+sum8[4])+(sum8[1]+sum8[5])+(sum8[2]+sum8[6])+(sum8[3]+sum8[7]);
+                for(;p < k;++p)
+                    sum += a[p]*xj[p];
+                yj[i] = sum;
+            }
+        }
+    };
+    int block_count = (r+row_block-1)/row_block;
+    if(thread_count > 1 && size_t(r)*size_t(k)*size_t(c) >= (size_t(1) << 18))
+        par_for(block_count,fun,thread_count);
+    else
+        for(int b = 0;b < block_count;++b)
+            fun(b);
+}
 
 class matrix{
 public:
@@ -20,24 +102,29 @@ public:
     typedef const float* const_iterator;
     typedef float& reference;
 private:
+    backend_type backend = default_backend();
+    std::vector<float> host;
     float* ptr = 0;
     int c = 1;
     int r = 0;
     size_t total_element = 0,buf_size = 0;
     void free_mem(void)
     {
+#ifdef USE_CUBLAS
         if(ptr)
-        {
-            cudaFree (ptr);
-            c = 1;
-            r = 0;
-            total_element = 0;
-            buf_size = 0;
-        }
+            cudaFree(ptr);
+#endif
+        ptr = 0;
+        host.clear();
+        c = 1;
+        r = 0;
+        total_element = 0;
+        buf_size = 0;
     }
 
 public:
     matrix(void){}
+    matrix(backend_type backend_):backend(backend_){}
     matrix(int r_){resize(r_,1);}
     matrix(int r_,int c_){resize(r_,c_);}
     matrix(const std::vector<float>& rhs)
@@ -50,12 +137,17 @@ public:
         resize(r_,c_);
         *this = rhs;
     }
+    matrix(const matrix& rhs):backend(rhs.backend)
+    {
+        *this = rhs;
+    }
+    backend_type get_backend(void) const{return backend;}
     float* get(void) const{return ptr;}
     void resize(int r_,int c_)
     {
         if(r == r_ && c == c_)
             return;
-        if(total_element == r_*c_)
+        if(total_element == size_t(r_)*size_t(c_))
         {
             r = r_;
             c = c_;
@@ -64,11 +156,23 @@ public:
         free_mem();
         if(r_)
         {
-            if (cudaMalloc ((void**)&ptr, r_*c_*sizeof(float)) != cudaSuccess)
-                throw std::exception("device memory allocation failed");
+            size_t size = size_t(r_)*size_t(c_);
+            if(backend == cpu)
+            {
+                host.resize(size);
+                ptr = &host[0];
+            }
+#ifdef USE_CUBLAS
+            else
+            if (cudaMalloc ((void**)&ptr, size*sizeof(float)) != cudaSuccess)
+            {
+                ptr = 0;
+                throw std::runtime_error("device memory allocation failed");
+            }
+#endif
             r = r_;
             c = c_;
-            total_element = r_*c_;
+            total_element = size;
             buf_size = total_element*sizeof(float);
         }
     }
@@ -86,15 +190,35 @@ public:
 
     const matrix& operator=(const matrix& rhs)
     {
+        if(this == &rhs)
+            return *this;
         resize(rhs.row_count(),rhs.col_count());
-        if(cudaMemcpy(ptr,rhs.ptr,buf_size,cudaMemcpyDeviceToDevice) != CUBLAS_STATUS_SUCCESS)
-            throw std::exception("cudaMemcpy failed in operator=");
+        if(!total_element)
+            return *this;
+        if(backend == cpu && rhs.backend == cpu)
+        {
+            std::copy(rhs.ptr,rhs.ptr+total_element,ptr);
+            return *this;
+        }
+#ifdef USE_CUBLAS
+        cudaMemcpyKind kind = backend == cpu ? cudaMemcpyDeviceToHost :
+                             (rhs.backend == cpu ? cudaMemcpyHostToDevice : cudaMemcpyDeviceToDevice);
+        if(cudaMemcpy(ptr,rhs.ptr,buf_size,kind) != cudaSuccess)
+            throw std::runtime_error("cudaMemcpy failed in operator=");
+#endif
         return *this;
     }
     const matrix& operator=(const float* rhs)
     {
-        if(cudaMemcpy(ptr,rhs,buf_size,cudaMemcpyHostToDevice) != CUBLAS_STATUS_SUCCESS)
-            throw std::exception("cudaMemcpy failed in operator=");
+        if(backend == cpu)
+        {
+            std::copy(rhs,rhs+total_element,ptr);
+            return *this;
+        }
+#ifdef USE_CUBLAS
+        if(cudaMemcpy(ptr,rhs,buf_size,cudaMemcpyHostToDevice) != cudaSuccess)
+            throw std::runtime_error("cudaMemcpy failed in operator=");
+#endif
         return *this;
     }
     const matrix& operator=(const std::vector<float>& rhs)
@@ -108,39 +232,69 @@ public:
 
     void copy_to(float* rhs) const
     {
-        if(cudaMemcpy(rhs,ptr,buf_size,cudaMemcpyDeviceToHost) != CUBLAS_STATUS_SUCCESS)
-            throw std::exception("cudaMemcpy failed in assign");
+        if(backend == cpu)
+        {
+            std::copy(ptr,ptr+total_element,rhs);
+            return;
+        }
+#ifdef USE_CUBLAS
+        if(cudaMemcpy(rhs,ptr,buf_size,cudaMemcpyDeviceToHost) != cudaSuccess)
+            throw std::runtime_error("cudaMemcpy failed in assign");
+#endif
     }
 
     void copy_to(std::vector<float>&lhs) const
     {
         lhs.resize(total_element);
-        copy_to(&lhs[0]);
+        if(total_element)
+            copy_to(&lhs[0]);
     }
 
 };
 
 
 struct context{
+    backend_type backend;
+#ifdef USE_CUBLAS
     cublasHandle_t handle = 0;
-    context(void)
+#endif
+    int thread_count = tipl::available_thread_count();
+    context(backend_type backend_ = default_backend()):backend(backend_)
     {
-        if (cublasCreate(&handle) != CUBLAS_STATUS_SUCCESS)
+#ifdef USE_CUBLAS
+        if(backend == cuda && cublasCreate(&handle) != CUBLAS_STATUS_SUCCESS)
             handle = 0;
+        if(!handle)
+            backend = cpu;
+#else
+        backend = cpu;
+#endif
     }
     ~context(void)
     {
+#ifdef USE_CUBLAS
         if(handle)
             cublasDestroy(handle);
+#endif
     }
-    void y_Ax(matrix& y,matrix& A, matrix& x)
+    void y_Ax(matrix& y,const matrix& A,const matrix& x)
     {
         if(A.col_count() != x.row_count())
-            throw std::exception("Invalid y_Ax operation");
+            throw std::runtime_error("Invalid y_Ax operation");
+        if(A.get_backend() != x.get_backend() || A.get_backend() != y.get_backend())
+            throw std::runtime_error("y_Ax operands are on different backends");
         int r = A.row_count();
         int c = x.col_count();
         int k = A.col_count();
         y.resize(r,c);
+        if(A.get_backend() == cpu)
+        {
+            tipl::cu::y_Ax(y.get(),A.get(),x.get(),r,k,c,thread_count);
+            return;
+        }
+#ifdef USE_CUBLAS
+        if(backend != cuda)
+            throw std::runtime_error("no cuBLAS context for device matrices");
         float alpha = 1.0;
         float beta = 0.0f;
         if(cublasSgemm(handle,CUBLAS_OP_T,CUBLAS_OP_N,
@@ -149,12 +303,13 @@ struct context{
                     x.get(),k,
                     &beta,
                     y.get(),r) != CUBLAS_STATUS_SUCCESS)
-            throw std::exception("cublasSgemm failed in y_Ax");
+            throw std::runtime_error("cublasSgemm failed in y_Ax");
+#endif
     }
 };
 
 
-
+#ifdef USE_CUBLAS
 
 struct contextXt{
     cublasXtHandle_t handle = 0;
@@ -180,11 +335,10 @@ struct contextXt{
     }
 };
 
-
+#endif//USE_CUBLAS
 
 }
 }
-#endif//USE_CUBLAS
 
 
 #endif//cuH
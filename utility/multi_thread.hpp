@@ -1,6 +1,8 @@
 #ifndef MULTI_THREAD_HPP
 #define MULTI_THREAD_HPP
 #include <future>
+#include <algorithm>
+#include <thread>
 namespace tipl{
 
 class time
@@ -18,16 +20,40 @@ class time
     std::chrono::high_resolution_clock::time_point t1, t2;
 };
 
+// the default thread count of par_for and its variants on the calling thread, 0 for all cores
+inline unsigned int& thread_budget(void)
+{
+    static thread_local unsigned int budget = 0;
+    return budget;
+}
+inline int available_thread_count(void)
+{
+    unsigned int count = thread_budget();
+    if(!count)
+        count = std::thread::hardware_concurrency();
+    return count ? int(count) : 1;
+}
+// sets the thread budget of the current thread until the end of the scope
+class thread_budget_scope
+{
+    unsigned int previous;
+public:
+    thread_budget_scope(unsigned int budget):previous(thread_budget()){thread_budget() = budget;}
+    ~thread_budget_scope(void){thread_budget() = previous;}
+};
+
 template <class T,class Func>
-void par_for(T size, Func f, int thread_count = std::thread::hardware_concurrency())
+void par_for(T size, Func f, int thread_count = available_thread_count())
 {
     std::vector<std::future<void> > futures;
+    unsigned int budget = thread_budget();
     if(thread_count > size)
         thread_count = int(size);
     for(int id = 1; id < thread_count; id++)
     {
-        futures.push_back(std::move(std::async(std::launch::async, [id,size,thread_count,&f]
+        futures.push_back(std::move(std::async(std::launch::async, [id,size,thread_count,&f,budget]
         {
+            thread_budget_scope scope(budget);
             for(int i = id; i < size; i += thread_count)
                 f(i);
         })));
@@ -39,22 +65,26 @@ void par_for(T size, Func f, int thread_count = std::thread::hardware_concurrenc
 }
 
 template <class T,class Func>
-void par_for_asyn(T size, Func f, int thread_count = std::thread::hardware_concurrency())
+void par_for_asyn(T size, Func f, int thread_count = available_thread_count())
 {
     std::vector<std::future<void> > futures;
+    unsigned int budget = thread_budget();
     if(thread_count > size)
         thread_count = int(size);
     T now = 0;
     std::mutex read_now;
     for(int id = 1; id < thread_count; id++)
     {
-        futures.push_back(std::move(std::async(std::launch::async, [id,size,thread_count,&f,&now,&read_now]
+        futures.push_back(std::move(std::async(std::launch::async, [id,size,thread_count,&f,&now,&read_now,budget]
         {
-            while(now < size)
+            thread_budget_scope scope(budget);
+            while(true)
             {
                 T i;
                 {
                     std::lock_guard<std::mutex> lock(read_now);
+                    if(now >= size)
+                        break;
                     i = now;
                     ++now;
                 }
@@ -62,11 +92,13 @@ void par_for_asyn(T size, Func f, int thread_count = std::thread::hardware_concu
             }
         })));
     }
-    while(now < size)
+    while(true)
     {
         T i;
         {
             std::lock_guard<std::mutex> lock(read_now);
+            if(now >= size)
+                break;
             i = now;
             ++now;
         }
@@ -78,15 +110,17 @@ void par_for_asyn(T size, Func f, int thread_count = std::thread::hardware_concu
 
 
 template <class T,class Func>
-void par_for2(T size, Func f, int thread_count = std::thread::hardware_concurrency())
+void par_for2(T size, Func f, int thread_count = available_thread_count())
 {
     std::vector<std::future<void> > futures;
+    unsigned int budget = thread_budget();
     if(thread_count > size)
         thread_count = size;
     for(int id = 1; id < thread_count; id++)
     {
-        futures.push_back(std::move(std::async(std::launch::async, [id,size,thread_count,&f]
+        futures.push_back(std::move(std::async(std::launch::async, [id,size,thread_count,&f,budget]
         {
+            thread_budget_scope scope(budget);
             for(int i = id; i < size; i += thread_count)
                 f(i,id);
         })));
@@ -98,22 +132,26 @@ void par_for2(T size, Func f, int thread_count = std::thread::hardware_concurren
 }
 
 template <class T,class Func>
-void par_for_asyn2(T size, Func f, int thread_count = std::thread::hardware_concurrency())
+void par_for_asyn2(T size, Func f, int thread_count = available_thread_count())
 {
     std::vector<std::future<void> > futures;
+    unsigned int budget = thread_budget();
     if(thread_count > size)
         thread_count = int(size);
     T now = 0;
     std::mutex read_now;
     for(int id = 1; id < thread_count; id++)
     {
-        futures.push_back(std::move(std::async(std::launch::async, [id,size,thread_count,&f,&now,&read_now]
+        futures.push_back(std::move(std::async(std::launch::async, [id,size,thread_count,&f,&now,&read_now,budget]
         {
-            while(now < size)
+            thread_budget_scope scope(budget);
+            while(true)
             {
                 T i;
                 {
                     std::lock_guard<std::mutex> lock(read_now);
+                    if(now >= size)
+                        break;
                     i = now;
                     ++now;
                 }
@@ -121,11 +159,13 @@ void par_for_asyn2(T size, Func f, int thread_count = std::thread::hardware_conc
             }
         })));
     }
-    while(now < size)
+    while(true)
     {
         T i;
         {
             std::lock_guard<std::mutex> lock(read_now);
+            if(now >= size)
+                break;
             i = now;
             ++now;
         }
@@ -135,11 +175,12 @@ void par_for_asyn2(T size, Func f, int thread_count = std::thread::hardware_conc
         future.wait();
 }
 template <class T,class Func>
-void par_for_block(T size, Func f, int thread_count = std::thread::hardware_concurrency())
+void par_for_block(T size, Func f, int thread_count = available_thread_count())
 {
     if(!size)
         return;
     std::vector<std::future<void> > futures;
+    unsigned int budget = thread_budget();
     if(thread_count > size)
         thread_count = size;
 
@@ -148,8 +189,9 @@ void par_for_block(T size, Func f, int thread_count = std::thread::hardware_conc
     for(int id = 1; id < thread_count; id++)
     {
         size_t end = pos + block_size;
-        futures.push_back(std::move(std::async(std::launch::async, [pos,end,&f]
+        futures.push_back(std::move(std::async(std::launch::async, [pos,end,&f,budget]
         {
+            thread_budget_scope scope(budget);
             for(size_t i = pos; i < end;++i)
                 f(i);
         })));
@@ -162,11 +204,12 @@ void par_for_block(T size, Func f, int thread_count = std::thread::hardware_conc
 }
 
 template <class T,class Func>
-void par_for_block2(T size, Func f, int thread_count = std::thread::hardware_concurrency())
+void par_for_block2(T size, Func f, int thread_count = available_thread_count())
 {
     if(!size)
         return;
     std::vector<std::future<void> > futures;
+    unsigned int budget = thread_budget();
     if(thread_count > size)
         thread_count = size;
 
@@ -175,8 +218,9 @@ void par_for_block2(T size, Func f, int thread_count = std::thread::hardware_con
     for(int id = 1; id < thread_count; id++)
     {
         size_t end = pos + block_size;
-        futures.push_back(std::move(std::async(std::launch::async, [id,pos,end,&f]
+        futures.push_back(std::move(std::async(std::launch::async, [id,pos,end,&f,budget]
         {
+            thread_budget_scope scope(budget);
             for(size_t i = pos; i < end;++i)
                 f(i,id);
         })));
@@ -188,6 +232,21 @@ void par_for_block2(T size, Func f, int thread_count = std::thread::hardware_con
         future.wait();
 }
 
+/*
+    f(i) for i < size with job_count jobs running at a time. The par_for
+    calls made by a job share thread_count among the jobs.
+*/
+template <class T,class Func>
+void par_for_jobs(T size, Func f, int job_count, int thread_count = available_thread_count())
+{
+    job_count = std::max<int>(1,job_count);
+    unsigned int budget = unsigned(std::max<int>(1,thread_count/job_count));
+    par_for_asyn(size,[&](T i)
+    {
+        thread_budget_scope scope(budget);
+        f(i);
+    },job_count);
+}
 
 class thread{
 private:
@@ -216,7 +275,12 @@ public:
         if(started)
             clear();
         started = true;
-        th.reset(new std::future<void>(std::async(std::launch::async,fun)));
+        unsigned int budget = thread_budget();
+        th.reset(new std::future<void>(std::async(std::launch::async,[budget,fun]()
+        {
+            thread_budget_scope scope(budget);
+            fun();
+        })));
     }
     void wait(void)
     {
@@ -0,0 +1,240 @@
+//---------------------------------------------------------------------------
+#ifndef VECTOR_IMAGE_HPP
+#define VECTOR_IMAGE_HPP
+#include <vector>
+#include "basic_image.hpp"
+
+namespace tipl
+{
+
+/*
+ *  vector-valued image stored as structure of arrays: one contiguous plane
+ *  per vector component. It shares geometry/pixel_index with tipl::image,
+ *  so a displacement field can be stored as
+ *
+ *  tipl::vector_image<3> dis(geo);     // dis.plane(0..2) are float planes
+ *  dis[index] += tipl::vector<3>(1,0,0);
+ *
+ *  Kernels in dif.hpp, gaussian.hpp and resampling.hpp work directly on the
+ *  planes so that the inner loops are unit-stride scalar loops.
+ */
+template<unsigned int dim,class element_type_ = float>
+class vector_image
+{
+public:
+    typedef element_type_ element_type;
+    typedef tipl::vector<dim,element_type> value_type;
+    typedef tipl::geometry<dim> geometry_type;
+    typedef pointer_image<element_type,dim> plane_type;
+    typedef const_pointer_image<element_type,dim> const_plane_type;
+    static const unsigned int dimension = dim;
+public:
+    // write-through access to the pixel at one index
+    class reference{
+        vector_image* I;
+        size_t index;
+    public:
+        reference(vector_image* I_,size_t index_):I(I_),index(index_){}
+        operator value_type(void) const
+        {
+            return (*(const vector_image*)I)[index];
+        }
+        element_type operator[](unsigned int d) const
+        {
+            return I->data[d][index];
+        }
+        element_type& operator[](unsigned int d)
+        {
+            return I->data[d][index];
+        }
+        template<class rhs_type>
+        const reference& operator=(const rhs_type& rhs)
+        {
+            for(unsigned int d = 0;d < dim;++d)
+                I->data[d][index] = rhs[d];
+            return *this;
+        }
+        const reference& operator=(const reference& rhs)
+        {
+            for(unsigned int d = 0;d < dim;++d)
+                I->data[d][index] = rhs[d];
+            return *this;
+        }
+        template<class rhs_type>
+        const reference& operator+=(const rhs_type& rhs)
+        {
+            for(unsigned int d = 0;d < dim;++d)
+                I->data[d][index] += rhs[d];
+            return *this;
+        }
+        template<class rhs_type>
+        const reference& operator-=(const rhs_type& rhs)
+        {
+            for(unsigned int d = 0;d < dim;++d)
+                I->data[d][index] -= rhs[d];
+            return *this;
+        }
+        const reference& operator*=(element_type value)
+        {
+            for(unsigned int d = 0;d < dim;++d)
+                I->data[d][index] *= value;
+            return *this;
+        }
+        const reference& operator/=(element_type value)
+        {
+            for(unsigned int d = 0;d < dim;++d)
+                I->data[d][index] /= value;
+            return *this;
+        }
+    };
+protected:
+    std::vector<element_type> data[dim];
+    geometry_type geo;
+public:
+    vector_image(void){}
+    vector_image(const geometry_type& geo_):geo(geo_)
+    {
+        for(unsigned int d = 0;d < dim;++d)
+            data[d].resize(geo.size());
+    }
+    template<class rhs_value_type,class rhs_storage_type>
+    vector_image(const image<tipl::vector<dim,rhs_value_type>,dim,rhs_storage_type>& rhs){operator=(rhs);}
+public:
+    template<class rhs_value_type,class rhs_storage_type>
+    const vector_image& operator=(const image<tipl::vector<dim,rhs_value_type>,dim,rhs_storage_type>& rhs)
+    {
+        resize(rhs.geometry());
+        for(size_t index = 0;index < rhs.size();++index)
+        {
+            tipl::vector<dim,rhs_value_type> v(rhs[index]);
+            for(unsigned int d = 0;d < dim;++d)
+                data[d][index] = v[d];
+        }
+        return *this;
+    }
+    template<class rhs_value_type,class rhs_storage_type>
+    void save_to_image(image<tipl::vector<dim,rhs_value_type>,dim,rhs_storage_type>& rhs) const
+    {
+        rhs.resize(geo);
+        for(size_t index = 0;index < rhs.size();++index)
+            for(unsigned int d = 0;d < dim;++d)
+                rhs[index][d] = data[d][index];
+    }
+public:
+    const geometry_type& geometry(void) const
+    {
+        return geo;
+    }
+    int width(void) const
+    {
+        return geo.width();
+    }
+    int height(void) const
+    {
+        return geo.height();
+    }
+    int depth(void) const
+    {
+        return geo.depth();
+    }
+    size_t plane_size(void) const
+    {
+        return geo.plane_size();
+    }
+    size_t size(void) const
+    {
+        return data[0].size();
+    }
+    bool empty(void) const
+    {
+        return data[0].empty();
+    }
+public:
+    element_type* plane(unsigned int d)
+    {
+        return data[d].empty() ? 0 : &data[d][0];
+    }
+    const element_type* plane(unsigned int d) const
+    {
+        return data[d].empty() ? 0 : &data[d][0];
+    }
+    plane_type plane_image(unsigned int d)
+    {
+        return plane_type(plane(d),geo);
+    }
+    const_plane_type plane_image(unsigned int d) const
+    {
+        return const_plane_type(plane(d),geo);
+    }
+public:
+    value_type operator[](size_t index) const
+    {
+        value_type v;
+        for(unsigned int d = 0;d < dim;++d)
+            v[d] = data[d][index];
+        return v;
+    }
+    reference operator[](size_t index)
+    {
+        return reference(this,index);
+    }
+public:
+    void resize(const geometry_type& geo_)
+    {
+        geo = geo_;
+        for(unsigned int d = 0;d < dim;++d)
+            data[d].resize(geo.size());
+    }
+    void clear(void)
+    {
+        for(unsigned int d = 0;d < dim;++d)
+            data[d].clear();
+        geo.clear();
+    }
+    void swap(vector_image& rhs)
+    {
+        for(unsigned int d = 0;d < dim;++d)
+            data[d].swap(rhs.data[d]);
+        std::swap(geo,rhs.geo);
+    }
+public:
+    template<class scalar_type>
+    const vector_image& operator*=(scalar_type value)
+    {
+        for(unsigned int d = 0;d < dim;++d)
+        {
+            element_type* out = plane(d);
+            size_t size = data[d].size();
+            for(size_t index = 0;index < size;++index)
+                out[index] *= value;
+        }
+        return *this;
+    }
+    const vector_image& operator+=(const vector_image& rhs)
+    {
+        for(unsigned int d = 0;d < dim;++d)
+        {
+            element_type* out = plane(d);
+            const element_type* in = rhs.plane(d);
+            size_t size = data[d].size();
+            for(size_t index = 0;index < size;++index)
+                out[index] += in[index];
+        }
+        return *this;
+    }
+    const vector_image& operator-=(const vector_image& rhs)
+    {
+        for(unsigned int d = 0;d < dim;++d)
+        {
+            element_type* out = plane(d);
+            const element_type* in = rhs.plane(d);
+            size_t size = data[d].size();
+            for(size_t index = 0;index < size;++index)
+                out[index] -= in[index];
+        }
+        return *this;
+    }
+};
+
+}
+#endif//VECTOR_IMAGE_HPP